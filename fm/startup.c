@@ -26,69 +26,571 @@
 #include "fmcrypto.h"
 #include <endian.h>
 
+#include "wld_fm.h"
 
-/********************************************************************
-    IqrFM_HandleMessage
 
-    Read the FM command and search for the hKey object handle on the 
-    passed in embedded slot ID.  If an error occurs log a message 
-    in the HSM debug window
+/*
+    Long-lived sessions and key handle cache
+
+    The FM runs one command at a time, so the tables below need no
+    locking.  Each embedded slot keeps one session open for the life of
+    the FM, and the handle found for a (slot, label) pair is cached so
+    a verify is normally a lookup plus compare.  A stale entry is
+    refreshed once when the compare fails; WLD_FM_FLUSH_MAGIC drops
+    entries explicitly.
 */
-static
-int IqrFM_HandleMessage( FmMsgHandle token )
-{
+#define IQRFM_MAX_SESSIONS      128
+#define IQRFM_KEY_CACHE_SIZE    256             // power of 2
+#define IQRFM_MAX_LABEL_LEN     32
+
+// Handles fetched by the one C_FindObjects call of a bulk key verify.
+// A slot holding more objects is still verified, one object at a time
+// for the keys beyond the array.
+#define IQRFM_MAX_BULK_OBJECTS  8192
+
+typedef struct IQRFM_SESSION {
+    uint32_t inUse;                             // 0 if unused
     uint32_t slot;
-    uint32_t hKey, hHSMKey=0;
+    CK_SESSION_HANDLE hSession;
+} IQRFM_SESSION;
 
-    CK_RV ckResult = CKR_OK;
+typedef struct IQRFM_KEY_ENTRY {
+    uint32_t inUse;                             // 0 if unused
+    uint32_t slot;
+    uint32_t labelLen;
+    char label[IQRFM_MAX_LABEL_LEN];
     CK_OBJECT_HANDLE hObj;
-    CK_SESSION_HANDLE hSession;
-    CK_SLOT_ID eSlot;
-    CK_ULONG retcount = 0;
-    const char label[] = "MyAESKey";
-    CK_ATTRIBUTE findAttr = {CKA_LABEL, (CK_BYTE_PTR)label, strlen(label)};
+} IQRFM_KEY_ENTRY;
 
+static IQRFM_SESSION IqrFM_Sessions[IQRFM_MAX_SESSIONS];
+static IQRFM_KEY_ENTRY IqrFM_KeyCache[IQRFM_KEY_CACHE_SIZE];
+static CK_OBJECT_HANDLE IqrFM_BulkHandles[IQRFM_MAX_BULK_OBJECTS];
+static uint32_t IqrFM_BulkBitmap[(WLD_FM_MAX_BULK_VERIFY + 31) / 32];
 
-    // Read in the passed in parameters from the message block
-    if (SVC_IO_Read32(token, &slot) != sizeof(slot))
+
+/********************************************************************
+    IqrFM_GetSession
+
+    Return the long-lived session of an embedded slot, opening it on
+    first use.  A new session replaces the oldest one when the table
+    is full.
+*/
+static
+CK_RV IqrFM_GetSession( uint32_t slot, CK_SESSION_HANDLE *phSession )
+{
+    static uint32_t nextVictim = 0;
+    IQRFM_SESSION *pFree = NULL;
+    CK_RV ckResult;
+    uint32_t i;
+
+    for (i=0; i < IQRFM_MAX_SESSIONS; i++)
     {
-        ckResult = CKR_ARGUMENTS_BAD;
-        goto done;
+        if (IqrFM_Sessions[i].inUse && IqrFM_Sessions[i].slot == slot)
+        {
+            *phSession = IqrFM_Sessions[i].hSession;
+            return CKR_OK;
+        }
+
+        if (!pFree && !IqrFM_Sessions[i].inUse)
+            pFree = &IqrFM_Sessions[i];
     }
 
-    if (SVC_IO_Read32(token, &hKey) != sizeof(hKey))
+    if (!pFree)
     {
-        ckResult = CKR_ARGUMENTS_BAD;
-        goto done;
+        pFree = &IqrFM_Sessions[nextVictim];
+        nextVictim = (nextVictim + 1) % IQRFM_MAX_SESSIONS;
+        (void)C_CloseSession(pFree->hSession);
+        pFree->inUse = 0;
     }
 
-    // Open a session
-    eSlot = (CK_SLOT_ID)slot;
-    ckResult = C_OpenSession(eSlot, CKF_RW_SESSION|CKF_SERIAL_SESSION, NULL, NULL, &hSession);
+    ckResult = C_OpenSession((CK_SLOT_ID)slot, CKF_RW_SESSION|CKF_SERIAL_SESSION,
+        NULL, NULL, &pFree->hSession);
     if (ckResult == CKR_OK)
     {
-        ckResult = C_FindObjectsInit(hSession, &findAttr, 1);
+        pFree->inUse = 1;
+        pFree->slot = slot;
+        *phSession = pFree->hSession;
+    }
+
+    return ckResult;
+}
+
+/********************************************************************
+    IqrFM_DropSession
+
+    Close the long-lived session of an embedded slot (all slots if
+    slot is WLD_FM_FLUSH_ALL)
+*/
+static
+void IqrFM_DropSession( uint32_t slot )
+{
+    uint32_t i;
+
+    for (i=0; i < IQRFM_MAX_SESSIONS; i++)
+    {
+        if (!IqrFM_Sessions[i].inUse)
+            continue;
+
+        if (slot == WLD_FM_FLUSH_ALL || IqrFM_Sessions[i].slot == slot)
+        {
+            (void)C_CloseSession(IqrFM_Sessions[i].hSession);
+            IqrFM_Sessions[i].inUse = 0;
+        }
+    }
+}
+
+/********************************************************************
+    IqrFM_KeyCacheEntry
+
+    Return the cache entry a (slot, label) pair maps to
+*/
+static
+IQRFM_KEY_ENTRY *IqrFM_KeyCacheEntry( uint32_t slot, const char *label, uint32_t labelLen )
+{
+    uint32_t hash = 2166136261u;
+    uint32_t i;
+
+    for (i=0; i < labelLen; i++)
+        hash = (hash ^ (uint8_t)label[i]) * 16777619u;
+
+    hash ^= slot * 0x9E3779B1u;
+
+    return &IqrFM_KeyCache[(hash >> 8) & (IQRFM_KEY_CACHE_SIZE - 1)];
+}
+
+/********************************************************************
+    IqrFM_FlushKeyCache
+
+    Drop the cached key handles and the session of an embedded slot
+    (all slots if slot is WLD_FM_FLUSH_ALL)
+*/
+static
+void IqrFM_FlushKeyCache( uint32_t slot )
+{
+    uint32_t i;
+
+    for (i=0; i < IQRFM_KEY_CACHE_SIZE; i++)
+    {
+        if (slot == WLD_FM_FLUSH_ALL || (IqrFM_KeyCache[i].inUse && IqrFM_KeyCache[i].slot == slot))
+            memset(&IqrFM_KeyCache[i], 0, sizeof(IQRFM_KEY_ENTRY));
+    }
+
+    IqrFM_DropSession(slot);
+}
+
+/********************************************************************
+    IqrFM_FindObjects
+
+    Search the embedded slot for up to maxCount objects matching the
+    template with one C_FindObjects call, using the slot's long-lived
+    session and reopening the session once if it has been closed
+    underneath us
+*/
+static
+CK_RV IqrFM_FindObjects( uint32_t slot, CK_ATTRIBUTE *pTemplate, CK_ULONG ulCount,
+    CK_OBJECT_HANDLE *phObj, CK_ULONG maxCount, CK_ULONG *pCount )
+{
+    CK_RV ckResult;
+    CK_SESSION_HANDLE hSession;
+    int attempt;
+
+    *pCount = 0;
+
+    for (attempt=0; attempt < 2; attempt++)
+    {
+        ckResult = IqrFM_GetSession(slot, &hSession);
+        if (ckResult != CKR_OK)
+            return ckResult;
+
+        ckResult = C_FindObjectsInit(hSession, pTemplate, ulCount);
         if (ckResult == CKR_OK)
         {
-            ckResult = C_FindObjects(hSession, &hObj, 1, &retcount);
+            ckResult = C_FindObjects(hSession, phObj, maxCount, pCount);
             (void)C_FindObjectsFinal(hSession);
         }
+
+        if (ckResult != CKR_SESSION_HANDLE_INVALID && ckResult != CKR_SESSION_CLOSED)
+            break;
+
+        IqrFM_DropSession(slot);
+    }
+
+    return ckResult;
+}
+
+/********************************************************************
+    IqrFM_FindKey
+
+    Search the embedded slot for the object with the given label
+*/
+static
+CK_RV IqrFM_FindKey( uint32_t slot, const char *label, uint32_t labelLen,
+    CK_OBJECT_HANDLE *phObj )
+{
+    CK_RV ckResult;
+    CK_ULONG retcount = 0;
+    CK_ATTRIBUTE findAttr = {CKA_LABEL, (CK_BYTE_PTR)label, labelLen};
+
+    ckResult = IqrFM_FindObjects(slot, &findAttr, 1, phObj, 1, &retcount);
+
+    if (ckResult == CKR_OK && retcount != 1)
+        ckResult = CKR_OBJECT_HANDLE_INVALID;
+
+    return ckResult;
+}
+
+/********************************************************************
+    IqrFM_VerifyKey
+
+    Check that hKey is the handle of the object with our label on the
+    passed in embedded slot ID.  If an error occurs log a message in
+    the HSM debug window
+*/
+static
+CK_RV IqrFM_VerifyKey( uint32_t slot, uint32_t hKey )
+{
+    uint32_t hHSMKey=0;
+
+    CK_RV ckResult = CKR_OK;
+    CK_OBJECT_HANDLE hObj = 0;
+    const char label[] = "MyAESKey";
+    uint32_t labelLen = (uint32_t)strlen(label);
+    IQRFM_KEY_ENTRY *pEntry;
+
+
+    if (slot == WLD_FM_FLUSH_ALL)
+    {
+        ckResult = CKR_SLOT_ID_INVALID;
+        goto done;
     }
 
+    // Hot path - the cached handle matches
+    pEntry = IqrFM_KeyCacheEntry(slot, label, labelLen);
+    if (pEntry->inUse && pEntry->slot == slot && pEntry->labelLen == labelLen &&
+        memcmp(pEntry->label, label, labelLen) == 0)
+    {
+        hHSMKey = (uint32_t)pEntry->hObj;
+        if (hHSMKey == hKey)
+            return CKR_OK;
+    }
+
+    // Missing or stale - search the slot and refresh the entry
+    memset(pEntry, 0, sizeof(IQRFM_KEY_ENTRY));
+
+    ckResult = IqrFM_FindKey(slot, label, labelLen, &hObj);
     if (ckResult == CKR_OK)
     {
         // Found the object with that label - make sure same handle as was passed in
         hHSMKey = (uint32_t)hObj;
-        if (hHSMKey != hKey || retcount != 1)
+        if (labelLen <= IQRFM_MAX_LABEL_LEN)
+        {
+            pEntry->inUse = 1;
+            pEntry->slot = slot;
+            pEntry->labelLen = labelLen;
+            memcpy(pEntry->label, label, labelLen);
+            pEntry->hObj = hObj;
+        }
+
+        if (hHSMKey != hKey)
             ckResult = CKR_OBJECT_HANDLE_INVALID;
     }
 
+done:
+
     if (ckResult != CKR_OK)
     {
         printf("SampleFM: key=%d, hsmkey=%d, rv=%x\n",
             (int)hKey, (int)hHSMKey, (unsigned int)ckResult);
     }
 
+    return ckResult;
+}
+
+/********************************************************************
+    IqrFM_HandleBatch
+
+    Read a batch envelope (count, record length and count key verify
+    records) and reply with one status word per record.  The message
+    status only reports whether the envelope itself was valid.
+*/
+static
+int IqrFM_HandleBatch( FmMsgHandle token )
+{
+    uint32_t count, recordLen, i;
+    uint32_t slot, hKey;
+    CK_RV ckResult = CKR_OK;
+
+    if (SVC_IO_Read32(token, &count) != sizeof(count) ||
+        SVC_IO_Read32(token, &recordLen) != sizeof(recordLen))
+    {
+        ckResult = CKR_ARGUMENTS_BAD;
+        goto done;
+    }
+
+    if (count == 0 || count > WLD_FM_MAX_BATCH ||
+        recordLen != WLD_FM_VERIFY_RECORD_LEN)
+    {
+        ckResult = CKR_ARGUMENTS_BAD;
+        goto done;
+    }
+
+    if (SVC_IO_Write32(token, count) != sizeof(count))
+    {
+        ckResult = CKR_BUFFER_TOO_SMALL;
+        goto done;
+    }
+
+    for (i=0; i < count; i++)
+    {
+        if (SVC_IO_Read32(token, &slot) != sizeof(slot) ||
+            SVC_IO_Read32(token, &hKey) != sizeof(hKey))
+        {
+            ckResult = CKR_ARGUMENTS_BAD;
+            goto done;
+        }
+
+        if (SVC_IO_Write32(token, (uint32_t)IqrFM_VerifyKey(slot, hKey)) != sizeof(uint32_t))
+        {
+            ckResult = CKR_BUFFER_TOO_SMALL;
+            goto done;
+        }
+    }
+
+done:
+
+    return (int)ckResult;
+}
+
+/********************************************************************
+    IqrFM_CompareHandles
+
+    qsort / bsearch order of object handles
+*/
+static
+int IqrFM_CompareHandles( const void *pA, const void *pB )
+{
+    CK_OBJECT_HANDLE a = *(const CK_OBJECT_HANDLE *)pA;
+    CK_OBJECT_HANDLE b = *(const CK_OBJECT_HANDLE *)pB;
+
+    return (a > b) - (a < b);
+}
+
+/********************************************************************
+    IqrFM_CheckKey
+
+    Check that hKey is the object labelled label on the slot, given the
+    sorted handles of the slot's objects (all of them if complete).  A
+    handle that is not there fails at once; otherwise the key cache or
+    the object's CKA_LABEL decides, and a match refreshes the cache.
+*/
+static
+int IqrFM_CheckKey( uint32_t slot, CK_SESSION_HANDLE hSession, const char *label,
+    uint32_t labelLen, CK_OBJECT_HANDLE hKey, CK_ULONG objCount, int complete )
+{
+    IQRFM_KEY_ENTRY *pEntry;
+    char objLabel[WLD_FM_MAX_LABEL_LEN];
+    CK_ATTRIBUTE labelAttr = {CKA_LABEL, objLabel, sizeof(objLabel)};
+    int found;
+
+    found = bsearch(&hKey, IqrFM_BulkHandles, objCount, sizeof(CK_OBJECT_HANDLE),
+        IqrFM_CompareHandles) != NULL;
+    pEntry = IqrFM_KeyCacheEntry(slot, label, labelLen);
+
+    if (!found && complete)
+    {
+        if (pEntry->inUse && pEntry->slot == slot && pEntry->hObj == hKey)
+            memset(pEntry, 0, sizeof(IQRFM_KEY_ENTRY));
+        return 0;
+    }
+
+    if (found && pEntry->inUse && pEntry->slot == slot && pEntry->labelLen == labelLen &&
+        memcmp(pEntry->label, label, labelLen) == 0 && pEntry->hObj == hKey)
+        return 1;
+
+    if (C_GetAttributeValue(hSession, hKey, &labelAttr, 1) != CKR_OK ||
+        labelAttr.ulValueLen != labelLen || memcmp(objLabel, label, labelLen) != 0)
+        return 0;
+
+    if (labelLen <= IQRFM_MAX_LABEL_LEN)
+    {
+        pEntry->inUse = 1;
+        pEntry->slot = slot;
+        pEntry->labelLen = labelLen;
+        memcpy(pEntry->label, label, labelLen);
+        pEntry->hObj = hKey;
+    }
+
+    return 1;
+}
+
+/********************************************************************
+    IqrFM_HandleBulkVerify
+
+    Read a bulk key verify (embedded slot, count and count (hKey,
+    label) records), fetch the handles of all the slot's objects with
+    one C_FindObjects call and reply with a bitmap of the keys that
+    checked out.  The message status reports whether the envelope was
+    valid and the slot could be searched.
+*/
+static
+int IqrFM_HandleBulkVerify( FmMsgHandle token )
+{
+    uint32_t slot, count, hKey, labelLen, i;
+    char label[WLD_FM_MAX_LABEL_LEN];
+    CK_SESSION_HANDLE hSession;
+    CK_ULONG objCount = 0;
+    CK_RV ckResult = CKR_OK;
+    int complete;
+
+    if (SVC_IO_Read32(token, &slot) != sizeof(slot) ||
+        SVC_IO_Read32(token, &count) != sizeof(count) ||
+        count == 0 || count > WLD_FM_MAX_BULK_VERIFY)
+    {
+        ckResult = CKR_ARGUMENTS_BAD;
+        goto done;
+    }
+
+    if (slot == WLD_FM_FLUSH_ALL)
+    {
+        ckResult = CKR_SLOT_ID_INVALID;
+        goto done;
+    }
+
+    // Every object on the slot at once: an empty template
+    ckResult = IqrFM_FindObjects(slot, NULL, 0, IqrFM_BulkHandles, IQRFM_MAX_BULK_OBJECTS, &objCount);
+    if (ckResult == CKR_OK)
+        ckResult = IqrFM_GetSession(slot, &hSession);
+    if (ckResult != CKR_OK)
+        goto done;
+
+    complete = objCount < IQRFM_MAX_BULK_OBJECTS;
+    qsort(IqrFM_BulkHandles, objCount, sizeof(CK_OBJECT_HANDLE), IqrFM_CompareHandles);
+    memset(IqrFM_BulkBitmap, 0, sizeof(IqrFM_BulkBitmap));
+
+    for (i=0; i < count; i++)
+    {
+        if (SVC_IO_Read32(token, &hKey) != sizeof(hKey) ||
+            SVC_IO_Read32(token, &labelLen) != sizeof(labelLen) ||
+            labelLen == 0 || labelLen > WLD_FM_MAX_LABEL_LEN ||
+            SVC_IO_Read(token, label, labelLen) != (int)labelLen)
+        {
+            ckResult = CKR_ARGUMENTS_BAD;
+            goto done;
+        }
+
+        if (IqrFM_CheckKey(slot, hSession, label, labelLen, (CK_OBJECT_HANDLE)hKey, objCount, complete))
+            IqrFM_BulkBitmap[i / 32] |= 1u << (i % 32);
+    }
+
+    if (SVC_IO_Write32(token, count) != sizeof(count))
+    {
+        ckResult = CKR_BUFFER_TOO_SMALL;
+        goto done;
+    }
+
+    for (i=0; i < (count + 31) / 32; i++)
+    {
+        if (SVC_IO_Write32(token, IqrFM_BulkBitmap[i]) != sizeof(uint32_t))
+        {
+            ckResult = CKR_BUFFER_TOO_SMALL;
+            goto done;
+        }
+    }
+
+done:
+
+    return (int)ckResult;
+}
+
+/********************************************************************
+    IqrFM_HandlePing
+
+    Answer a ping without touching any slot
+*/
+static
+int IqrFM_HandlePing( FmMsgHandle token )
+{
+    (void)token;
+
+    return (int)CKR_OK;
+}
+
+/********************************************************************
+    IqrFM_HandleFlush
+
+    Flush the key cache of the slot that follows
+*/
+static
+int IqrFM_HandleFlush( FmMsgHandle token )
+{
+    uint32_t slot;
+
+    if (SVC_IO_Read32(token, &slot) != sizeof(slot))
+        return (int)CKR_ARGUMENTS_BAD;
+
+    IqrFM_FlushKeyCache(slot);
+
+    return (int)CKR_OK;
+}
+
+/********************************************************************
+    Command table
+
+    A message that starts with one of these opcodes is handed to its
+    handler with the opcode already read.  Adding a command is adding
+    an opcode to wld_fm.h and a line here.
+*/
+typedef int (*IQRFM_HANDLER)( FmMsgHandle token );
+
+typedef struct IQRFM_COMMAND {
+    uint32_t opcode;
+    IQRFM_HANDLER handler;
+} IQRFM_COMMAND;
+
+static const IQRFM_COMMAND IqrFM_Commands[] = {
+    { WLD_FM_BATCH_MAGIC,       IqrFM_HandleBatch },
+    { WLD_FM_PING_MAGIC,        IqrFM_HandlePing },
+    { WLD_FM_FLUSH_MAGIC,       IqrFM_HandleFlush },
+    { WLD_FM_BULK_VERIFY_MAGIC, IqrFM_HandleBulkVerify }
+};
+
+/********************************************************************
+    IqrFM_HandleMessage
+
+    Read the first word of the FM command.  An opcode goes to its
+    handler in the command table; anything else is the embedded slot
+    ID of a single key verify, and the hKey object handle that follows
+    is verified on it.
+*/
+static
+int IqrFM_HandleMessage( FmMsgHandle token )
+{
+    uint32_t slot;
+    uint32_t hKey;
+    uint32_t i;
+    CK_RV ckResult = CKR_OK;
+
+    // Read in the passed in parameters from the message block
+    if (SVC_IO_Read32(token, &slot) != sizeof(slot))
+    {
+        ckResult = CKR_ARGUMENTS_BAD;
+        goto done;
+    }
+
+    for (i=0; i < sizeof(IqrFM_Commands) / sizeof(IqrFM_Commands[0]); i++)
+    {
+        if (IqrFM_Commands[i].opcode == slot)
+            return IqrFM_Commands[i].handler(token);
+    }
+
+    if (SVC_IO_Read32(token, &hKey) != sizeof(hKey))
+    {
+        ckResult = CKR_ARGUMENTS_BAD;
+        goto done;
+    }
+
+    ckResult = IqrFM_VerifyKey(slot, hKey);
+
 done:
 
     return (int)ckResult;
@@ -15,12 +15,12 @@
 
 #undef UNICODE
 
+#include <stdio.h>
 #include <stdbool.h>
 #include <fm/host/stdint.h>
 #include <fm/host/md.h>
 
 #define WLD_NO_SLOT_ID 9999
-#define MAX_WLD_PARTITIONS 20
 
 // WLD Error Codes
 #define WLDR_OK                         0
@@ -28,20 +28,181 @@
 #define WLDR_NO_SLOTLIST_DEFINED        2
 #define WLDR_WLD_ALREADY_INITIALIZED    3
 #define WLDR_MD_CMD_ERROR               4
+#define WLDR_INVALID_PARAMETER          5
+#define WLDR_ASYNC_NOT_INITIALIZED      6
 
 typedef unsigned long int WLD_RV;
 
+// MD_RV returned by SendWLDMessageToFM when its timeout expired before
+// a reply was received.  Not an MD library result code.
+#define WLD_MDR_TIMEOUT ((MD_RV)0x80000100)
+
+// MD_RV returned by SendWLDMessageToFM when admission control turned
+// the command away: every adapter it could go to is at its limits (see
+// SetWLDAdmission).  Nothing was sent, so it is safe to retry
+// elsewhere.  Not an MD library result code.
+#define WLD_MDR_BUSY ((MD_RV)0x80000101)
+
+// Slot selection policies used by GetWLDSlotID (and SendWLDMessageToFM
+// with WLD_NO_SLOT_ID).  The policy may also be set with the WLD_POLICY
+// environment variable: "rr", "least", "ewma", "p2c" or "adapter".
+// Round-robin spreads requests over the partitions, so an adapter
+// with three partitions gets three times the share of an adapter with
+// one; adapter round-robin gives every adapter (hsmID) with an active
+// partition the same share, and takes turns over the partitions of
+// each adapter.  Adapter round-robin does not use partition weights.
+typedef enum WLD_POLICY {
+    WLD_POLICY_ROUND_ROBIN = 0,         // default
+    WLD_POLICY_LEAST_OUTSTANDING,       // fewest requests in flight on the adapter
+    WLD_POLICY_EWMA_LATENCY,            // lowest EWMA latency x (in flight + 1)
+    WLD_POLICY_POWER_OF_TWO,            // less loaded of two random partitions
+    WLD_POLICY_ADAPTER_ROUND_ROBIN      // adapters in turn, then their partitions in turn
+} WLD_POLICY;
+
+// weight sets the partition's share of the traffic relative to the
+// others (1 - 1000, default 1).  In WLD_SLOT_LIST a slot is given a
+// weight as "slot:weight", e.g. "3:4,5:1"; WLD_CALIBRATE=<msec> sets the
+// weight of slots without one from the FM ping throughput measured on
+// their adapter at startup.  InitializeWLD and ReconfigureWLD return
+// WLDR_INVALID_PARAMETER for a weight out of range or a slot list
+// entry that does not parse.
 typedef struct WLD_PARTITION_LOOKUP {
     uint32_t slot;
     bool active;
     uint32_t embeddedSlot;
     uint32_t hsmID;
+    uint32_t weight;
 } WLD_PARTITION_LOOKUP;
 
+// Circuit breaker state of an adapter.  An adapter that fails a command
+// is opened (its partitions are taken out of rotation) and probed in
+// the background with exponential backoff.  Once a probe succeeds it
+// is half open and gets a growing share of its traffic back until it
+// is closed again.
+typedef enum WLD_ADAPTER_STATE {
+    WLD_ADAPTER_CLOSED = 0,             // healthy
+    WLD_ADAPTER_OPEN,                   // failed, waiting for a probe
+    WLD_ADAPTER_HALF_OPEN               // probe passed, ramping traffic back
+} WLD_ADAPTER_STATE;
+
+typedef struct WLD_HEALTH_CONFIG {
+    uint32_t probeIntervalMsec;         // how often the prober wakes up
+    uint32_t probeTimeoutMsec;          // timeout of the FM ping
+    uint32_t backoffMinMsec;            // first retry after a failure
+    uint32_t backoffMaxMsec;            // retry interval cap
+    uint32_t rampSteps;                 // traffic share steps back to full
+    uint32_t rampStepMsec;              // time spent at each step
+    uint16_t pingFmNumber;              // FM to ping (0 = MD_GetHsmState only)
+} WLD_HEALTH_CONFIG;
+
+// InitializeWLD discovers all adapters in parallel, asking each for its
+// state once.  It returns when every adapter has answered or after
+// WLD_DISCOVERY_TIMEOUT msec (default 10000); with WLD_READY=first it
+// returns as soon as one partition is usable.  Adapters not discovered
+// by then join through the health prober when they answer.
+// WLD_TOPOLOGY_CACHE=<file> keeps the discovered topology across runs:
+// partitions found last time are used at once (combine with
+// WLD_READY=first to skip the wait) and revalidated in the background.
+
 WLD_RV InitializeWLD(uint32_t *pSlotList, uint32_t numSlots);
 
+WLD_RV InitializeWLDWeighted(uint32_t *pSlotList, const uint32_t *pWeights, uint32_t numSlots);
+
+// Replace the slot list while requests keep flowing.  pSlotList NULL
+// re-reads WLD_SLOT_FILE (a file holding the list) or WLD_SLOT_LIST;
+// a weight of 0 keeps the weight a remaining slot had.  Slots and
+// adapters that stay keep their state and only new adapters are
+// discovered.  Requests already running on the old table finish there,
+// and the call returns once they have, or after WLD_DRAIN_TIMEOUT msec
+// (default 30000).  The new table is in use before the wait, and
+// another ReconfigureWLD may run meanwhile.
+WLD_RV ReconfigureWLD(uint32_t *pSlotList, const uint32_t *pWeights, uint32_t numSlots);
+
 WLD_RV GetWLDSlotID(uint32_t *pSlotID, uint32_t *pEmbeddedSlotID);
 
+WLD_RV GetWLDSlotInfo(uint32_t slotID, uint32_t *pHsmID, uint32_t *pEmbeddedSlotID);
+
+WLD_RV SetWLDPolicy(WLD_POLICY policy);
+
+WLD_POLICY GetWLDPolicy(void);
+
+WLD_RV SetWLDHealthConfig(const WLD_HEALTH_CONFIG *pConfig);
+
+WLD_RV GetWLDAdapterState(uint32_t hsmID, WLD_ADAPTER_STATE *pState, uint32_t *pAdmitPermille);
+
+void StopWLDHealthMonitor(void);
+
+WLD_RV GetWLDAdapterLatency(uint32_t hsmID, uint32_t permille, uint64_t *pNsec);
+
+/*
+    Statistics
+
+    Every command sent by SendWLDMessageToFM is counted per partition
+    and per adapter, with the MD result and the MD_SendReceive latency.
+    Counters live in per thread blocks, so the request path never
+    writes a cache line another thread writes; GetWLDStats sums them
+    into a snapshot.  Latencies are kept in a log-linear (HDR style)
+    histogram with 8 sub-buckets per power of two.
+*/
+
+#define WLD_STATS_MD_RESULTS            9   // see GetWLDStatsResultName
+#define WLD_STATS_HIST_BUCKETS          368
+
+typedef enum WLD_STATS_FORMAT {
+    WLD_STATS_JSON = 0,
+    WLD_STATS_PROMETHEUS                // text exposition format
+} WLD_STATS_FORMAT;
+
+typedef struct WLD_ADAPTER_STATS {
+    uint32_t hsmID;
+    WLD_ADAPTER_STATE state;
+    uint32_t admitPermille;
+    uint32_t inFlight;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t mdResults[WLD_STATS_MD_RESULTS];
+    uint64_t retries;
+    uint64_t deactivations;
+    uint64_t latencySumNsec;
+    uint64_t latencyP50Nsec;
+    uint64_t latencyP99Nsec;
+    uint64_t latencyP999Nsec;
+    uint64_t latencyMaxNsec;
+    uint64_t latencyBuckets[WLD_STATS_HIST_BUCKETS];
+} WLD_ADAPTER_STATS;
+
+typedef struct WLD_PARTITION_STATS {
+    uint32_t slot;
+    uint32_t hsmID;
+    bool active;
+    uint32_t weight;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t retries;
+} WLD_PARTITION_STATS;
+
+typedef struct WLD_STATS {
+    uint64_t timestampNsec;             // CLOCK_MONOTONIC
+    uint32_t adapterCount;
+    WLD_ADAPTER_STATS *pAdapters;
+    uint32_t partitionCount;
+    WLD_PARTITION_STATS *pPartitions;
+} WLD_STATS;
+
+WLD_RV GetWLDStats(WLD_STATS **ppStats);
+
+void FreeWLDStats(WLD_STATS *pStats);
+
+const char *GetWLDStatsResultName(uint32_t result);
+
+uint64_t GetWLDStatsBucketNsec(uint32_t bucket);
+
+WLD_RV WriteWLDStats(FILE *pFile, WLD_STATS_FORMAT format);
+
+WLD_RV StartWLDStatsDump(const char *pPath, WLD_STATS_FORMAT format, uint32_t intervalMsec);
+
+void StopWLDStatsDump(void);
+
 MD_RV SendWLDMessageToFM(uint32_t slotID,
     uint16_t fmNumber,
     MD_Buffer_t *pReq,
@@ -50,4 +211,357 @@ MD_RV SendWLDMessageToFM(uint32_t slotID,
     uint32_t *pReceivedLen,
     uint32_t *pFMStatus);
 
+/*
+    Admission control
+
+    Each adapter may be limited to maxInFlight commands at once and to
+    ratePerSec commands a second (a token bucket holding burst tokens).
+    A command that would exceed a limit goes to another adapter when
+    any slot will do.  Otherwise SendWLDMessageToFM waits in the
+    adapter's queue - at most maxQueued callers - until it gets in or
+    its timeout expires (maxWaitMsec without a timeout, 0 = no limit),
+    and TrySendWLDMessageToFM does not wait at all.  Either returns
+    WLD_MDR_BUSY when the command was not admitted.  Nothing is limited
+    until SetWLDAdmission is called or, for all adapters, the
+    WLD_ADMISSION environment variable is set to
+    "maxInFlight[:maxQueued[:ratePerSec[:burst[:maxWaitMsec]]]]".
+*/
+
+#define WLD_ALL_ADAPTERS 0xFFFFFFFF
+
+typedef struct WLD_ADMISSION_CONFIG {
+    uint32_t maxInFlight;               // commands sent at once, 0 = no limit
+    uint32_t maxQueued;                 // callers waiting, 0 = fail at once
+    uint32_t ratePerSec;                // token bucket rate, 0 = no limit
+    uint32_t burst;                     // token bucket size (0 = 1)
+    uint32_t maxWaitMsec;               // longest wait without a timeout, 0 = no limit
+} WLD_ADMISSION_CONFIG;
+
+// Limit one adapter (hsmID), or with WLD_ALL_ADAPTERS every adapter
+// that was not given limits of its own
+WLD_RV SetWLDAdmission(uint32_t hsmID, const WLD_ADMISSION_CONFIG *pConfig);
+
+void GetWLDAdmissionCounts(uint64_t *pQueued, uint64_t *pRejected);
+
+MD_RV TrySendWLDMessageToFM(uint32_t slotID,
+    uint16_t fmNumber,
+    MD_Buffer_t *pReq,
+    uint32_t timeout,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    uint32_t *pFMStatus);
+
+/*
+    Retries
+
+    A command that fails is classified by ClassifyWLDError.  With
+    WLD_NO_SLOT_ID it is replayed on another partition unless the error
+    is fatal: an adapter fault opens the adapter's breaker and a
+    partition fault takes only that partition out of rotation (the
+    health prober brings it back once its embedded slot resolves
+    again), and either is replayed at once.  A retryable error leaves
+    the adapter in rotation and is replayed after an exponential
+    backoff with full jitter.  A command for a given slot is never
+    replayed, but its adapter or partition is still taken out.
+
+    Replays are limited by maxAttempts per command and by a budget
+    shared by the whole process: every first attempt earns
+    budgetPercent / 100 of a retry, every retry spends one, and at most
+    budgetReserve retries can be saved up.  When the budget is spent the
+    error is returned instead of being replayed.  The defaults may be
+    changed with the WLD_RETRY environment variable,
+    "budgetPercent[:budgetReserve[:maxAttempts[:backoffMinUsec[:backoffMaxUsec]]]]".
+*/
+
+typedef enum WLD_ERROR_CLASS {
+    WLD_ERROR_NONE = 0,                 // success
+    WLD_ERROR_FATAL,                    // returned to the caller, not replayed
+    WLD_ERROR_RETRYABLE,                // transient, replayed after a backoff
+    WLD_ERROR_PARTITION,                // the partition is gone, take it out
+    WLD_ERROR_ADAPTER                   // the adapter failed, open its breaker
+} WLD_ERROR_CLASS;
+
+typedef struct WLD_RETRY_CONFIG {
+    uint32_t budgetPercent;             // retries earned per 100 first attempts (default 20, 0 = no budget)
+    uint32_t budgetReserve;             // retries that can be saved up (default 10)
+    uint32_t maxAttempts;               // attempts per command (default 0 = one per partition)
+    uint32_t backoffMinUsec;            // first backoff (default 200, 0 = none)
+    uint32_t backoffMaxUsec;            // backoff cap (default 20000)
+} WLD_RETRY_CONFIG;
+
+// Classify the result of a command: the MD result and, when that is
+// MDR_OK, the FM status
+WLD_ERROR_CLASS ClassifyWLDError(MD_RV mdResult, uint32_t fmStatus);
+
+WLD_RV SetWLDRetryConfig(const WLD_RETRY_CONFIG *pConfig);
+
+WLD_RV GetWLDRetryConfig(WLD_RETRY_CONFIG *pConfig);
+
+void GetWLDRetryCounts(uint64_t *pRetries, uint64_t *pDenied);
+
+/*
+    Result cache
+
+    SendWLDCachedMessageToFM is SendWLDMessageToFM for commands that
+    only read, such as the sample FM's key verify.  Replies are kept,
+    keyed by FM number, request bytes and slot, and handed out again
+    until they expire: ttlMsec for an FM status of 0 and
+    negativeTtlMsec for any other status (0 = not kept).  MD errors are
+    never kept.  Callers asking for a command that another caller is
+    already sending wait for its reply instead of sending it again.  A
+    slot's replies are dropped when its partition is taken out of
+    rotation, and replies for WLD_NO_SLOT_ID when any partition is;
+    InvalidateWLDCache drops them on request, e.g. after a command that
+    changes keys (WLD_NO_SLOT_ID drops all of them).  Nothing is cached
+    until SetWLDCache is called or the WLD_CACHE environment variable
+    is set to "entries[:ttlMsec[:negativeTtlMsec[:maxReplyLen]]]"
+    (ttlMsec defaults to 1000 there).
+*/
+
+typedef struct WLD_CACHE_CONFIG {
+    uint32_t entries;                   // replies kept, 0 = off
+    uint32_t ttlMsec;                   // life of a reply with FM status 0, 0 = not kept
+    uint32_t negativeTtlMsec;           // life of a reply with another status, 0 = not kept
+    uint32_t maxReplyLen;               // longer replies are not kept (0 = 256)
+} WLD_CACHE_CONFIG;
+
+WLD_RV SetWLDCache(const WLD_CACHE_CONFIG *pConfig);
+
+WLD_RV GetWLDCacheConfig(WLD_CACHE_CONFIG *pConfig);
+
+void InvalidateWLDCache(uint32_t slotID);
+
+void GetWLDCacheCounts(uint64_t *pHits, uint64_t *pMisses, uint64_t *pCollapsed);
+
+MD_RV SendWLDCachedMessageToFM(uint32_t slotID,
+    uint16_t fmNumber,
+    MD_Buffer_t *pReq,
+    uint32_t timeout,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    uint32_t *pFMStatus);
+
+/*
+    Request tracing
+
+    StartWLDTrace records every call of SendWLDMessageToFM (and of the
+    calls built on it) in a binary trace file: one WLD_TRACE_RECORD
+    with the time the call started, the FM number, the slot asked for
+    and the partition and adapter that served it, the request size, the
+    MD result, the FM status and the latency of the whole call.  Records
+    are collected in a ring per thread and copied to the memory mapped
+    file a ring at a time, so they are in file order per thread only;
+    sort them by timeNsec.  The file has room for maxRecords (0 = about
+    a million) and calls after that are counted as dropped.
+    StopWLDTrace writes out what is left in the rings, fills in the
+    header and trims the file.  The file of a trace that was never
+    stopped says records == 0; its records are the ones flagged
+    WLD_TRACE_RECORDED.  Fields are in host byte order.  A trace is
+    started by InitializeWLD when the WLD_TRACE environment variable is
+    set to "path[:maxRecords]".  wldreplay sends a trace again.
+*/
+
+#define WLD_TRACE_MAGIC                 "WLDTRACE"
+#define WLD_TRACE_VERSION               1
+
+#define WLD_TRACE_RECORDED              0x0001  // the record was written
+#define WLD_TRACE_ANY_SLOT              0x0002  // sent with WLD_NO_SLOT_ID
+
+typedef struct WLD_TRACE_HEADER {
+    char magic[8];                      // WLD_TRACE_MAGIC, not terminated
+    uint32_t version;                   // WLD_TRACE_VERSION
+    uint32_t recordSize;                // sizeof(WLD_TRACE_RECORD)
+    uint64_t startTimeNsec;             // wall clock (CLOCK_REALTIME) time of timeNsec 0
+    uint64_t records;                   // records in the file, 0 until the trace stopped
+    uint64_t capacity;                  // records the file had room for
+    uint64_t dropped;                   // calls not recorded because the file was full
+} WLD_TRACE_HEADER;
+
+typedef struct WLD_TRACE_RECORD {
+    uint64_t timeNsec;                  // start of the call since the trace started
+    uint32_t latencyNsec;               // the whole call, retries included (capped)
+    uint32_t slot;                      // slot that served it, or the slot asked for
+    uint32_t hsmID;                     // adapter that served it, 0xFFFFFFFF if none was tried
+    uint32_t mdResult;
+    uint32_t fmStatus;                  // valid when mdResult is MDR_OK
+    uint32_t requestLen;
+    uint16_t fmNumber;
+    uint16_t flags;                     // WLD_TRACE_*
+    uint32_t thread;                    // number of the thread that made the call
+} WLD_TRACE_RECORD;
+
+WLD_RV StartWLDTrace(const char *pPath, uint64_t maxRecords);
+
+void StopWLDTrace(void);
+
+void GetWLDTraceCounts(uint64_t *pRecorded, uint64_t *pDropped);
+
+/*
+    Host-wide sharing
+
+    SetWLDShared shares the partition table with the other processes on
+    the host: the partitions, the active flags, the requests in flight
+    per adapter and the round-robin cursor of every table published
+    afterwards live in a POSIX shared memory segment named pName (e.g.
+    "/wld") plus a hash of the table layout, so processes share a
+    segment only when they use the same slots with the same weights.
+    Selection stays lock free.  An adapter taken out by one process is
+    out for all of them until the process that took it out has probed
+    it back.  The share of a process that exits without detaching (its
+    requests in flight, the adapters it was probing) is taken back by
+    the health prober of the others within a second.  At most 64
+    processes share a segment, and they must see each other's process
+    IDs.  The segment of a table that ReconfigureWLD replaced is removed
+    by the last process to leave it; one left behind by processes that
+    all exited is taken over by the next process to attach.  Sharing
+    starts with InitializeWLD when the WLD_SHARED environment variable
+    is set to the name; NULL stops it for tables published later.
+*/
+
+typedef struct WLD_SHARED_STATE {
+    bool shared;                        // the published table is in a segment
+    uint32_t processes;                 // processes attached to it
+    uint64_t reclaimed;                 // processes that exited without detaching
+} WLD_SHARED_STATE;
+
+WLD_RV SetWLDShared(const char *pName);
+
+WLD_RV GetWLDSharedState(WLD_SHARED_STATE *pState);
+
+/*
+    Key affinity
+
+    GetWLDSlotIDForKey maps an affinity key - a key label or handle, any
+    bytes - to a partition by weighted rendezvous hashing: every active
+    partition scores the key and the best score wins.  The same key goes
+    to the same partition, so per-key state in the FM (cached handles,
+    sessions) stays warm, and when an adapter goes inactive only the
+    keys it owned move; they come back when it does.
+
+    Bounded load: an adapter is skipped for a key while it has more than
+    loadPercent of its weighted share of the requests in flight, and
+    the key goes to its next best partition (a "spill") instead, so a
+    hot key cannot melt one adapter.  loadPercent is 100 or more, or 0
+    for no bound (default 125, or the WLD_AFFINITY_LOAD environment
+    variable).
+
+    SendWLDKeyedMessageToFM is SendWLDMessageToFM with the slot chosen
+    by key; if the adapter fails the command is replayed on the key's
+    next partition.  Commands that carry the embedded slot should get
+    it from GetWLDSlotIDForKey and be sent to that slot instead.
+*/
+
+WLD_RV GetWLDSlotIDForKey(const void *pKey, uint32_t keyLen, uint32_t *pSlotID, uint32_t *pEmbeddedSlotID);
+
+WLD_RV SetWLDAffinityLoad(uint32_t loadPercent);
+
+uint64_t GetWLDAffinitySpills(void);
+
+MD_RV SendWLDKeyedMessageToFM(const void *pKey,
+    uint32_t keyLen,
+    uint16_t fmNumber,
+    MD_Buffer_t *pReq,
+    uint32_t timeout,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    uint32_t *pFMStatus);
+
+/*
+    Hedged requests
+
+    SendWLDHedgedMessageToFM is for idempotent commands sent with
+    WLD_NO_SLOT_ID.  If the adapter the command went to has not replied
+    once the configured percentile of its recent latency has passed
+    (see GetWLDAdapterLatency), a duplicate is sent to a partition on
+    another adapter.  The first reply is returned and the other one is
+    discarded.  Hedges are limited to maxHedgePercent of the hedged
+    calls so that a slow cluster is not loaded twice over.  The request
+    is copied, so the buffers need only stay valid for the call.
+*/
+
+typedef struct WLD_HEDGE_CONFIG {
+    uint32_t percentile;                // permille of recent latency, 0 = off
+    uint32_t minDelayUsec;              // never hedge sooner than this
+    uint32_t maxHedgePercent;           // hedges per 100 hedged calls
+} WLD_HEDGE_CONFIG;
+
+WLD_RV SetWLDHedging(const WLD_HEDGE_CONFIG *pConfig);
+
+void GetWLDHedgeCounts(uint64_t *pHedged, uint64_t *pHedgeWins);
+
+MD_RV SendWLDHedgedMessageToFM(uint32_t slotID,
+    uint16_t fmNumber,
+    MD_Buffer_t *pReq,
+    uint32_t timeout,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    uint32_t *pFMStatus);
+
+/*
+    Asynchronous interface
+
+    Requests are queued on a per-adapter submission queue and sent by a
+    fixed number of worker threads per adapter (the in-flight depth of
+    that adapter).  Completion is reported through the callback passed
+    to SubmitWLDMessageToFM or, when no callback is given, through the
+    completion queue read by PollWLDCompletions.  The descriptor from
+    GetWLDCompletionFD (an eventfd) becomes readable whenever
+    completions are queued.  The request and response buffers must stay
+    valid until the request completes.
+*/
+
+typedef uint64_t WLD_TICKET;
+
+typedef struct WLD_COMPLETION {
+    WLD_TICKET ticket;
+    MD_RV mdResult;
+    uint32_t receivedLen;
+    uint32_t fmStatus;
+    void *pContext;
+} WLD_COMPLETION;
+
+typedef void (*WLD_COMPLETION_CB)(const WLD_COMPLETION *pCompletion);
+
+WLD_RV InitializeWLDAsync(uint32_t inFlightPerAdapter);
+
+void FinalizeWLDAsync(void);
+
+WLD_RV SubmitWLDMessageToFM(uint32_t slotID,
+    uint16_t fmNumber,
+    MD_Buffer_t *pReq,
+    uint32_t timeout,
+    MD_Buffer_t *pResp,
+    WLD_COMPLETION_CB pCallback,
+    void *pContext,
+    WLD_TICKET *pTicket);
+
+uint32_t PollWLDCompletions(WLD_COMPLETION *pCompletions, uint32_t maxCompletions, uint32_t waitMsec);
+
+int GetWLDCompletionFD(void);
+
+/*
+    Batched interface
+
+    Fixed-size records for the same adapter sent concurrently through
+    SendWLDBatchRecord are coalesced into one batch envelope (see
+    wld_fm.h).  A batch is sent once it holds maxRecords records or
+    lingerUsec has passed since its first record was added, or
+    earlier if the earliest deadline (timeout) of its records is due.
+    The envelope is sent within that deadline, so no caller waits for
+    it much past its own.  A record is built for the adapter of its
+    slot (embedded slot, key handles), so slotID must be a WLD slot:
+    WLD_NO_SLOT_ID is rejected with MDR_INVALID_PARAMETER and a failed
+    envelope is not replayed elsewhere.  The record must stay valid
+    until the call returns.
+*/
+
+WLD_RV SetWLDBatching(uint32_t maxRecords, uint32_t lingerUsec);
+
+MD_RV SendWLDBatchRecord(uint32_t slotID,
+    uint16_t fmNumber,
+    const void *pRecord,
+    uint32_t recordLen,
+    uint32_t timeout,
+    uint32_t *pRecordStatus);
+
 #endif
\ No newline at end of file
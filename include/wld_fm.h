@@ -0,0 +1,101 @@
+/*
+    wld_fm.h 
+
+    Message formats shared by the workload distribution (WLD) host code
+    and the sample FM.  All fields are 32-bit big-endian words.
+    This code is sample ONLY and Thales Inc. assumes no liability
+    or responsibility for its correct operation.
+*/
+
+
+#ifndef _WLD_FM_H_
+#define _WLD_FM_H_
+
+/*
+    Opcodes
+
+    A message whose first word is one of the WLD_FM_*_MAGIC values
+    below is a command looked up in the FM's command table; any other
+    first word is the embedded slot of a single key verify.  The magic
+    values can never be mistaken for an embedded slot number.
+*/
+
+/*
+    Key verify (single record)
+
+    Request:    embeddedSlot, hKey
+    Reply:      none - the result is returned as the FM status
+*/
+#define WLD_FM_VERIFY_RECORD_LEN        8
+
+/*
+    Batch envelope - many records in one MD_SendReceive
+
+    Request:    WLD_FM_BATCH_MAGIC, count, recordLen, count * record
+    Reply:      count, count * status
+
+    The FM status of the message is CKR_OK if the envelope itself was
+    accepted; each record's result is in the status vector.
+*/
+#define WLD_FM_BATCH_MAGIC              0x57424348  /* "WBCH" */
+#define WLD_FM_MAX_BATCH                256
+
+/*
+    Key cache flush
+
+    Request:    WLD_FM_FLUSH_MAGIC, embeddedSlot
+    Reply:      none
+
+    Drops the FM's cached key handles and closes its long-lived session
+    for embeddedSlot, or for every slot when embeddedSlot is
+    WLD_FM_FLUSH_ALL.  Send it after keys are created, deleted or
+    renamed on a slot.
+*/
+#define WLD_FM_FLUSH_MAGIC              0x57464C53  /* "WFLS" */
+#define WLD_FM_FLUSH_ALL                0xFFFFFFFF
+
+/*
+    Ping
+
+    Request:    WLD_FM_PING_MAGIC
+    Reply:      none
+
+    Answered with CKR_OK without touching any slot.  Used by the WLD
+    health prober to check that an adapter and its FM respond.
+*/
+#define WLD_FM_PING_MAGIC               0x57504E47  /* "WPNG" */
+
+/*
+    Bulk key verify
+
+    Request:    WLD_FM_BULK_VERIFY_MAGIC, embeddedSlot, count,
+                count * (hKey, labelLen, labelLen label bytes)
+    Reply:      count, (count + 31) / 32 bitmap words
+
+    Bit i % 32 of bitmap word i / 32 is set if hKey of record i is the
+    object labelled label on embeddedSlot.  Labels are not padded, so
+    a record only starts on a word boundary if the labels before it
+    happen to.  The FM fetches the handles of all the slot's objects
+    with one C_FindObjects call and checks every record against them,
+    so a whole slot's keys can be revalidated (after a partition
+    restore, say) with a few messages.  The FM status is CKR_OK if the
+    request was valid and the slot could be searched.
+*/
+#define WLD_FM_BULK_VERIFY_MAGIC        0x5742564B  /* "WBVK" */
+#define WLD_FM_MAX_BULK_VERIFY          1024
+#define WLD_FM_MAX_LABEL_LEN            64
+
+/*
+    FM status
+
+    The FM status of a reply is a PKCS#11 CK_RV.  The host only needs
+    the ones that say the partition (token) the command was for is gone
+    while the adapter itself answered; their values are those of
+    CKR_DEVICE_REMOVED, CKR_TOKEN_NOT_PRESENT and
+    CKR_TOKEN_NOT_RECOGNIZED, so no PKCS#11 header is needed.
+*/
+#define WLD_FM_STATUS_DEVICE_REMOVED        0x00000032
+#define WLD_FM_STATUS_TOKEN_NOT_PRESENT     0x000000E0
+#define WLD_FM_STATUS_TOKEN_NOT_RECOGNIZED  0x000000E1
+
+#endif
@@ -0,0 +1,237 @@
+/*
+    wld_msg.h
+
+    Typed FM messages for the workload distribution (WLD) sample.  A
+    message is described once as a list of fields; WLD_MSG_DEFINE turns
+    the list into a struct, its wire length and big-endian encode,
+    decode, append and parse functions, so no command has to marshal
+    its words by hand.  Messages are built in a per-thread WLD_MSG
+    whose arena and reply buffer are allocated once and reused, so a
+    typed FM call makes no heap allocation and copies nothing but the
+    wire format.  This code is sample ONLY and Thales Inc. assumes no
+    liability or responsibility for its correct operation.
+*/
+
+
+#ifndef _WLD_MSG_H_
+#define _WLD_MSG_H_
+
+#include "wld.h"
+#include "wld_fm.h"
+
+// Bytes of encoded fields a message can hold, the number of buffers
+// it can be sent as (a full batch envelope: header plus one per
+// record), and the largest reply
+#define WLD_MSG_ARENA_LEN               1024
+#define WLD_MSG_MAX_SEGMENTS            (WLD_FM_MAX_BATCH + 2)
+#define WLD_MSG_REPLY_LEN               ((WLD_FM_MAX_BATCH + 1) * 4)
+
+// A message being built, then sent.  request[] is NULL terminated and
+// may be passed to SendWLDMessageToFM (or SendWLDHedgedMessageToFM)
+// directly, with reply[] for the reply.  The reply is valid until the
+// thread's next BeginWLDMessage.  pLarge holds a message too big for
+// the arena (ReserveWLDLargeMessage); it only grows and stays with the
+// buffer.
+typedef struct WLD_MSG {
+    MD_Buffer_t request[WLD_MSG_MAX_SEGMENTS + 1];
+    uint32_t segments;
+    uint32_t arenaUsed;
+    bool overflow;
+    MD_Buffer_t reply[2];
+    uint32_t replyLen;
+    uint8_t *pLarge;
+    uint32_t largeLen;
+    uint8_t arena[WLD_MSG_ARENA_LEN];
+    uint8_t replyData[WLD_MSG_REPLY_LEN];
+} WLD_MSG;
+
+// Get the calling thread's message, emptied.  NULL only if the first
+// allocation for the thread fails.
+WLD_MSG *BeginWLDMessage(void);
+
+// Reserve len bytes of the arena at the end of the message
+uint8_t *ReserveWLDMessage(WLD_MSG *pMsg, uint32_t len);
+
+// Reserve len bytes outside the arena, as a buffer of their own, for a
+// message the arena cannot hold.  One per message.
+uint8_t *ReserveWLDLargeMessage(WLD_MSG *pMsg, uint32_t len);
+
+// Add caller memory to the message without copying it.  It must stay
+// valid until the message has been sent.
+bool AttachWLDMessage(WLD_MSG *pMsg, const void *pData, uint32_t len);
+
+// Send the message.  Fails with MDR_INVALID_PARAMETER if it overflowed.
+MD_RV SendWLDMessage(WLD_MSG *pMsg,
+    uint32_t slotID,
+    uint16_t fmNumber,
+    uint32_t timeout,
+    uint32_t *pFMStatus);
+
+// Big-endian field codecs, byte by byte so neither alignment nor host
+// byte order matter
+static inline uint8_t *wldMsgPut_uint8_t(uint8_t *p, uint8_t v)
+{
+    p[0] = v;
+    return p + 1;
+}
+
+static inline uint8_t *wldMsgPut_uint16_t(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+    return p + 2;
+}
+
+static inline uint8_t *wldMsgPut_uint32_t(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+    return p + 4;
+}
+
+static inline uint8_t *wldMsgPut_uint64_t(uint8_t *p, uint64_t v)
+{
+    p = wldMsgPut_uint32_t(p, (uint32_t)(v >> 32));
+    return wldMsgPut_uint32_t(p, (uint32_t)v);
+}
+
+static inline const uint8_t *wldMsgGet_uint8_t(const uint8_t *p, uint8_t *pV)
+{
+    *pV = p[0];
+    return p + 1;
+}
+
+static inline const uint8_t *wldMsgGet_uint16_t(const uint8_t *p, uint16_t *pV)
+{
+    *pV = (uint16_t)((p[0] << 8) | p[1]);
+    return p + 2;
+}
+
+static inline const uint8_t *wldMsgGet_uint32_t(const uint8_t *p, uint32_t *pV)
+{
+    *pV = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    return p + 4;
+}
+
+static inline const uint8_t *wldMsgGet_uint64_t(const uint8_t *p, uint64_t *pV)
+{
+    uint32_t hi, lo;
+
+    p = wldMsgGet_uint32_t(p, &hi);
+    p = wldMsgGet_uint32_t(p, &lo);
+    *pV = ((uint64_t)hi << 32) | lo;
+    return p;
+}
+
+#define WLD_MSG_FIELD_DECL(type, name)  type name;
+#define WLD_MSG_FIELD_LEN(type, name)   + sizeof(type)
+#define WLD_MSG_FIELD_PUT(type, name)   p = wldMsgPut_##type(p, pFields->name);
+#define WLD_MSG_FIELD_GET(type, name)   p = wldMsgGet_##type(p, &pFields->name);
+
+/*
+    WLD_MSG_DEFINE(Name, FIELDS)
+
+    FIELDS(X) lists the fields in wire order as X(type, name), where
+    type is uint8_t, uint16_t, uint32_t or uint64_t.  Defines:
+
+        typedef struct { ... } Name;
+        Name_WIRE_LEN
+        uint8_t *Name_Encode(const Name *, uint8_t *p)
+        const uint8_t *Name_Decode(Name *, const uint8_t *p)
+        bool Name_Append(WLD_MSG *, const Name *)
+        bool Name_Parse(const uint8_t *p, uint32_t len, Name *)
+*/
+#define WLD_MSG_DEFINE(Name, FIELDS) \
+    typedef struct Name { FIELDS(WLD_MSG_FIELD_DECL) } Name; \
+    enum { Name##_WIRE_LEN = 0 FIELDS(WLD_MSG_FIELD_LEN) }; \
+    static inline uint8_t *Name##_Encode(const Name *pFields, uint8_t *p) \
+    { \
+        FIELDS(WLD_MSG_FIELD_PUT) \
+        return p; \
+    } \
+    static inline const uint8_t *Name##_Decode(Name *pFields, const uint8_t *p) \
+    { \
+        FIELDS(WLD_MSG_FIELD_GET) \
+        return p; \
+    } \
+    static inline bool Name##_Append(WLD_MSG *pMsg, const Name *pFields) \
+    { \
+        uint8_t *p = ReserveWLDMessage(pMsg, Name##_WIRE_LEN); \
+        return p && Name##_Encode(pFields, p); \
+    } \
+    static inline bool Name##_Parse(const uint8_t *p, uint32_t len, Name *pFields) \
+    { \
+        return len >= Name##_WIRE_LEN && Name##_Decode(pFields, p); \
+    }
+
+// The sample FM's messages (see wld_fm.h)
+#define WLD_MSG_VERIFY_FIELDS(X) \
+    X(uint32_t, embeddedSlot) \
+    X(uint32_t, hKey)
+WLD_MSG_DEFINE(WLD_MSG_VERIFY, WLD_MSG_VERIFY_FIELDS)
+
+#define WLD_MSG_PING_FIELDS(X) \
+    X(uint32_t, magic)
+WLD_MSG_DEFINE(WLD_MSG_PING, WLD_MSG_PING_FIELDS)
+
+#define WLD_MSG_FLUSH_FIELDS(X) \
+    X(uint32_t, magic) \
+    X(uint32_t, embeddedSlot)
+WLD_MSG_DEFINE(WLD_MSG_FLUSH, WLD_MSG_FLUSH_FIELDS)
+
+#define WLD_MSG_BATCH_FIELDS(X) \
+    X(uint32_t, magic) \
+    X(uint32_t, count) \
+    X(uint32_t, recordLen)
+WLD_MSG_DEFINE(WLD_MSG_BATCH, WLD_MSG_BATCH_FIELDS)
+
+#define WLD_MSG_BATCH_REPLY_FIELDS(X) \
+    X(uint32_t, count)
+WLD_MSG_DEFINE(WLD_MSG_BATCH_REPLY, WLD_MSG_BATCH_REPLY_FIELDS)
+
+#define WLD_MSG_BULK_VERIFY_FIELDS(X) \
+    X(uint32_t, magic) \
+    X(uint32_t, embeddedSlot) \
+    X(uint32_t, count)
+WLD_MSG_DEFINE(WLD_MSG_BULK_VERIFY, WLD_MSG_BULK_VERIFY_FIELDS)
+
+// One bulk verify record; labelLen label bytes follow
+#define WLD_MSG_BULK_KEY_FIELDS(X) \
+    X(uint32_t, hKey) \
+    X(uint32_t, labelLen)
+WLD_MSG_DEFINE(WLD_MSG_BULK_KEY, WLD_MSG_BULK_KEY_FIELDS)
+
+#define WLD_MSG_BULK_REPLY_FIELDS(X) \
+    X(uint32_t, count)
+WLD_MSG_DEFINE(WLD_MSG_BULK_REPLY, WLD_MSG_BULK_REPLY_FIELDS)
+
+_Static_assert(WLD_MSG_VERIFY_WIRE_LEN == WLD_FM_VERIFY_RECORD_LEN, "verify record length");
+_Static_assert(WLD_FM_MAX_BULK_VERIFY % 32 == 0, "bulk verify bitmap words");
+_Static_assert(WLD_MSG_BULK_REPLY_WIRE_LEN + WLD_FM_MAX_BULK_VERIFY / 8 <= WLD_MSG_REPLY_LEN,
+    "bulk verify reply length");
+
+// A key to check with VerifyWLDKeys: the object labelled pLabel should
+// have handle hKey
+typedef struct WLD_KEY_REF {
+    const char *pLabel;
+    uint32_t labelLen;
+    uint32_t hKey;
+} WLD_KEY_REF;
+
+// Check count keys on slotID with bulk key verify messages of up to
+// WLD_FM_MAX_BULK_VERIFY keys each.  Bit i % 32 of pBitmap[i / 32]
+// ((count + 31) / 32 words) is set if key i checked out.  timeout is
+// per message.  Returns the first MD error, or MDR_OK with *pFMStatus
+// the first FM status that was not CKR_OK (keys of that message are
+// left clear).  The messages are built in the thread's WLD_MSG.
+MD_RV VerifyWLDKeys(uint32_t slotID,
+    uint16_t fmNumber,
+    const WLD_KEY_REF *pKeys,
+    uint32_t count,
+    uint32_t timeout,
+    uint32_t *pBitmap,
+    uint32_t *pFMStatus);
+
+#endif
@@ -0,0 +1,49 @@
+/*
+    wld_session.h
+
+    Host side PKCS#11 session pool for the workload distribution (WLD)
+    sample.  Each WLD slot keeps a pool of logged-in sessions that
+    threads check out and return, and a cache of object handles
+    resolved by label, so that picking a slot also hands back a warm
+    session and key handle.
+    This code is sample ONLY and Thales Inc. assumes no liability
+    or responsibility for its correct operation.
+*/
+
+
+#ifndef _WLD_SESSION_H_
+#define _WLD_SESSION_H_
+
+#include "cryptoki_v2.h"
+#include "wld.h"
+
+#define WLD_SESSION_DEFAULT_PER_SLOT    8
+#define WLD_SESSION_MAX_LABEL_LEN       64
+#define WLD_SESSION_MAX_LABELS          8
+
+// A checked out session.  Filled in by GetWLDSession and handed back
+// unchanged to ReleaseWLDSession.
+typedef struct WLD_SESSION {
+    uint32_t slotID;
+    uint32_t embeddedSlotID;
+    CK_SESSION_HANDLE hSession;
+    CK_OBJECT_HANDLE hObject;
+    void *pPool;
+    uint32_t generation;
+} WLD_SESSION;
+
+WLD_RV InitializeWLDSessionPool(CK_FUNCTION_LIST *pFunctions,
+    CK_USER_TYPE userType,
+    const CK_CHAR *pPin,
+    CK_ULONG pinLen,
+    uint32_t maxSessionsPerSlot);
+
+void FinalizeWLDSessionPool(void);
+
+CK_RV GetWLDSession(uint32_t slotID, const char *pLabel, WLD_SESSION *pSession);
+
+void ReleaseWLDSession(WLD_SESSION *pSession, CK_RV lastResult);
+
+void FlushWLDSessions(uint32_t slotID);
+
+#endif
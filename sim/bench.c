@@ -0,0 +1,1050 @@
+/*
+    bench.c
+
+    End-to-end throughput benchmark for the WLD layer running against
+    the simulated HSM backend (sim_md.c / sim_fm.c).  Each worker thread
+    repeatedly selects a slot with GetWLDSlotID() and sends the sample
+    FM key-verify command through SendWLDMessageToFM(), exactly as
+    wldapp does, and the driver reports requests/sec and latency
+    percentiles.
+*/
+
+#undef UNICODE
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <cryptoki.h>
+
+#include "md.h"
+#include "wld.h"
+#include "wld_fm.h"
+#include "wld_msg.h"
+#include "wld_time.h"
+#include "sim.h"
+
+typedef struct BENCH_THREAD BENCH_THREAD;
+
+// One outstanding asynchronous request
+typedef struct BENCH_REQ {
+    BENCH_THREAD *pThread;
+    uint64_t start;
+    int recording;
+    uint8_t wire[WLD_MSG_VERIFY_WIRE_LEN];
+    MD_Buffer_t request[2];
+    MD_Buffer_t reply;
+} BENCH_REQ;
+
+struct BENCH_THREAD {
+    pthread_t thread;
+    uint64_t *pLatency;     // latencies (nsec) recorded after warm-up
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t mdErrors;
+    uint64_t fmErrors;
+    uint64_t noSlot;
+    uint64_t busy;          // turned away by admission control
+    uint64_t keyMoves;      // keyed requests that went to another slot than the key's last one
+    unsigned int seed;
+
+    // Bulk key verify (-V): the keys of one call and its result bitmap
+    WLD_KEY_REF *pBulkKeys;
+    uint32_t *pBulkBitmap;
+
+    // Asynchronous mode: free request records, guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    BENCH_REQ *pReqs;
+    BENCH_REQ **ppFree;
+    uint32_t freeCount;
+};
+
+static volatile int benchRecording = 0;
+static volatile int benchStop = 0;
+static uint32_t *benchKeys = NULL;
+static uint32_t benchWindow = 0;
+static bool benchBatch = false;
+static bool benchHedge = false;
+static bool benchTryAny = false;
+static uint32_t benchTimeout = 0;
+static uint32_t benchAffinityKeys = 0;
+static uint32_t benchHotPercent = 0;
+static _Atomic uint32_t *benchKeySlot = NULL;
+static uint32_t benchBulkKeys = 0;
+static char (*benchBulkLabels)[24] = NULL;
+
+// Reconfiguration churn (-R): the slot lists switched between
+#define BENCH_MAX_SLOTS 1024
+
+typedef struct BENCH_SLOTS {
+    uint32_t count;
+    uint32_t slots[BENCH_MAX_SLOTS];
+    uint32_t weights[BENCH_MAX_SLOTS];
+} BENCH_SLOTS;
+
+static BENCH_SLOTS benchSlots[2];
+static uint32_t benchReconfigureMsec = 0;
+static uint32_t benchReconfigures = 0;
+static uint32_t benchReconfigureFailures = 0;
+static uint64_t benchReconfigureMaxNsec = 0;
+
+static void usage(void)
+{
+    printf("\nUsage: wldbench [options]\n");
+    printf("  -a <n>          simulated adapters (default 4)\n");
+    printf("  -p <n>          partitions per adapter (default 1)\n");
+    printf("  -l <list>       WLD slot list with optional weights, e.g. 0:3,1,3 (default all slots)\n");
+    printf("  -t <n>          worker threads (default 8)\n");
+    printf("  -d <sec>        measured duration (default 5)\n");
+    printf("  -w <sec>        warm-up (default 1)\n");
+    printf("  -s <dist>       service time: fixed:U, uniform:U:S, exp:U, lognormal:U:SIGMA\n");
+    printf("                  in usec (default exp:200)\n");
+    printf("  -c <n>          commands serviced concurrently per adapter (default 4)\n");
+    printf("  -q <n>          queue depth per adapter (default 256)\n");
+    printf("  -F <usec>       FM side C_FindObjects cost (default 0)\n");
+    printf("  -f <hsm:rate>   failure injection rate for one adapter (repeatable)\n");
+    printf("  -x <hsm:factor> slow down one adapter by factor (repeatable)\n");
+    printf("  -P <policy>     slot selection policy: rr, least, ewma, p2c, adapter\n");
+    printf("                  (default WLD_POLICY or rr)\n");
+    printf("  -A <n>          asynchronous mode with n requests in flight per adapter\n");
+    printf("  -W <n>          asynchronous requests outstanding per thread (default 16)\n");
+    printf("  -C <hsm:n>      commands serviced concurrently by one adapter (repeatable)\n");
+    printf("  -Q <hsm:n>      queue depth of one adapter (repeatable)\n");
+    printf("  -B <n:usec>     batch up to n key verifies per FM message, lingering usec\n");
+    printf("  -O <hsm:msec>   take one adapter down for the first msec of the run (repeatable)\n");
+    printf("  -J <fmt>        print the WLD statistics at the end: json or prom\n");
+    printf("  -T <msec>       timeout of each request (default none)\n");
+    printf("  -H <pm:usec:pct> send FM pings with WLD_NO_SLOT_ID, hedged at permille pm of\n");
+    printf("                  the adapter's recent latency (at least usec), at most pct%% hedges\n");
+    printf("  -M <hsm:msec>   MD_GetHsmState/MD_GetEmbeddedSlotID latency of one adapter (repeatable)\n");
+    printf("  -K <n[:hot]>    route by key affinity over n keys, hot%% of requests using key 0\n");
+    printf("                  (load bound from WLD_AFFINITY_LOAD)\n");
+    printf("  -L <n[:q[:rate[:burst[:msec]]]]> admission limits per adapter: n in flight, q queued,\n");
+    printf("                  rate/s with burst, msec longest wait\n");
+    printf("  -N              send FM pings to any slot, turned away at once when adapters are full\n");
+    printf("  -V <n>          verify n keys of the slot per call with one bulk key verify message\n");
+    printf("  -E <n[:ttl[:neg]]> keep n key verify results for ttl msec (default 1000), FM errors\n");
+    printf("                  for neg msec (default 0)\n");
+    printf("  -Y <file>       record a request trace of the run in file (see wldreplay)\n");
+    printf("  -R <msec:list>  switch between the slot list and list with ReconfigureWLD every msec\n");
+}
+
+static void recordLatency(BENCH_THREAD *pThread, uint64_t nsec)
+{
+    uint64_t *pNew;
+    uint64_t capacity;
+
+    if (pThread->count == pThread->capacity)
+    {
+        capacity = pThread->capacity ? pThread->capacity * 2 : 65536;
+        pNew = realloc(pThread->pLatency, capacity * sizeof(uint64_t));
+        if (!pNew)
+            return;
+        pThread->pLatency = pNew;
+        pThread->capacity = capacity;
+    }
+
+    pThread->pLatency[pThread->count++] = nsec;
+}
+
+// Simulate an adapter outage: a halted adapter fails every command
+static void setAdapterDown(uint32_t hsm, bool down)
+{
+    SIM_ADAPTER_CONFIG hsmCfg;
+
+    if (SIM_GetAdapterConfig(hsm, &hsmCfg) != MDR_OK)
+        return;
+
+    hsmCfg.state = down ? S_HALTED : S_NORMAL_OPERATION;
+    SIM_SetAdapterConfig(hsm, &hsmCfg);
+}
+
+// Send the sample FM key-verify command (see SendCmdToFM in wld/main.c),
+// through the result cache when -E turned it on
+static MD_RV benchSendCmd(uint32_t slotID, uint32_t embeddedSlotID, uint32_t hKey, uint32_t *pFmStatus)
+{
+    WLD_MSG *pMsg = BeginWLDMessage();
+    WLD_MSG_VERIFY verify;
+
+    verify.embeddedSlot = embeddedSlotID;
+    verify.hKey = hKey;
+
+    if (!WLD_MSG_VERIFY_Append(pMsg, &verify))
+        return MDR_INSUFFICIENT_RESOURCE;
+
+    return SendWLDCachedMessageToFM(slotID, FM_NUMBER_CUSTOM_FM, pMsg->request, benchTimeout,
+        pMsg->reply, &pMsg->replyLen, pFmStatus);
+}
+
+// Send an FM ping to any slot, hedged if the adapter is slow
+static MD_RV benchSendHedgedPing(uint32_t *pFmStatus)
+{
+    WLD_MSG *pMsg = BeginWLDMessage();
+    WLD_MSG_PING ping = { WLD_FM_PING_MAGIC };
+
+    if (!WLD_MSG_PING_Append(pMsg, &ping))
+        return MDR_INSUFFICIENT_RESOURCE;
+
+    return SendWLDHedgedMessageToFM(WLD_NO_SLOT_ID, FM_NUMBER_CUSTOM_FM, pMsg->request, benchTimeout,
+        pMsg->reply, &pMsg->replyLen, pFmStatus);
+}
+
+// Send an FM ping to any slot, failing fast if every adapter is full
+static MD_RV benchTrySendPing(uint32_t *pFmStatus)
+{
+    WLD_MSG *pMsg = BeginWLDMessage();
+    WLD_MSG_PING ping = { WLD_FM_PING_MAGIC };
+
+    if (!WLD_MSG_PING_Append(pMsg, &ping))
+        return MDR_INSUFFICIENT_RESOURCE;
+
+    return TrySendWLDMessageToFM(WLD_NO_SLOT_ID, FM_NUMBER_CUSTOM_FM, pMsg->request, benchTimeout,
+        pMsg->reply, &pMsg->replyLen, pFmStatus);
+}
+
+// Send the key-verify command as one record of a batch envelope
+static MD_RV benchSendBatchRecord(uint32_t slotID, uint32_t embeddedSlotID, uint32_t hKey, uint32_t *pFmStatus)
+{
+    WLD_MSG_VERIFY verify;
+    uint8_t record[WLD_MSG_VERIFY_WIRE_LEN];
+
+    verify.embeddedSlot = embeddedSlotID;
+    verify.hKey = hKey;
+    WLD_MSG_VERIFY_Encode(&verify, record);
+
+    return SendWLDBatchRecord(slotID, FM_NUMBER_CUSTOM_FM, record, sizeof(record), benchTimeout, pFmStatus);
+}
+
+// Verify the slot's first benchBulkKeys keys in one call.  A key that
+// does not check out is reported as an FM error.
+static MD_RV benchSendBulkVerify(BENCH_THREAD *pThread, uint32_t slotID, uint32_t *pFmStatus)
+{
+    MD_RV mdResult;
+    uint32_t i;
+
+    for (i=0; i < benchBulkKeys; i++)
+        (void)SIM_GetKeyHandle(slotID, pThread->pBulkKeys[i].pLabel, &pThread->pBulkKeys[i].hKey);
+
+    mdResult = VerifyWLDKeys(slotID, FM_NUMBER_CUSTOM_FM, pThread->pBulkKeys, benchBulkKeys,
+        benchTimeout, pThread->pBulkBitmap, pFmStatus);
+    if (mdResult != MDR_OK || *pFmStatus != 0)
+        return mdResult;
+
+    for (i=0; i < benchBulkKeys; i++)
+    {
+        if (!(pThread->pBulkBitmap[i / 32] & (1u << (i % 32))))
+        {
+            *pFmStatus = CKR_OBJECT_HANDLE_INVALID;
+            break;
+        }
+    }
+
+    return MDR_OK;
+}
+
+// Select the slot of the next request: by key affinity with -K,
+// otherwise with the current policy
+static WLD_RV benchGetSlot(BENCH_THREAD *pThread, uint32_t *pSlotID, uint32_t *pEmbeddedSlotID)
+{
+    uint32_t key;
+    uint32_t previous;
+    WLD_RV wldErr;
+
+    if (!benchAffinityKeys)
+        return GetWLDSlotID(pSlotID, pEmbeddedSlotID);
+
+    if ((uint32_t)rand_r(&pThread->seed) % 100 < benchHotPercent)
+        key = 0;
+    else
+        key = (uint32_t)rand_r(&pThread->seed) % benchAffinityKeys;
+
+    wldErr = GetWLDSlotIDForKey(&key, sizeof(key), pSlotID, pEmbeddedSlotID);
+    if (wldErr == WLDR_OK)
+    {
+        previous = atomic_exchange_explicit(&benchKeySlot[key], *pSlotID, memory_order_relaxed);
+        if (previous != WLD_NO_SLOT_ID && previous != *pSlotID && benchRecording)
+            pThread->keyMoves++;
+    }
+
+    return wldErr;
+}
+
+// Parse a slot list with optional weights, e.g. "0:3,1,3"
+static void parseSlots(char *pArg, BENCH_SLOTS *pSlots)
+{
+    char *part;
+    char *pSave = NULL;
+
+    pSlots->count = 0;
+    part = strtok_r(pArg, " ,", &pSave);
+    while (part != NULL && pSlots->count < BENCH_MAX_SLOTS)
+    {
+        pSlots->slots[pSlots->count] = (uint32_t)strtoul(part, &part, 10);
+        pSlots->weights[pSlots->count++] = (*part == ':') ? (uint32_t)atoi(part + 1) : 0;
+        part = strtok_r(NULL, " ,", &pSave);
+    }
+}
+
+// Reconfiguration churn: swap the slot list back and forth under load
+static void *benchReconfigureWorker(void *pArg)
+{
+    BENCH_SLOTS *pSlots;
+    uint64_t start, nsec;
+    uint32_t next = 1;
+
+    (void)pArg;
+
+    while (!benchStop)
+    {
+        usleep(benchReconfigureMsec * 1000);
+        if (benchStop)
+            break;
+
+        pSlots = &benchSlots[next];
+        start = wldNowNsec();
+        if (ReconfigureWLD(pSlots->slots, pSlots->weights, pSlots->count) != WLDR_OK)
+            benchReconfigureFailures++;
+        nsec = wldNowNsec() - start;
+
+        benchReconfigures++;
+        if (nsec > benchReconfigureMaxNsec)
+            benchReconfigureMaxNsec = nsec;
+        next ^= 1;
+    }
+
+    return NULL;
+}
+
+static void *benchWorker(void *pArg)
+{
+    BENCH_THREAD *pThread = (BENCH_THREAD *)pArg;
+    uint32_t slotID, embeddedSlotID;
+    uint32_t fmStatus;
+    uint64_t start;
+    MD_RV mdResult;
+    int recording;
+
+    while (!benchStop)
+    {
+        start = wldNowNsec();
+        recording = benchRecording;
+        fmStatus = 0;
+
+        if (benchHedge)
+            mdResult = benchSendHedgedPing(&fmStatus);
+        else if (benchTryAny)
+            mdResult = benchTrySendPing(&fmStatus);
+        else if (benchGetSlot(pThread, &slotID, &embeddedSlotID) != WLDR_OK)
+        {
+            if (recording)
+                pThread->noSlot++;
+            usleep(1000);
+            continue;
+        }
+        else if (benchBulkKeys)
+            mdResult = benchSendBulkVerify(pThread, slotID, &fmStatus);
+        else if (benchBatch)
+            mdResult = benchSendBatchRecord(slotID, embeddedSlotID, benchKeys[slotID], &fmStatus);
+        else
+            mdResult = benchSendCmd(slotID, embeddedSlotID, benchKeys[slotID], &fmStatus);
+
+        // Turned away: an upstream caller would try elsewhere
+        if (mdResult == WLD_MDR_BUSY)
+        {
+            if (recording)
+                pThread->busy++;
+            usleep(1000);
+            continue;
+        }
+
+        if (!recording)
+            continue;
+
+        if (mdResult != MDR_OK)
+            pThread->mdErrors++;
+        else if (fmStatus != 0)
+            pThread->fmErrors++;
+
+        recordLatency(pThread, wldNowNsec() - start);
+    }
+
+    return NULL;
+}
+
+// Completion callback for asynchronous mode
+static void benchAsyncDone(const WLD_COMPLETION *pCompletion)
+{
+    BENCH_REQ *pReq = (BENCH_REQ *)pCompletion->pContext;
+    BENCH_THREAD *pThread = pReq->pThread;
+    uint64_t end = wldNowNsec();
+
+    pthread_mutex_lock(&pThread->lock);
+    if (pReq->recording)
+    {
+        if (pCompletion->mdResult != MDR_OK)
+            pThread->mdErrors++;
+        else if (pCompletion->fmStatus != 0)
+            pThread->fmErrors++;
+
+        recordLatency(pThread, end - pReq->start);
+    }
+    pThread->ppFree[pThread->freeCount++] = pReq;
+    pthread_cond_signal(&pThread->ready);
+    pthread_mutex_unlock(&pThread->lock);
+}
+
+// Asynchronous mode: keep benchWindow requests outstanding per thread
+static void *benchAsyncWorker(void *pArg)
+{
+    BENCH_THREAD *pThread = (BENCH_THREAD *)pArg;
+    BENCH_REQ *pReq;
+    uint32_t slotID, embeddedSlotID;
+    WLD_MSG_VERIFY verify;
+    WLD_RV rv;
+
+    while (!benchStop)
+    {
+        pthread_mutex_lock(&pThread->lock);
+        while (pThread->freeCount == 0)
+            pthread_cond_wait(&pThread->ready, &pThread->lock);
+        pReq = pThread->ppFree[--pThread->freeCount];
+        pthread_mutex_unlock(&pThread->lock);
+
+        pReq->start = wldNowNsec();
+        pReq->recording = benchRecording;
+
+        rv = benchGetSlot(pThread, &slotID, &embeddedSlotID);
+        if (rv == WLDR_OK)
+        {
+            verify.embeddedSlot = embeddedSlotID;
+            verify.hKey = benchKeys[slotID];
+            WLD_MSG_VERIFY_Encode(&verify, pReq->wire);
+            rv = SubmitWLDMessageToFM(slotID, FM_NUMBER_CUSTOM_FM, pReq->request, benchTimeout,
+                &pReq->reply, benchAsyncDone, pReq, NULL);
+        }
+
+        if (rv != WLDR_OK)
+        {
+            pthread_mutex_lock(&pThread->lock);
+            if (pReq->recording)
+                pThread->noSlot++;
+            pThread->ppFree[pThread->freeCount++] = pReq;
+            pthread_mutex_unlock(&pThread->lock);
+            usleep(1000);
+        }
+    }
+
+    // Wait for the outstanding requests before the records go away
+    pthread_mutex_lock(&pThread->lock);
+    while (pThread->freeCount < benchWindow)
+        pthread_cond_wait(&pThread->ready, &pThread->lock);
+    pthread_mutex_unlock(&pThread->lock);
+
+    return NULL;
+}
+
+static bool initAsyncThread(BENCH_THREAD *pThread)
+{
+    BENCH_REQ *pReq;
+    uint32_t i;
+
+    pthread_mutex_init(&pThread->lock, NULL);
+    pthread_cond_init(&pThread->ready, NULL);
+    pThread->pReqs = calloc(benchWindow, sizeof(BENCH_REQ));
+    pThread->ppFree = calloc(benchWindow, sizeof(BENCH_REQ *));
+    if (!pThread->pReqs || !pThread->ppFree)
+        return false;
+
+    for (i=0; i < benchWindow; i++)
+    {
+        pReq = &pThread->pReqs[i];
+        pReq->pThread = pThread;
+        pReq->request[0].pData = pReq->wire;
+        pReq->request[0].length = sizeof(pReq->wire);
+        pReq->request[1].pData = NULL;
+        pReq->request[1].length = 0;
+        pReq->reply.pData = NULL;
+        pReq->reply.length = 0;
+        pThread->ppFree[pThread->freeCount++] = pReq;
+    }
+
+    return true;
+}
+
+static int compareU64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentileUsec(const uint64_t *pSorted, uint64_t count, double pct)
+{
+    uint64_t rank;
+
+    if (count == 0)
+        return 0;
+
+    rank = (uint64_t)(pct / 100.0 * (double)count);
+    if (rank >= count)
+        rank = count - 1;
+
+    return (double)pSorted[rank] / 1000.0;
+}
+
+static bool parsePair(const char *arg, uint32_t *pHsm, double *pVal)
+{
+    return sscanf(arg, "%u:%lf", pHsm, pVal) == 2;
+}
+
+int main(int argc, char* argv[])
+{
+    SIM_ADAPTER_CONFIG cfg;
+    SIM_ADAPTER_CONFIG hsmCfg;
+    SIM_ADAPTER_STATS stats;
+    WLD_ADAPTER_STATE state;
+    BENCH_THREAD *pThreads = NULL;
+    uint64_t *pAll = NULL;
+    uint64_t *pServedStart = NULL;
+    uint64_t total = 0, mdErrors = 0, fmErrors = 0, noSlot = 0;
+    uint64_t servedTotal = 0;
+    uint64_t startNs = 0, endNs = 0;
+    uint32_t adapters = 4, partitions = 1, threads = 8;
+    uint32_t duration = 5, warmup = 1;
+    uint32_t asyncDepth = 0, window = 16;
+    uint32_t batchMax = 0, batchLinger = 0;
+    uint64_t hedged = 0, hedgeWins = 0;
+    uint64_t keyMoves = 0;
+    uint64_t busy = 0, admitQueued = 0, admitRejected = 0;
+    uint64_t retries = 0, retriesDenied = 0;
+    uint64_t cacheHits = 0, cacheMisses = 0, cacheCollapsed = 0;
+    WLD_CACHE_CONFIG cacheCfg = {0, 1000, 0, 0};
+    uint64_t traced = 0, traceDropped = 0;
+    char *traceArg = NULL;
+    WLD_ADMISSION_CONFIG admission = {0, 0, 0, 0, 0};
+    bool admit = false;
+    WLD_HEDGE_CONFIG hedgeCfg = {0, 0, 0};
+    pthread_t reconfigureThread;
+    bool reconfiguring = false;
+    uint32_t hsm;
+    uint32_t i, j;
+    double val, elapsed;
+    double failRate[SIM_MAX_ADAPTERS] = {0};
+    double slowFactor[SIM_MAX_ADAPTERS];
+    double servers[SIM_MAX_ADAPTERS];
+    double queueDepth[SIM_MAX_ADAPTERS];
+    double outageMsec[SIM_MAX_ADAPTERS] = {0};
+    double queryMsec[SIM_MAX_ADAPTERS] = {0};
+    bool outage = false;
+    uint64_t now;
+    char *slotArg = NULL;
+    char *reconfigureArg = NULL;
+    char *policyArg = NULL;
+    char *statsArg = NULL;
+    char *part;
+    WLD_RV wldErr;
+    int opt;
+    int rc = 1;
+
+    SIM_DefaultAdapterConfig(&cfg);
+    for (i=0; i < SIM_MAX_ADAPTERS; i++)
+    {
+        slowFactor[i] = 1.0;
+        servers[i] = -1;
+        queueDepth[i] = -1;
+    }
+
+    while ((opt = getopt(argc, argv, "a:p:l:t:d:w:s:c:q:F:f:x:C:Q:P:A:W:B:O:J:T:H:K:M:R:L:NV:E:Y:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a': adapters = (uint32_t)atoi(optarg); break;
+            case 'p': partitions = (uint32_t)atoi(optarg); break;
+            case 'l': slotArg = optarg; break;
+            case 'P': policyArg = optarg; break;
+            case 'J': statsArg = optarg; break;
+            case 'A': asyncDepth = (uint32_t)atoi(optarg); break;
+            case 'W': window = (uint32_t)atoi(optarg); break;
+            case 'B':
+                batchMax = (uint32_t)strtoul(optarg, &part, 10);
+                batchLinger = (*part == ':') ? (uint32_t)atoi(part + 1) : 0;
+                break;
+            case 'T': benchTimeout = (uint32_t)atoi(optarg); break;
+            case 'L':
+                if (sscanf(optarg, "%u:%u:%u:%u:%u", &admission.maxInFlight, &admission.maxQueued,
+                    &admission.ratePerSec, &admission.burst, &admission.maxWaitMsec) < 1)
+                {
+                    printf("Invalid admission setting: %s\n", optarg);
+                    usage();
+                    return 1;
+                }
+                admit = true;
+                break;
+            case 'N': benchTryAny = true; break;
+            case 'V': benchBulkKeys = (uint32_t)atoi(optarg); break;
+            case 'Y': traceArg = optarg; break;
+            case 'E':
+                if (sscanf(optarg, "%u:%u:%u", &cacheCfg.entries, &cacheCfg.ttlMsec,
+                    &cacheCfg.negativeTtlMsec) < 1 || SetWLDCache(&cacheCfg) != WLDR_OK)
+                {
+                    printf("Invalid result cache setting: %s\n", optarg);
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'R':
+                benchReconfigureMsec = (uint32_t)strtoul(optarg, &reconfigureArg, 10);
+                if (*reconfigureArg != ':' || benchReconfigureMsec == 0)
+                {
+                    printf("Invalid reconfiguration setting: %s\n", optarg);
+                    usage();
+                    return 1;
+                }
+                reconfigureArg++;
+                break;
+            case 'H':
+                if (sscanf(optarg, "%u:%u:%u", &hedgeCfg.percentile, &hedgeCfg.minDelayUsec,
+                    &hedgeCfg.maxHedgePercent) != 3 || SetWLDHedging(&hedgeCfg) != WLDR_OK)
+                {
+                    printf("Invalid hedging setting: %s\n", optarg);
+                    usage();
+                    return 1;
+                }
+                benchHedge = true;
+                break;
+            case 'K':
+                if (sscanf(optarg, "%u:%u", &benchAffinityKeys, &benchHotPercent) < 1 ||
+                    benchAffinityKeys == 0 || benchHotPercent > 100)
+                {
+                    printf("Invalid key affinity setting: %s\n", optarg);
+                    usage();
+                    return 1;
+                }
+                break;
+            case 't': threads = (uint32_t)atoi(optarg); break;
+            case 'd': duration = (uint32_t)atoi(optarg); break;
+            case 'w': warmup = (uint32_t)atoi(optarg); break;
+            case 'c': cfg.servers = (uint32_t)atoi(optarg); break;
+            case 'q': cfg.queueDepth = (uint32_t)atoi(optarg); break;
+            case 'F': cfg.findUsec = atof(optarg); break;
+            case 's':
+                if (SIM_ParseDist(optarg, &cfg) != MDR_OK)
+                {
+                    printf("Invalid service time distribution: %s\n", optarg);
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'f':
+            case 'x':
+            case 'C':
+            case 'Q':
+            case 'O':
+            case 'M':
+                if (!parsePair(optarg, &hsm, &val) || hsm >= SIM_MAX_ADAPTERS || val < 0)
+                {
+                    printf("Invalid adapter setting: %s\n", optarg);
+                    usage();
+                    return 1;
+                }
+                if (opt == 'f')
+                    failRate[hsm] = val;
+                else if (opt == 'x')
+                    slowFactor[hsm] = val;
+                else if (opt == 'C')
+                    servers[hsm] = val;
+                else if (opt == 'O')
+                    outageMsec[hsm] = val;
+                else if (opt == 'M')
+                    queryMsec[hsm] = val;
+                else
+                    queueDepth[hsm] = val;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (threads == 0 || duration == 0 || (asyncDepth && window == 0) ||
+        (benchHedge && (asyncDepth || batchMax || benchAffinityKeys)) ||
+        (benchTryAny && (asyncDepth || batchMax || benchHedge)) ||
+        (benchBulkKeys && (asyncDepth || batchMax || benchHedge || benchTryAny || benchBulkKeys > 99999)) ||
+        (admit && SetWLDAdmission(WLD_ALL_ADAPTERS, &admission) != WLDR_OK) ||
+        (batchMax && (asyncDepth || SetWLDBatching(batchMax, batchLinger) != WLDR_OK)))
+    {
+        usage();
+        return 1;
+    }
+
+    if (SIM_Initialize(adapters, partitions, benchBulkKeys, &cfg) != MDR_OK)
+    {
+        printf("Invalid simulator configuration\n");
+        return 1;
+    }
+
+    for (hsm=0; hsm < adapters; hsm++)
+    {
+        hsmCfg = cfg;
+        hsmCfg.failRate = failRate[hsm];
+        hsmCfg.slowFactor = slowFactor[hsm];
+        hsmCfg.queryUsec = queryMsec[hsm] * 1000.0;
+        if (servers[hsm] >= 0)
+            hsmCfg.servers = (uint32_t)servers[hsm];
+        if (queueDepth[hsm] >= 0)
+            hsmCfg.queueDepth = (uint32_t)queueDepth[hsm];
+        SIM_SetAdapterConfig(hsm, &hsmCfg);
+    }
+
+    if (MD_Initialize() != MDR_OK)
+        return 1;
+
+    if (slotArg)
+        parseSlots(slotArg, &benchSlots[0]);
+    else
+    {
+        for (i=0; i < SIM_GetSlotCount() && i < BENCH_MAX_SLOTS; i++)
+        {
+            benchSlots[0].slots[benchSlots[0].count] = i;
+            benchSlots[0].weights[benchSlots[0].count++] = 0;
+        }
+    }
+    if (reconfigureArg)
+        parseSlots(reconfigureArg, &benchSlots[1]);
+
+    startNs = wldNowNsec();
+    wldErr = InitializeWLDWeighted(benchSlots[0].slots, benchSlots[0].weights, benchSlots[0].count);
+    if (wldErr != WLDR_OK)
+    {
+        printf("\nERROR: InitializeWLD failed - wldErr=%d\n", (int)wldErr);
+        goto doneMain;
+    }
+    printf("\nInitializeWLD: %.1f msec\n", (double)(wldNowNsec() - startNs) / 1e6);
+
+    if (policyArg)
+    {
+        if (strcmp(policyArg, "rr") == 0)
+            SetWLDPolicy(WLD_POLICY_ROUND_ROBIN);
+        else if (strcmp(policyArg, "least") == 0)
+            SetWLDPolicy(WLD_POLICY_LEAST_OUTSTANDING);
+        else if (strcmp(policyArg, "ewma") == 0)
+            SetWLDPolicy(WLD_POLICY_EWMA_LATENCY);
+        else if (strcmp(policyArg, "p2c") == 0)
+            SetWLDPolicy(WLD_POLICY_POWER_OF_TWO);
+        else if (strcmp(policyArg, "adapter") == 0)
+            SetWLDPolicy(WLD_POLICY_ADAPTER_ROUND_ROBIN);
+        else
+        {
+            printf("Invalid policy: %s\n", policyArg);
+            goto doneMain;
+        }
+    }
+
+    // Resolve the key handle on every slot up front (the host side
+    // C_FindObjects of PerformFMFunction is not part of this benchmark)
+    benchKeys = calloc(SIM_GetSlotCount(), sizeof(uint32_t));
+    pThreads = calloc(threads, sizeof(BENCH_THREAD));
+    pServedStart = calloc(adapters, sizeof(uint64_t));
+    if (!benchKeys || !pThreads || !pServedStart)
+        goto doneMain;
+
+    for (i=0; i < threads; i++)
+        pThreads[i].seed = i + 1;
+
+    if (benchAffinityKeys)
+    {
+        benchKeySlot = malloc(benchAffinityKeys * sizeof(*benchKeySlot));
+        if (!benchKeySlot)
+            goto doneMain;
+        for (i=0; i < benchAffinityKeys; i++)
+            atomic_init(&benchKeySlot[i], WLD_NO_SLOT_ID);
+    }
+
+    for (i=0; i < SIM_GetSlotCount(); i++)
+        (void)SIM_GetKeyHandle(i, "MyAESKey", &benchKeys[i]);
+
+    if (benchBulkKeys)
+    {
+        benchBulkLabels = malloc(benchBulkKeys * sizeof(*benchBulkLabels));
+        if (!benchBulkLabels)
+            goto doneMain;
+        for (i=0; i < benchBulkKeys; i++)
+            snprintf(benchBulkLabels[i], sizeof(benchBulkLabels[i]), "WLDKey%05u", i);
+
+        for (i=0; i < threads; i++)
+        {
+            pThreads[i].pBulkKeys = calloc(benchBulkKeys, sizeof(WLD_KEY_REF));
+            pThreads[i].pBulkBitmap = calloc((benchBulkKeys + 31) / 32, sizeof(uint32_t));
+            if (!pThreads[i].pBulkKeys || !pThreads[i].pBulkBitmap)
+                goto doneMain;
+            for (j=0; j < benchBulkKeys; j++)
+            {
+                pThreads[i].pBulkKeys[j].pLabel = benchBulkLabels[j];
+                pThreads[i].pBulkKeys[j].labelLen = (uint32_t)strlen(benchBulkLabels[j]);
+            }
+        }
+    }
+
+    if (asyncDepth)
+    {
+        if (InitializeWLDAsync(asyncDepth) != WLDR_OK)
+            goto doneMain;
+
+        benchWindow = window;
+        for (i=0; i < threads; i++)
+        {
+            if (!initAsyncThread(&pThreads[i]))
+                goto doneMain;
+        }
+    }
+
+    printf("\nwldbench: adapters=%u, partitions/adapter=%u, slots=%u, threads=%u, "
+        "servers=%u, queue=%u, service=%.1fus, policy=%d",
+        adapters, partitions, benchSlots[0].count, threads, cfg.servers, cfg.queueDepth, cfg.meanUsec,
+        (int)GetWLDPolicy());
+    if (asyncDepth)
+        printf(", async depth=%u, window=%u", asyncDepth, window);
+    benchBatch = (batchMax != 0);
+    if (batchMax)
+        printf(", batch=%u, linger=%uus", batchMax, batchLinger);
+    if (benchAffinityKeys)
+        printf(", keys=%u, hot=%u%%", benchAffinityKeys, benchHotPercent);
+    if (benchReconfigureMsec)
+        printf(", reconfigure every %u msec", benchReconfigureMsec);
+    if (admit)
+        printf(", admission=%u in flight/%u queued/%u per sec", admission.maxInFlight,
+            admission.maxQueued, admission.ratePerSec);
+    if (benchTryAny)
+        printf(", fail fast");
+    if (benchBulkKeys)
+        printf(", bulk verify of %u keys", benchBulkKeys);
+    printf("\n");
+
+    for (i=0; i < threads; i++)
+    {
+        if (pthread_create(&pThreads[i].thread, NULL,
+            asyncDepth ? benchAsyncWorker : benchWorker, &pThreads[i]) != 0)
+        {
+            printf("Failed to create worker thread %u\n", i);
+            benchStop = 1;
+            threads = i;
+            break;
+        }
+    }
+
+    if (!benchStop)
+    {
+        sleep(warmup);
+
+        for (hsm=0; hsm < adapters; hsm++)
+        {
+            SIM_GetAdapterStats(hsm, &stats);
+            pServedStart[hsm] = stats.served;
+        }
+
+        for (hsm=0; hsm < adapters; hsm++)
+        {
+            if (outageMsec[hsm] > 0)
+            {
+                setAdapterDown(hsm, true);
+                outage = true;
+            }
+        }
+
+        // Trace the measured part of the run only
+        if (traceArg && StartWLDTrace(traceArg, 0) != WLDR_OK)
+            traceArg = NULL;
+
+        startNs = wldNowNsec();
+        benchRecording = 1;
+        if (benchReconfigureMsec)
+            reconfiguring = (pthread_create(&reconfigureThread, NULL, benchReconfigureWorker, NULL) == 0);
+        if (!outage)
+            sleep(duration);
+
+        // Bring the adapters taken down with -O back as their outage ends
+        while (outage && (now = wldNowNsec()) - startNs < duration * 1000000000ULL)
+        {
+            for (hsm=0; hsm < adapters; hsm++)
+            {
+                if (outageMsec[hsm] > 0 && (double)(now - startNs) >= outageMsec[hsm] * 1e6)
+                {
+                    setAdapterDown(hsm, false);
+                    outageMsec[hsm] = 0;
+                }
+            }
+            usleep(10000);
+        }
+        benchRecording = 0;
+        endNs = wldNowNsec();
+        benchStop = 1;
+    }
+
+    for (i=0; i < threads; i++)
+        pthread_join(pThreads[i].thread, NULL);
+    if (reconfiguring)
+        pthread_join(reconfigureThread, NULL);
+    if (traceArg)
+        StopWLDTrace();
+
+    if (threads == 0)
+        goto doneMain;
+
+    for (i=0; i < threads; i++)
+    {
+        total += pThreads[i].count;
+        mdErrors += pThreads[i].mdErrors;
+        fmErrors += pThreads[i].fmErrors;
+        noSlot += pThreads[i].noSlot;
+        keyMoves += pThreads[i].keyMoves;
+        busy += pThreads[i].busy;
+    }
+
+    pAll = malloc((total ? total : 1) * sizeof(uint64_t));
+    if (!pAll)
+        goto doneMain;
+
+    total = 0;
+    for (i=0; i < threads; i++)
+    {
+        memcpy(pAll + total, pThreads[i].pLatency, pThreads[i].count * sizeof(uint64_t));
+        total += pThreads[i].count;
+    }
+    qsort(pAll, total, sizeof(uint64_t), compareU64);
+
+    elapsed = (double)(endNs - startNs) / 1e9;
+
+    printf("\nrequests=%llu, md errors=%llu, fm errors=%llu, no slot=%llu\n",
+        (unsigned long long)total, (unsigned long long)mdErrors,
+        (unsigned long long)fmErrors, (unsigned long long)noSlot);
+    printf("throughput=%.1f req/s\n", (double)total / elapsed);
+    if (benchBulkKeys)
+        printf("keys verified=%.1f keys/s\n", (double)total * benchBulkKeys / elapsed);
+    printf("latency usec: p50=%.1f, p99=%.1f, p999=%.1f, max=%.1f\n",
+        percentileUsec(pAll, total, 50.0),
+        percentileUsec(pAll, total, 99.0),
+        percentileUsec(pAll, total, 99.9),
+        total ? (double)pAll[total - 1] / 1000.0 : 0.0);
+
+    for (hsm=0; hsm < adapters; hsm++)
+    {
+        SIM_GetAdapterStats(hsm, &stats);
+        pServedStart[hsm] = stats.served - pServedStart[hsm];
+        servedTotal += pServedStart[hsm];
+    }
+
+    printf("fm messages=%llu (%.2f requests/message)\n",
+        (unsigned long long)servedTotal,
+        servedTotal ? (double)total / (double)servedTotal : 0.0);
+
+    if (benchHedge)
+    {
+        GetWLDHedgeCounts(&hedged, &hedgeWins);
+        printf("hedges=%llu (%.2f%% of requests), won=%llu\n",
+            (unsigned long long)hedged, total ? 100.0 * (double)hedged / (double)total : 0.0,
+            (unsigned long long)hedgeWins);
+    }
+
+    if (benchAffinityKeys)
+    {
+        printf("key affinity: spills=%llu, key moves=%llu\n",
+            (unsigned long long)GetWLDAffinitySpills(), (unsigned long long)keyMoves);
+    }
+
+    if (admit)
+    {
+        GetWLDAdmissionCounts(&admitQueued, &admitRejected);
+        printf("admission: busy=%llu (%.1f%% of calls), queued=%llu, rejected=%llu\n",
+            (unsigned long long)busy, total + busy ? 100.0 * (double)busy / (double)(total + busy) : 0.0,
+            (unsigned long long)admitQueued, (unsigned long long)admitRejected);
+    }
+
+    if (cacheCfg.entries)
+    {
+        GetWLDCacheCounts(&cacheHits, &cacheMisses, &cacheCollapsed);
+        printf("result cache: hits=%llu, misses=%llu, collapsed=%llu, hit rate=%.1f%%\n",
+            (unsigned long long)cacheHits, (unsigned long long)cacheMisses,
+            (unsigned long long)cacheCollapsed,
+            cacheHits + cacheMisses + cacheCollapsed ?
+            100.0 * (double)(cacheHits + cacheCollapsed) / (double)(cacheHits + cacheMisses + cacheCollapsed) : 0.0);
+    }
+
+    GetWLDRetryCounts(&retries, &retriesDenied);
+    if (retries || retriesDenied)
+    {
+        printf("retries=%llu (%.2f%% of requests), denied by the retry budget=%llu\n",
+            (unsigned long long)retries, total ? 100.0 * (double)retries / (double)total : 0.0,
+            (unsigned long long)retriesDenied);
+    }
+
+    if (traceArg)
+    {
+        GetWLDTraceCounts(&traced, &traceDropped);
+        printf("trace: %llu calls recorded in %s, %llu dropped\n",
+            (unsigned long long)traced, traceArg, (unsigned long long)traceDropped);
+    }
+
+    if (benchReconfigureMsec)
+    {
+        printf("reconfigurations=%u, failed=%u, longest ReconfigureWLD=%.1f msec\n",
+            benchReconfigures, benchReconfigureFailures, (double)benchReconfigureMaxNsec / 1e6);
+    }
+
+    for (hsm=0; hsm < adapters; hsm++)
+    {
+        SIM_GetAdapterStats(hsm, &stats);
+        if (GetWLDAdapterState(hsm, &state, NULL) != WLDR_OK)
+            state = WLD_ADAPTER_CLOSED;
+        printf("adapter %u: served=%llu (%.1f%%), failed=%llu, rejected=%llu, timed out=%llu, open sessions=%lld, %s\n",
+            hsm, (unsigned long long)pServedStart[hsm],
+            servedTotal ? 100.0 * (double)pServedStart[hsm] / (double)servedTotal : 0.0,
+            (unsigned long long)stats.failed, (unsigned long long)stats.rejected,
+            (unsigned long long)stats.timedOut,
+            (long long)stats.openSessions,
+            state == WLD_ADAPTER_OPEN ? "open" : state == WLD_ADAPTER_HALF_OPEN ? "half open" : "closed");
+    }
+
+    if (statsArg)
+    {
+        printf("\n");
+        if (WriteWLDStats(stdout, strcmp(statsArg, "prom") == 0 ?
+            WLD_STATS_PROMETHEUS : WLD_STATS_JSON) != WLDR_OK)
+            printf("Failed to get the WLD statistics\n");
+    }
+
+    rc = 0;
+
+doneMain:
+
+    FinalizeWLDAsync();
+    StopWLDHealthMonitor();
+
+    if (pThreads)
+    {
+        for (i=0; i < threads; i++)
+        {
+            free(pThreads[i].pLatency);
+            free(pThreads[i].pReqs);
+            free(pThreads[i].ppFree);
+            free(pThreads[i].pBulkKeys);
+            free(pThreads[i].pBulkBitmap);
+        }
+        free(pThreads);
+    }
+    free(pAll);
+    free(pServedStart);
+    free(benchKeys);
+    free(benchKeySlot);
+    free(benchBulkLabels);
+
+    MD_Finalize();
+
+    return rc;
+}
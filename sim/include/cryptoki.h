@@ -0,0 +1,76 @@
+/*
+    cryptoki.h
+
+    Stand-in for the FM-side PKCS#11 interface used by the WLD simulator
+    build.  Only the subset called by the sample FM is provided; the
+    object store behind it lives in sim/sim_fm.c.
+*/
+
+#ifndef _SIM_CRYPTOKI_H_
+#define _SIM_CRYPTOKI_H_
+
+typedef unsigned char CK_BYTE;
+typedef CK_BYTE *CK_BYTE_PTR;
+typedef unsigned long int CK_ULONG;
+typedef CK_ULONG *CK_ULONG_PTR;
+typedef CK_ULONG CK_RV;
+typedef CK_ULONG CK_FLAGS;
+typedef CK_ULONG CK_SLOT_ID;
+typedef CK_ULONG CK_SESSION_HANDLE;
+typedef CK_SESSION_HANDLE *CK_SESSION_HANDLE_PTR;
+typedef CK_ULONG CK_OBJECT_HANDLE;
+typedef CK_OBJECT_HANDLE *CK_OBJECT_HANDLE_PTR;
+typedef CK_ULONG CK_ATTRIBUTE_TYPE;
+typedef void *CK_VOID_PTR;
+typedef CK_RV (*CK_NOTIFY)(CK_SESSION_HANDLE hSession, CK_ULONG event, CK_VOID_PTR pApplication);
+
+typedef struct CK_ATTRIBUTE {
+    CK_ATTRIBUTE_TYPE type;
+    CK_VOID_PTR pValue;
+    CK_ULONG ulValueLen;
+} CK_ATTRIBUTE;
+typedef CK_ATTRIBUTE *CK_ATTRIBUTE_PTR;
+
+#define NULL_PTR                        0
+
+#define CKF_RW_SESSION                  0x00000002UL
+#define CKF_SERIAL_SESSION              0x00000004UL
+
+#define CKA_LABEL                       0x00000003UL
+
+#define CKR_OK                          0x00000000UL
+#define CKR_HOST_MEMORY                 0x00000002UL
+#define CKR_SLOT_ID_INVALID             0x00000003UL
+#define CKR_GENERAL_ERROR               0x00000005UL
+#define CKR_ARGUMENTS_BAD               0x00000007UL
+#define CKR_ATTRIBUTE_TYPE_INVALID      0x00000012UL
+#define CKR_DATA_LEN_RANGE              0x00000021UL
+#define CKR_DEVICE_REMOVED              0x00000032UL
+#define CKR_OBJECT_HANDLE_INVALID       0x00000082UL
+#define CKR_OPERATION_ACTIVE            0x00000090UL
+#define CKR_OPERATION_NOT_INITIALIZED   0x00000091UL
+#define CKR_SESSION_CLOSED              0x000000B0UL
+#define CKR_SESSION_COUNT               0x000000B1UL
+#define CKR_SESSION_HANDLE_INVALID      0x000000B3UL
+#define CKR_TEMPLATE_INCOMPLETE         0x000000D0UL
+#define CKR_TOKEN_NOT_PRESENT           0x000000E0UL
+#define CKR_TOKEN_NOT_RECOGNIZED        0x000000E1UL
+#define CKR_BUFFER_TOO_SMALL            0x00000150UL
+
+CK_RV C_OpenSession(CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR pApplication,
+    CK_NOTIFY Notify, CK_SESSION_HANDLE_PTR phSession);
+
+CK_RV C_CloseSession(CK_SESSION_HANDLE hSession);
+
+CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate,
+    CK_ULONG ulCount);
+
+CK_RV C_FindObjects(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject,
+    CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulObjectCount);
+
+CK_RV C_FindObjectsFinal(CK_SESSION_HANDLE hSession);
+
+CK_RV C_GetAttributeValue(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
+    CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
+
+#endif
@@ -0,0 +1,18 @@
+/*
+    fm/common/fm_byteorder.h
+
+    Stand-in for the FM SDK byte order helpers used by the WLD
+    simulator build.
+*/
+
+#ifndef _SIM_FM_BYTEORDER_H_
+#define _SIM_FM_BYTEORDER_H_
+
+#include <endian.h>
+
+#define fm_htobe16(x)   htobe16(x)
+#define fm_htobe32(x)   htobe32(x)
+#define fm_be16toh(x)   be16toh(x)
+#define fm_be32toh(x)   be32toh(x)
+
+#endif
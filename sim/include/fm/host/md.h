@@ -0,0 +1,61 @@
+/*
+    fm/host/md.h
+
+    Stand-in for the FM SDK message dispatch (MD) API used by the WLD
+    simulator build.  Only the types and calls used by the WLD sample
+    are declared here; the implementation lives in sim/sim_md.c.
+*/
+
+#ifndef _SIM_MD_H_
+#define _SIM_MD_H_
+
+#include <fm/host/stdint.h>
+
+#define FM_NUMBER_CUSTOM_FM     0x8000
+
+typedef enum {
+    MDR_OK = 0,
+    MDR_UNSUCCESSFUL = 0x80000001,
+    MDR_NOT_IMPLEMENTED,
+    MDR_INSUFFICIENT_RESOURCE,
+    MDR_INTERNAL_ERROR,
+    MDR_INVALID_PARAMETER,
+    MDR_INVALID_HSM_INDEX
+} MD_RV;
+
+typedef enum {
+    S_WAIT_ON_TAMPER = 1,
+    S_DECOMMISSIONED,
+    S_HALTED,
+    S_TEST_FAILED,
+    S_NORMAL_OPERATION,
+    S_NON_FIPS_MODE
+} HsmState_t;
+
+typedef struct {
+    uint8_t *pData;
+    uint32_t length;
+} MD_Buffer_t;
+
+MD_RV MD_Initialize(void);
+
+void MD_Finalize(void);
+
+MD_RV MD_GetHsmCount(uint32_t *pHsmCount);
+
+MD_RV MD_GetHsmIndexForSlot(uint32_t slotID, uint32_t *pHsmIndex);
+
+MD_RV MD_GetEmbeddedSlotID(uint32_t slotID, unsigned long int *pEmbeddedSlotID);
+
+MD_RV MD_GetHsmState(uint32_t hsmIndex, HsmState_t *pState, uint32_t *pErrorCode);
+
+MD_RV MD_SendReceive(uint32_t hsmIndex,
+    uint32_t originatorId,
+    uint16_t fmNumber,
+    MD_Buffer_t *pReq,
+    uint32_t timeout,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    uint32_t *pFmStatus);
+
+#endif
@@ -0,0 +1,10 @@
+/*
+    fm/host/stdint.h
+
+    Stand-in for the FM SDK host stdint.h used by the WLD simulator
+    build.  Defers to the system header; there is no include guard as
+    this file may be reached twice (as <fm/host/stdint.h> and, through
+    the fm/host include path, as <stdint.h>).
+*/
+
+#include_next <stdint.h>
@@ -0,0 +1,16 @@
+/*
+    fm/hsm/fm.h
+
+    Stand-in for the FM SDK fm.h used by the WLD simulator build.
+*/
+
+#ifndef _SIM_FM_H_
+#define _SIM_FM_H_
+
+#include <stdint.h>
+
+typedef int FM_RV;
+
+#define FM_OK   0
+
+#endif
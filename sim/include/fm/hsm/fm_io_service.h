@@ -0,0 +1,22 @@
+/*
+    fm/hsm/fm_io_service.h
+
+    Stand-in for the FM SDK request/reply stream I/O calls used by the
+    WLD simulator build.  32-bit values are read and written big-endian
+    on the wire, as on the HSM.
+*/
+
+#ifndef _SIM_FM_IO_SERVICE_H_
+#define _SIM_FM_IO_SERVICE_H_
+
+#include "fm/hsm/fmsw.h"
+
+int SVC_IO_Read32(FmMsgHandle token, uint32_t *pVal);
+
+int SVC_IO_Read(FmMsgHandle token, void *pBuf, uint32_t len);
+
+int SVC_IO_Write32(FmMsgHandle token, uint32_t val);
+
+int SVC_IO_Write(FmMsgHandle token, const void *pBuf, uint32_t len);
+
+#endif
@@ -0,0 +1,22 @@
+/*
+    fm/hsm/fmsw.h
+
+    Stand-in for the FM SDK stream dispatch switch used by the WLD
+    simulator build.  Handlers registered here are invoked in-process
+    by the simulated MD_SendReceive (see sim/sim_fm.c).
+*/
+
+#ifndef _SIM_FMSW_H_
+#define _SIM_FMSW_H_
+
+#include "fm/hsm/fm.h"
+
+typedef struct SIM_FM_MSG *FmMsgHandle;
+
+typedef int (*FMSW_StreamHandler_t)(FmMsgHandle token);
+
+uint16_t GetFMID(void);
+
+FM_RV FMSW_RegisterStreamDispatch(uint16_t fmID, FMSW_StreamHandler_t handler);
+
+#endif
@@ -0,0 +1,10 @@
+/*
+    fmcrypto.h
+
+    Stand-in for the FM SDK fmcrypto.h used by the WLD simulator build.
+*/
+
+#ifndef _SIM_FMCRYPTO_H_
+#define _SIM_FMCRYPTO_H_
+
+#endif
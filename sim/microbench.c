@@ -0,0 +1,767 @@
+/*
+    microbench.c
+
+    Microbenchmarks for the WLD dispatcher hot path (wldmicro).  The MD
+    library is replaced by the stub below, whose MD_SendReceive returns
+    at once, so only the WLD layer is measured:
+
+      select   GetWLDSlotID
+      lookup   GetWLDSlotInfo of a random slot (the slot -> partition
+               lookup of getWLD_HSMIndexFromSlot)
+      send     SendWLDMessageToFM with WLD_NO_SLOT_ID
+      churn    send while adapters fail and come back: breakers open
+               (SetHSMInactive), partitions leave and rejoin the
+               rotation and the prober runs concurrently
+
+    Every scenario runs for each partition count and thread count
+    given.  Results are ns per operation per thread, cache misses per
+    operation when hardware counters can be read (perf_event_open), and
+    scaling efficiency: throughput per thread relative to the smallest
+    thread count.  -s saves the results as a baseline; -b compares with
+    a baseline and exits with 1 when a result is slower than it by more
+    than the threshold.  The WLD_* environment variables (WLD_POLICY
+    etc.) apply as usual.
+*/
+
+#undef UNICODE
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "md.h"
+#include "wld.h"
+#include "wld_time.h"
+#include "wld_random.h"
+
+#define MICRO_MAX_ADAPTERS  64
+#define MICRO_MAX_SLOTS     4096
+#define MICRO_MAX_THREADS   1024
+#define MICRO_MAX_LIST      32
+#define MICRO_MAX_RESULTS   (MICRO_SCENARIOS * MICRO_MAX_LIST * MICRO_MAX_LIST)
+
+// How long to wait for the adapters to be back after a churn run
+#define MICRO_RECOVER_MSEC  2000
+
+typedef enum MICRO_SCENARIO {
+    MICRO_SELECT = 0,
+    MICRO_LOOKUP,
+    MICRO_SEND,
+    MICRO_CHURN,
+    MICRO_SCENARIOS
+} MICRO_SCENARIO;
+
+static const char *microScenarioNames[MICRO_SCENARIOS] = { "select", "lookup", "send", "churn" };
+
+typedef enum MICRO_PHASE {
+    MICRO_WARMUP = 0,
+    MICRO_MEASURE,
+    MICRO_DONE
+} MICRO_PHASE;
+
+typedef struct MICRO_THREAD {
+    pthread_t thread;
+    uint64_t ops;           // operations while measuring
+    uint64_t errors;
+    uint64_t misses;
+    bool missesValid;
+} __attribute__((aligned(64))) MICRO_THREAD;
+
+typedef struct MICRO_RESULT {
+    MICRO_SCENARIO scenario;
+    uint32_t threads;
+    uint32_t partitions;
+    double nsPerOp;         // per thread: wall time x threads / operations
+    double mopsPerSec;
+    double missesPerOp;     // < 0 when the counters could not be read
+    double efficiency;      // throughput per thread relative to the smallest thread count
+    uint64_t errors;
+    uint64_t deactivations;
+} MICRO_RESULT;
+
+typedef struct MICRO_BASELINE {
+    char scenario[16];
+    uint32_t threads;
+    uint32_t partitions;
+    double nsPerOp;
+} MICRO_BASELINE;
+
+static uint32_t microAdapters = 8;
+static _Atomic bool microDown[MICRO_MAX_ADAPTERS];
+
+static MICRO_SCENARIO microScenario;
+static uint32_t microPartitions;
+static uint32_t microChurnUsec = 1000;
+static _Atomic int microPhase;
+
+static MICRO_RESULT microResults[MICRO_MAX_RESULTS];
+static uint32_t microResultCount = 0;
+
+static MICRO_BASELINE *microBaseline = NULL;
+static uint32_t microBaselineCount = 0;
+
+/*
+    MD library stub.  Slot s lives on adapter s % adapters; an adapter
+    that the churn thread took down reports S_HALTED and fails every
+    command.
+*/
+
+MD_RV MD_Initialize(void)
+{
+    return MDR_OK;
+}
+
+void MD_Finalize(void)
+{
+}
+
+MD_RV MD_GetHsmCount(uint32_t *pHsmCount)
+{
+    *pHsmCount = microAdapters;
+    return MDR_OK;
+}
+
+MD_RV MD_GetHsmIndexForSlot(uint32_t slotID, uint32_t *pHsmIndex)
+{
+    *pHsmIndex = slotID % microAdapters;
+    return MDR_OK;
+}
+
+MD_RV MD_GetEmbeddedSlotID(uint32_t slotID, unsigned long int *pEmbeddedSlotID)
+{
+    *pEmbeddedSlotID = slotID / microAdapters;
+    return MDR_OK;
+}
+
+MD_RV MD_GetHsmState(uint32_t hsmIndex, HsmState_t *pState, uint32_t *pErrorCode)
+{
+    if (hsmIndex >= microAdapters)
+        return MDR_INVALID_HSM_INDEX;
+
+    *pState = atomic_load_explicit(&microDown[hsmIndex], memory_order_relaxed) ?
+        S_HALTED : S_NORMAL_OPERATION;
+    if (pErrorCode)
+        *pErrorCode = 0;
+    return MDR_OK;
+}
+
+MD_RV MD_SendReceive(uint32_t hsmIndex,
+    uint32_t originatorId,
+    uint16_t fmNumber,
+    MD_Buffer_t *pReq,
+    uint32_t timeout,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    uint32_t *pFmStatus)
+{
+    (void)originatorId;
+    (void)fmNumber;
+    (void)pReq;
+    (void)timeout;
+    (void)pResp;
+
+    if (hsmIndex >= microAdapters)
+        return MDR_INVALID_HSM_INDEX;
+    if (atomic_load_explicit(&microDown[hsmIndex], memory_order_relaxed))
+        return MDR_UNSUCCESSFUL;
+
+    if (pReceivedLen)
+        *pReceivedLen = 0;
+    if (pFmStatus)
+        *pFmStatus = 0;
+    return MDR_OK;
+}
+
+static void usage(void)
+{
+    printf("\nUsage: wldmicro [options]\n");
+    printf("  -S <list>       scenarios: select, lookup, send, churn (default all)\n");
+    printf("  -t <list>       thread counts (default 1,2,4,8,16,32,64,128)\n");
+    printf("  -p <list>       partition counts (default 4,16,64,256)\n");
+    printf("  -a <n>          adapters the partitions are spread over (default 8)\n");
+    printf("  -d <msec>       measured time of each run (default 100)\n");
+    printf("  -w <msec>       warm-up of each run (default 20)\n");
+    printf("  -n <n>          runs of each point, the fastest counts (default 3)\n");
+    printf("  -c <usec>       churn: how long an adapter stays down, and up (default 1000)\n");
+    printf("  -s <file>       save the results as a baseline\n");
+    printf("  -b <file>       compare with a baseline, exit 1 on a regression\n");
+    printf("  -r <percent>    regression threshold (default 20)\n");
+}
+
+static void microSleepMsec(uint32_t msec)
+{
+    struct timespec ts = { msec / 1000, (long)(msec % 1000) * 1000000L };
+
+    nanosleep(&ts, NULL);
+}
+
+// Parse a comma separated list of numbers
+static uint32_t parseList(const char *pArg, uint32_t *pList, uint32_t max)
+{
+    const char *p = pArg;
+    char *pEnd;
+    uint32_t count = 0;
+
+    while (*p && count < max)
+    {
+        pList[count] = (uint32_t)strtoul(p, &pEnd, 10);
+        if (pEnd == p || pList[count] == 0)
+            return 0;
+        count++;
+        p = (*pEnd == ',') ? pEnd + 1 : pEnd;
+        if (*pEnd && *pEnd != ',')
+            return 0;
+    }
+
+    return *p ? 0 : count;
+}
+
+// Parse a comma separated list of scenario names into a mask
+static bool parseScenarios(const char *pArg, bool *pRun)
+{
+    char buf[128];
+    char *pSave = NULL;
+    char *pName;
+    uint32_t s;
+
+    snprintf(buf, sizeof(buf), "%s", pArg);
+    memset(pRun, 0, MICRO_SCENARIOS * sizeof(bool));
+
+    for (pName = strtok_r(buf, ",", &pSave); pName; pName = strtok_r(NULL, ",", &pSave))
+    {
+        for (s=0; s < MICRO_SCENARIOS && strcmp(pName, microScenarioNames[s]) != 0; s++)
+            ;
+        if (s == MICRO_SCENARIOS)
+            return false;
+        pRun[s] = true;
+    }
+
+    return true;
+}
+
+// Counter of the cache misses of the calling thread, or -1
+static int openMissCounter(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void *microWorker(void *pArg)
+{
+    MICRO_THREAD *pThread = (MICRO_THREAD *)pArg;
+    uint8_t wire[16] = { 0 };
+    uint8_t buf[64];
+    MD_Buffer_t request[2] = { { wire, sizeof(wire) }, { NULL, 0 } };
+    MD_Buffer_t reply = { buf, sizeof(buf) };
+    uint32_t slot, embSlot, hsmID;
+    uint32_t recvLen, fmStatus;
+    uint64_t ops = 0;
+    uint64_t errors = 0;
+    bool measuring = false;
+    bool ok;
+    int phase;
+    int fd;
+
+    fd = openMissCounter();
+
+    while ((phase = atomic_load_explicit(&microPhase, memory_order_relaxed)) != MICRO_DONE)
+    {
+        if (phase == MICRO_MEASURE && !measuring)
+        {
+            measuring = true;
+            ops = 0;
+            errors = 0;
+            if (fd >= 0)
+            {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+
+        switch (microScenario)
+        {
+            case MICRO_SELECT:
+                ok = (GetWLDSlotID(&slot, &embSlot) == WLDR_OK);
+                break;
+            case MICRO_LOOKUP:
+                slot = (uint32_t)(wldRandom64() % microPartitions);
+                ok = (GetWLDSlotInfo(slot, &hsmID, &embSlot) == WLDR_OK);
+                break;
+            default:
+                ok = (SendWLDMessageToFM(WLD_NO_SLOT_ID, FM_NUMBER_CUSTOM_FM, request, 0,
+                    &reply, &recvLen, &fmStatus) == MDR_OK);
+                break;
+        }
+
+        ops++;
+        errors += !ok;
+    }
+
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        pThread->missesValid = (read(fd, &pThread->misses, sizeof(pThread->misses)) ==
+            sizeof(pThread->misses));
+        close(fd);
+    }
+
+    pThread->ops = measuring ? ops : 0;
+    pThread->errors = measuring ? errors : 0;
+
+    return NULL;
+}
+
+// Take a random adapter down and bring it back, over and over
+static void *microChurn(void *pArg)
+{
+    struct timespec ts = { 0, (long)microChurnUsec * 1000L };
+    uint32_t hsm;
+
+    (void)pArg;
+
+    while (atomic_load_explicit(&microPhase, memory_order_relaxed) != MICRO_DONE)
+    {
+        hsm = (uint32_t)(wldRandom64() % microAdapters);
+        atomic_store_explicit(&microDown[hsm], true, memory_order_relaxed);
+        nanosleep(&ts, NULL);
+        atomic_store_explicit(&microDown[hsm], false, memory_order_relaxed);
+        nanosleep(&ts, NULL);
+    }
+
+    return NULL;
+}
+
+// Deactivations counted on all adapters so far
+static uint64_t microDeactivations(void)
+{
+    WLD_STATS *pStats;
+    uint64_t count = 0;
+    uint32_t i;
+
+    if (GetWLDStats(&pStats) != WLDR_OK)
+        return 0;
+    for (i=0; i < pStats->adapterCount; i++)
+        count += pStats->pAdapters[i].deactivations;
+    FreeWLDStats(pStats);
+
+    return count;
+}
+
+// Wait until every partition is back in rotation
+static bool microRecovered(void)
+{
+    WLD_STATS *pStats;
+    uint32_t waited;
+    uint32_t active;
+    uint32_t i;
+
+    for (waited=0; waited < MICRO_RECOVER_MSEC; waited++)
+    {
+        if (GetWLDStats(&pStats) != WLDR_OK)
+            return false;
+        for (i=0, active=0; i < pStats->partitionCount; i++)
+            active += pStats->pPartitions[i].active;
+        active = (active == pStats->partitionCount);
+        FreeWLDStats(pStats);
+        if (active)
+            return true;
+        microSleepMsec(1);
+    }
+
+    return false;
+}
+
+// One run of a scenario.  False if a thread could not be started.
+static bool microRun(uint32_t threads, uint32_t warmupMsec, uint32_t durationMsec, MICRO_RESULT *pResult)
+{
+    static MICRO_THREAD microThreads[MICRO_MAX_THREADS];
+    pthread_t churnThread;
+    uint64_t start, elapsed;
+    uint64_t deactivations;
+    uint64_t ops = 0;
+    uint64_t misses = 0;
+    bool missesValid = true;
+    bool churn = (microScenario == MICRO_CHURN);
+    bool ok = true;
+    bool recovered = true;
+    int savedStdout = -1;
+    int devNull;
+    uint32_t started;
+    uint32_t i;
+
+    atomic_store_explicit(&microPhase, MICRO_WARMUP, memory_order_relaxed);
+    deactivations = microDeactivations();
+
+    // The breakers log every transition on stdout; a churn run makes
+    // thousands of them, which would bury the results
+    if (churn)
+    {
+        fflush(stdout);
+        devNull = open("/dev/null", O_WRONLY);
+        if (devNull >= 0)
+        {
+            savedStdout = dup(STDOUT_FILENO);
+            dup2(devNull, STDOUT_FILENO);
+            close(devNull);
+        }
+    }
+
+    for (started=0; started < threads; started++)
+    {
+        memset(&microThreads[started], 0, sizeof(MICRO_THREAD));
+        if (pthread_create(&microThreads[started].thread, NULL, microWorker, &microThreads[started]) != 0)
+        {
+            ok = false;
+            break;
+        }
+    }
+    if (ok && churn && pthread_create(&churnThread, NULL, microChurn, NULL) != 0)
+    {
+        ok = false;
+        churn = false;
+    }
+
+    microSleepMsec(warmupMsec);
+    start = wldNowNsec();
+    atomic_store_explicit(&microPhase, MICRO_MEASURE, memory_order_relaxed);
+    microSleepMsec(durationMsec);
+    atomic_store_explicit(&microPhase, MICRO_DONE, memory_order_relaxed);
+    elapsed = wldNowNsec() - start;
+
+    for (i=0; i < started; i++)
+    {
+        pthread_join(microThreads[i].thread, NULL);
+        ops += microThreads[i].ops;
+        pResult->errors += microThreads[i].errors;
+        misses += microThreads[i].misses;
+        missesValid = missesValid && microThreads[i].missesValid;
+    }
+    if (churn)
+    {
+        pthread_join(churnThread, NULL);
+        recovered = microRecovered();
+    }
+
+    if (savedStdout >= 0)
+    {
+        fflush(stdout);
+        dup2(savedStdout, STDOUT_FILENO);
+        close(savedStdout);
+    }
+    if (!recovered)
+        printf("\nWARNING: the adapters did not all come back after a churn run\n");
+
+    if (!ok || ops == 0)
+        return false;
+
+    pResult->nsPerOp = (double)elapsed * threads / (double)ops;
+    pResult->mopsPerSec = (double)ops * 1000.0 / (double)elapsed;
+    pResult->missesPerOp = missesValid ? (double)misses / (double)ops : -1.0;
+    pResult->deactivations = microDeactivations() - deactivations;
+
+    return true;
+}
+
+// Publish a table of partitions slots 0 .. partitions - 1
+static bool microTable(uint32_t partitions, bool first)
+{
+    static uint32_t slots[MICRO_MAX_SLOTS];
+    uint32_t i;
+
+    for (i=0; i < partitions; i++)
+        slots[i] = i;
+
+    microPartitions = partitions;
+    if (first)
+        return InitializeWLD(slots, partitions) == WLDR_OK;
+    return ReconfigureWLD(slots, NULL, partitions) == WLDR_OK;
+}
+
+static const MICRO_BASELINE *findBaseline(const MICRO_RESULT *pResult)
+{
+    uint32_t i;
+
+    for (i=0; i < microBaselineCount; i++)
+    {
+        if (strcmp(microBaseline[i].scenario, microScenarioNames[pResult->scenario]) == 0 &&
+            microBaseline[i].threads == pResult->threads &&
+            microBaseline[i].partitions == pResult->partitions)
+            return &microBaseline[i];
+    }
+
+    return NULL;
+}
+
+static bool loadBaseline(const char *pPath)
+{
+    MICRO_BASELINE entry;
+    MICRO_BASELINE *pNew;
+    char line[256];
+    FILE *pFile;
+
+    pFile = fopen(pPath, "r");
+    if (!pFile)
+        return false;
+
+    while (fgets(line, sizeof(line), pFile))
+    {
+        if (line[0] == '#' ||
+            sscanf(line, "%15s %u %u %lf", entry.scenario, &entry.threads, &entry.partitions,
+                &entry.nsPerOp) != 4)
+            continue;
+
+        pNew = realloc(microBaseline, (microBaselineCount + 1) * sizeof(MICRO_BASELINE));
+        if (!pNew)
+            break;
+        microBaseline = pNew;
+        microBaseline[microBaselineCount++] = entry;
+    }
+
+    fclose(pFile);
+    return true;
+}
+
+static bool saveBaseline(const char *pPath)
+{
+    FILE *pFile;
+    uint32_t i;
+
+    pFile = fopen(pPath, "w");
+    if (!pFile)
+        return false;
+
+    fprintf(pFile, "# wldmicro baseline: scenario threads partitions ns/op\n");
+    for (i=0; i < microResultCount; i++)
+        fprintf(pFile, "%s %u %u %.2f\n", microScenarioNames[microResults[i].scenario],
+            microResults[i].threads, microResults[i].partitions, microResults[i].nsPerOp);
+
+    return fclose(pFile) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    WLD_HEALTH_CONFIG health = {
+        1,                  // probeIntervalMsec
+        10,                 // probeTimeoutMsec
+        1,                  // backoffMinMsec
+        8,                  // backoffMaxMsec
+        1,                  // rampSteps
+        1,                  // rampStepMsec
+        FM_NUMBER_CUSTOM_FM // pingFmNumber
+    };
+    uint32_t threadList[MICRO_MAX_LIST] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint32_t partitionList[MICRO_MAX_LIST] = { 4, 16, 64, 256 };
+    uint32_t threadCount = 8;
+    uint32_t partitionCount = 4;
+    bool run[MICRO_SCENARIOS] = { true, true, true, true };
+    uint32_t duration = 100;
+    uint32_t warmup = 20;
+    uint32_t repeats = 3;
+    uint32_t threshold = 20;
+    const char *pSavePath = NULL;
+    const char *pBaselinePath = NULL;
+    const MICRO_BASELINE *pBase;
+    MICRO_RESULT result;
+    MICRO_RESULT *pResult;
+    double baseRate = 0.0;
+    uint32_t baseThreads = 0;
+    uint32_t regressions = 0;
+    uint32_t compared = 0;
+    uint32_t p, s, t, r;
+    int rc = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "S:t:p:a:d:w:n:c:s:b:r:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'S':
+                if (!parseScenarios(optarg, run))
+                {
+                    printf("Invalid scenario list: %s\n", optarg);
+                    usage();
+                    return 1;
+                }
+                break;
+            case 't':
+            case 'p':
+                if (opt == 't')
+                    threadCount = parseList(optarg, threadList, MICRO_MAX_LIST);
+                else
+                    partitionCount = parseList(optarg, partitionList, MICRO_MAX_LIST);
+                if ((opt == 't' ? threadCount : partitionCount) == 0)
+                {
+                    printf("Invalid list: %s\n", optarg);
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'a': microAdapters = (uint32_t)atoi(optarg); break;
+            case 'd': duration = (uint32_t)atoi(optarg); break;
+            case 'w': warmup = (uint32_t)atoi(optarg); break;
+            case 'n': repeats = (uint32_t)atoi(optarg); break;
+            case 'c': microChurnUsec = (uint32_t)atoi(optarg); break;
+            case 's': pSavePath = optarg; break;
+            case 'b': pBaselinePath = optarg; break;
+            case 'r': threshold = (uint32_t)atoi(optarg); break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    for (t=0; t < threadCount; t++)
+    {
+        if (threadList[t] > MICRO_MAX_THREADS)
+            threadCount = 0;
+    }
+    for (p=0; p < partitionCount; p++)
+    {
+        if (partitionList[p] > MICRO_MAX_SLOTS)
+            partitionCount = 0;
+    }
+    if (microAdapters == 0 || microAdapters > MICRO_MAX_ADAPTERS || duration == 0 || repeats == 0 ||
+        microChurnUsec == 0 || threadCount == 0 || partitionCount == 0)
+    {
+        usage();
+        return 1;
+    }
+
+    if (pBaselinePath && !loadBaseline(pBaselinePath))
+    {
+        printf("Cannot read baseline %s\n", pBaselinePath);
+        return 1;
+    }
+
+    if (MD_Initialize() != MDR_OK || SetWLDHealthConfig(&health) != WLDR_OK)
+        return 1;
+
+    printf("\nwldmicro: %u adapters, %ld cpus, %u msec runs (best of %u)\n",
+        microAdapters, sysconf(_SC_NPROCESSORS_ONLN), duration, repeats);
+    printf("\n%-8s %7s %10s %10s %10s %10s %8s %10s %8s",
+        "scenario", "threads", "partitions", "ns/op", "Mops/s", "misses/op", "scaling", "errors", "deact");
+    if (pBaselinePath)
+        printf(" %10s %8s", "baseline", "change");
+    printf("\n");
+
+    for (p=0; p < partitionCount; p++)
+    {
+        if (!microTable(partitionList[p], p == 0))
+        {
+            printf("\nERROR: cannot set up a table of %u partitions\n", partitionList[p]);
+            rc = 1;
+            break;
+        }
+
+        for (s=0; s < MICRO_SCENARIOS; s++)
+        {
+            if (!run[s])
+                continue;
+
+            microScenario = (MICRO_SCENARIO)s;
+            baseThreads = 0;
+
+            for (t=0; t < threadCount && microResultCount < MICRO_MAX_RESULTS; t++)
+            {
+                pResult = &microResults[microResultCount];
+                memset(pResult, 0, sizeof(*pResult));
+
+                for (r=0; r < repeats; r++)
+                {
+                    memset(&result, 0, sizeof(result));
+                    if (!microRun(threadList[t], warmup, duration, &result))
+                        continue;
+                    if (pResult->nsPerOp == 0.0 || result.nsPerOp < pResult->nsPerOp)
+                        *pResult = result;
+                }
+
+                if (pResult->nsPerOp == 0.0)
+                {
+                    printf("\nERROR: %s with %u threads did not run\n", microScenarioNames[s], threadList[t]);
+                    rc = 1;
+                    continue;
+                }
+
+                pResult->scenario = (MICRO_SCENARIO)s;
+                pResult->threads = threadList[t];
+                pResult->partitions = partitionList[p];
+                if (baseThreads == 0)
+                {
+                    baseThreads = pResult->threads;
+                    baseRate = pResult->mopsPerSec / baseThreads;
+                }
+                pResult->efficiency = (pResult->mopsPerSec / pResult->threads) / baseRate;
+                microResultCount++;
+
+                printf("%-8s %7u %10u %10.1f %10.2f ", microScenarioNames[s], pResult->threads,
+                    pResult->partitions, pResult->nsPerOp, pResult->mopsPerSec);
+                if (pResult->missesPerOp < 0)
+                    printf("%10s", "n/a");
+                else
+                    printf("%10.2f", pResult->missesPerOp);
+                printf(" %7.1f%% %10llu %8llu", pResult->efficiency * 100.0,
+                    (unsigned long long)pResult->errors, (unsigned long long)pResult->deactivations);
+
+                pBase = pBaselinePath ? findBaseline(pResult) : NULL;
+                if (pBase)
+                {
+                    compared++;
+                    printf(" %10.1f %+7.1f%%", pBase->nsPerOp,
+                        (pResult->nsPerOp / pBase->nsPerOp - 1.0) * 100.0);
+                    if (pResult->nsPerOp > pBase->nsPerOp * (1.0 + threshold / 100.0))
+                    {
+                        printf("  REGRESSION");
+                        regressions++;
+                    }
+                }
+                else if (pBaselinePath)
+                    printf(" %10s", "-");
+                printf("\n");
+                fflush(stdout);
+            }
+        }
+    }
+
+    if (pBaselinePath)
+    {
+        printf("\n%u of %u results compared with %s are more than %u%% slower\n",
+            regressions, compared, pBaselinePath, threshold);
+        if (regressions)
+            rc = 1;
+    }
+
+    if (pSavePath)
+    {
+        if (saveBaseline(pSavePath))
+            printf("\nbaseline saved to %s\n", pSavePath);
+        else
+        {
+            printf("\nERROR: cannot write baseline %s\n", pSavePath);
+            rc = 1;
+        }
+    }
+
+    free(microBaseline);
+    StopWLDHealthMonitor();
+
+    return rc;
+}
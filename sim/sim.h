@@ -0,0 +1,98 @@
+/*
+    sim.h
+
+    Simulated HSM backend for the WLD sample.  The simulator provides a
+    local stand-in for the MD_xxx message dispatch calls used by wld.c,
+    with a configurable number of adapters, service-time distribution,
+    queue depth and failure injection per adapter.  FM handlers registered
+    through FMSW_RegisterStreamDispatch (i.e. fm/startup.c) are executed
+    in-process against a small simulated object store.
+
+    Slot numbering:  slot N lives on adapter (N / partitionsPerAdapter).
+    Embedded slot IDs are N + 1 so that they are unique across adapters
+    (FM code from all simulated adapters shares one address space).
+*/
+
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include <stdbool.h>
+#include <fm/host/stdint.h>
+#include <fm/host/md.h>
+
+#define SIM_MAX_ADAPTERS    64
+#define SIM_MAX_LABEL_LEN   32
+
+typedef enum SIM_DIST {
+    SIM_DIST_FIXED = 0,
+    SIM_DIST_UNIFORM,
+    SIM_DIST_EXP,
+    SIM_DIST_LOGNORMAL
+} SIM_DIST;
+
+// Per adapter behaviour.  Service times are in microseconds.
+typedef struct SIM_ADAPTER_CONFIG {
+    SIM_DIST dist;
+    double meanUsec;        // mean service time of one command
+    double spread;          // uniform: +/- usec, lognormal: sigma
+    double slowFactor;      // multiplier applied to every service time
+    uint32_t servers;       // commands serviced concurrently
+    uint32_t queueDepth;    // commands allowed to wait for a server
+    double failRate;        // probability a command fails with MDR_UNSUCCESSFUL
+    double findUsec;        // cost of each FM side C_FindObjects call
+    double queryUsec;       // latency of MD_GetHsmState and MD_GetEmbeddedSlotID
+    HsmState_t state;       // state reported by MD_GetHsmState
+} SIM_ADAPTER_CONFIG;
+
+typedef struct SIM_ADAPTER_STATS {
+    uint64_t served;        // commands that reached the FM
+    uint64_t failed;        // injected failures
+    uint64_t rejected;      // commands rejected because the queue was full
+    uint64_t timedOut;      // commands whose MD_SendReceive timeout expired
+    uint64_t finds;         // FM side C_FindObjects calls
+    int64_t openSessions;   // FM side sessions opened and not yet closed
+} SIM_ADAPTER_STATS;
+
+void SIM_DefaultAdapterConfig(SIM_ADAPTER_CONFIG *pCfg);
+
+MD_RV SIM_ParseDist(const char *spec, SIM_ADAPTER_CONFIG *pCfg);
+
+MD_RV SIM_Initialize(uint32_t numAdapters,
+    uint32_t partitionsPerAdapter,
+    uint32_t keysPerPartition,
+    const SIM_ADAPTER_CONFIG *pCfg);
+
+MD_RV SIM_SetAdapterConfig(uint32_t hsmID, const SIM_ADAPTER_CONFIG *pCfg);
+
+MD_RV SIM_GetAdapterConfig(uint32_t hsmID, SIM_ADAPTER_CONFIG *pCfg);
+
+MD_RV SIM_GetAdapterStats(uint32_t hsmID, SIM_ADAPTER_STATS *pStats);
+
+uint32_t SIM_GetAdapterCount(void);
+
+uint32_t SIM_GetSlotCount(void);
+
+MD_RV SIM_GetKeyHandle(uint32_t slotID, const char *label, uint32_t *phKey);
+
+// Internal to the simulator (sim_md.c <-> sim_fm.c)
+void SIM_FM_Startup(void);
+
+bool SIM_FM_IsRegistered(uint16_t fmNumber);
+
+uint32_t SIM_FM_Dispatch(uint32_t hsmID,
+    MD_Buffer_t *pReq,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    double *pChargeUsec);
+
+bool SIM_FM_FindKey(uint32_t embeddedSlot, const char *label, uint32_t len, uint32_t *phKey);
+
+uint32_t SIM_FM_ObjectCount(uint32_t embeddedSlot);
+
+bool SIM_FM_KeyLabel(uint32_t hKey, char *label, uint32_t size);
+
+void SIM_FM_NoteSession(uint32_t embeddedSlot, int delta);
+
+void SIM_FM_NoteFind(uint32_t embeddedSlot);
+
+#endif
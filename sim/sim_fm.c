@@ -0,0 +1,389 @@
+/*
+    sim_fm.c
+
+    In-process FM runtime for the WLD simulator.  Provides the FMSW
+    dispatch registration, the SVC_IO request/reply stream calls and the
+    FM side PKCS#11 subset used by fm/startup.c.  FM handlers are run one
+    at a time (as in the FM on an adapter); modelled costs such as
+    C_FindObjects are charged to the calling command and slept outside
+    of the FM lock by sim_md.c.
+*/
+
+#undef UNICODE
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include <cryptoki.h>
+#include "fm/hsm/fmsw.h"
+#include "fm/hsm/fm_io_service.h"
+
+#include "sim.h"
+
+struct SIM_FM_MSG {
+    MD_Buffer_t *pReq;
+    uint32_t reqIndex;
+    uint32_t reqOffset;
+    MD_Buffer_t *pResp;
+    uint32_t respIndex;
+    uint32_t respOffset;
+    uint32_t written;
+};
+
+typedef struct SIM_FIND_STATE {
+    CK_SESSION_HANDLE hSession;
+    bool active;
+    bool done;
+    bool all;               // no label in the template: every object
+    uint32_t next;          // next object returned when all is set
+    char label[SIM_MAX_LABEL_LEN];
+    uint32_t labelLen;
+} SIM_FIND_STATE;
+
+static FMSW_StreamHandler_t SIM_Handler = NULL;
+static uint16_t SIM_HandlerFMID = 0;
+
+// State below is only touched with fm_mutex held
+static pthread_mutex_t fm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t SIM_CurrentHsm = 0;
+static double SIM_ChargeUsec = 0;
+static uint32_t SIM_SessionSeq = 0;
+static SIM_FIND_STATE SIM_Find;
+
+extern FM_RV Startup(void);
+
+void SIM_FM_Startup(void)
+{
+    if (!SIM_Handler)
+        (void)Startup();
+}
+
+bool SIM_FM_IsRegistered(uint16_t fmNumber)
+{
+    return SIM_Handler != NULL && SIM_HandlerFMID == fmNumber;
+}
+
+// Run the registered FM handler against the request buffers, returning
+// the FM status and the modelled FM side cost in pChargeUsec
+uint32_t SIM_FM_Dispatch(uint32_t hsmID,
+    MD_Buffer_t *pReq,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    double *pChargeUsec)
+{
+    struct SIM_FM_MSG msg;
+    uint32_t fmStatus;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.pReq = pReq;
+    msg.pResp = pResp;
+
+    pthread_mutex_lock(&fm_mutex);
+    SIM_CurrentHsm = hsmID;
+    SIM_ChargeUsec = 0;
+    memset(&SIM_Find, 0, sizeof(SIM_Find));
+
+    fmStatus = (uint32_t)SIM_Handler(&msg);
+
+    *pChargeUsec = SIM_ChargeUsec;
+    pthread_mutex_unlock(&fm_mutex);
+
+    *pReceivedLen = msg.written;
+    return fmStatus;
+}
+
+/*
+    FMSW
+*/
+
+uint16_t GetFMID(void)
+{
+    return FM_NUMBER_CUSTOM_FM;
+}
+
+FM_RV FMSW_RegisterStreamDispatch(uint16_t fmID, FMSW_StreamHandler_t handler)
+{
+    SIM_Handler = handler;
+    SIM_HandlerFMID = fmID;
+    return FM_OK;
+}
+
+/*
+    SVC_IO - request buffers are an MD_Buffer_t array terminated by an
+    entry with a NULL pData, as passed to MD_SendReceive
+*/
+
+int SVC_IO_Read(FmMsgHandle token, void *pBuf, uint32_t len)
+{
+    uint8_t *pOut = (uint8_t *)pBuf;
+    MD_Buffer_t *pCur;
+    uint32_t count = 0;
+    uint32_t n;
+
+    while (count < len && token->pReq)
+    {
+        pCur = &token->pReq[token->reqIndex];
+        if (pCur->pData == NULL)
+            break;
+
+        n = pCur->length - token->reqOffset;
+        if (n > len - count)
+            n = len - count;
+
+        memcpy(pOut + count, pCur->pData + token->reqOffset, n);
+        count += n;
+        token->reqOffset += n;
+        if (token->reqOffset == pCur->length)
+        {
+            token->reqIndex++;
+            token->reqOffset = 0;
+        }
+    }
+
+    return (int)count;
+}
+
+int SVC_IO_Read32(FmMsgHandle token, uint32_t *pVal)
+{
+    uint32_t val;
+    int n;
+
+    n = SVC_IO_Read(token, &val, sizeof(val));
+    if (n == sizeof(val))
+        *pVal = be32toh(val);
+
+    return n;
+}
+
+int SVC_IO_Write(FmMsgHandle token, const void *pBuf, uint32_t len)
+{
+    const uint8_t *pIn = (const uint8_t *)pBuf;
+    MD_Buffer_t *pCur;
+    uint32_t count = 0;
+    uint32_t n;
+
+    while (count < len && token->pResp)
+    {
+        pCur = &token->pResp[token->respIndex];
+        if (pCur->pData == NULL)
+            break;
+
+        n = pCur->length - token->respOffset;
+        if (n > len - count)
+            n = len - count;
+
+        memcpy(pCur->pData + token->respOffset, pIn + count, n);
+        count += n;
+        token->respOffset += n;
+        if (token->respOffset == pCur->length)
+        {
+            token->respIndex++;
+            token->respOffset = 0;
+        }
+    }
+
+    token->written += count;
+    return (int)count;
+}
+
+int SVC_IO_Write32(FmMsgHandle token, uint32_t val)
+{
+    uint32_t beVal = htobe32(val);
+
+    return SVC_IO_Write(token, &beVal, sizeof(beVal));
+}
+
+/*
+    FM side PKCS#11.  Session handles carry the embedded slot in the
+    upper 16 bits.  Only slots belonging to the adapter the current
+    command was sent to are visible.
+*/
+
+static bool simSlotOnCurrentHsm(CK_SLOT_ID slotID)
+{
+    uint32_t hsmID;
+
+    if (slotID == 0 || slotID > SIM_GetSlotCount())
+        return false;
+
+    if (MD_GetHsmIndexForSlot((uint32_t)slotID - 1, &hsmID) != MDR_OK)
+        return false;
+
+    return hsmID == SIM_CurrentHsm;
+}
+
+static bool simSessionValid(CK_SESSION_HANDLE hSession)
+{
+    return simSlotOnCurrentHsm((CK_SLOT_ID)(hSession >> 16));
+}
+
+CK_RV C_OpenSession(CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR pApplication,
+    CK_NOTIFY Notify, CK_SESSION_HANDLE_PTR phSession)
+{
+    (void)flags;
+    (void)pApplication;
+    (void)Notify;
+
+    if (!phSession)
+        return CKR_ARGUMENTS_BAD;
+
+    if (!simSlotOnCurrentHsm(slotID))
+        return CKR_SLOT_ID_INVALID;
+
+    SIM_SessionSeq = (SIM_SessionSeq + 1) & 0xFFFF;
+    if (SIM_SessionSeq == 0)
+        SIM_SessionSeq = 1;
+
+    *phSession = ((CK_SESSION_HANDLE)slotID << 16) | SIM_SessionSeq;
+    SIM_FM_NoteSession((uint32_t)slotID, 1);
+
+    return CKR_OK;
+}
+
+CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
+{
+    if (!simSessionValid(hSession))
+        return CKR_SESSION_HANDLE_INVALID;
+
+    SIM_FM_NoteSession((uint32_t)(hSession >> 16), -1);
+    return CKR_OK;
+}
+
+CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate,
+    CK_ULONG ulCount)
+{
+    CK_ULONG i;
+
+    if (!simSessionValid(hSession))
+        return CKR_SESSION_HANDLE_INVALID;
+
+    if (SIM_Find.active)
+        return CKR_OPERATION_ACTIVE;
+
+    if (ulCount && !pTemplate)
+        return CKR_ARGUMENTS_BAD;
+
+    memset(&SIM_Find, 0, sizeof(SIM_Find));
+    for (i=0; i < ulCount; i++)
+    {
+        if (pTemplate[i].type != CKA_LABEL)
+            continue;
+
+        if (pTemplate[i].ulValueLen > sizeof(SIM_Find.label))
+        {
+            // No simulated object carries a label this long
+            SIM_Find.done = true;
+            continue;
+        }
+
+        memcpy(SIM_Find.label, pTemplate[i].pValue, pTemplate[i].ulValueLen);
+        SIM_Find.labelLen = (uint32_t)pTemplate[i].ulValueLen;
+    }
+
+    // An empty template matches every object
+    if (SIM_Find.labelLen == 0 && !SIM_Find.done)
+    {
+        SIM_Find.all = true;
+        SIM_Find.next = 1;
+    }
+
+    SIM_Find.hSession = hSession;
+    SIM_Find.active = true;
+
+    return CKR_OK;
+}
+
+CK_RV C_FindObjects(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject,
+    CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulObjectCount)
+{
+    SIM_ADAPTER_CONFIG cfg;
+    uint32_t eSlot = (uint32_t)(hSession >> 16);
+    uint32_t hKey;
+
+    if (!SIM_Find.active || SIM_Find.hSession != hSession)
+        return CKR_OPERATION_NOT_INITIALIZED;
+
+    if (!phObject || !pulObjectCount)
+        return CKR_ARGUMENTS_BAD;
+
+    *pulObjectCount = 0;
+
+    if (SIM_GetAdapterConfig(SIM_CurrentHsm, &cfg) == MDR_OK)
+        SIM_ChargeUsec += cfg.findUsec;
+    SIM_FM_NoteFind(eSlot);
+
+    if (SIM_Find.all)
+    {
+        while (*pulObjectCount < ulMaxObjectCount && SIM_Find.next <= SIM_FM_ObjectCount(eSlot))
+            phObject[(*pulObjectCount)++] = ((CK_OBJECT_HANDLE)eSlot << 16) | SIM_Find.next++;
+        return CKR_OK;
+    }
+
+    if (!SIM_Find.done && ulMaxObjectCount > 0 &&
+        SIM_FM_FindKey(eSlot, SIM_Find.label, SIM_Find.labelLen, &hKey))
+    {
+        phObject[0] = (CK_OBJECT_HANDLE)hKey;
+        *pulObjectCount = 1;
+    }
+    SIM_Find.done = true;
+
+    return CKR_OK;
+}
+
+CK_RV C_GetAttributeValue(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
+    CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+    char label[SIM_MAX_LABEL_LEN];
+    CK_ULONG len;
+    CK_RV ckResult = CKR_OK;
+    CK_ULONG i;
+
+    if (!simSessionValid(hSession))
+        return CKR_SESSION_HANDLE_INVALID;
+
+    if (ulCount && !pTemplate)
+        return CKR_ARGUMENTS_BAD;
+
+    if ((hObject >> 16) != (hSession >> 16) || !SIM_FM_KeyLabel((uint32_t)hObject, label, sizeof(label)))
+        return CKR_OBJECT_HANDLE_INVALID;
+
+    // Only CKA_LABEL is simulated
+    for (i=0; i < ulCount; i++)
+    {
+        if (pTemplate[i].type != CKA_LABEL)
+        {
+            pTemplate[i].ulValueLen = (CK_ULONG)-1;
+            ckResult = CKR_ATTRIBUTE_TYPE_INVALID;
+            continue;
+        }
+
+        len = (CK_ULONG)strlen(label);
+        if (pTemplate[i].pValue)
+        {
+            if (pTemplate[i].ulValueLen < len)
+            {
+                pTemplate[i].ulValueLen = (CK_ULONG)-1;
+                ckResult = CKR_BUFFER_TOO_SMALL;
+                continue;
+            }
+            memcpy(pTemplate[i].pValue, label, len);
+        }
+        pTemplate[i].ulValueLen = len;
+    }
+
+    return ckResult;
+}
+
+CK_RV C_FindObjectsFinal(CK_SESSION_HANDLE hSession)
+{
+    if (!SIM_Find.active || SIM_Find.hSession != hSession)
+        return CKR_OPERATION_NOT_INITIALIZED;
+
+    memset(&SIM_Find, 0, sizeof(SIM_Find));
+    return CKR_OK;
+}
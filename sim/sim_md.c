@@ -0,0 +1,584 @@
+/*
+    sim_md.c
+
+    Simulated MD_xxx message dispatch layer for the WLD sample.  Each
+    simulated adapter has a number of servers (commands processed in
+    parallel), a bounded wait queue, a service-time distribution and a
+    failure injection rate.  Commands addressed to a registered FM are
+    executed in-process by sim_fm.c.
+*/
+
+#undef UNICODE
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sim.h"
+#include "wld_time.h"
+#include "wld_random.h"
+
+typedef struct SIM_ADAPTER {
+    SIM_ADAPTER_CONFIG cfg;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    uint32_t busy;
+    uint32_t waiting;
+    SIM_ADAPTER_STATS stats;
+} SIM_ADAPTER;
+
+static SIM_ADAPTER SIM_Adapters[SIM_MAX_ADAPTERS];
+static uint32_t SIM_AdapterCount = 0;
+static uint32_t SIM_PartitionsPerAdapter = 0;
+static uint32_t SIM_KeysPerPartition = 0;
+static bool SIM_Initialized = false;
+static bool MD_Initialized = false;
+
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Return a uniformly distributed double in (0, 1]
+static double simRandom(void)
+{
+    return ((double)(wldRandom64() >> 11) + 1.0) / 9007199254740992.0;
+}
+
+// Draw one service time (usec) from the adapter's distribution
+static double simServiceTime(const SIM_ADAPTER_CONFIG *pCfg)
+{
+    double usec = pCfg->meanUsec;
+    double mu;
+
+    switch (pCfg->dist)
+    {
+        case SIM_DIST_UNIFORM:
+            usec = pCfg->meanUsec + pCfg->spread * (2.0 * simRandom() - 1.0);
+            break;
+        case SIM_DIST_EXP:
+            usec = -pCfg->meanUsec * log(simRandom());
+            break;
+        case SIM_DIST_LOGNORMAL:
+            // Box-Muller, scaled so the distribution mean is meanUsec
+            mu = log(pCfg->meanUsec > 0 ? pCfg->meanUsec : 1.0) - pCfg->spread * pCfg->spread / 2.0;
+            usec = exp(mu + pCfg->spread *
+                sqrt(-2.0 * log(simRandom())) * cos(2.0 * M_PI * simRandom()));
+            break;
+        case SIM_DIST_FIXED:
+        default:
+            break;
+    }
+
+    if (usec < 0)
+        usec = 0;
+
+    return usec * pCfg->slowFactor;
+}
+
+static void simSleepUsec(double usec)
+{
+    struct timespec ts;
+    uint64_t nsec;
+
+    if (usec <= 0)
+        return;
+
+    nsec = (uint64_t)(usec * 1000.0);
+    ts.tv_sec = nsec / 1000000000ULL;
+    ts.tv_nsec = nsec % 1000000000ULL;
+    while (nanosleep(&ts, &ts) != 0)
+        ;
+}
+
+// A management query (state, embedded slot) takes the adapter's
+// queryUsec - a round trip to a remote or unreachable adapter
+static void simQueryDelay(SIM_ADAPTER *pAdapter)
+{
+    double usec;
+
+    pthread_mutex_lock(&pAdapter->lock);
+    usec = pAdapter->cfg.queryUsec;
+    pthread_mutex_unlock(&pAdapter->lock);
+
+    simSleepUsec(usec);
+}
+
+void SIM_DefaultAdapterConfig(SIM_ADAPTER_CONFIG *pCfg)
+{
+    memset(pCfg, 0, sizeof(*pCfg));
+    pCfg->dist = SIM_DIST_EXP;
+    pCfg->meanUsec = 200.0;
+    pCfg->spread = 0.0;
+    pCfg->slowFactor = 1.0;
+    pCfg->servers = 4;
+    pCfg->queueDepth = 256;
+    pCfg->failRate = 0.0;
+    pCfg->findUsec = 0.0;
+    pCfg->queryUsec = 0.0;
+    pCfg->state = S_NORMAL_OPERATION;
+}
+
+// Parse a service time spec: "fixed:MEAN", "uniform:MEAN:SPREAD",
+// "exp:MEAN" or "lognormal:MEAN:SIGMA" (MEAN and SPREAD in usec)
+MD_RV SIM_ParseDist(const char *spec, SIM_ADAPTER_CONFIG *pCfg)
+{
+    char name[16];
+    double mean = 0, spread = 0;
+    int n;
+
+    if (!spec || !pCfg)
+        return MDR_INVALID_PARAMETER;
+
+    n = sscanf(spec, "%15[a-z]:%lf:%lf", name, &mean, &spread);
+    if (n < 2 || mean < 0)
+        return MDR_INVALID_PARAMETER;
+
+    if (strcmp(name, "fixed") == 0)
+        pCfg->dist = SIM_DIST_FIXED;
+    else if (strcmp(name, "uniform") == 0)
+        pCfg->dist = SIM_DIST_UNIFORM;
+    else if (strcmp(name, "exp") == 0)
+        pCfg->dist = SIM_DIST_EXP;
+    else if (strcmp(name, "lognormal") == 0)
+        pCfg->dist = SIM_DIST_LOGNORMAL;
+    else
+        return MDR_INVALID_PARAMETER;
+
+    pCfg->meanUsec = mean;
+    pCfg->spread = (n == 3) ? spread : 0.0;
+
+    return MDR_OK;
+}
+
+MD_RV SIM_Initialize(uint32_t numAdapters,
+    uint32_t partitionsPerAdapter,
+    uint32_t keysPerPartition,
+    const SIM_ADAPTER_CONFIG *pCfg)
+{
+    SIM_ADAPTER_CONFIG defCfg;
+    pthread_condattr_t condAttr;
+    uint32_t i;
+
+    if (numAdapters == 0 || numAdapters > SIM_MAX_ADAPTERS ||
+        partitionsPerAdapter == 0 || keysPerPartition >= 0xFFFF)
+        return MDR_INVALID_PARAMETER;
+
+    if (!pCfg)
+    {
+        SIM_DefaultAdapterConfig(&defCfg);
+        pCfg = &defCfg;
+    }
+
+    pthread_mutex_lock(&sim_mutex);
+
+    if (SIM_Initialized)
+    {
+        pthread_mutex_unlock(&sim_mutex);
+        return MDR_INVALID_PARAMETER;
+    }
+
+    // MD_SendReceive timeouts are measured on the monotonic clock
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+
+    for (i=0; i < numAdapters; i++)
+    {
+        memset(&SIM_Adapters[i], 0, sizeof(SIM_Adapters[i]));
+        SIM_Adapters[i].cfg = *pCfg;
+        if (SIM_Adapters[i].cfg.servers == 0)
+            SIM_Adapters[i].cfg.servers = 1;
+        pthread_mutex_init(&SIM_Adapters[i].lock, NULL);
+        pthread_cond_init(&SIM_Adapters[i].ready, &condAttr);
+    }
+    pthread_condattr_destroy(&condAttr);
+
+    SIM_AdapterCount = numAdapters;
+    SIM_PartitionsPerAdapter = partitionsPerAdapter;
+    SIM_KeysPerPartition = keysPerPartition;
+    SIM_Initialized = true;
+
+    pthread_mutex_unlock(&sim_mutex);
+
+    return MDR_OK;
+}
+
+MD_RV SIM_SetAdapterConfig(uint32_t hsmID, const SIM_ADAPTER_CONFIG *pCfg)
+{
+    SIM_ADAPTER *pAdapter;
+
+    if (hsmID >= SIM_AdapterCount || !pCfg)
+        return MDR_INVALID_HSM_INDEX;
+
+    pAdapter = &SIM_Adapters[hsmID];
+    pthread_mutex_lock(&pAdapter->lock);
+    pAdapter->cfg = *pCfg;
+    if (pAdapter->cfg.servers == 0)
+        pAdapter->cfg.servers = 1;
+    pthread_cond_broadcast(&pAdapter->ready);
+    pthread_mutex_unlock(&pAdapter->lock);
+
+    return MDR_OK;
+}
+
+MD_RV SIM_GetAdapterConfig(uint32_t hsmID, SIM_ADAPTER_CONFIG *pCfg)
+{
+    SIM_ADAPTER *pAdapter;
+
+    if (hsmID >= SIM_AdapterCount || !pCfg)
+        return MDR_INVALID_HSM_INDEX;
+
+    pAdapter = &SIM_Adapters[hsmID];
+    pthread_mutex_lock(&pAdapter->lock);
+    *pCfg = pAdapter->cfg;
+    pthread_mutex_unlock(&pAdapter->lock);
+
+    return MDR_OK;
+}
+
+MD_RV SIM_GetAdapterStats(uint32_t hsmID, SIM_ADAPTER_STATS *pStats)
+{
+    SIM_ADAPTER *pAdapter;
+
+    if (hsmID >= SIM_AdapterCount || !pStats)
+        return MDR_INVALID_HSM_INDEX;
+
+    pAdapter = &SIM_Adapters[hsmID];
+    pthread_mutex_lock(&pAdapter->lock);
+    *pStats = pAdapter->stats;
+    pthread_mutex_unlock(&pAdapter->lock);
+
+    return MDR_OK;
+}
+
+uint32_t SIM_GetAdapterCount(void)
+{
+    return SIM_AdapterCount;
+}
+
+uint32_t SIM_GetSlotCount(void)
+{
+    return SIM_AdapterCount * SIM_PartitionsPerAdapter;
+}
+
+// Host side stand-in for C_FindObjects by label on a (host) slot
+MD_RV SIM_GetKeyHandle(uint32_t slotID, const char *label, uint32_t *phKey)
+{
+    if (slotID >= SIM_GetSlotCount() || !label || !phKey)
+        return MDR_INVALID_PARAMETER;
+
+    if (!SIM_FM_FindKey(slotID + 1, label, (uint32_t)strlen(label), phKey))
+        return MDR_UNSUCCESSFUL;
+
+    return MDR_OK;
+}
+
+// Key store lookup shared with sim_fm.c.  Every partition holds
+// "MyAESKey" plus SIM_KeysPerPartition keys labelled WLDKeyNNNNN.
+bool SIM_FM_FindKey(uint32_t embeddedSlot, const char *label, uint32_t len, uint32_t *phKey)
+{
+    const char myKey[] = "MyAESKey";
+    const char prefix[] = "WLDKey";
+    uint32_t index = 0;
+    uint32_t i;
+
+    if (embeddedSlot == 0 || embeddedSlot > SIM_GetSlotCount())
+        return false;
+
+    if (len == sizeof(myKey) - 1 && memcmp(label, myKey, len) == 0)
+    {
+        index = 0;
+    }
+    else if (len > sizeof(prefix) - 1 && len <= sizeof(prefix) - 1 + 5 &&
+        memcmp(label, prefix, sizeof(prefix) - 1) == 0)
+    {
+        for (i = sizeof(prefix) - 1; i < len; i++)
+        {
+            if (label[i] < '0' || label[i] > '9')
+                return false;
+            index = index * 10 + (uint32_t)(label[i] - '0');
+        }
+        if (index >= SIM_KeysPerPartition)
+            return false;
+        index++;
+    }
+    else
+        return false;
+
+    *phKey = (embeddedSlot << 16) | (index + 1);
+    return true;
+}
+
+// Objects on an embedded slot: handle (embeddedSlot << 16) | n for n
+// from 1 to the count returned
+uint32_t SIM_FM_ObjectCount(uint32_t embeddedSlot)
+{
+    if (embeddedSlot == 0 || embeddedSlot > SIM_GetSlotCount())
+        return 0;
+
+    return SIM_KeysPerPartition + 1;
+}
+
+// Label of an object (see SIM_FM_FindKey), NUL terminated
+bool SIM_FM_KeyLabel(uint32_t hKey, char *label, uint32_t size)
+{
+    uint32_t n = hKey & 0xFFFF;
+
+    if (n == 0 || n > SIM_FM_ObjectCount(hKey >> 16))
+        return false;
+
+    if (n == 1)
+        snprintf(label, size, "MyAESKey");
+    else
+        snprintf(label, size, "WLDKey%05u", n - 2);
+
+    return true;
+}
+
+static SIM_ADAPTER *simAdapterForEmbeddedSlot(uint32_t embeddedSlot)
+{
+    if (embeddedSlot == 0 || embeddedSlot > SIM_GetSlotCount())
+        return NULL;
+
+    return &SIM_Adapters[(embeddedSlot - 1) / SIM_PartitionsPerAdapter];
+}
+
+void SIM_FM_NoteSession(uint32_t embeddedSlot, int delta)
+{
+    SIM_ADAPTER *pAdapter = simAdapterForEmbeddedSlot(embeddedSlot);
+
+    if (pAdapter)
+        __atomic_fetch_add(&pAdapter->stats.openSessions, delta, __ATOMIC_RELAXED);
+}
+
+void SIM_FM_NoteFind(uint32_t embeddedSlot)
+{
+    SIM_ADAPTER *pAdapter = simAdapterForEmbeddedSlot(embeddedSlot);
+
+    if (pAdapter)
+        __atomic_fetch_add(&pAdapter->stats.finds, 1, __ATOMIC_RELAXED);
+}
+
+/*
+    MD API
+*/
+
+MD_RV MD_Initialize(void)
+{
+    MD_RV rv = MDR_OK;
+
+    if (!SIM_Initialized)
+        rv = SIM_Initialize(4, 1, 0, NULL);
+
+    if (rv == MDR_OK && !MD_Initialized)
+    {
+        // "Load" the FM on every simulated adapter
+        SIM_FM_Startup();
+        MD_Initialized = true;
+    }
+
+    return rv;
+}
+
+void MD_Finalize(void)
+{
+    MD_Initialized = false;
+}
+
+MD_RV MD_GetHsmCount(uint32_t *pHsmCount)
+{
+    if (!MD_Initialized)
+        return MDR_INTERNAL_ERROR;
+
+    if (!pHsmCount)
+        return MDR_INVALID_PARAMETER;
+
+    *pHsmCount = SIM_AdapterCount;
+    return MDR_OK;
+}
+
+MD_RV MD_GetHsmIndexForSlot(uint32_t slotID, uint32_t *pHsmIndex)
+{
+    if (!MD_Initialized)
+        return MDR_INTERNAL_ERROR;
+
+    if (!pHsmIndex || slotID >= SIM_GetSlotCount())
+        return MDR_INVALID_PARAMETER;
+
+    *pHsmIndex = slotID / SIM_PartitionsPerAdapter;
+    return MDR_OK;
+}
+
+MD_RV MD_GetEmbeddedSlotID(uint32_t slotID, unsigned long int *pEmbeddedSlotID)
+{
+    if (!MD_Initialized)
+        return MDR_INTERNAL_ERROR;
+
+    if (!pEmbeddedSlotID || slotID >= SIM_GetSlotCount())
+        return MDR_INVALID_PARAMETER;
+
+    simQueryDelay(&SIM_Adapters[slotID / SIM_PartitionsPerAdapter]);
+
+    *pEmbeddedSlotID = slotID + 1;
+    return MDR_OK;
+}
+
+MD_RV MD_GetHsmState(uint32_t hsmIndex, HsmState_t *pState, uint32_t *pErrorCode)
+{
+    SIM_ADAPTER *pAdapter;
+
+    if (!MD_Initialized)
+        return MDR_INTERNAL_ERROR;
+
+    if (hsmIndex >= SIM_AdapterCount)
+        return MDR_INVALID_HSM_INDEX;
+
+    if (!pState)
+        return MDR_INVALID_PARAMETER;
+
+    pAdapter = &SIM_Adapters[hsmIndex];
+    simQueryDelay(pAdapter);
+
+    pthread_mutex_lock(&pAdapter->lock);
+    *pState = pAdapter->cfg.state;
+    pthread_mutex_unlock(&pAdapter->lock);
+
+    if (pErrorCode)
+        *pErrorCode = 0;
+
+    return MDR_OK;
+}
+
+MD_RV MD_SendReceive(uint32_t hsmIndex,
+    uint32_t originatorId,
+    uint16_t fmNumber,
+    MD_Buffer_t *pReq,
+    uint32_t timeout,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    uint32_t *pFmStatus)
+{
+    MD_RV mdResult = MDR_OK;
+    SIM_ADAPTER *pAdapter;
+    SIM_ADAPTER_CONFIG cfg;
+    double serviceUsec;
+    double chargeUsec = 0;
+    uint32_t recvlen = 0;
+    uint32_t fmStatus = 0;
+    bool fail;
+
+    struct timespec deadlineTs;
+    uint64_t deadline = 0;
+    uint64_t now;
+    bool timedOut = false;
+
+    (void)originatorId;
+
+    // timeout is in msec, 0 waits for ever.  A command still queued when
+    // it expires is dropped; one being serviced is abandoned by the
+    // adapter at that point and its reply discarded.
+    if (timeout)
+    {
+        deadline = wldNowNsec() + (uint64_t)timeout * 1000000ULL;
+        deadlineTs.tv_sec = (time_t)(deadline / 1000000000ULL);
+        deadlineTs.tv_nsec = (long)(deadline % 1000000000ULL);
+    }
+
+    if (!MD_Initialized)
+        return MDR_INTERNAL_ERROR;
+
+    if (hsmIndex >= SIM_AdapterCount)
+        return MDR_INVALID_HSM_INDEX;
+
+    if (!pReq || !pReceivedLen || !pFmStatus)
+        return MDR_INVALID_PARAMETER;
+
+    if (!SIM_FM_IsRegistered(fmNumber))
+        return MDR_INVALID_PARAMETER;
+
+    pAdapter = &SIM_Adapters[hsmIndex];
+
+    // Wait for a free server, or reject if the adapter queue is full
+    pthread_mutex_lock(&pAdapter->lock);
+    if (pAdapter->cfg.state != S_NORMAL_OPERATION)
+    {
+        pAdapter->stats.failed++;
+        pthread_mutex_unlock(&pAdapter->lock);
+        return MDR_UNSUCCESSFUL;
+    }
+
+    if (pAdapter->busy >= pAdapter->cfg.servers)
+    {
+        if (pAdapter->waiting >= pAdapter->cfg.queueDepth)
+        {
+            pAdapter->stats.rejected++;
+            pthread_mutex_unlock(&pAdapter->lock);
+            return MDR_INSUFFICIENT_RESOURCE;
+        }
+
+        pAdapter->waiting++;
+        while (pAdapter->busy >= pAdapter->cfg.servers && !timedOut)
+        {
+            if (!deadline)
+                pthread_cond_wait(&pAdapter->ready, &pAdapter->lock);
+            else if (pthread_cond_timedwait(&pAdapter->ready, &pAdapter->lock, &deadlineTs) == ETIMEDOUT)
+                timedOut = (pAdapter->busy >= pAdapter->cfg.servers);
+        }
+        pAdapter->waiting--;
+
+        if (timedOut)
+        {
+            pAdapter->stats.timedOut++;
+            pthread_mutex_unlock(&pAdapter->lock);
+            return MDR_UNSUCCESSFUL;
+        }
+    }
+    pAdapter->busy++;
+    cfg = pAdapter->cfg;
+    pthread_mutex_unlock(&pAdapter->lock);
+
+    serviceUsec = simServiceTime(&cfg);
+    fail = (cfg.failRate > 0 && simRandom() <= cfg.failRate);
+
+    if (!fail)
+        fmStatus = SIM_FM_Dispatch(hsmIndex, pReq, pResp, &recvlen, &chargeUsec);
+
+    // Model the time the adapter spends on this command
+    serviceUsec += chargeUsec * cfg.slowFactor;
+    if (deadline)
+    {
+        now = wldNowNsec();
+        if (now + (uint64_t)(serviceUsec * 1000.0) > deadline)
+        {
+            serviceUsec = (double)(deadline > now ? deadline - now : 0) / 1000.0;
+            timedOut = true;
+        }
+    }
+    simSleepUsec(serviceUsec);
+
+    pthread_mutex_lock(&pAdapter->lock);
+    pAdapter->busy--;
+    if (fail)
+        pAdapter->stats.failed++;
+    else
+        pAdapter->stats.served++;
+    if (timedOut)
+        pAdapter->stats.timedOut++;
+    pthread_cond_signal(&pAdapter->ready);
+    pthread_mutex_unlock(&pAdapter->lock);
+
+    if (fail || timedOut)
+    {
+        mdResult = MDR_UNSUCCESSFUL;
+    }
+    else
+    {
+        *pReceivedLen = recvlen;
+        *pFmStatus = fmStatus;
+    }
+
+    return mdResult;
+}
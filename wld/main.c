@@ -16,12 +16,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/stat.h>
 #include "cryptoki_v2.h"
 #include <stdbool.h>
-#include "fm/common/fm_byteorder.h"
 
 #include "md.h"
 #include "wld.h"
+#include "wld_fm.h"
+#include "wld_msg.h"
+#include "wld_session.h"
+#include "wld_time.h"
+#include "wld_random.h"
 
 void*                           LibHandle = NULL;
 CK_FUNCTION_LIST*               P11Functions = NULL;
@@ -96,6 +105,29 @@ CK_BBOOL LoadP11Functions()
     return myRC;
 }
 
+/*
+    MD_RV SendVerifyCmd()
+
+    Build the key verify command for the sample FM and send it to the
+    adapter of slotID, returning the FM status in pFmStatus.  A verify
+    only reads, so its result may come from the WLD result cache (see
+    WLD_CACHE).
+*/
+static MD_RV SendVerifyCmd(uint32_t slotID, uint32_t embeddedSlotID, uint32_t hKey, uint32_t *pFmStatus)
+{
+    WLD_MSG *pMsg = BeginWLDMessage();
+    WLD_MSG_VERIFY verify;
+
+    verify.embeddedSlot = embeddedSlotID;
+    verify.hKey = hKey;
+
+    if (!WLD_MSG_VERIFY_Append(pMsg, &verify))
+        return MDR_INSUFFICIENT_RESOURCE;
+
+    return SendWLDCachedMessageToFM(slotID, FM_NUMBER_CUSTOM_FM, pMsg->request, 0,
+        pMsg->reply, &pMsg->replyLen, pFmStatus);
+}
+
 /*
     WLD_RV SendCmdToFm()
 
@@ -106,37 +138,9 @@ CK_BBOOL LoadP11Functions()
 WLD_RV SendCmdToFM(uint32_t slotID, uint32_t embeddedSlotID, uint32_t hKey, int *fmErr)
 {
     MD_RV mdResult = MDR_UNSUCCESSFUL;
-    MD_Buffer_t request[3];
-    MD_Buffer_t reply;
-
     uint32_t appState = 0;
-    uint32_t recvlen = 0;
-    uint32_t eSlot = embeddedSlotID;
-    uint32_t hkey = hKey;
-
-    // Set the Request buffers
-    eSlot = fm_htobe32(eSlot);
-    request[0].pData = (uint8_t *)&eSlot;
-    request[0].length = sizeof(eSlot);
-
-    hkey = fm_htobe32(hkey);
-    request[1].pData = (uint8_t *)&hkey;
-    request[1].length = sizeof(hkey);
-
-    request[2].pData = NULL;
-    request[2].length = 0;
-
-    // And the reply buffer
-    reply.pData = NULL;
-    reply.length = 0;
-
-    mdResult = SendWLDMessageToFM(slotID,
-        FM_NUMBER_CUSTOM_FM,
-        request,
-        0,
-        &reply,
-        &recvlen,
-        &appState);
+
+    mdResult = SendVerifyCmd(slotID, embeddedSlotID, hKey, &appState);
 
     if (mdResult != MDR_OK)
     {
@@ -154,9 +158,11 @@ WLD_RV SendCmdToFM(uint32_t slotID, uint32_t embeddedSlotID, uint32_t hKey, int
 /*
     CK_RV PerformFMFunction()
 
-    This function demonstrates the use of the GetWLDSlotID() function and
+    This function demonstrates the use of the GetWLDSession() function and
     how to respond to and error back from the SendWLDMessageToFM() function.
-    (See the SendCmdToFM function above.)
+    (See the SendCmdToFM function above.)  GetWLDSession picks the slot with
+    GetWLDSlotID() and hands back a logged in session and the key handle
+    from the per slot pool, so no PKCS#11 calls are made on the fast path.
 */
 
 CK_RV PerformFMFunction(int *fmErr)
@@ -164,68 +170,568 @@ CK_RV PerformFMFunction(int *fmErr)
     CK_RV rv = CKR_OK;
     WLD_RV wldErr = WLDR_OK;
     int cmdErr = 0;
-    uint32_t slotID = WLD_NO_SLOT_ID, embeddedSlotID;
-    CK_OBJECT_HANDLE hObject;
-    CK_SESSION_HANDLE hSession;
-    CK_CHAR myAESKey[] = "MyAESKey";
-    CK_CHAR pswd[] = "userpin";
-    CK_ULONG retCount;
-    CK_ATTRIBUTE findAttr = {CKA_LABEL, myAESKey, sizeof(myAESKey)-1};
+    WLD_SESSION session;
 
     while (1)
     {
-        if (GetWLDSlotID(&slotID, &embeddedSlotID) == WLDR_NO_SLOT_AVAILABLE)
+        rv = GetWLDSession(WLD_NO_SLOT_ID, "MyAESKey", &session);
+        if (rv != CKR_OK)
         {
-            rv = CKR_TOKEN_NOT_PRESENT;
+            if (rv == CKR_OBJECT_HANDLE_INVALID)
+                printf("NO KEY FOUND!");
             break;
         }
         
-        printf("slotID=%d, embeddedSlotID=%d,  ", (int)slotID, (int)embeddedSlotID);
+        printf("slotID=%d, embeddedSlotID=%d,  ", (int)session.slotID, (int)session.embeddedSlotID);
+        printf("hKey=%d, ", (int)session.hObject);
+        
+        // Create FM command block and transmit
+        wldErr = SendCmdToFM(session.slotID, session.embeddedSlotID, (uint32_t)session.hObject, &cmdErr);
+        if (wldErr == WLDR_MD_CMD_ERROR)
+            rv = CKR_FUNCTION_FAILED;
+        
+        *fmErr = cmdErr;
+
+        // The FM rejecting the handle means our cached handle is stale
+        ReleaseWLDSession(&session,
+            (cmdErr == (int)CKR_OBJECT_HANDLE_INVALID) ? CKR_OBJECT_HANDLE_INVALID : rv);
 
-        rv = P11Functions->C_OpenSession(slotID, CKF_RW_SESSION | CKF_SERIAL_SESSION,
-            NULL, NULL, &hSession);
+        // Command was sent successfully to FM - break from loop
         if (rv == CKR_OK)
+            break;
+    }
+
+    return rv;
+}
+
+/*
+    Load generation mode
+
+    wldapp -L runs a number of threads against the WLD layer for a fixed
+    time and reports what it sustained.  In closed loop mode (the
+    default) each thread sends its next request as soon as the previous
+    one completes.  In open loop mode (-r) requests are started on a
+    fixed schedule at the target rate and latency is measured from the
+    scheduled start, so a stalled adapter shows up in the latency
+    instead of silently lowering the request rate (coordinated
+    omission).
+*/
+
+#define LOAD_ROUTE_SLOT 0           // key verify on a slot from GetWLDSession
+#define LOAD_ROUTE_ANY  100         // FM ping sent with WLD_NO_SLOT_ID
+
+typedef struct LOAD_CONFIG {
+    uint32_t threads;
+    double rate;                    // total requests/sec, 0 = closed loop
+    uint32_t warmup;
+    uint32_t duration;
+    uint32_t anyPercent;            // share of requests routed with WLD_NO_SLOT_ID
+    uint32_t sessionsPerSlot;
+    const char *pOutFile;
+    bool csv;
+} LOAD_CONFIG;
+
+typedef struct LOAD_THREAD {
+    pthread_t thread;
+    uint32_t id;
+    uint64_t *pLatency;
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t anyCount;
+    uint64_t mdErrors;
+    uint64_t fmErrors;
+    uint64_t p11Errors;
+} LOAD_THREAD;
+
+static LOAD_CONFIG LoadCfg;
+static volatile int loadStop = 0;
+static volatile int loadRecording = 0;
+
+static void loadSleepUntil(uint64_t nsec)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(nsec / 1000000000ULL);
+    ts.tv_nsec = (long)(nsec % 1000000000ULL);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+        ;
+}
+
+static void loadRecordLatency(LOAD_THREAD *pThread, uint64_t nsec)
+{
+    uint64_t *pNew;
+    uint64_t capacity;
+
+    if (pThread->count == pThread->capacity)
+    {
+        capacity = pThread->capacity ? pThread->capacity * 2 : 65536;
+        pNew = realloc(pThread->pLatency, capacity * sizeof(uint64_t));
+        if (!pNew)
+            return;
+        pThread->pLatency = pNew;
+        pThread->capacity = capacity;
+    }
+
+    pThread->pLatency[pThread->count++] = nsec;
+}
+
+// Send an FM ping and let the WLD pick (and fail over) the slot
+static MD_RV loadSendPing(uint32_t *pFmStatus)
+{
+    WLD_MSG *pMsg = BeginWLDMessage();
+    WLD_MSG_PING ping = { WLD_FM_PING_MAGIC };
+
+    if (!WLD_MSG_PING_Append(pMsg, &ping))
+        return MDR_INSUFFICIENT_RESOURCE;
+
+    return SendWLDMessage(pMsg, WLD_NO_SLOT_ID, FM_NUMBER_CUSTOM_FM, 0, pFmStatus);
+}
+
+// Run one request and account for it
+static void loadOneRequest(LOAD_THREAD *pThread, uint64_t start, int recording)
+{
+    WLD_SESSION session;
+    uint32_t fmStatus = 0;
+    MD_RV mdResult;
+    CK_RV rv;
+    bool any;
+
+    // Decide the routing of this iteration
+    any = (wldRandom() % 100) < LoadCfg.anyPercent;
+
+    if (any)
+        mdResult = loadSendPing(&fmStatus);
+    else
+    {
+        rv = GetWLDSession(WLD_NO_SLOT_ID, "MyAESKey", &session);
+        if (rv != CKR_OK)
         {
-            rv = P11Functions->C_Login(hSession, CKU_CRYPTO_OFFICER, pswd, sizeof(pswd)-1);
-            if (rv != CKR_OK)
-                break;
+            if (recording)
+                pThread->p11Errors++;
+            return;
+        }
+
+        mdResult = SendVerifyCmd(session.slotID, session.embeddedSlotID,
+            (uint32_t)session.hObject, &fmStatus);
+
+        ReleaseWLDSession(&session,
+            (mdResult == MDR_OK && fmStatus == CKR_OBJECT_HANDLE_INVALID) ? CKR_OBJECT_HANDLE_INVALID : CKR_OK);
+    }
+
+    if (!recording)
+        return;
+
+    if (any)
+        pThread->anyCount++;
+    if (mdResult != MDR_OK)
+        pThread->mdErrors++;
+    else if (fmStatus != 0)
+        pThread->fmErrors++;
+
+    loadRecordLatency(pThread, wldNowNsec() - start);
+}
+
+static void *loadWorker(void *pArg)
+{
+    LOAD_THREAD *pThread = (LOAD_THREAD *)pArg;
+    uint64_t interval = 0;
+    uint64_t next;
+
+    // Open loop: every thread owns an equal share of the schedule,
+    // offset so that the threads do not start in step
+    if (LoadCfg.rate > 0)
+        interval = (uint64_t)(1e9 * LoadCfg.threads / LoadCfg.rate);
+    next = wldNowNsec() + interval * pThread->id / LoadCfg.threads;
+
+    while (!loadStop)
+    {
+        if (interval)
+        {
+            loadSleepUntil(next);
+            loadOneRequest(pThread, next, loadRecording);
+            next += interval;
         }
         else
+            loadOneRequest(pThread, wldNowNsec(), loadRecording);
+    }
+
+    return NULL;
+}
+
+static int loadCompareU64(const void *pA, const void *pB)
+{
+    uint64_t a = *(const uint64_t *)pA;
+    uint64_t b = *(const uint64_t *)pB;
+
+    return (a > b) - (a < b);
+}
+
+static double loadPercentileUsec(const uint64_t *pSorted, uint64_t count, double pct)
+{
+    uint64_t index;
+
+    if (count == 0)
+        return 0.0;
+
+    index = (uint64_t)((pct / 100.0) * (double)(count - 1) + 0.5);
+    return (double)pSorted[index] / 1000.0;
+}
+
+// Requests per adapter between two statistics snapshots
+static uint64_t loadAdapterDelta(const WLD_STATS *pBefore, const WLD_STATS *pAfter, uint32_t i)
+{
+    uint32_t j;
+
+    for (j=0; pBefore && j < pBefore->adapterCount; j++)
+    {
+        if (pBefore->pAdapters[j].hsmID == pAfter->pAdapters[i].hsmID)
+            return pAfter->pAdapters[i].requests - pBefore->pAdapters[j].requests;
+    }
+
+    return pAfter->pAdapters[i].requests;
+}
+
+// Write the results as one JSON object, or append one CSV row (with a
+// header if the file is new) so runs can be tracked across releases
+static void loadWriteResults(FILE *pFile, const uint64_t *pAll, uint64_t total,
+    uint64_t anyCount, uint64_t errors, double elapsed,
+    const WLD_STATS *pBefore, const WLD_STATS *pAfter, bool header)
+{
+    const double pcts[] = {50.0, 90.0, 99.0, 99.9};
+    const char *names[] = {"p50", "p90", "p99", "p999"};
+    uint32_t i;
+
+    if (LoadCfg.csv)
+    {
+        if (header)
+        {
+            fprintf(pFile, "threads,mode,target_rate,duration_s,any_pct,requests,errors,throughput");
+            for (i=0; i < 4; i++)
+                fprintf(pFile, ",%s_us", names[i]);
+            fprintf(pFile, ",max_us");
+            for (i=0; pAfter && i < pAfter->adapterCount; i++)
+                fprintf(pFile, ",hsm%u_requests", pAfter->pAdapters[i].hsmID);
+            fprintf(pFile, "\n");
+        }
+
+        fprintf(pFile, "%u,%s,%.1f,%.3f,%u,%llu,%llu,%.1f",
+            LoadCfg.threads, LoadCfg.rate > 0 ? "open" : "closed", LoadCfg.rate,
+            elapsed, LoadCfg.anyPercent, (unsigned long long)total,
+            (unsigned long long)errors, (double)total / elapsed);
+        for (i=0; i < 4; i++)
+            fprintf(pFile, ",%.1f", loadPercentileUsec(pAll, total, pcts[i]));
+        fprintf(pFile, ",%.1f", total ? (double)pAll[total - 1] / 1000.0 : 0.0);
+        for (i=0; pAfter && i < pAfter->adapterCount; i++)
+            fprintf(pFile, ",%llu", (unsigned long long)loadAdapterDelta(pBefore, pAfter, i));
+        fprintf(pFile, "\n");
+        return;
+    }
+
+    fprintf(pFile, "{\"threads\":%u,\"mode\":\"%s\",\"target_rate\":%.1f,\"duration_s\":%.3f,"
+        "\"any_pct\":%u,\"requests\":%llu,\"any_requests\":%llu,\"errors\":%llu,\"throughput\":%.1f,"
+        "\"latency_us\":{",
+        LoadCfg.threads, LoadCfg.rate > 0 ? "open" : "closed", LoadCfg.rate, elapsed,
+        LoadCfg.anyPercent, (unsigned long long)total, (unsigned long long)anyCount,
+        (unsigned long long)errors, (double)total / elapsed);
+    for (i=0; i < 4; i++)
+        fprintf(pFile, "\"%s\":%.1f,", names[i], loadPercentileUsec(pAll, total, pcts[i]));
+    fprintf(pFile, "\"max\":%.1f},\"adapters\":[", total ? (double)pAll[total - 1] / 1000.0 : 0.0);
+    for (i=0; pAfter && i < pAfter->adapterCount; i++)
+        fprintf(pFile, "%s{\"hsm\":%u,\"requests\":%llu}", i ? "," : "",
+            pAfter->pAdapters[i].hsmID, (unsigned long long)loadAdapterDelta(pBefore, pAfter, i));
+    fprintf(pFile, "]}\n");
+}
+
+/*
+    int RunLoad()
+
+    Run the load generator configured in LoadCfg and report the results
+*/
+static int RunLoad(void)
+{
+    LOAD_THREAD *pThreads;
+    WLD_STATS *pBefore = NULL;
+    WLD_STATS *pAfter = NULL;
+    uint64_t *pAll = NULL;
+    uint64_t total = 0, anyCount = 0, mdErrors = 0, fmErrors = 0, p11Errors = 0;
+    uint64_t startNs = 0, endNs = 0, adapterTotal = 0;
+    uint32_t started;
+    uint32_t i;
+    double elapsed;
+    FILE *pFile;
+    bool header;
+    int rc = -1;
+
+    pThreads = calloc(LoadCfg.threads, sizeof(LOAD_THREAD));
+    if (!pThreads)
+        return -1;
+
+    printf("\nLoad: threads=%u, %s", LoadCfg.threads, LoadCfg.rate > 0 ? "open loop" : "closed loop");
+    if (LoadCfg.rate > 0)
+        printf(" at %.1f req/s", LoadCfg.rate);
+    printf(", warm-up=%us, duration=%us, WLD_NO_SLOT_ID share=%u%%\n",
+        LoadCfg.warmup, LoadCfg.duration, LoadCfg.anyPercent);
+
+    for (started=0; started < LoadCfg.threads; started++)
+    {
+        pThreads[started].id = started;
+        if (pthread_create(&pThreads[started].thread, NULL, loadWorker, &pThreads[started]) != 0)
+        {
+            printf("Failed to create load thread %u\n", started);
+            loadStop = 1;
             break;
+        }
+    }
 
-        // Retrieve the encryption key handle on this slot
-        rv = P11Functions->C_FindObjectsInit(hSession, &findAttr, 1);
-        if (rv == CKR_OK)
+    if (!loadStop)
+    {
+        sleep(LoadCfg.warmup);
+
+        (void)GetWLDStats(&pBefore);
+        startNs = wldNowNsec();
+        loadRecording = 1;
+        sleep(LoadCfg.duration);
+        loadRecording = 0;
+        endNs = wldNowNsec();
+        (void)GetWLDStats(&pAfter);
+        loadStop = 1;
+    }
+
+    for (i=0; i < started; i++)
+        pthread_join(pThreads[i].thread, NULL);
+
+    if (endNs == 0)
+        goto doneLoad;
+
+    for (i=0; i < started; i++)
+    {
+        total += pThreads[i].count;
+        anyCount += pThreads[i].anyCount;
+        mdErrors += pThreads[i].mdErrors;
+        fmErrors += pThreads[i].fmErrors;
+        p11Errors += pThreads[i].p11Errors;
+    }
+
+    pAll = malloc((total ? total : 1) * sizeof(uint64_t));
+    if (!pAll)
+        goto doneLoad;
+
+    total = 0;
+    for (i=0; i < started; i++)
+    {
+        memcpy(pAll + total, pThreads[i].pLatency, pThreads[i].count * sizeof(uint64_t));
+        total += pThreads[i].count;
+    }
+    qsort(pAll, total, sizeof(uint64_t), loadCompareU64);
+
+    elapsed = (double)(endNs - startNs) / 1e9;
+
+    printf("\nrequests=%llu (WLD_NO_SLOT_ID=%llu), md errors=%llu, fm errors=%llu, session errors=%llu\n",
+        (unsigned long long)total, (unsigned long long)anyCount, (unsigned long long)mdErrors,
+        (unsigned long long)fmErrors, (unsigned long long)p11Errors);
+    printf("throughput=%.1f req/s\n", (double)total / elapsed);
+    printf("latency usec: p50=%.1f, p90=%.1f, p99=%.1f, p999=%.1f, max=%.1f\n",
+        loadPercentileUsec(pAll, total, 50.0),
+        loadPercentileUsec(pAll, total, 90.0),
+        loadPercentileUsec(pAll, total, 99.0),
+        loadPercentileUsec(pAll, total, 99.9),
+        total ? (double)pAll[total - 1] / 1000.0 : 0.0);
+
+    for (i=0; pAfter && i < pAfter->adapterCount; i++)
+        adapterTotal += loadAdapterDelta(pBefore, pAfter, i);
+    for (i=0; pAfter && i < pAfter->adapterCount; i++)
+    {
+        printf("adapter %u: requests=%llu (%.1f%%)\n", pAfter->pAdapters[i].hsmID,
+            (unsigned long long)loadAdapterDelta(pBefore, pAfter, i),
+            adapterTotal ? 100.0 * (double)loadAdapterDelta(pBefore, pAfter, i) / (double)adapterTotal : 0.0);
+    }
+
+    if (LoadCfg.pOutFile)
+    {
+        pFile = fopen(LoadCfg.pOutFile, LoadCfg.csv ? "a" : "w");
+        if (!pFile)
+            printf("Failed to open %s\n", LoadCfg.pOutFile);
+        else
         {
-            rv = P11Functions->C_FindObjects(hSession, &hObject, 1, &retCount);
-            if (rv != CKR_OK || retCount != 1)
-            {
-                if (retCount != 1)
-                {
-                    printf("NO KEY FOUND!");
-                    rv = CKR_OBJECT_HANDLE_INVALID;
-                }
+            header = LoadCfg.csv && ftell(pFile) == 0;
+            loadWriteResults(pFile, pAll, total, anyCount, mdErrors + fmErrors + p11Errors,
+                elapsed, pBefore, pAfter, header);
+            fclose(pFile);
+        }
+    }
+
+    rc = 0;
+
+doneLoad:
+
+    for (i=0; i < started; i++)
+        free(pThreads[i].pLatency);
+    free(pThreads);
+    free(pAll);
+    FreeWLDStats(pBefore);
+    FreeWLDStats(pAfter);
+
+    return rc;
+}
+
+static void LoadUsage(void)
+{
+    printf("\nUsage: wldapp <#iterations>\n");
+    printf("       wldapp -L [options]\n\n");
+    printf("  -L              load generation mode\n");
+    printf("  -t <n>          threads (default 8)\n");
+    printf("  -r <req/s>      open loop at this total rate (default closed loop)\n");
+    printf("  -w <sec>        warm-up (default 2)\n");
+    printf("  -d <sec>        measured duration (default 10)\n");
+    printf("  -m <route>      slot (key verify on an explicit slot), any (FM ping\n");
+    printf("                  with WLD_NO_SLOT_ID) or mix:<pct any> (default slot)\n");
+    printf("  -s <n>          sessions per slot (default: threads)\n");
+    printf("  -o <file>       also write the results to file\n");
+    printf("  -f <fmt>        results file format: json (default) or csv (appended)\n");
+}
+
+// Parse the load generation options into LoadCfg
+static bool ParseLoadOptions(int argc, char *argv[])
+{
+    int opt;
+
+    memset(&LoadCfg, 0, sizeof(LoadCfg));
+    LoadCfg.threads = 8;
+    LoadCfg.warmup = 2;
+    LoadCfg.duration = 10;
+    LoadCfg.anyPercent = LOAD_ROUTE_SLOT;
+
+    while ((opt = getopt(argc, argv, "Lt:r:w:d:m:s:o:f:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'L': break;
+            case 't': LoadCfg.threads = (uint32_t)atoi(optarg); break;
+            case 'r': LoadCfg.rate = atof(optarg); break;
+            case 'w': LoadCfg.warmup = (uint32_t)atoi(optarg); break;
+            case 'd': LoadCfg.duration = (uint32_t)atoi(optarg); break;
+            case 's': LoadCfg.sessionsPerSlot = (uint32_t)atoi(optarg); break;
+            case 'o': LoadCfg.pOutFile = optarg; break;
+            case 'f':
+                if (strcmp(optarg, "csv") == 0)
+                    LoadCfg.csv = true;
+                else if (strcmp(optarg, "json") != 0)
+                    return false;
+                break;
+            case 'm':
+                if (strcmp(optarg, "slot") == 0)
+                    LoadCfg.anyPercent = LOAD_ROUTE_SLOT;
+                else if (strcmp(optarg, "any") == 0)
+                    LoadCfg.anyPercent = LOAD_ROUTE_ANY;
+                else if (strncmp(optarg, "mix:", 4) == 0 && atoi(optarg + 4) >= 0 && atoi(optarg + 4) <= 100)
+                    LoadCfg.anyPercent = (uint32_t)atoi(optarg + 4);
+                else
+                    return false;
                 break;
-            }
+            default:
+                return false;
         }
+    }
 
-        printf("hKey=%d, ", (int)hObject);
-        
-        // Create FM command block and transmit
-        wldErr = SendCmdToFM(slotID, embeddedSlotID, (uint32_t)hObject, &cmdErr);
-        if (wldErr == WLDR_MD_CMD_ERROR)
-            rv = CKR_FUNCTION_FAILED;
-        
-        *fmErr = cmdErr;
+    if (LoadCfg.threads == 0 || LoadCfg.duration == 0 || LoadCfg.rate < 0)
+        return false;
 
-        (void) P11Functions->C_CloseSession(hSession);
+    if (LoadCfg.sessionsPerSlot == 0)
+        LoadCfg.sessionsPerSlot = LoadCfg.threads;
 
-        // Command was sent successfully to FM - break from loop
-        if (rv == CKR_OK)
-            break;
+    return true;
+}
+
+/*
+    Slot list reload
+
+    SIGHUP, or a change to the file named by WLD_SLOT_FILE, makes the
+    watcher thread call ReconfigureWLD, so slots can be added, removed
+    or reweighted without restarting.
+*/
+
+// How often the watcher looks for a reload request
+#define WATCH_POLL_MSEC 200
+
+static volatile sig_atomic_t reloadRequested = 0;
+static volatile int watchStop = 0;
+static pthread_t watchThread;
+static bool watchRunning = false;
+
+static void onSighup(int sig)
+{
+    (void)sig;
+    reloadRequested = 1;
+}
+
+static void *watchSlotList(void *pArg)
+{
+    const char *pPath = getenv("WLD_SLOT_FILE");
+    const struct timespec poll = { 0, WATCH_POLL_MSEC * 1000000L };
+    struct timespec lastChange = { 0, 0 };
+    struct stat st;
+    WLD_RV wldErr;
+    bool reload;
+
+    (void)pArg;
+
+    if (pPath && stat(pPath, &st) == 0)
+        lastChange = st.st_mtim;
+
+    while (!watchStop)
+    {
+        nanosleep(&poll, NULL);
+
+        reload = false;
+        if (pPath && stat(pPath, &st) == 0 &&
+            (st.st_mtim.tv_sec != lastChange.tv_sec || st.st_mtim.tv_nsec != lastChange.tv_nsec))
+        {
+            lastChange = st.st_mtim;
+            reload = true;
+        }
+        if (reloadRequested)
+        {
+            reloadRequested = 0;
+            reload = true;
+        }
+        if (!reload)
+            continue;
+
+        wldErr = ReconfigureWLD(NULL, NULL, 0);
+        if (wldErr == WLDR_OK)
+            printf("\nWLD slot list reloaded\n");
+        else
+            printf("\nERROR: Failed to reload the WLD slot list - wldErr=%d \n", (int)wldErr);
     }
 
-    return rv;
+    return NULL;
+}
+
+// Install the SIGHUP handler and start the watcher thread
+static void StartSlotListWatch(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onSighup;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    (void)sigaction(SIGHUP, &sa, NULL);
+
+    watchStop = 0;
+    watchRunning = (pthread_create(&watchThread, NULL, watchSlotList, NULL) == 0);
+    if (!watchRunning)
+        printf("\nWARNING: slot list reload is not available\n");
+}
+
+static void StopSlotListWatch(void)
+{
+    if (!watchRunning)
+        return;
+
+    watchStop = 1;
+    pthread_join(watchThread, NULL);
+    watchRunning = false;
 }
 
 /*
@@ -241,6 +747,8 @@ int main(int argc, char* argv[])
     WLD_RV wldErr;
     MD_RV mdErr;
     CK_ULONG iterations = 20;
+    CK_CHAR pswd[] = "userpin";
+    bool loadMode = false;
     int fmErr;
     int i;
 
@@ -252,9 +760,18 @@ int main(int argc, char* argv[])
 
     if (argc < 2)
     {
-        printf("\nUsage: fmtest <#iterations>\n");
+        LoadUsage();
         goto doneMain;
     }
+    else if (argv[1][0] == '-')
+    {
+        loadMode = true;
+        if (!ParseLoadOptions(argc, argv))
+        {
+            LoadUsage();
+            goto doneMain;
+        }
+    }
     else
         iterations = (CK_ULONG)atoi(argv[1]);
 
@@ -270,6 +787,28 @@ int main(int argc, char* argv[])
         printf("\nERROR: No FM Slots and/or Adapters available - wldErr=%d \n", (int)wldErr);
         goto doneMain;
     }
+    if (wldErr == WLDR_INVALID_PARAMETER)
+    {
+        printf("\nERROR: Invalid WLD slot list - wldErr=%d \n", (int)wldErr);
+        goto doneMain;
+    }
+
+    StartSlotListWatch();
+
+    // Pool of logged in sessions per WLD slot
+    wldErr = InitializeWLDSessionPool(P11Functions, CKU_CRYPTO_OFFICER, pswd, sizeof(pswd)-1,
+        loadMode ? LoadCfg.sessionsPerSlot : 0);
+    if (wldErr != WLDR_OK)
+    {
+        printf("\nERROR: Failed to set up the session pool - wldErr=%d \n", (int)wldErr);
+        goto doneMain;
+    }
+
+    if (loadMode)
+    {
+        rc = RunLoad();
+        goto doneMain;
+    }
 
     printf("\nStarting %d iterations of special FM function:\n", (int)iterations);
 
@@ -287,6 +826,11 @@ doneMain:
 
     printf("\nAll done!\n");
 
+    StopSlotListWatch();
+    FinalizeWLDSessionPool();
+    StopWLDHealthMonitor();
+    StopWLDTrace();
+
     if (P11Functions)
     {
         P11Functions->C_Finalize(NULL_PTR);
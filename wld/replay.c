@@ -0,0 +1,439 @@
+/*
+    replay.c
+
+    wldreplay: send a request trace recorded by StartWLDTrace (or the
+    WLD_TRACE environment variable) again, at the pace it was recorded
+    or scaled up or down, and compare the latencies with the recorded
+    ones.  Each call is sent when it is due, by whichever worker thread
+    is free, so a cluster that cannot keep up shows as calls sent late
+    rather than as a slower replay.  Calls are replayed as FM pings of
+    the recorded request size to the recorded FM, on the recorded slot
+    or (-u) on any slot.
+
+    Built in wld/ it runs against the adapters of WLD_SLOT_LIST or
+    WLD_SLOT_FILE.  Built in sim/ (WLD_REPLAY_SIM) it runs against the
+    simulated backend, whose adapters are set up on the command line,
+    so a trace taken on four adapters can be replayed on six.  This
+    code is sample ONLY and Thales Inc. assumes no liability or
+    responsibility for its correct operation.
+*/
+
+#undef UNICODE
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "md.h"
+#include "wld.h"
+#include "wld_fm.h"
+#include "wld_msg.h"
+#include "wld_time.h"
+#ifdef WLD_REPLAY_SIM
+#include "sim.h"
+#endif
+
+// Calls sent later than this after they were due are counted as late
+#define REPLAY_LATE_NSEC                1000000ULL
+
+typedef struct REPLAY_RESULT {
+    uint32_t latencyNsec;
+    uint32_t lagUsec;                   // how late the call was sent
+    uint32_t mdResult;
+    uint32_t fmStatus;
+} REPLAY_RESULT;
+
+static WLD_TRACE_RECORD *pRecords = NULL;
+static REPLAY_RESULT *pResults = NULL;
+static uint64_t replayCount = 0;
+static _Atomic uint64_t replayNext = 0;
+static uint64_t replayStartNsec = 0;
+static uint32_t replayRequestLen = 4;
+static double replayScale = 1.0;
+static bool replayAnySlot = false;
+static uint32_t replayTimeout = 0;
+
+static void usage(void)
+{
+    printf("\nUsage: wldreplay [options] <trace file>\n");
+    printf("  -r <x>          replay x times as fast as recorded (default 1)\n");
+    printf("  -t <n>          worker threads (default 64)\n");
+    printf("  -u              send every call to any slot, not the slot it was recorded on\n");
+    printf("  -T <msec>       timeout of each call (default none)\n");
+#ifdef WLD_REPLAY_SIM
+    printf("  -a <n>          simulated adapters (default 4)\n");
+    printf("  -p <n>          partitions per adapter (default 1)\n");
+    printf("  -s <dist>       service time: fixed:U, uniform:U:S, exp:U, lognormal:U:SIGMA\n");
+    printf("                  in usec (default exp:200)\n");
+    printf("  -c <n>          commands serviced concurrently per adapter (default 4)\n");
+    printf("  -q <n>          queue depth per adapter (default 256)\n");
+#endif
+}
+
+static int compareTime(const void *a, const void *b)
+{
+    uint64_t x = ((const WLD_TRACE_RECORD *)a)->timeNsec;
+    uint64_t y = ((const WLD_TRACE_RECORD *)b)->timeNsec;
+
+    return (x > y) - (x < y);
+}
+
+static int compareU32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Read a trace into pRecords, in time order.  A trace that was not
+// stopped has no record count; its written records are flagged.
+static bool loadTrace(const char *pPath, WLD_TRACE_HEADER *pHeader)
+{
+    const WLD_TRACE_RECORD *pFileRecords;
+    struct stat st;
+    uint8_t *pMap;
+    uint64_t fileRecords;
+    uint64_t i;
+    int fd;
+
+    fd = open(pPath, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(WLD_TRACE_HEADER))
+    {
+        printf("Cannot read the trace '%s'\n", pPath);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    pMap = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pMap == MAP_FAILED)
+    {
+        printf("Cannot map the trace '%s' - %s\n", pPath, strerror(errno));
+        return false;
+    }
+
+    memcpy(pHeader, pMap, sizeof(WLD_TRACE_HEADER));
+    if (memcmp(pHeader->magic, WLD_TRACE_MAGIC, sizeof(pHeader->magic)) != 0 ||
+        pHeader->version != WLD_TRACE_VERSION || pHeader->recordSize != sizeof(WLD_TRACE_RECORD))
+    {
+        printf("'%s' is not a WLD trace of this version\n", pPath);
+        munmap(pMap, (size_t)st.st_size);
+        return false;
+    }
+
+    fileRecords = ((uint64_t)st.st_size - sizeof(WLD_TRACE_HEADER)) / sizeof(WLD_TRACE_RECORD);
+    if (pHeader->records && pHeader->records < fileRecords)
+        fileRecords = pHeader->records;
+    if (pHeader->records == 0)
+        printf("The trace was not stopped - replaying the records that were written\n");
+
+    pFileRecords = (const WLD_TRACE_RECORD *)(pMap + sizeof(WLD_TRACE_HEADER));
+    pRecords = malloc((fileRecords ? fileRecords : 1) * sizeof(WLD_TRACE_RECORD));
+    if (!pRecords)
+    {
+        munmap(pMap, (size_t)st.st_size);
+        return false;
+    }
+
+    for (i=0; i < fileRecords; i++)
+    {
+        if (pFileRecords[i].flags & WLD_TRACE_RECORDED)
+            pRecords[replayCount++] = pFileRecords[i];
+    }
+    munmap(pMap, (size_t)st.st_size);
+
+    qsort(pRecords, replayCount, sizeof(WLD_TRACE_RECORD), compareTime);
+
+    for (i=0; i < replayCount; i++)
+    {
+        if (pRecords[i].requestLen > replayRequestLen)
+            replayRequestLen = pRecords[i].requestLen;
+    }
+
+    return true;
+}
+
+static void *replayWorker(void *pArg)
+{
+    const WLD_TRACE_RECORD *pRecord;
+    REPLAY_RESULT *pResult;
+    WLD_MSG_PING ping = { WLD_FM_PING_MAGIC };
+    MD_Buffer_t request[2];
+    MD_Buffer_t reply[2];
+    uint8_t replyData[WLD_MSG_REPLY_LEN];
+    uint8_t *pRequest;
+    struct timespec pause;
+    uint64_t index;
+    uint64_t due;
+    uint64_t now;
+    uint32_t recvlen;
+    uint32_t fmStatus;
+    MD_RV mdResult;
+
+    (void)pArg;
+
+    // A ping padded to the size of the largest recorded request
+    pRequest = calloc(1, replayRequestLen);
+    if (!pRequest)
+        return NULL;
+    WLD_MSG_PING_Encode(&ping, pRequest);
+
+    reply[0].pData = replyData;
+    reply[0].length = sizeof(replyData);
+    reply[1].pData = NULL;
+    reply[1].length = 0;
+
+    while ((index = atomic_fetch_add_explicit(&replayNext, 1, memory_order_relaxed)) < replayCount)
+    {
+        pRecord = &pRecords[index];
+        pResult = &pResults[index];
+
+        due = replayStartNsec + (uint64_t)((double)pRecord->timeNsec / replayScale);
+        now = wldNowNsec();
+        if (now < due)
+        {
+            pause.tv_sec = (time_t)((due - now) / 1000000000ULL);
+            pause.tv_nsec = (long)((due - now) % 1000000000ULL);
+            nanosleep(&pause, NULL);
+            now = wldNowNsec();
+        }
+        pResult->lagUsec = now > due ? (uint32_t)((now - due) / 1000) : 0;
+
+        request[0].pData = pRequest;
+        request[0].length = pRecord->requestLen < WLD_MSG_PING_WIRE_LEN ?
+            WLD_MSG_PING_WIRE_LEN : pRecord->requestLen;
+        request[1].pData = NULL;
+        request[1].length = 0;
+        recvlen = 0;
+        fmStatus = 0;
+
+        mdResult = SendWLDMessageToFM(
+            (replayAnySlot || (pRecord->flags & WLD_TRACE_ANY_SLOT)) ? WLD_NO_SLOT_ID : pRecord->slot,
+            pRecord->fmNumber, request, replayTimeout, reply, &recvlen, &fmStatus);
+
+        now = wldNowNsec() - now;
+        pResult->latencyNsec = now < 0xFFFFFFFFULL ? (uint32_t)now : 0xFFFFFFFF;
+        pResult->mdResult = (uint32_t)mdResult;
+        pResult->fmStatus = fmStatus;
+    }
+
+    free(pRequest);
+    return NULL;
+}
+
+// Print the p50/p90/p99/p99.9/max of count values, sorted in place
+static void printPercentiles(const char *pName, uint32_t *pValues, uint64_t count, double scale)
+{
+    static const double pcts[] = { 50.0, 90.0, 99.0, 99.9 };
+    uint64_t rank;
+    uint32_t i;
+
+    printf("%-10s", pName);
+    if (count == 0)
+    {
+        printf(" -\n");
+        return;
+    }
+
+    qsort(pValues, count, sizeof(uint32_t), compareU32);
+    for (i=0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+    {
+        rank = (uint64_t)(pcts[i] / 100.0 * (double)count);
+        if (rank >= count)
+            rank = count - 1;
+        printf(" %10.1f", (double)pValues[rank] / scale);
+    }
+    printf(" %10.1f\n", (double)pValues[count - 1] / scale);
+}
+
+int main(int argc, char* argv[])
+{
+    WLD_TRACE_HEADER header;
+    WLD_STATS *pStats = NULL;
+    pthread_t *pThreads = NULL;
+    uint32_t *pValues = NULL;
+    uint64_t traceNsec, replayNsec;
+    uint64_t mdErrors = 0, fmErrors = 0, late = 0;
+    uint64_t recordedErrors = 0;
+    uint64_t i;
+    uint32_t threads = 64;
+    uint32_t started = 0;
+    WLD_RV wldErr;
+    int opt;
+    int rc = 1;
+#ifdef WLD_REPLAY_SIM
+    SIM_ADAPTER_CONFIG cfg;
+    uint32_t adapters = 4, partitions = 1;
+    uint32_t *pSlots = NULL;
+    uint32_t slot;
+
+    SIM_DefaultAdapterConfig(&cfg);
+#define REPLAY_OPTIONS "r:t:uT:a:p:s:c:q:h"
+#else
+#define REPLAY_OPTIONS "r:t:uT:h"
+#endif
+
+    while ((opt = getopt(argc, argv, REPLAY_OPTIONS)) != -1)
+    {
+        switch (opt)
+        {
+            case 'r': replayScale = atof(optarg); break;
+            case 't': threads = (uint32_t)atoi(optarg); break;
+            case 'u': replayAnySlot = true; break;
+            case 'T': replayTimeout = (uint32_t)atoi(optarg); break;
+#ifdef WLD_REPLAY_SIM
+            case 'a': adapters = (uint32_t)atoi(optarg); break;
+            case 'p': partitions = (uint32_t)atoi(optarg); break;
+            case 'c': cfg.servers = (uint32_t)atoi(optarg); break;
+            case 'q': cfg.queueDepth = (uint32_t)atoi(optarg); break;
+            case 's':
+                if (SIM_ParseDist(optarg, &cfg) != MDR_OK)
+                {
+                    printf("Invalid service time distribution: %s\n", optarg);
+                    usage();
+                    return 1;
+                }
+                break;
+#endif
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1 || replayScale <= 0 || threads == 0)
+    {
+        usage();
+        return 1;
+    }
+
+    if (!loadTrace(argv[optind], &header))
+        return 1;
+    if (replayCount == 0)
+    {
+        printf("The trace has no records\n");
+        goto doneMain;
+    }
+
+#ifdef WLD_REPLAY_SIM
+    if (SIM_Initialize(adapters, partitions, 0, &cfg) != MDR_OK)
+    {
+        printf("Invalid simulator configuration\n");
+        goto doneMain;
+    }
+#endif
+
+    if (MD_Initialize() != MDR_OK)
+    {
+        printf("MD_Initialize failed\n");
+        goto doneMain;
+    }
+
+#ifdef WLD_REPLAY_SIM
+    pSlots = calloc(SIM_GetSlotCount(), sizeof(uint32_t));
+    if (!pSlots)
+        goto doneMain;
+    for (slot=0; slot < SIM_GetSlotCount(); slot++)
+        pSlots[slot] = slot;
+    wldErr = InitializeWLD(pSlots, SIM_GetSlotCount());
+#else
+    wldErr = InitializeWLD(NULL, 0);
+#endif
+    if (wldErr != WLDR_OK)
+    {
+        printf("\nERROR: InitializeWLD failed - wldErr=%d\n", (int)wldErr);
+        goto doneMain;
+    }
+
+    pResults = calloc(replayCount, sizeof(REPLAY_RESULT));
+    pValues = malloc(replayCount * sizeof(uint32_t));
+    pThreads = calloc(threads, sizeof(pthread_t));
+    if (!pResults || !pValues || !pThreads)
+        goto doneMain;
+
+    traceNsec = pRecords[replayCount - 1].timeNsec;
+    printf("\nReplaying %llu calls recorded over %.2f sec (%.0f calls/s) at %.2fx with %u threads\n",
+        (unsigned long long)replayCount, (double)traceNsec / 1e9,
+        traceNsec ? (double)replayCount * 1e9 / (double)traceNsec : 0.0, replayScale, threads);
+    if (header.dropped)
+        printf("(%llu calls were not recorded: the trace file was full)\n", (unsigned long long)header.dropped);
+
+    replayStartNsec = wldNowNsec();
+    for (started=0; started < threads; started++)
+    {
+        if (pthread_create(&pThreads[started], NULL, replayWorker, NULL) != 0)
+            break;
+    }
+    for (i=0; i < started; i++)
+        pthread_join(pThreads[i], NULL);
+    replayNsec = wldNowNsec() - replayStartNsec;
+
+    for (i=0; i < replayCount; i++)
+    {
+        if (pRecords[i].mdResult != MDR_OK || pRecords[i].fmStatus != 0)
+            recordedErrors++;
+        if (pResults[i].mdResult != MDR_OK)
+            mdErrors++;
+        else if (pResults[i].fmStatus != 0)
+            fmErrors++;
+        if (pResults[i].lagUsec >= REPLAY_LATE_NSEC / 1000)
+            late++;
+    }
+
+    printf("replayed in %.2f sec (%.0f calls/s), md errors=%llu, fm errors=%llu (recorded: %llu errors)\n",
+        (double)replayNsec / 1e9, (double)replayCount * 1e9 / (double)replayNsec,
+        (unsigned long long)mdErrors, (unsigned long long)fmErrors, (unsigned long long)recordedErrors);
+    printf("sent more than %llu msec late: %llu (%.2f%%)\n", REPLAY_LATE_NSEC / 1000000ULL,
+        (unsigned long long)late, 100.0 * (double)late / (double)replayCount);
+
+    printf("\n%-10s %10s %10s %10s %10s %10s\n", "usec", "p50", "p90", "p99", "p99.9", "max");
+    for (i=0; i < replayCount; i++)
+        pValues[i] = pRecords[i].latencyNsec;
+    printPercentiles("recorded", pValues, replayCount, 1000.0);
+    for (i=0; i < replayCount; i++)
+        pValues[i] = pResults[i].latencyNsec;
+    printPercentiles("replayed", pValues, replayCount, 1000.0);
+    for (i=0; i < replayCount; i++)
+        pValues[i] = pResults[i].lagUsec;
+    printPercentiles("late by", pValues, replayCount, 1.0);
+
+    if (GetWLDStats(&pStats) == WLDR_OK)
+    {
+        printf("\n%-8s %12s %12s\n", "adapter", "calls", "mean usec");
+        for (i=0; i < pStats->adapterCount; i++)
+        {
+            printf("%-8u %12llu %12.1f\n", pStats->pAdapters[i].hsmID,
+                (unsigned long long)pStats->pAdapters[i].requests,
+                pStats->pAdapters[i].requests ?
+                (double)pStats->pAdapters[i].latencySumNsec / (double)pStats->pAdapters[i].requests / 1000.0 : 0.0);
+        }
+        FreeWLDStats(pStats);
+    }
+
+    rc = 0;
+
+doneMain:
+
+    StopWLDHealthMonitor();
+    free(pThreads);
+    free(pValues);
+    free(pResults);
+    free(pRecords);
+#ifdef WLD_REPLAY_SIM
+    free(pSlots);
+#endif
+
+    return rc;
+}
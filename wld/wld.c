@@ -17,246 +17,3661 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
 
 #include "wld.h"
+#include "wld_fm.h"
+#include "wld_msg.h"
+#include "wld_stats.h"
+#include "wld_admit.h"
+#include "wld_retry.h"
+#include "wld_cache.h"
+#include "wld_trace.h"
+#include "wld_shm.h"
+#include "wld_time.h"
+#include "wld_random.h"
 
-static WLD_PARTITION_LOOKUP WLD_PartitionTable[MAX_WLD_PARTITIONS];
-static uint32_t WLD_PartitionCount = 0;
-static uint32_t WLD_CurrentPartitionIndex = 0;
+// Number of round-robin tickets a thread takes from the shared cursor
+// at a time, so the cursor cache line is not bounced on every request
+#define WLD_CURSOR_BATCH 16
+
+// Marks an empty index entry / a partition whose adapter is unknown
+#define WLD_NO_INDEX 0xFFFFFFFF
+
+// EWMA weight given to each new latency sample (1 / 2^WLD_EWMA_SHIFT)
+#define WLD_EWMA_SHIFT 3
+
+// Traffic share of a fully admitted adapter, and how many times a
+// selection that lands on a ramping adapter is redrawn
+#define WLD_ADMIT_FULL 1000
+#define WLD_ADMIT_RETRIES 4
+
+// Partition weights, and the longest smooth weighted round-robin
+// schedule built for them (weights are scaled down to fit)
+#define WLD_MAX_WEIGHT 1000
+#define WLD_MAX_SCHEDULE 65536
+
+// Throughput calibration (WLD_CALIBRATE): FM pings kept in flight per
+// adapter, and the weight given to the fastest partition
+#define WLD_CALIBRATE_THREADS 8
+#define WLD_CALIBRATE_SCALE 100
+
+// Recent latency window of an adapter (see GetWLDAdapterLatency).
+// Buckets are quarter octaves of nanoseconds starting at 1us; once the
+// window holds WLD_WINDOW_SAMPLES samples every bucket is halved, so
+// old samples fade out.
+#define WLD_WINDOW_MIN_SHIFT 10
+#define WLD_WINDOW_BUCKETS 104
+#define WLD_WINDOW_SAMPLES 2048
+#define WLD_WINDOW_MIN_SAMPLES 64
+
+// Key affinity: partitions ranked per key before the load bound is
+// applied, and the default bound (percent of an adapter's weighted
+// share of the requests in flight)
+#define WLD_AFFINITY_CANDIDATES 8
+#define WLD_AFFINITY_LOAD 125
+
+// How long InitializeWLD waits for the adapters to be discovered
+// (WLD_DISCOVERY_TIMEOUT)
+#define WLD_DISCOVERY_MSEC 10000
+
+// How long ReconfigureWLD waits for the requests on the table it
+// replaced to finish before retiring it (WLD_DRAIN_TIMEOUT)
+#define WLD_DRAIN_MSEC 30000
+
+// How often the prober looks for processes that left a shared table
+// without detaching (WLD_SHARED)
+#define WLD_SHM_RECLAIM_MSEC 1000
+
+// Load seen on one adapter, fed by SendWLDMessageToFM and read by the
+// slot selection policies.  One cache line per adapter.
+typedef struct WLD_ADAPTER_LOAD {
+    _Atomic uint32_t inFlight;
+    _Atomic uint32_t admitPermille;
+    _Atomic uint64_t ewmaNsec;
+} __attribute__((aligned(64))) WLD_ADAPTER_LOAD;
+
+typedef struct WLD_ADAPTER_WINDOW {
+    _Atomic uint32_t samples;
+    _Atomic uint32_t buckets[WLD_WINDOW_BUCKETS];
+} __attribute__((aligned(64))) WLD_ADAPTER_WINDOW;
+
+// Circuit breaker of one adapter.  Only changed with health_mutex held;
+// the request path reads state and the adapter's admitPermille.
+typedef struct WLD_ADAPTER_HEALTH {
+    _Atomic int state;
+    uint32_t trips;
+    uint32_t rampStep;
+    uint64_t retryAtNsec;
+    uint64_t rampAtNsec;
+} WLD_ADAPTER_HEALTH;
+
+// A partition taken out of rotation on its own (see tripWLDPartition).
+// Only changed with health_mutex held.
+typedef struct WLD_PARTITION_HEALTH {
+    uint32_t trips;
+    uint64_t retryAtNsec;   // when the prober checks it again, 0 = in rotation
+    uint64_t trippedAtNsec;
+} WLD_PARTITION_HEALTH;
+
+// Partitions that live on one adapter (hsmID).  The partition indices
+// are pTable->pAdapterPartitions[first .. first + count - 1]
+typedef struct WLD_ADAPTER {
+    uint32_t hsmID;
+    uint32_t first;
+    uint32_t count;
+    uint32_t weight;        // sum of the partition weights
+} WLD_ADAPTER;
+
+// A partition of the table (the fields of WLD_PARTITION_LOOKUP).
+// active and embeddedSlot change while the table is in use (breakers,
+// late discovery): the embedded slot is stored before the partition is
+// made active, with release, so a reader that loads active (or the
+// active bitmap) with acquire sees the embedded slot that goes with it.
+typedef struct WLD_PARTITION {
+    uint32_t slot;
+    _Atomic bool active;
+    _Atomic uint32_t embeddedSlot;
+    uint32_t hsmID;
+    uint32_t weight;
+} WLD_PARTITION;
+
+// The partition table is published as an immutable snapshot.  Readers
+// load WLD_Table and never lock; the only mutable state is the active
+// bitmap, which is updated with atomic read-modify-write operations.
+typedef struct WLD_TABLE {
+    uint32_t count;
+    uint32_t words;
+    WLD_PARTITION *pPartitions;
+    _Atomic uint64_t *pActive;
+
+    // slot -> partition index, open addressed (size slotMask + 1)
+    uint32_t slotMask;
+    uint32_t *pSlotIndex;
+
+    // hsmID -> partitions on that adapter
+    uint32_t adapterCount;
+    WLD_ADAPTER *pAdapters;
+    uint32_t *pAdapterPartitions;
+    uint32_t hsmMapSize;
+    uint32_t *pHsmMap;
+
+    // The partitions of each adapter as a mask over the active bitmap
+    // (words masks per adapter index)
+    uint64_t *pAdapterMask;
+
+    // Smooth weighted round-robin order of the partition indexes, or
+    // NULL when every partition has the same weight
+    uint32_t scheduleLength;
+    uint32_t *pSchedule;
+
+    // partition index -> adapter index, and the load per adapter index
+    uint32_t *pPartitionAdapter;
+    WLD_ADAPTER_LOAD *pLoad;
+    WLD_ADAPTER_WINDOW *pWindow;
+    WLD_ADAPTER_HEALTH *pHealth;
+    WLD_PARTITION_HEALTH *pPartitionHealth;
+
+    // partition index -> statistics index, which stays the same for a
+    // slot across tables (adapters are counted by hsmID)
+    uint32_t statPartitions;
+    uint32_t *pPartitionStat;
+
+    // Round-robin cursor.  When the table is shared with the other
+    // processes of the host (see shareWLDTable) the cursor, the
+    // partitions, the active bitmap and the loads live in the segment,
+    // pMyInFlight is this process's share of the requests in flight and
+    // pOwnPartitions the private partitions the table was built with.
+    _Atomic uint32_t *pCursor;
+    WLD_SHM *pShared;
+    _Atomic uint32_t *pMyInFlight;
+    WLD_PARTITION *pOwnPartitions;
+
+    // Holders other than request threads (discovery) - see retireWLDTable
+    _Atomic uint32_t pins;
+} WLD_TABLE;
+
+// Current table, and the table ReconfigureWLD replaced while its
+// requests drain.  Both are only read between enterWLD and leaveWLD.
+static WLD_TABLE * _Atomic WLD_Table = NULL;
+static WLD_TABLE * _Atomic WLD_Draining = NULL;
+static uint32_t WLD_TableGeneration = 0;
+static _Atomic uint32_t WLD_CurrentPartitionIndex = 0;
 static bool InWLDMode = false;
+static _Atomic int WLD_Policy = WLD_POLICY_ROUND_ROBIN;
+static _Atomic uint32_t WLD_AffinityLoad = WLD_AFFINITY_LOAD;
+static _Atomic uint64_t WLD_AffinitySpills = 0;
+
+static __thread uint32_t wldCursorNext = 0;
+static __thread uint32_t wldCursorEnd = 0;
+
+// Serializes writers (InitializeWLD, ReconfigureWLD); never taken on
+// the request path
+static pthread_mutex_t wld_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int defaultHSM = 3;
+
+// Table readers (see enterWLD).  Records are never freed: when a
+// thread exits its record is released and adopted by the next new
+// thread.
+typedef struct WLD_READER {
+    struct WLD_READER *pNext;
+    _Atomic uint64_t epoch;     // epoch the thread entered at, 0 = not reading
+    _Atomic bool inUse;
+} __attribute__((aligned(64))) WLD_READER;
+
+static WLD_READER * _Atomic WLD_Readers = NULL;
+static _Atomic uint64_t WLD_Epoch = 1;
+static _Atomic uint32_t WLD_UntrackedReaders = 0;
+static __thread WLD_READER *pMyReader = NULL;
+static __thread uint32_t wldReadDepth = 0;
+static __thread bool wldReadUntracked = false;
+static pthread_once_t readerKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t readerKey;
+
+// Replaced tables that were still in use when ReconfigureWLD gave up
+// waiting.  Guarded by retired_mutex, as tables are drained without
+// wld_mutex.
+typedef struct WLD_RETIRED {
+    struct WLD_RETIRED *pNext;
+    WLD_TABLE *pTable;
+    uint64_t epoch;
+} WLD_RETIRED;
+
+static WLD_RETIRED *WLD_RetiredTables = NULL;
+static pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Slot of each statistics index.  Guarded by wld_mutex.
+static uint32_t *WLD_StatSlots = NULL;
+static uint32_t WLD_StatSlotCount = 0;
+static uint32_t WLD_StatSlotCapacity = 0;
+
+// Background health prober (see the circuit breaker section below)
+static pthread_mutex_t health_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t health_cond;
+static pthread_t healthThread;
+static bool healthRunning = false;
+static bool healthStop = false;
+static WLD_HEALTH_CONFIG WLD_HealthConfig = {
+    50,                 // probeIntervalMsec
+    1000,               // probeTimeoutMsec
+    100,                // backoffMinMsec
+    30000,              // backoffMaxMsec
+    4,                  // rampSteps
+    1000,               // rampStepMsec
+    FM_NUMBER_CUSTOM_FM // pingFmNumber
+};
+
+// Enable this define to print the contents of the WLD_PartitionTable
+// #define DEBUG_WLD 1
+
+static inline bool isPartitionActive(const WLD_TABLE *pTable, uint32_t index)
+{
+    return (atomic_load_explicit(&pTable->pActive[index / 64], memory_order_acquire) >>
+        (index % 64)) & 1;
+}
+
+static inline void setPartitionActive(WLD_TABLE *pTable, uint32_t index, bool active)
+{
+    uint64_t bit = 1ULL << (index % 64);
+
+    if (active)
+        atomic_fetch_or_explicit(&pTable->pActive[index / 64], bit, memory_order_release);
+    else if (atomic_fetch_and_explicit(&pTable->pActive[index / 64], ~bit, memory_order_release) & bit)
+        wldCacheInvalidateSlot(pTable->pPartitions[index].slot);
+}
+
+// Put a partition back in rotation with its (re)resolved embedded slot
+static inline void activateWLDPartition(WLD_TABLE *pTable, uint32_t index, uint32_t embSlot)
+{
+    WLD_PARTITION *pPart = &pTable->pPartitions[index];
+
+    atomic_store_explicit(&pPart->embeddedSlot, embSlot, memory_order_relaxed);
+    atomic_store_explicit(&pPart->active, true, memory_order_release);
+    setPartitionActive(pTable, index, true);
+}
+
+// Take a partition out of rotation until its embedded slot resolves again
+static inline void deactivateWLDPartition(WLD_TABLE *pTable, uint32_t index)
+{
+    atomic_store_explicit(&pTable->pPartitions[index].active, false, memory_order_relaxed);
+    setPartitionActive(pTable, index, false);
+}
+
+static inline uint32_t loadWLDEmbeddedSlot(const WLD_PARTITION *pPart)
+{
+    return atomic_load_explicit(&pPart->embeddedSlot, memory_order_acquire);
+}
+
+static void freeWLDTable(WLD_TABLE *pTable)
+{
+    if (pTable)
+    {
+        if (pTable->pShared)
+            wldShmDetach(pTable->pShared);
+        else
+        {
+            free(pTable->pPartitions);
+            free((void *)pTable->pActive);
+            free(pTable->pLoad);
+        }
+        free(pTable->pOwnPartitions);
+        free(pTable->pSlotIndex);
+        free(pTable->pAdapters);
+        free(pTable->pAdapterPartitions);
+        free(pTable->pHsmMap);
+        free(pTable->pAdapterMask);
+        free(pTable->pSchedule);
+        free(pTable->pPartitionAdapter);
+        free(pTable->pWindow);
+        free(pTable->pHealth);
+        free(pTable->pPartitionHealth);
+        free(pTable->pPartitionStat);
+        free(pTable);
+    }
+}
+
+// Allocate an empty table (all partitions inactive) for count partitions
+static WLD_TABLE *allocWLDTable(uint32_t count)
+{
+    WLD_TABLE *pTable;
+    uint32_t words = (count + 63) / 64;
+    uint32_t i;
+
+    pTable = calloc(1, sizeof(WLD_TABLE));
+    if (!pTable)
+        return NULL;
+
+    pTable->count = count;
+    pTable->words = words ? words : 1;
+    pTable->pPartitions = calloc(count ? count : 1, sizeof(WLD_PARTITION));
+    pTable->pActive = calloc(pTable->words, sizeof(_Atomic uint64_t));
+    pTable->pPartitionHealth = calloc(count ? count : 1, sizeof(WLD_PARTITION_HEALTH));
+    if (!pTable->pPartitions || !pTable->pActive || !pTable->pPartitionHealth)
+    {
+        freeWLDTable(pTable);
+        return NULL;
+    }
+
+    for (i=0; i < pTable->words; i++)
+        atomic_init(&pTable->pActive[i], 0);
+    atomic_init(&pTable->pins, 0);
+    pTable->pCursor = &WLD_CurrentPartitionIndex;
+
+    return pTable;
+}
+
+// Thread exit: release the thread's reader record for adoption
+static void releaseWLDReader(void *pArg)
+{
+    WLD_READER *pReader = (WLD_READER *)pArg;
+
+    atomic_store_explicit(&pReader->epoch, 0, memory_order_release);
+    atomic_store_explicit(&pReader->inUse, false, memory_order_release);
+}
+
+static void createReaderKey(void)
+{
+    (void)pthread_key_create(&readerKey, releaseWLDReader);
+}
+
+// Get this thread's reader record, adopting a released one if possible
+static WLD_READER *getWLDReader(void)
+{
+    WLD_READER *pReader;
+    bool expected;
+
+    (void)pthread_once(&readerKeyOnce, createReaderKey);
+
+    for (pReader = atomic_load_explicit(&WLD_Readers, memory_order_acquire);
+        pReader; pReader = pReader->pNext)
+    {
+        expected = false;
+        if (atomic_compare_exchange_strong_explicit(&pReader->inUse, &expected, true,
+            memory_order_acquire, memory_order_relaxed))
+            break;
+    }
+
+    if (!pReader)
+    {
+        pReader = aligned_alloc(sizeof(WLD_READER), sizeof(WLD_READER));
+        if (!pReader)
+            return NULL;
+
+        atomic_init(&pReader->epoch, 0);
+        atomic_init(&pReader->inUse, true);
+        pReader->pNext = atomic_load_explicit(&WLD_Readers, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&WLD_Readers, &pReader->pNext, pReader,
+            memory_order_release, memory_order_relaxed))
+            ;
+    }
+
+    (void)pthread_setspecific(readerKey, pReader);
+    pMyReader = pReader;
+
+    return pReader;
+}
+
+// Start reading the tables and return the current one.  A table that
+// ReconfigureWLD replaces is not freed until every thread that entered
+// before the replacement has left: the thread publishes the epoch it
+// entered at, and the writer waits until no thread shows an epoch from
+// before its swap.  Calls nest.
+static WLD_TABLE *enterWLD(void)
+{
+    WLD_READER *pReader;
+
+    if (wldReadDepth++ == 0)
+    {
+        pReader = pMyReader ? pMyReader : getWLDReader();
+        if (pReader)
+            atomic_store_explicit(&pReader->epoch,
+                atomic_load_explicit(&WLD_Epoch, memory_order_seq_cst), memory_order_seq_cst);
+        else
+        {
+            // No record - hold every table instead
+            wldReadUntracked = true;
+            atomic_fetch_add_explicit(&WLD_UntrackedReaders, 1, memory_order_seq_cst);
+        }
+    }
+
+    return atomic_load_explicit(&WLD_Table, memory_order_seq_cst);
+}
+
+static void leaveWLD(void)
+{
+    if (--wldReadDepth)
+        return;
+
+    if (wldReadUntracked)
+    {
+        wldReadUntracked = false;
+        atomic_fetch_sub_explicit(&WLD_UntrackedReaders, 1, memory_order_release);
+    }
+    else
+        atomic_store_explicit(&pMyReader->epoch, 0, memory_order_release);
+}
+
+// True once no thread can still be reading a table that was replaced
+// before the epoch was advanced past epoch
+static bool wldQuiescent(uint64_t epoch)
+{
+    WLD_READER *pReader;
+    uint64_t entered;
+
+    if (atomic_load_explicit(&WLD_UntrackedReaders, memory_order_seq_cst))
+        return false;
+
+    for (pReader = atomic_load_explicit(&WLD_Readers, memory_order_acquire);
+        pReader; pReader = pReader->pNext)
+    {
+        entered = atomic_load_explicit(&pReader->epoch, memory_order_seq_cst);
+        if (entered && entered <= epoch)
+            return false;
+    }
+
+    return true;
+}
+
+// Give every partition its statistics index, registering slots seen
+// for the first time.  Call with wld_mutex held.
+static bool assignWLDStatIndexes(WLD_TABLE *pTable)
+{
+    uint32_t *pNew;
+    uint32_t i, j;
+
+    pTable->pPartitionStat = malloc((pTable->count ? pTable->count : 1) * sizeof(uint32_t));
+    if (!pTable->pPartitionStat)
+        return false;
+
+    for (i=0; i < pTable->count; i++)
+    {
+        for (j=0; j < WLD_StatSlotCount; j++)
+        {
+            if (WLD_StatSlots[j] == pTable->pPartitions[i].slot)
+                break;
+        }
+
+        if (j == WLD_StatSlotCount)
+        {
+            if (WLD_StatSlotCount == WLD_StatSlotCapacity)
+            {
+                pNew = realloc(WLD_StatSlots, (WLD_StatSlotCapacity ? WLD_StatSlotCapacity * 2 : 32) *
+                    sizeof(uint32_t));
+                if (!pNew)
+                    return false;
+                WLD_StatSlots = pNew;
+                WLD_StatSlotCapacity = WLD_StatSlotCapacity ? WLD_StatSlotCapacity * 2 : 32;
+            }
+            WLD_StatSlots[WLD_StatSlotCount++] = pTable->pPartitions[i].slot;
+        }
+
+        pTable->pPartitionStat[i] = j;
+    }
+
+    pTable->statPartitions = WLD_StatSlotCount;
+
+    return true;
+}
+
+static inline uint32_t hashWLDSlot(uint32_t slotID)
+{
+    return slotID * 0x9E3779B1U;
+}
+
+// Build the slot -> partition and hsmID -> partitions indexes once the
+// hsmID of every partition is known.  Partitions whose adapter could
+// not be determined (hsmID == WLD_NO_INDEX) are left out of the
+// adapter index.
+static bool indexWLDTable(WLD_TABLE *pTable)
+{
+    WLD_ADAPTER *pAdapter;
+    uint32_t size = 16;
+    uint32_t maxHsm = 0;
+    uint32_t hsmID;
+    uint32_t next;
+    uint32_t h;
+    uint32_t i;
+
+    // Keep the slot index at most half full
+    while (size < pTable->count * 2)
+        size <<= 1;
+
+    pTable->slotMask = size - 1;
+    pTable->pSlotIndex = malloc(size * sizeof(uint32_t));
+    if (!pTable->pSlotIndex)
+        return false;
+    memset(pTable->pSlotIndex, 0xFF, size * sizeof(uint32_t));
+
+    for (i=0; i < pTable->count; i++)
+    {
+        h = hashWLDSlot(pTable->pPartitions[i].slot) & pTable->slotMask;
+        while (pTable->pSlotIndex[h] != WLD_NO_INDEX)
+        {
+            // The first entry for a slot listed twice wins
+            if (pTable->pPartitions[pTable->pSlotIndex[h]].slot == pTable->pPartitions[i].slot)
+                break;
+            h = (h + 1) & pTable->slotMask;
+        }
+        if (pTable->pSlotIndex[h] == WLD_NO_INDEX)
+            pTable->pSlotIndex[h] = i;
+    }
+
+    // hsmIDs are MD adapter indexes, so a direct map is small
+    for (i=0; i < pTable->count; i++)
+    {
+        hsmID = pTable->pPartitions[i].hsmID;
+        if (hsmID != WLD_NO_INDEX && hsmID >= maxHsm)
+            maxHsm = hsmID + 1;
+    }
+
+    pTable->hsmMapSize = maxHsm;
+    pTable->pHsmMap = malloc((maxHsm ? maxHsm : 1) * sizeof(uint32_t));
+    pTable->pAdapters = calloc(maxHsm ? maxHsm : 1, sizeof(WLD_ADAPTER));
+    pTable->pAdapterPartitions = malloc((pTable->count ? pTable->count : 1) * sizeof(uint32_t));
+    if (!pTable->pHsmMap || !pTable->pAdapters || !pTable->pAdapterPartitions)
+        return false;
+    memset(pTable->pHsmMap, 0xFF, (maxHsm ? maxHsm : 1) * sizeof(uint32_t));
+
+    // Count the partitions per adapter, in order of first appearance
+    for (i=0; i < pTable->count; i++)
+    {
+        hsmID = pTable->pPartitions[i].hsmID;
+        if (hsmID == WLD_NO_INDEX)
+            continue;
+
+        if (pTable->pHsmMap[hsmID] == WLD_NO_INDEX)
+        {
+            pTable->pHsmMap[hsmID] = pTable->adapterCount;
+            pTable->pAdapters[pTable->adapterCount++].hsmID = hsmID;
+        }
+        pTable->pAdapters[pTable->pHsmMap[hsmID]].count++;
+    }
+
+    next = 0;
+    for (i=0; i < pTable->adapterCount; i++)
+    {
+        pTable->pAdapters[i].first = next;
+        next += pTable->pAdapters[i].count;
+        pTable->pAdapters[i].count = 0;
+    }
+
+    for (i=0; i < pTable->count; i++)
+    {
+        hsmID = pTable->pPartitions[i].hsmID;
+        if (hsmID == WLD_NO_INDEX)
+            continue;
+
+        pAdapter = &pTable->pAdapters[pTable->pHsmMap[hsmID]];
+        pTable->pAdapterPartitions[pAdapter->first + pAdapter->count++] = i;
+    }
+
+    pTable->pAdapterMask = calloc((pTable->adapterCount ? pTable->adapterCount : 1) * pTable->words,
+        sizeof(uint64_t));
+    if (!pTable->pAdapterMask)
+        return false;
+
+    for (i=0; i < pTable->count; i++)
+    {
+        hsmID = pTable->pPartitions[i].hsmID;
+        if (hsmID != WLD_NO_INDEX)
+            pTable->pAdapterMask[pTable->pHsmMap[hsmID] * pTable->words + i / 64] |= 1ULL << (i % 64);
+    }
+
+    // Per adapter load for the selection policies
+    pTable->pPartitionAdapter = malloc((pTable->count ? pTable->count : 1) * sizeof(uint32_t));
+    pTable->pLoad = aligned_alloc(_Alignof(WLD_ADAPTER_LOAD),
+        (pTable->adapterCount ? pTable->adapterCount : 1) * sizeof(WLD_ADAPTER_LOAD));
+    pTable->pWindow = aligned_alloc(_Alignof(WLD_ADAPTER_WINDOW),
+        (pTable->adapterCount ? pTable->adapterCount : 1) * sizeof(WLD_ADAPTER_WINDOW));
+    pTable->pHealth = calloc(pTable->adapterCount ? pTable->adapterCount : 1, sizeof(WLD_ADAPTER_HEALTH));
+    if (!pTable->pPartitionAdapter || !pTable->pLoad || !pTable->pWindow || !pTable->pHealth)
+        return false;
+    memset(pTable->pWindow, 0, (pTable->adapterCount ? pTable->adapterCount : 1) * sizeof(WLD_ADAPTER_WINDOW));
+
+    for (i=0; i < pTable->count; i++)
+    {
+        hsmID = pTable->pPartitions[i].hsmID;
+        pTable->pPartitionAdapter[i] = (hsmID == WLD_NO_INDEX) ? WLD_NO_INDEX : pTable->pHsmMap[hsmID];
+    }
+
+    for (i=0; i < (pTable->adapterCount ? pTable->adapterCount : 1); i++)
+    {
+        atomic_init(&pTable->pLoad[i].inFlight, 0);
+        atomic_init(&pTable->pLoad[i].admitPermille, WLD_ADMIT_FULL);
+        atomic_init(&pTable->pLoad[i].ewmaNsec, 0);
+        atomic_init(&pTable->pHealth[i].state, WLD_ADAPTER_CLOSED);
+    }
+
+    return true;
+}
+
+// Get the partitions that live on this adapter, or NULL if none do
+static const WLD_ADAPTER *getWLD_AdapterFromHSMIndex(const WLD_TABLE *pTable, uint32_t hsmID)
+{
+    if (hsmID >= pTable->hsmMapSize || pTable->pHsmMap[hsmID] == WLD_NO_INDEX)
+        return NULL;
+
+    return &pTable->pAdapters[pTable->pHsmMap[hsmID]];
+}
+
+static uint32_t gcdWLD(uint32_t a, uint32_t b)
+{
+    uint32_t t;
+
+    while (b)
+    {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+// Lay the partitions out in smooth weighted round-robin order: at each
+// step every partition gains its weight, the one with the most credit
+// is taken and pays the total back.  A partition of weight 3 next to
+// one of weight 1 comes out as a a b a, not a a a b.  The weights are
+// reduced by their common divisor (and scaled down if the schedule
+// would be too long); equal weights need no schedule at all.
+static bool buildWLDSchedule(WLD_TABLE *pTable)
+{
+    int64_t *pCredit;
+    uint64_t total = 0;
+    uint32_t *pWeights;
+    uint32_t divisor = 0;
+    uint32_t best;
+    uint32_t i, n;
+    bool equal = true;
+
+    free(pTable->pSchedule);
+    pTable->pSchedule = NULL;
+    pTable->scheduleLength = 0;
+
+    for (i=0; i < pTable->count; i++)
+    {
+        divisor = gcdWLD(divisor, pTable->pPartitions[i].weight);
+        equal = equal && (pTable->pPartitions[i].weight == pTable->pPartitions[0].weight);
+    }
+
+    if (pTable->count < 2 || equal)
+        return true;
+
+    pWeights = malloc(pTable->count * sizeof(uint32_t));
+    pCredit = calloc(pTable->count, sizeof(int64_t));
+    if (!pWeights || !pCredit)
+    {
+        free(pWeights);
+        free(pCredit);
+        return false;
+    }
+
+    for (i=0; i < pTable->count; i++)
+    {
+        pWeights[i] = pTable->pPartitions[i].weight / divisor;
+        total += pWeights[i];
+    }
+
+    if (total > WLD_MAX_SCHEDULE)
+    {
+        total = 0;
+        for (i=0; i < pTable->count; i++)
+        {
+            pWeights[i] = (uint32_t)(((uint64_t)pWeights[i] * WLD_MAX_SCHEDULE) /
+                ((uint64_t)WLD_MAX_WEIGHT * pTable->count));
+            if (pWeights[i] == 0)
+                pWeights[i] = 1;
+            total += pWeights[i];
+        }
+    }
+
+    pTable->pSchedule = malloc(total * sizeof(uint32_t));
+    if (!pTable->pSchedule)
+    {
+        free(pWeights);
+        free(pCredit);
+        return false;
+    }
+
+    for (n=0; n < total; n++)
+    {
+        best = 0;
+        for (i=0; i < pTable->count; i++)
+        {
+            pCredit[i] += pWeights[i];
+            if (pCredit[i] > pCredit[best])
+                best = i;
+        }
+        pCredit[best] -= (int64_t)total;
+        pTable->pSchedule[n] = best;
+    }
+    pTable->scheduleLength = (uint32_t)total;
+
+    free(pWeights);
+    free(pCredit);
+
+    return true;
+}
+
+// Take the next round-robin ticket for this thread
+static inline uint32_t nextWLDTicket(const WLD_TABLE *pTable)
+{
+    if (wldCursorNext == wldCursorEnd)
+    {
+        wldCursorNext = atomic_fetch_add_explicit(pTable->pCursor,
+            WLD_CURSOR_BATCH, memory_order_relaxed);
+        wldCursorEnd = wldCursorNext + WLD_CURSOR_BATCH;
+    }
+
+    return wldCursorNext++;
+}
+
+// Map a round-robin ticket onto the active partitions: the ticket
+// selects the (ticket % activeCount)'th active entry, so traffic stays
+// evenly spread over the partitions that remain active
+static bool selectActivePartition(const WLD_TABLE *pTable, uint32_t ticket, uint32_t *pIndex)
+{
+    uint64_t word;
+    uint32_t activeCount;
+    uint32_t k;
+    uint32_t pc;
+    uint32_t w;
+
+    do
+    {
+        activeCount = 0;
+        for (w=0; w < pTable->words; w++)
+            activeCount += (uint32_t)__builtin_popcountll(
+                atomic_load_explicit(&pTable->pActive[w], memory_order_acquire));
+
+        if (activeCount == 0)
+            return false;
+
+        k = ticket % activeCount;
+        for (w=0; w < pTable->words; w++)
+        {
+            word = atomic_load_explicit(&pTable->pActive[w], memory_order_acquire);
+            pc = (uint32_t)__builtin_popcountll(word);
+            if (k < pc)
+            {
+                for (; k; k--)
+                    word &= word - 1;
+                *pIndex = w * 64 + (uint32_t)__builtin_ctzll(word);
+                return true;
+            }
+            k -= pc;
+        }
+
+        // The bitmap changed between the two passes - try again
+    } while (1);
+}
+
+// Load score of the adapter behind a partition - lower is better.  The
+// latency variant scales the EWMA latency by the queue the new request
+// would join.  Both are divided by the partition weight.
+static inline uint64_t partitionLoad(const WLD_TABLE *pTable, uint32_t index, bool useLatency)
+{
+    const WLD_ADAPTER_LOAD *pLoad;
+    uint64_t inFlight;
+
+    if (pTable->pPartitionAdapter[index] == WLD_NO_INDEX)
+        return UINT64_MAX;
+
+    pLoad = &pTable->pLoad[pTable->pPartitionAdapter[index]];
+    inFlight = atomic_load_explicit(&pLoad->inFlight, memory_order_relaxed);
+
+    // A partition of twice the weight looks half as loaded
+    if (!useLatency)
+        return inFlight * WLD_MAX_WEIGHT / pTable->pPartitions[index].weight;
+
+    return (inFlight + 1) * (atomic_load_explicit(&pLoad->ewmaNsec, memory_order_relaxed) + 1) *
+        WLD_MAX_WEIGHT / pTable->pPartitions[index].weight;
+}
+
+// Pick the active partition with the lowest load score.  The scan
+// starts at the ticket so that ties rotate between partitions.
+static bool selectLeastLoaded(const WLD_TABLE *pTable, uint32_t ticket, bool useLatency, uint32_t *pIndex)
+{
+    uint64_t best = UINT64_MAX;
+    uint64_t load;
+    uint32_t index;
+    uint32_t i;
+    bool found = false;
+
+    if (pTable->count == 0)
+        return false;
+
+    index = ticket % pTable->count;
+    for (i=0; i < pTable->count; i++, index++)
+    {
+        if (index == pTable->count)
+            index = 0;
+
+        if (!isPartitionActive(pTable, index))
+            continue;
+
+        load = partitionLoad(pTable, index, useLatency);
+        if (!found || load < best)
+        {
+            best = load;
+            *pIndex = index;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+// Power of two choices: sample two active partitions at random and
+// keep the one with fewer requests in flight (EWMA latency breaks ties)
+static bool selectPowerOfTwo(const WLD_TABLE *pTable, uint32_t *pIndex)
+{
+    uint32_t first, second;
+    uint64_t firstLoad, secondLoad;
+
+    if (!selectActivePartition(pTable, wldRandom(), &first))
+        return false;
+
+    if (!selectActivePartition(pTable, wldRandom(), &second) || second == first)
+    {
+        *pIndex = first;
+        return true;
+    }
+
+    firstLoad = partitionLoad(pTable, first, false);
+    secondLoad = partitionLoad(pTable, second, false);
+    if (firstLoad == secondLoad)
+    {
+        firstLoad = partitionLoad(pTable, first, true);
+        secondLoad = partitionLoad(pTable, second, true);
+    }
+
+    *pIndex = (secondLoad < firstLoad) ? second : first;
+    return true;
+}
+
+// Draw an active partition in proportion to its weight: the draw
+// selects a point on the summed weights of the active partitions
+static bool selectActiveWeighted(const WLD_TABLE *pTable, uint32_t draw, uint32_t *pIndex)
+{
+    uint64_t word;
+    uint64_t total;
+    uint64_t k;
+    uint32_t index;
+    uint32_t w;
+
+    do
+    {
+        total = 0;
+        for (w=0; w < pTable->words; w++)
+        {
+            word = atomic_load_explicit(&pTable->pActive[w], memory_order_acquire);
+            for (; word; word &= word - 1)
+                total += pTable->pPartitions[w * 64 + (uint32_t)__builtin_ctzll(word)].weight;
+        }
+
+        if (total == 0)
+            return false;
+
+        k = draw % total;
+        for (w=0; w < pTable->words; w++)
+        {
+            word = atomic_load_explicit(&pTable->pActive[w], memory_order_acquire);
+            for (; word; word &= word - 1)
+            {
+                index = w * 64 + (uint32_t)__builtin_ctzll(word);
+                if (k < pTable->pPartitions[index].weight)
+                {
+                    *pIndex = index;
+                    return true;
+                }
+                k -= pTable->pPartitions[index].weight;
+            }
+        }
+
+        // The bitmap changed between the two passes - try again
+    } while (1);
+}
+
+// Weighted round-robin: each ticket indexes the schedule.  When its
+// turn falls on an inactive partition the request is drawn among the
+// active ones by weight instead, so the cost stays one ticket and a
+// pass over the bitmap however long the schedule is, and the active
+// partitions keep their relative weights.
+static bool selectWeightedPartition(const WLD_TABLE *pTable, uint32_t *pIndex)
+{
+    uint32_t index;
+
+    index = pTable->pSchedule[nextWLDTicket(pTable) % pTable->scheduleLength];
+    if (isPartitionActive(pTable, index))
+    {
+        *pIndex = index;
+        return true;
+    }
+
+    return selectActiveWeighted(pTable, wldRandom(), pIndex);
+}
+
+// Active partitions of an adapter
+static inline uint32_t adapterActiveCount(const WLD_TABLE *pTable, uint32_t adapterIndex)
+{
+    const uint64_t *pMask = &pTable->pAdapterMask[adapterIndex * pTable->words];
+    uint32_t count = 0;
+    uint32_t w;
+
+    for (w=0; w < pTable->words; w++)
+        count += (uint32_t)__builtin_popcountll(
+            atomic_load_explicit(&pTable->pActive[w], memory_order_acquire) & pMask[w]);
+
+    return count;
+}
+
+// Adapter round-robin: the ticket selects the (ticket % n)'th of the n
+// adapters with an active partition, and each adapter takes turns over
+// its active partitions with the tickets it gets (ticket / n).  The
+// two levels only read the active bitmap, so nothing is shared but the
+// cursor.
+static bool selectAdapterPartition(const WLD_TABLE *pTable, uint32_t ticket, uint32_t *pIndex)
+{
+    const uint64_t *pMask;
+    uint64_t word;
+    uint32_t activeAdapters;
+    uint32_t count = 0;
+    uint32_t a, k, pc, w;
+
+    do
+    {
+        activeAdapters = 0;
+        for (a=0; a < pTable->adapterCount; a++)
+            activeAdapters += (adapterActiveCount(pTable, a) != 0);
+
+        if (activeAdapters == 0)
+            return false;
+
+        k = ticket % activeAdapters;
+        for (a=0; a < pTable->adapterCount; a++)
+        {
+            count = adapterActiveCount(pTable, a);
+            if (count && k-- == 0)
+                break;
+        }
+
+        if (a < pTable->adapterCount)
+        {
+            pMask = &pTable->pAdapterMask[a * pTable->words];
+            k = (ticket / activeAdapters) % count;
+            for (w=0; w < pTable->words; w++)
+            {
+                word = atomic_load_explicit(&pTable->pActive[w], memory_order_acquire) & pMask[w];
+                pc = (uint32_t)__builtin_popcountll(word);
+                if (k < pc)
+                {
+                    for (; k; k--)
+                        word &= word - 1;
+                    *pIndex = w * 64 + (uint32_t)__builtin_ctzll(word);
+                    return true;
+                }
+                k -= pc;
+            }
+        }
+
+        // The bitmap changed between the passes - try again
+    } while (1);
+}
+
+// Pick an active partition according to the current policy
+static bool pickWLDPartition(const WLD_TABLE *pTable, uint32_t *pIndex)
+{
+    switch (atomic_load_explicit(&WLD_Policy, memory_order_relaxed))
+    {
+        case WLD_POLICY_LEAST_OUTSTANDING:
+            return selectLeastLoaded(pTable, nextWLDTicket(pTable), false, pIndex);
+        case WLD_POLICY_EWMA_LATENCY:
+            return selectLeastLoaded(pTable, nextWLDTicket(pTable), true, pIndex);
+        case WLD_POLICY_POWER_OF_TWO:
+            return selectPowerOfTwo(pTable, pIndex);
+        case WLD_POLICY_ADAPTER_ROUND_ROBIN:
+            return selectAdapterPartition(pTable, nextWLDTicket(pTable), pIndex);
+        case WLD_POLICY_ROUND_ROBIN:
+        default:
+            if (pTable->pSchedule)
+                return selectWeightedPartition(pTable, pIndex);
+            return selectActivePartition(pTable, nextWLDTicket(pTable), pIndex);
+    }
+}
+
+// Select an active partition.  A partition on an adapter that is
+// ramping back up after a failure only keeps the selection with the
+// adapter's admit probability; otherwise a random active partition is
+// drawn instead, a few times at most.
+static bool selectWLDPartition(const WLD_TABLE *pTable, uint32_t *pIndex)
+{
+    uint32_t admit;
+    uint32_t adapter;
+    uint32_t retry;
+
+    if (!pickWLDPartition(pTable, pIndex))
+        return false;
+
+    for (retry=0; retry < WLD_ADMIT_RETRIES; retry++)
+    {
+        adapter = pTable->pPartitionAdapter[*pIndex];
+        if (adapter == WLD_NO_INDEX)
+            break;
+
+        admit = atomic_load_explicit(&pTable->pLoad[adapter].admitPermille, memory_order_relaxed);
+        if (admit >= WLD_ADMIT_FULL || wldRandom() % WLD_ADMIT_FULL < admit)
+            break;
+
+        if (!selectActivePartition(pTable, wldRandom(), pIndex))
+            return false;
+    }
+
+    return true;
+}
+
+// 64 bit finalizer (splitmix64) that spreads the affinity hashes
+static inline uint64_t mixWLDHash(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// FNV-1a hash of an affinity key
+static uint64_t hashWLDKey(const void *pKey, uint32_t keyLen)
+{
+    const uint8_t *p = (const uint8_t *)pKey;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    uint32_t i;
+
+    for (i=0; i < keyLen; i++)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return mixWLDHash(hash);
+}
+
+// Rendezvous cost of a partition for a key - lower is better.  The
+// key and the slot give a uniform draw u; with unequal weights the
+// cost is -ln(u) / weight, so each partition wins a share of the keys
+// proportional to its weight.
+static inline double affinityCost(const WLD_TABLE *pTable, uint64_t keyHash, uint32_t index)
+{
+    uint64_t h = mixWLDHash(keyHash ^ mixWLDHash(pTable->pPartitions[index].slot));
+    double u = ((double)(h >> 11) + 0.5) / 9007199254740992.0;
+
+    if (!pTable->pSchedule)
+        return 1.0 - u;
+
+    return -log(u) / (double)pTable->pPartitions[index].weight;
+}
+
+// True if one more request on the adapter keeps it within loadPercent
+// of its weighted share of all requests in flight (rounded up, so an
+// idle cluster never refuses a key)
+static inline bool withinAffinityLoad(const WLD_TABLE *pTable, uint32_t adapter,
+    uint64_t loadPercent, uint64_t inFlight, uint64_t activeWeight)
+{
+    uint64_t cap;
+
+    cap = (loadPercent * (inFlight + 1) * pTable->pAdapters[adapter].weight +
+        100 * activeWeight - 1) / (100 * activeWeight);
+
+    return atomic_load_explicit(&pTable->pLoad[adapter].inFlight, memory_order_relaxed) < cap;
+}
+
+// Select the partition of a key.  The active partitions are ranked by
+// rendezvous cost and the best one whose adapter is within the load
+// bound (and admits the request if it is ramping up) wins.  If none of
+// the ranked partitions qualifies the least loaded partition is taken.
+static bool selectKeyedPartition(const WLD_TABLE *pTable, uint64_t keyHash, uint32_t *pIndex)
+{
+    uint32_t rank[WLD_AFFINITY_CANDIDATES];
+    double cost[WLD_AFFINITY_CANDIDATES];
+    uint32_t ranked = 0;
+    uint64_t activeWeight = 0;
+    uint64_t inFlight = 0;
+    uint64_t loadPercent;
+    uint32_t adapter;
+    uint32_t admit;
+    uint32_t i, j;
+    double c;
+
+    for (i=0; i < pTable->count; i++)
+    {
+        if (!isPartitionActive(pTable, i) || pTable->pPartitionAdapter[i] == WLD_NO_INDEX)
+            continue;
+
+        activeWeight += pTable->pPartitions[i].weight;
+        c = affinityCost(pTable, keyHash, i);
+        if (ranked == WLD_AFFINITY_CANDIDATES)
+        {
+            if (c >= cost[ranked - 1])
+                continue;
+            ranked--;
+        }
+
+        // Keep the candidates sorted, best first
+        for (j=ranked; j > 0 && cost[j - 1] > c; j--)
+        {
+            cost[j] = cost[j - 1];
+            rank[j] = rank[j - 1];
+        }
+        cost[j] = c;
+        rank[j] = i;
+        ranked++;
+    }
+
+    if (ranked == 0)
+        return false;
+
+    loadPercent = atomic_load_explicit(&WLD_AffinityLoad, memory_order_relaxed);
+    if (loadPercent)
+    {
+        for (i=0; i < pTable->adapterCount; i++)
+            inFlight += atomic_load_explicit(&pTable->pLoad[i].inFlight, memory_order_relaxed);
+    }
+
+    for (i=0; i < ranked; i++)
+    {
+        adapter = pTable->pPartitionAdapter[rank[i]];
+        admit = atomic_load_explicit(&pTable->pLoad[adapter].admitPermille, memory_order_relaxed);
+        if (admit < WLD_ADMIT_FULL && wldRandom() % WLD_ADMIT_FULL >= admit)
+            continue;
+
+        if (!loadPercent || withinAffinityLoad(pTable, adapter, loadPercent, inFlight, activeWeight))
+        {
+            *pIndex = rank[i];
+            if (i)
+                atomic_fetch_add_explicit(&WLD_AffinitySpills, 1, memory_order_relaxed);
+            return true;
+        }
+    }
+
+    if (!selectLeastLoaded(pTable, (uint32_t)keyHash, false, pIndex))
+        *pIndex = rank[0];
+    if (*pIndex != rank[0])
+        atomic_fetch_add_explicit(&WLD_AffinitySpills, 1, memory_order_relaxed);
+
+    return true;
+}
+
+// A command for any slot that its adapter cannot admit goes to the
+// first adapter after it that can, on one of its active partitions.
+// The admission is taken.
+static bool selectAdmittedPartition(const WLD_TABLE *pTable, uint32_t *pIndex)
+{
+    const WLD_ADAPTER *pAdapter;
+    uint32_t start = pTable->pPartitionAdapter[*pIndex];
+    uint32_t ticket = nextWLDTicket(pTable);
+    uint32_t index = 0;
+    uint32_t a, i;
+
+    for (a=1; a < pTable->adapterCount; a++)
+    {
+        pAdapter = &pTable->pAdapters[(start + a) % pTable->adapterCount];
+        for (i=0; i < pAdapter->count; i++)
+        {
+            index = pTable->pAdapterPartitions[pAdapter->first + (ticket + i) % pAdapter->count];
+            if (isPartitionActive(pTable, index))
+                break;
+        }
+
+        if (i < pAdapter->count && wldAdmitTry(pAdapter->hsmID))
+        {
+            *pIndex = index;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Record the start of a request on the adapter behind a partition.
+// On a shared table the host-wide count goes up before this process's
+// share and down after it, so a process that dies in between leaves a
+// count too many behind, never one too few.
+static inline void beginWLDRequest(WLD_TABLE *pTable, uint32_t index)
+{
+    uint32_t adapter = pTable->pPartitionAdapter[index];
+
+    if (adapter == WLD_NO_INDEX)
+        return;
+
+    atomic_fetch_add_explicit(&pTable->pLoad[adapter].inFlight, 1, memory_order_relaxed);
+    if (pTable->pMyInFlight)
+        atomic_fetch_add_explicit(&pTable->pMyInFlight[adapter], 1, memory_order_relaxed);
+}
+
+static inline uint32_t windowBucket(uint64_t nsec)
+{
+    uint32_t octave;
+
+    if (nsec < (1ULL << WLD_WINDOW_MIN_SHIFT))
+        return 0;
+
+    octave = 63 - (uint32_t)__builtin_clzll(nsec);
+    if (octave - WLD_WINDOW_MIN_SHIFT >= WLD_WINDOW_BUCKETS / 4)
+        return WLD_WINDOW_BUCKETS - 1;
+
+    return (octave - WLD_WINDOW_MIN_SHIFT) * 4 + (uint32_t)((nsec >> (octave - 2)) & 3);
+}
+
+// Upper bound (nsec) of a window bucket
+static inline uint64_t windowBucketNsec(uint32_t bucket)
+{
+    uint32_t octave = bucket / 4 + WLD_WINDOW_MIN_SHIFT;
+
+    return (1ULL << octave) + (uint64_t)(bucket % 4 + 1) * (1ULL << (octave - 2));
+}
+
+// Add a latency sample to the recent window of an adapter.  The thread
+// whose sample fills the window halves it.  Racing updates may lose a
+// sample or two, which does not matter for a percentile estimate.
+static void addWindowSample(WLD_ADAPTER_WINDOW *pWindow, uint64_t latencyNsec)
+{
+    uint32_t count;
+    uint32_t i;
+
+    atomic_fetch_add_explicit(&pWindow->buckets[windowBucket(latencyNsec)], 1, memory_order_relaxed);
+    if (atomic_fetch_add_explicit(&pWindow->samples, 1, memory_order_relaxed) + 1 != WLD_WINDOW_SAMPLES)
+        return;
+
+    for (i=0; i < WLD_WINDOW_BUCKETS; i++)
+    {
+        count = atomic_load_explicit(&pWindow->buckets[i], memory_order_relaxed);
+        if (count)
+            atomic_fetch_sub_explicit(&pWindow->buckets[i], count - count / 2, memory_order_relaxed);
+    }
+    atomic_fetch_sub_explicit(&pWindow->samples, WLD_WINDOW_SAMPLES / 2, memory_order_relaxed);
+}
+
+// Record a completion, folding the latency of successful requests into
+// the adapter EWMA and the recent window.  Concurrent updates may drop
+// a sample, which is acceptable for a load estimate.
+static inline void endWLDRequest(WLD_TABLE *pTable, uint32_t index, uint64_t latencyNsec, bool ok)
+{
+    WLD_ADAPTER_LOAD *pLoad;
+    uint64_t ewma;
+
+    if (pTable->pPartitionAdapter[index] == WLD_NO_INDEX)
+        return;
+
+    if (pTable->pMyInFlight)
+        atomic_fetch_sub_explicit(&pTable->pMyInFlight[pTable->pPartitionAdapter[index]], 1,
+            memory_order_relaxed);
+    pLoad = &pTable->pLoad[pTable->pPartitionAdapter[index]];
+    atomic_fetch_sub_explicit(&pLoad->inFlight, 1, memory_order_relaxed);
+
+    if (!ok)
+        return;
+
+    addWindowSample(&pTable->pWindow[pTable->pPartitionAdapter[index]], latencyNsec);
+
+    ewma = atomic_load_explicit(&pLoad->ewmaNsec, memory_order_relaxed);
+    if (ewma == 0)
+        ewma = latencyNsec;
+    else
+        ewma = ewma - (ewma >> WLD_EWMA_SHIFT) + (latencyNsec >> WLD_EWMA_SHIFT);
+    atomic_store_explicit(&pLoad->ewmaNsec, ewma, memory_order_relaxed);
+}
+
+// Map a WLD_POLICY environment value onto a policy
+static bool parseWLDPolicy(const char *pName, WLD_POLICY *pPolicy)
+{
+    if (strcmp(pName, "rr") == 0 || strcmp(pName, "roundrobin") == 0)
+        *pPolicy = WLD_POLICY_ROUND_ROBIN;
+    else if (strcmp(pName, "least") == 0 || strcmp(pName, "leastoutstanding") == 0)
+        *pPolicy = WLD_POLICY_LEAST_OUTSTANDING;
+    else if (strcmp(pName, "ewma") == 0)
+        *pPolicy = WLD_POLICY_EWMA_LATENCY;
+    else if (strcmp(pName, "p2c") == 0)
+        *pPolicy = WLD_POLICY_POWER_OF_TWO;
+    else if (strcmp(pName, "adapter") == 0 || strcmp(pName, "adapterroundrobin") == 0)
+        *pPolicy = WLD_POLICY_ADAPTER_ROUND_ROBIN;
+    else
+        return false;
+
+    return true;
+}
+
+// Get the index for the Partition table for this slot, or
+// pTable->count if the slot is not in the table
+static uint32_t getWLD_HSMIndexFromSlot(const WLD_TABLE *pTable, uint32_t slotID)
+{
+    uint32_t h = hashWLDSlot(slotID) & pTable->slotMask;
+    uint32_t index;
+
+    while ((index = pTable->pSlotIndex[h]) != WLD_NO_INDEX)
+    {
+        if (pTable->pPartitions[index].slot == slotID)
+            return index;
+        h = (h + 1) & pTable->slotMask;
+    }
+
+    return pTable->count;
+}
+
+// Find the partition of a slot with a known adapter in the current
+// table or, while it drains, the table ReconfigureWLD replaced.  Call
+// between enterWLD and leaveWLD.  Returns the table the slot was found
+// in, NULL if it is in neither.
+static WLD_TABLE *findWLDSlot(WLD_TABLE *pTable, uint32_t slotID, uint32_t *pIndex)
+{
+    uint32_t pass;
+    uint32_t index;
+
+    for (pass=0; pTable && pass < 2; pass++)
+    {
+        index = getWLD_HSMIndexFromSlot(pTable, slotID);
+        if (index < pTable->count && pTable->pPartitions[index].hsmID != WLD_NO_INDEX)
+        {
+            *pIndex = index;
+            return pTable;
+        }
+
+        pTable = atomic_load_explicit(&WLD_Draining, memory_order_seq_cst);
+    }
+
+    return NULL;
+}
+
+// Set all the slots for this adapter to inactive
+static void SetHSMInactive(WLD_TABLE *pTable, uint32_t adapter)
+{
+    const WLD_ADAPTER *pAdapter = getWLD_AdapterFromHSMIndex(pTable, adapter);
+    uint32_t i;
+
+    if (!pAdapter)
+        return;
+
+    for(i=0; i < pAdapter->count; i++)
+    {
+        setPartitionActive(pTable, pTable->pAdapterPartitions[pAdapter->first + i], false);
+    }
+
+    return;
+}
+
+/*
+    Circuit breaker
+
+    A failed command opens the breaker of its adapter: its partitions
+    are set inactive and the health prober thread retries the adapter
+    after an exponential, jittered backoff.  A probe is MD_GetHsmState
+    plus an FM ping.  When it passes, the partitions are reactivated
+    half open and the adapter's traffic share is ramped up in rampSteps
+    steps before the breaker closes.  A failure while half open opens
+    the breaker again with a longer backoff.
+*/
+
+// Backoff before the next probe after the given number of trips in a
+// row, +/- 25% so that adapters do not get probed in lock step
+static uint64_t wldBackoffNsec(uint32_t trips)
+{
+    uint64_t msec = WLD_HealthConfig.backoffMinMsec;
+
+    while (--trips && msec < WLD_HealthConfig.backoffMaxMsec)
+        msec *= 2;
+    if (msec > WLD_HealthConfig.backoffMaxMsec)
+        msec = WLD_HealthConfig.backoffMaxMsec;
+
+    return msec * (750000ULL + (wldRandom() % 500000ULL));
+}
+
+// Check whether any partition of an adapter is active
+static bool adapterHasActivePartition(const WLD_TABLE *pTable, uint32_t adapterIndex)
+{
+    const WLD_ADAPTER *pAdapter = &pTable->pAdapters[adapterIndex];
+    uint32_t i;
+
+    for (i=0; i < pAdapter->count; i++)
+    {
+        if (isPartitionActive(pTable, pTable->pAdapterPartitions[pAdapter->first + i]))
+            return true;
+    }
+
+    return false;
+}
+
+// Open the breaker of an adapter.  Call with health_mutex held.
+static void openWLDAdapter(WLD_TABLE *pTable, uint32_t adapterIndex, uint64_t now)
+{
+    WLD_ADAPTER_HEALTH *pHealth = &pTable->pHealth[adapterIndex];
+
+    SetHSMInactive(pTable, pTable->pAdapters[adapterIndex].hsmID);
+
+    pHealth->trips++;
+    pHealth->retryAtNsec = now + wldBackoffNsec(pHealth->trips);
+    atomic_store_explicit(&pTable->pLoad[adapterIndex].admitPermille, 0, memory_order_relaxed);
+    atomic_store_explicit(&pHealth->state, WLD_ADAPTER_OPEN, memory_order_release);
+    if (pTable->pShared)
+        wldShmSetProbing(pTable->pShared, adapterIndex, true);
+}
+
+// Check that an adapter is back: it reports normal operation and the
+// FM answers a ping.  Any FM status counts as an answer, so FMs that
+// do not know the ping are fine too.
+static bool probeWLDAdapter(uint32_t hsmID, uint16_t fmNumber, uint32_t timeout)
+{
+    MD_Buffer_t request[2];
+    MD_Buffer_t reply;
+    HsmState_t hsmState;
+    WLD_MSG_PING ping = { WLD_FM_PING_MAGIC };
+    uint8_t wire[WLD_MSG_PING_WIRE_LEN];
+    uint32_t recvlen = 0;
+    uint32_t appState = 0;
+
+    if (MD_GetHsmState(hsmID, &hsmState, NULL) != MDR_OK || hsmState != S_NORMAL_OPERATION)
+        return false;
+
+    if (fmNumber == 0)
+        return true;
+
+    WLD_MSG_PING_Encode(&ping, wire);
+    request[0].pData = wire;
+    request[0].length = sizeof(wire);
+    request[1].pData = NULL;
+    request[1].length = 0;
+
+    reply.pData = NULL;
+    reply.length = 0;
+
+    return MD_SendReceive(hsmID, 0, fmNumber, request, timeout,
+        &reply, &recvlen, &appState) == MDR_OK;
+}
+
+// Reactivate the partitions of an adapter that passed its probe,
+// resolving the embedded slot of any that were not usable at
+// InitializeWLD time
+static void reactivateWLDAdapter(WLD_TABLE *pTable, uint32_t adapterIndex)
+{
+    const WLD_ADAPTER *pAdapter = &pTable->pAdapters[adapterIndex];
+    WLD_PARTITION *pPart;
+    unsigned long int embSlot;
+    uint32_t index;
+    uint32_t i;
+
+    for (i=0; i < pAdapter->count; i++)
+    {
+        index = pTable->pAdapterPartitions[pAdapter->first + i];
+        pPart = &pTable->pPartitions[index];
+
+        // The adapter came back as a whole, so do its partitions
+        if (!atomic_load_explicit(&pPart->active, memory_order_relaxed))
+        {
+            if (MD_GetEmbeddedSlotID(pPart->slot, &embSlot) != MDR_OK)
+                continue;
+            pTable->pPartitionHealth[index].retryAtNsec = 0;
+            activateWLDPartition(pTable, index, (uint32_t)embSlot);
+            continue;
+        }
+
+        pTable->pPartitionHealth[index].retryAtNsec = 0;
+        setPartitionActive(pTable, index, true);
+    }
+}
+
+// Check the partitions of an adapter that were taken out on their own
+// whose backoff has expired: one whose embedded slot resolves again is
+// put back in rotation.  Call with health_mutex held, which is dropped
+// around each check.  False if the table was replaced meanwhile.
+static bool probeWLDPartitions(WLD_TABLE *pTable, uint32_t adapterIndex, uint32_t generation)
+{
+    const WLD_ADAPTER *pAdapter = &pTable->pAdapters[adapterIndex];
+    WLD_PARTITION_HEALTH *pFault;
+    WLD_PARTITION *pPart;
+    unsigned long int embSlot;
+    MD_RV mdResult;
+    uint32_t index;
+    uint32_t i;
+
+    for (i=0; i < pAdapter->count; i++)
+    {
+        index = pTable->pAdapterPartitions[pAdapter->first + i];
+        pFault = &pTable->pPartitionHealth[index];
+        pPart = &pTable->pPartitions[index];
+        if (pFault->retryAtNsec == 0 || wldNowNsec() < pFault->retryAtNsec)
+            continue;
+
+        pthread_mutex_unlock(&health_mutex);
+        mdResult = MD_GetEmbeddedSlotID(pPart->slot, &embSlot);
+        pthread_mutex_lock(&health_mutex);
+
+        if (WLD_TableGeneration != generation)
+            return false;
+
+        // The adapter's breaker opened meanwhile and takes over
+        if (pFault->retryAtNsec == 0 ||
+            atomic_load_explicit(&pTable->pHealth[adapterIndex].state, memory_order_relaxed) == WLD_ADAPTER_OPEN)
+            continue;
+
+        if (mdResult != MDR_OK)
+        {
+            pFault->trips++;
+            pFault->retryAtNsec = wldNowNsec() + wldBackoffNsec(pFault->trips);
+            continue;
+        }
+
+        pFault->retryAtNsec = 0;
+        activateWLDPartition(pTable, index, (uint32_t)embSlot);
+#if DEBUG_WLD
+        printf("\nWLD: slot %u is back in rotation\n", pPart->slot);
+#endif
+    }
+
+    return true;
+}
+
+// Take back what processes that died left in the segment of a shared
+// table: their requests in flight, and the adapters and partitions
+// only they were probing, which this process probes from now on.  An
+// adapter they were ramping back carries on ramping.  Call with
+// health_mutex held.
+static void reclaimWLDShared(WLD_TABLE *pTable)
+{
+    WLD_ADAPTER_HEALTH *pHealth;
+    uint32_t *pInFlight;
+    bool *pOrphaned;
+    uint32_t adapter;
+    uint32_t admit;
+    uint64_t now;
+    uint32_t i;
+
+    pInFlight = calloc(pTable->adapterCount ? pTable->adapterCount : 1, sizeof(uint32_t));
+    pOrphaned = calloc(pTable->adapterCount ? pTable->adapterCount : 1, sizeof(bool));
+    if (!pInFlight || !pOrphaned || wldShmReclaim(pTable->pShared, pInFlight, pOrphaned) == 0)
+    {
+        free(pInFlight);
+        free(pOrphaned);
+        return;
+    }
+
+    now = wldNowNsec();
+    for (i=0; i < pTable->adapterCount; i++)
+    {
+        pHealth = &pTable->pHealth[i];
+        if (pInFlight[i])
+            atomic_fetch_sub_explicit(&pTable->pLoad[i].inFlight, pInFlight[i], memory_order_relaxed);
+
+        if (!pOrphaned[i] || atomic_load_explicit(&pHealth->state, memory_order_relaxed) != WLD_ADAPTER_CLOSED)
+            continue;
+
+        admit = atomic_load_explicit(&pTable->pLoad[i].admitPermille, memory_order_relaxed);
+        if (!adapterHasActivePartition(pTable, i))
+        {
+            openWLDAdapter(pTable, i, now);
+#if DEBUG_WLD
+            printf("\nWLD: probing adapter %u for a process that exited\n", pTable->pAdapters[i].hsmID);
+#endif
+        }
+        else if (admit < WLD_ADMIT_FULL)
+        {
+            pHealth->rampStep = admit * WLD_HealthConfig.rampSteps / WLD_ADMIT_FULL;
+            pHealth->rampAtNsec = now + WLD_HealthConfig.rampStepMsec * 1000000ULL;
+            atomic_store_explicit(&pHealth->state, WLD_ADAPTER_HALF_OPEN, memory_order_release);
+            wldShmSetProbing(pTable->pShared, i, true);
+        }
+    }
+
+    // Partitions out of rotation on their own are checked here as well
+    for (i=0; i < pTable->count; i++)
+    {
+        adapter = pTable->pPartitionAdapter[i];
+        if (!atomic_load_explicit(&pTable->pPartitions[i].active, memory_order_relaxed) &&
+            adapter != WLD_NO_INDEX &&
+            pTable->pPartitionHealth[i].retryAtNsec == 0 &&
+            atomic_load_explicit(&pTable->pHealth[adapter].state, memory_order_relaxed) == WLD_ADAPTER_CLOSED)
+            pTable->pPartitionHealth[i].retryAtNsec = now;
+    }
+
+    free(pInFlight);
+    free(pOrphaned);
+}
+
+// Health prober thread: probe open adapters when their backoff expires
+// and step the traffic share of half open ones.  On a shared table it
+// also takes back the share of processes that died.
+static void *healthMonitor(void *pArg)
+{
+    WLD_TABLE *pTable;
+    WLD_ADAPTER_HEALTH *pHealth;
+    struct timespec deadline;
+    uint64_t now, nsec;
+    uint64_t reclaimAtNsec = 0;
+    uint32_t hsmID;
+    uint32_t timeout;
+    uint32_t generation;
+    uint32_t i;
+    uint16_t fmNumber;
+    bool ok;
+
+    (void)pArg;
+
+    pthread_mutex_lock(&health_mutex);
+
+    while (!healthStop)
+    {
+        pTable = atomic_load_explicit(&WLD_Table, memory_order_acquire);
+        generation = WLD_TableGeneration;
+
+        for (i=0; pTable && i < pTable->adapterCount && !healthStop; i++)
+        {
+            pHealth = &pTable->pHealth[i];
+            hsmID = pTable->pAdapters[i].hsmID;
+            now = wldNowNsec();
+
+            switch (atomic_load_explicit(&pHealth->state, memory_order_relaxed))
+            {
+                case WLD_ADAPTER_OPEN:
+                    if (now < pHealth->retryAtNsec)
+                        break;
+
+                    // Probe without holding the lock - it may take a while
+                    fmNumber = WLD_HealthConfig.pingFmNumber;
+                    timeout = WLD_HealthConfig.probeTimeoutMsec;
+                    pthread_mutex_unlock(&health_mutex);
+                    ok = probeWLDAdapter(hsmID, fmNumber, timeout);
+                    pthread_mutex_lock(&health_mutex);
+
+                    // The table was replaced (and may be gone) meanwhile
+                    if (WLD_TableGeneration != generation)
+                    {
+                        pTable = NULL;
+                        break;
+                    }
+
+                    if (atomic_load_explicit(&pHealth->state, memory_order_relaxed) != WLD_ADAPTER_OPEN)
+                        break;
+
+                    now = wldNowNsec();
+                    if (!ok)
+                    {
+                        pHealth->trips++;
+                        pHealth->retryAtNsec = now + wldBackoffNsec(pHealth->trips);
+                        break;
+                    }
+
+                    pHealth->rampStep = 1;
+                    pHealth->rampAtNsec = now + WLD_HealthConfig.rampStepMsec * 1000000ULL;
+                    atomic_store_explicit(&pTable->pLoad[i].admitPermille,
+                        WLD_ADMIT_FULL / WLD_HealthConfig.rampSteps, memory_order_relaxed);
+                    atomic_store_explicit(&pHealth->state, WLD_ADAPTER_HALF_OPEN, memory_order_release);
+                    reactivateWLDAdapter(pTable, i);
+#if DEBUG_WLD
+                    printf("\nWLD: adapter %u passed its probe - ramping traffic back\n", hsmID);
+#endif
+                    break;
+
+                case WLD_ADAPTER_HALF_OPEN:
+                    if (now < pHealth->rampAtNsec)
+                        break;
+
+                    if (++pHealth->rampStep < WLD_HealthConfig.rampSteps)
+                    {
+                        pHealth->rampAtNsec = now + WLD_HealthConfig.rampStepMsec * 1000000ULL;
+                        atomic_store_explicit(&pTable->pLoad[i].admitPermille,
+                            WLD_ADMIT_FULL * pHealth->rampStep / WLD_HealthConfig.rampSteps,
+                            memory_order_relaxed);
+                        break;
+                    }
+
+                    pHealth->trips = 0;
+                    atomic_store_explicit(&pTable->pLoad[i].admitPermille, WLD_ADMIT_FULL, memory_order_relaxed);
+                    atomic_store_explicit(&pHealth->state, WLD_ADAPTER_CLOSED, memory_order_release);
+                    if (pTable->pShared)
+                        wldShmSetProbing(pTable->pShared, i, false);
+#if DEBUG_WLD
+                    printf("\nWLD: adapter %u recovered\n", hsmID);
+#endif
+                    break;
+
+                default:
+                    break;
+            }
+
+            if (pTable && atomic_load_explicit(&pHealth->state, memory_order_relaxed) != WLD_ADAPTER_OPEN &&
+                !probeWLDPartitions(pTable, i, generation))
+                pTable = NULL;
+        }
+
+        pTable = atomic_load_explicit(&WLD_Table, memory_order_acquire);
+        if (pTable && pTable->pShared && !healthStop && wldNowNsec() >= reclaimAtNsec)
+        {
+            reclaimWLDShared(pTable);
+            reclaimAtNsec = wldNowNsec() + WLD_SHM_RECLAIM_MSEC * 1000000ULL;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        nsec = (uint64_t)deadline.tv_nsec + WLD_HealthConfig.probeIntervalMsec * 1000000ULL;
+        deadline.tv_sec += nsec / 1000000000ULL;
+        deadline.tv_nsec = nsec % 1000000000ULL;
+        (void)pthread_cond_timedwait(&health_cond, &health_mutex, &deadline);
+    }
+
+    pthread_mutex_unlock(&health_mutex);
+
+    return NULL;
+}
+
+// Start the prober thread if it is not running.  Call with
+// health_mutex held.
+static void startWLDHealthMonitor(void)
+{
+    pthread_condattr_t attr;
+
+    if (healthRunning)
+        return;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&health_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    healthStop = false;
+    if (pthread_create(&healthThread, NULL, healthMonitor, NULL) == 0)
+        healthRunning = true;
+    else
+        printf("\nWLD: failed to start the health prober - failed adapters stay inactive\n");
+}
+
+// An adapter failed a command - open its breaker and let the prober
+// take it from there.  The breaker is in the current table, which may
+// have replaced the one the command was sent with.
+static void tripWLDAdapter(uint32_t hsmID)
+{
+    WLD_TABLE *pTable;
+    const WLD_ADAPTER *pAdapter;
+    uint32_t adapterIndex;
+
+    pthread_mutex_lock(&health_mutex);
+
+    // Tables are only swapped with health_mutex held
+    pTable = atomic_load_explicit(&WLD_Table, memory_order_acquire);
+    pAdapter = pTable ? getWLD_AdapterFromHSMIndex(pTable, hsmID) : NULL;
+    if (pAdapter)
+    {
+        adapterIndex = (uint32_t)(pAdapter - pTable->pAdapters);
+        if (atomic_load_explicit(&pTable->pHealth[adapterIndex].state, memory_order_relaxed) != WLD_ADAPTER_OPEN)
+        {
+            openWLDAdapter(pTable, adapterIndex, wldNowNsec());
+            startWLDHealthMonitor();
+            wldStatsRecordDeactivation(pTable->statPartitions, pTable->hsmMapSize, hsmID);
+        }
+    }
+
+    pthread_mutex_unlock(&health_mutex);
+}
+
+// A partition's FM reported that the partition is not there - take only
+// that partition out of rotation, and let the prober check it again
+// after a backoff.  Trips long apart start the backoff over.
+static void tripWLDPartition(uint32_t slotID)
+{
+    WLD_TABLE *pTable;
+    WLD_PARTITION_HEALTH *pFault;
+    uint32_t index;
+    uint64_t now;
+
+    pthread_mutex_lock(&health_mutex);
+
+    pTable = atomic_load_explicit(&WLD_Table, memory_order_acquire);
+    index = pTable ? getWLD_HSMIndexFromSlot(pTable, slotID) : 0;
+    if (pTable && index < pTable->count &&
+        atomic_load_explicit(&pTable->pPartitions[index].active, memory_order_relaxed))
+    {
+        pFault = &pTable->pPartitionHealth[index];
+        now = wldNowNsec();
+        if (now - pFault->trippedAtNsec > WLD_HealthConfig.backoffMaxMsec * 2000000ULL)
+            pFault->trips = 0;
+
+        deactivateWLDPartition(pTable, index);
+        pFault->trips++;
+        pFault->trippedAtNsec = now;
+        pFault->retryAtNsec = now + wldBackoffNsec(pFault->trips);
+        startWLDHealthMonitor();
+        wldStatsRecordDeactivation(pTable->statPartitions, pTable->hsmMapSize,
+            pTable->pPartitions[index].hsmID);
+    }
+
+    pthread_mutex_unlock(&health_mutex);
+}
+
+/*
+    Host-wide sharing
+
+    With WLD_SHARED (see SetWLDShared) a table is published into a
+    shared memory segment used by every process on the host whose table
+    has the same slots, adapters and weights.  The round-robin cursor,
+    the active bitmap, the partitions and the adapter loads are then
+    host-wide: the processes spread their requests together, the load
+    policies see everybody's requests in flight, and a breaker opened
+    by one process takes the adapter out for all of them.  The process
+    that opened it probes it and brings it back for everyone.  Breaker
+    backoff, latency windows and statistics stay per process.
+*/
+
+// Identify the layout of a table
+static uint64_t hashWLDLayout(const WLD_TABLE *pTable)
+{
+    uint64_t hash = mixWLDHash(((uint64_t)pTable->count << 32) | pTable->adapterCount);
+    uint32_t i;
+
+    for (i=0; i < pTable->count; i++)
+    {
+        hash = mixWLDHash(hash ^ (((uint64_t)pTable->pPartitions[i].slot << 32) |
+            pTable->pPartitions[i].hsmID));
+        hash = mixWLDHash(hash ^ pTable->pPartitions[i].weight);
+    }
+
+    return hash;
+}
+
+// Move a table that is about to be published into the segment of its
+// layout.  The first process in brings its state along.  One that
+// joins takes the host-wide state, adds the embedded slots only it has
+// resolved and closes the breakers of adapters that serve the others.
+// The private partitions are kept, as discovery may still read them.
+// Call with health_mutex held.
+static void shareWLDTable(WLD_TABLE *pTable)
+{
+    WLD_SHM_LAYOUT layout;
+    WLD_PARTITION *pParts;
+    _Atomic uint64_t *pActive;
+    WLD_ADAPTER_LOAD *pLoad;
+    WLD_SHM *pShm;
+    bool first;
+    int state;
+    uint32_t i;
+
+    layout.hash = hashWLDLayout(pTable);
+    layout.partitions = pTable->count;
+    layout.words = pTable->words;
+    layout.adapters = pTable->adapterCount;
+    layout.partitionSize = sizeof(WLD_PARTITION);
+    layout.loadSize = sizeof(WLD_ADAPTER_LOAD);
+
+    pShm = wldShmAttach(&layout, &first);
+    if (!pShm)
+        return;
+
+    pParts = (WLD_PARTITION *)wldShmPartitions(pShm);
+    pActive = wldShmActive(pShm);
+    pLoad = (WLD_ADAPTER_LOAD *)wldShmLoad(pShm);
+
+    if (first)
+    {
+        for (i=0; i < pTable->count; i++)
+        {
+            pParts[i].slot = pTable->pPartitions[i].slot;
+            pParts[i].hsmID = pTable->pPartitions[i].hsmID;
+            pParts[i].weight = pTable->pPartitions[i].weight;
+            atomic_store_explicit(&pParts[i].embeddedSlot,
+                loadWLDEmbeddedSlot(&pTable->pPartitions[i]), memory_order_relaxed);
+            atomic_store_explicit(&pParts[i].active,
+                atomic_load_explicit(&pTable->pPartitions[i].active, memory_order_relaxed),
+                memory_order_relaxed);
+        }
+        for (i=0; i < pTable->words; i++)
+            atomic_store_explicit(&pActive[i],
+                atomic_load_explicit(&pTable->pActive[i], memory_order_relaxed), memory_order_relaxed);
+        for (i=0; i < (pTable->adapterCount ? pTable->adapterCount : 1); i++)
+        {
+            atomic_store_explicit(&pLoad[i].inFlight, 0, memory_order_relaxed);
+            atomic_store_explicit(&pLoad[i].admitPermille,
+                atomic_load_explicit(&pTable->pLoad[i].admitPermille, memory_order_relaxed),
+                memory_order_relaxed);
+            atomic_store_explicit(&pLoad[i].ewmaNsec,
+                atomic_load_explicit(&pTable->pLoad[i].ewmaNsec, memory_order_relaxed),
+                memory_order_relaxed);
+        }
+    }
+
+    free((void *)pTable->pActive);
+    free(pTable->pLoad);
+    pTable->pOwnPartitions = pTable->pPartitions;
+    pTable->pPartitions = pParts;
+    pTable->pActive = pActive;
+    pTable->pLoad = pLoad;
+    pTable->pCursor = wldShmCursor(pShm);
+    pTable->pMyInFlight = wldShmInFlight(pShm);
+    pTable->pShared = pShm;
+
+    // Activate through the shared bitmap as well, or the others never
+    // route to the partition
+    for (i=0; !first && i < pTable->count; i++)
+    {
+        if (!atomic_load_explicit(&pParts[i].active, memory_order_acquire) &&
+            atomic_load_explicit(&pTable->pOwnPartitions[i].active, memory_order_relaxed))
+            activateWLDPartition(pTable, i, loadWLDEmbeddedSlot(&pTable->pOwnPartitions[i]));
+    }
+
+    for (i=0; i < pTable->adapterCount; i++)
+    {
+        state = atomic_load_explicit(&pTable->pHealth[i].state, memory_order_relaxed);
+        if (!first && state == WLD_ADAPTER_OPEN && adapterHasActivePartition(pTable, i))
+        {
+            pTable->pHealth[i].trips = 0;
+            atomic_store_explicit(&pTable->pHealth[i].state, WLD_ADAPTER_CLOSED, memory_order_release);
+        }
+        else if (state != WLD_ADAPTER_CLOSED)
+            wldShmSetProbing(pShm, i, true);
+    }
+
+    wldShmUnlock(pShm);
+
+    // The prober also takes back the share of processes that die
+    startWLDHealthMonitor();
+}
+
+// Append a slot and its weight (0 = not given) to a growable slot list
+static bool appendWLDSlot(uint32_t **ppSlots, uint32_t *pCount, uint32_t *pCapacity,
+    uint32_t slot, uint32_t weight)
+{
+    uint32_t *pNew;
+
+    if (*pCount == *pCapacity)
+    {
+        *pCapacity = *pCapacity ? *pCapacity * 2 : 32;
+        pNew = realloc(*ppSlots, *pCapacity * 2 * sizeof(uint32_t));
+        if (!pNew)
+            return false;
+        *ppSlots = pNew;
+    }
+
+    (*ppSlots)[*pCount * 2] = slot;
+    (*ppSlots)[*pCount * 2 + 1] = weight;
+    (*pCount)++;
+    return true;
+}
+
+// Parse one WLD_SLOT_LIST entry: "slot" or "slot:weight"
+static bool parseWLDSlotEntry(const char *pEntry, uint32_t *pSlot, uint32_t *pWeight)
+{
+    char *pEnd;
+    unsigned long value;
+
+    value = strtoul(pEntry, &pEnd, 10);
+    if (pEnd == pEntry || value > UINT32_MAX)
+        return false;
+    *pSlot = (uint32_t)value;
+    *pWeight = 0;
+
+    if (*pEnd == ':')
+    {
+        pEntry = pEnd + 1;
+        value = strtoul(pEntry, &pEnd, 10);
+        if (pEnd == pEntry || value == 0 || value > WLD_MAX_WEIGHT)
+            return false;
+        *pWeight = (uint32_t)value;
+    }
+
+    return *pEnd == '\0';
+}
+
+// Read the slot list: the contents of the file named by WLD_SLOT_FILE
+// ('#' starts a comment), otherwise WLD_SLOT_LIST.  Returns a copy for
+// the caller to free, NULL if neither is set or the file is unreadable.
+static char *readWLDSlotSpec(void)
+{
+    const char *pPath = getenv( "WLD_SLOT_FILE" );
+    const char *pList;
+    FILE *pFile;
+    char *pSpec;
+    char *pNew;
+    size_t len = 0;
+    size_t capacity = 256;
+    bool comment = false;
+    int c;
+
+    if (pPath == NULL)
+    {
+        pList = getenv( "WLD_SLOT_LIST" );
+        return pList ? strdup(pList) : NULL;
+    }
+
+    pFile = fopen(pPath, "r");
+    if (!pFile)
+    {
+        printf("\nWLD: cannot read WLD_SLOT_FILE %s\n", pPath);
+        return NULL;
+    }
+
+    pSpec = malloc(capacity);
+    while (pSpec && (c = getc(pFile)) != EOF)
+    {
+        if (c == '#')
+            comment = true;
+        else if (c == '\n')
+            comment = false;
+        if (comment)
+            continue;
+
+        if (len + 1 == capacity)
+        {
+            capacity *= 2;
+            pNew = realloc(pSpec, capacity);
+            if (!pNew)
+            {
+                free(pSpec);
+                pSpec = NULL;
+                break;
+            }
+            pSpec = pNew;
+        }
+        pSpec[len++] = (char)c;
+    }
+
+    if (pSpec)
+        pSpec[len] = '\0';
+    fclose(pFile);
+
+    return pSpec;
+}
+
+// Build an unpublished table - every partition inactive, adapters not
+// known yet - from a slot list or, with pSlotList NULL, from
+// WLD_SLOT_FILE / WLD_SLOT_LIST.  On failure *pRv says why: a weight
+// out of range or an entry that does not parse is
+// WLDR_INVALID_PARAMETER.
+static WLD_TABLE *buildWLDTable(const uint32_t *pSlotList, const uint32_t *pWeights,
+    uint32_t numSlots, WLD_RV *pRv)
+{
+    WLD_TABLE *pTable = NULL;
+    char *pSpec = NULL;
+    char *pSave = NULL;
+    char *part = NULL;
+    uint32_t *pSlots = NULL;
+    uint32_t slot, weight;
+    uint32_t slotCount = 0;
+    uint32_t slotCapacity = 0;
+    uint32_t i;
+
+    *pRv = WLDR_NO_SLOT_AVAILABLE;
+
+    if (pSlotList)
+    {
+        for (i=0; i < numSlots; i++)
+        {
+            weight = pWeights ? pWeights[i] : 0;
+            if (weight > WLD_MAX_WEIGHT)
+            {
+                printf("\nInvalid WLD weight %u for slot %u\n", weight, pSlotList[i]);
+                *pRv = WLDR_INVALID_PARAMETER;
+                break;
+            }
+            if (!appendWLDSlot(&pSlots, &slotCount, &slotCapacity, pSlotList[i], weight))
+                break;
+        }
+    }
+    else
+    {
+        // Tokenize a copy: strtok on the getenv() string would cut up
+        // the environment, so the list could not be read again
+        pSpec = readWLDSlotSpec();
+        if (pSpec == NULL)
+        {
+            *pRv = WLDR_NO_SLOTLIST_DEFINED;
+            return NULL;
+        }
+
+        // Entries are "slot" or "slot:weight", e.g. "3:4,5:1"
+        part = strtok_r(pSpec, " ,\t\r\n", &pSave);
+        while (part != NULL)
+        {
+            if (!parseWLDSlotEntry(part, &slot, &weight))
+            {
+                printf("\nInvalid WLD slot list entry '%s'\n", part);
+                *pRv = WLDR_INVALID_PARAMETER;
+                break;
+            }
+            if (!appendWLDSlot(&pSlots, &slotCount, &slotCapacity, slot, weight))
+                break;
+            part = strtok_r(NULL, " ,\t\r\n", &pSave);
+        }
+    }
+
+    // Allocate a zeroized Partition Lookup Table sized to the slot list
+    if (pSlotList ? slotCount == numSlots : part == NULL)
+        pTable = allocWLDTable(slotCount);
+
+    for (i=0; pTable && i < slotCount; i++)
+    {
+        pTable->pPartitions[i].slot = pSlots[i * 2];
+        pTable->pPartitions[i].weight = pSlots[i * 2 + 1];
+        pTable->pPartitions[i].hsmID = WLD_NO_INDEX;
+    }
+
+    free(pSlots);
+    free(pSpec);
+
+    return pTable;
+}
+
+// Determine which adapter (hsmID) each partition targets - a local
+// lookup, so it is never taken from the topology cache or an old table
+static void resolveWLDAdapters(WLD_TABLE *pTable)
+{
+    WLD_PARTITION *pPart;
+    MD_RV mdResult;
+    uint32_t i;
+
+    for (i=0; i < pTable->count; i++)
+    {
+        pPart = &pTable->pPartitions[i];
+        mdResult = MD_GetHsmIndexForSlot(pPart->slot, &pPart->hsmID);
+        if (mdResult != MDR_OK)
+        {
+            pPart->hsmID = WLD_NO_INDEX;
+            printf("\nError setting up WLD Table: slot=%u, mdResult=%x\n", pPart->slot, mdResult);
+        }
+    }
+}
+
+typedef struct WLD_CALIBRATE_ARG {
+    uint32_t hsmID;
+    uint16_t fmNumber;
+    uint64_t endNsec;
+    _Atomic uint64_t completed;
+} WLD_CALIBRATE_ARG;
+
+// Calibration thread: ping one adapter until the end time
+static void *calibrateWorker(void *pArg)
+{
+    WLD_CALIBRATE_ARG *pCal = (WLD_CALIBRATE_ARG *)pArg;
+    MD_Buffer_t request[2];
+    MD_Buffer_t reply;
+    WLD_MSG_PING ping = { WLD_FM_PING_MAGIC };
+    uint8_t wire[WLD_MSG_PING_WIRE_LEN];
+    uint32_t recvlen;
+    uint32_t appState;
+
+    WLD_MSG_PING_Encode(&ping, wire);
+    request[0].pData = wire;
+    request[0].length = sizeof(wire);
+    request[1].pData = NULL;
+    request[1].length = 0;
+    reply.pData = NULL;
+    reply.length = 0;
+
+    while (wldNowNsec() < pCal->endNsec)
+    {
+        recvlen = 0;
+        appState = 0;
+        if (MD_SendReceive(pCal->hsmID, 0, pCal->fmNumber, request, 1000,
+            &reply, &recvlen, &appState) != MDR_OK)
+            break;
+        atomic_fetch_add_explicit(&pCal->completed, 1, memory_order_relaxed);
+    }
+
+    return NULL;
+}
+
+// Give partitions without an explicit weight a weight in proportion to
+// the FM ping throughput of their adapter, shared among the partitions
+// on it.  All adapters are measured at the same time for msec.
+static void calibrateWLDWeights(WLD_TABLE *pTable, uint32_t msec)
+{
+    WLD_CALIBRATE_ARG *pCal;
+    pthread_t *pThreads;
+    uint64_t best = 0;
+    uint64_t rate;
+    uint32_t started = 0;
+    uint32_t adapter;
+    uint32_t i, t;
+    uint16_t fmNumber;
+
+    pthread_mutex_lock(&health_mutex);
+    fmNumber = WLD_HealthConfig.pingFmNumber;
+    pthread_mutex_unlock(&health_mutex);
+
+    if (pTable->adapterCount == 0 || fmNumber == 0)
+        return;
+
+    pCal = calloc(pTable->adapterCount, sizeof(WLD_CALIBRATE_ARG));
+    pThreads = calloc(pTable->adapterCount * WLD_CALIBRATE_THREADS, sizeof(pthread_t));
+    if (!pCal || !pThreads)
+    {
+        free(pCal);
+        free(pThreads);
+        return;
+    }
+
+    for (i=0; i < pTable->adapterCount; i++)
+    {
+        pCal[i].hsmID = pTable->pAdapters[i].hsmID;
+        pCal[i].fmNumber = fmNumber;
+        pCal[i].endNsec = wldNowNsec() + (uint64_t)msec * 1000000ULL;
+        atomic_init(&pCal[i].completed, 0);
+
+        if (!adapterHasActivePartition(pTable, i))
+            continue;
+
+        for (t=0; t < WLD_CALIBRATE_THREADS; t++)
+        {
+            if (pthread_create(&pThreads[started], NULL, calibrateWorker, &pCal[i]) == 0)
+                started++;
+        }
+    }
+
+    for (t=0; t < started; t++)
+        pthread_join(pThreads[t], NULL);
+
+    for (i=0; i < pTable->adapterCount; i++)
+    {
+        rate = atomic_load(&pCal[i].completed) / (pTable->pAdapters[i].count ? pTable->pAdapters[i].count : 1);
+        if (rate > best)
+            best = rate;
+    }
+
+    for (i=0; best && i < pTable->count; i++)
+    {
+        adapter = pTable->pPartitionAdapter[i];
+        if (pTable->pPartitions[i].weight || adapter == WLD_NO_INDEX)
+            continue;
+
+        rate = atomic_load(&pCal[adapter].completed) / pTable->pAdapters[adapter].count;
+        pTable->pPartitions[i].weight = (uint32_t)((rate * WLD_CALIBRATE_SCALE + best / 2) / best);
+
+#if DEBUG_WLD
+        printf("WLD calibration: slot=%d, hsmID=%d, pings=%llu, weight=%d\n",
+            pTable->pPartitions[i].slot, pTable->pPartitions[i].hsmID,
+            (unsigned long long)atomic_load(&pCal[adapter].completed),
+            pTable->pPartitions[i].weight);
+#endif
+    }
+
+    free(pCal);
+    free(pThreads);
+}
+
+// Settle the partition weights - calibrated if asked, 1 where none
+// was given - and build the weighted round-robin schedule
+static bool weighWLDTable(WLD_TABLE *pTable, const char *pCalibrate)
+{
+    uint32_t i, j;
+
+    if (pCalibrate && atoi(pCalibrate) > 0)
+        calibrateWLDWeights(pTable, (uint32_t)atoi(pCalibrate));
+
+    for (i=0; i < pTable->count; i++)
+    {
+        if (pTable->pPartitions[i].weight == 0)
+            pTable->pPartitions[i].weight = 1;
+    }
+
+    for (i=0; i < pTable->adapterCount; i++)
+    {
+        pTable->pAdapters[i].weight = 0;
+        for (j=0; j < pTable->pAdapters[i].count; j++)
+            pTable->pAdapters[i].weight += pTable->pPartitions[
+                pTable->pAdapterPartitions[pTable->pAdapters[i].first + j]].weight;
+    }
+
+    return buildWLDSchedule(pTable);
+}
+
+/*
+    Discovery
+
+    InitializeWLD resolves the adapter of every partition locally, then
+    starts one thread per adapter that checks the adapter's state once
+    and resolves the embedded slots of its partitions.  The table is
+    published when every adapter has answered, when the discovery
+    timeout expires or - with WLD_READY=first - as soon as one partition
+    is usable.  Adapters that have not answered by then start with an
+    open breaker; when their thread finishes the prober is told to
+    probe them at once, so they ramp in like a recovered adapter.
+
+    With WLD_TOPOLOGY_CACHE=<file> the partitions found by the previous
+    run are marked active straight away and revalidated by the
+    discovery threads in the background.  The file is rewritten once
+    discovery is complete.
+*/
+
+typedef struct WLD_DISCOVERY WLD_DISCOVERY;
+
+typedef struct WLD_DISCOVERY_ADAPTER {
+    WLD_DISCOVERY *pDiscovery;
+    uint32_t adapterIndex;
+    bool skip;              // already known, not discovered
+    bool done;
+    bool ok;                // reported normal operation
+} WLD_DISCOVERY_ADAPTER;
+
+// Shared by InitializeWLD (or ReconfigureWLD) and the discovery
+// threads, freed by the last one out.  If the table was never
+// published it is freed with it, otherwise it is pinned until then.
+struct WLD_DISCOVERY {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t refs;
+    uint32_t pending;       // adapters still being discovered
+    uint32_t usable;        // adapters with a partition found usable
+    bool published;
+    WLD_TABLE *pTable;
+    uint32_t *pEmbedded;    // partition index -> embedded slot found, WLD_NO_INDEX if none
+    WLD_DISCOVERY_ADAPTER *pAdapters;
+    char *pCachePath;
+};
+
+static void releaseWLDDiscovery(WLD_DISCOVERY *pDisc)
+{
+    bool last;
+
+    pthread_mutex_lock(&pDisc->lock);
+    last = (--pDisc->refs == 0);
+    pthread_mutex_unlock(&pDisc->lock);
+
+    if (!last)
+        return;
+
+    if (!pDisc->published)
+        freeWLDTable(pDisc->pTable);
+    else
+        atomic_fetch_sub_explicit(&pDisc->pTable->pins, 1, memory_order_release);
+
+    pthread_cond_destroy(&pDisc->cond);
+    pthread_mutex_destroy(&pDisc->lock);
+    free(pDisc->pEmbedded);
+    free(pDisc->pAdapters);
+    free(pDisc->pCachePath);
+    free(pDisc);
+}
+
+static WLD_DISCOVERY *allocWLDDiscovery(WLD_TABLE *pTable, const char *pCachePath)
+{
+    WLD_DISCOVERY *pDisc = calloc(1, sizeof(WLD_DISCOVERY));
+    pthread_condattr_t attr;
+    uint32_t i;
+
+    if (!pDisc)
+        return NULL;
+
+    pDisc->pEmbedded = malloc((pTable->count ? pTable->count : 1) * sizeof(uint32_t));
+    pDisc->pAdapters = calloc(pTable->adapterCount ? pTable->adapterCount : 1, sizeof(WLD_DISCOVERY_ADAPTER));
+    pDisc->pCachePath = pCachePath ? strdup(pCachePath) : NULL;
+    if (!pDisc->pEmbedded || !pDisc->pAdapters || (pCachePath && !pDisc->pCachePath))
+    {
+        free(pDisc->pEmbedded);
+        free(pDisc->pAdapters);
+        free(pDisc->pCachePath);
+        free(pDisc);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pDisc->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pDisc->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pDisc->refs = 1;
+    pDisc->pTable = pTable;
+    atomic_fetch_add_explicit(&pTable->pins, 1, memory_order_relaxed);
+    for (i=0; i < pTable->count; i++)
+        pDisc->pEmbedded[i] = WLD_NO_INDEX;
+    for (i=0; i < pTable->adapterCount; i++)
+    {
+        pDisc->pAdapters[i].pDiscovery = pDisc;
+        pDisc->pAdapters[i].adapterIndex = i;
+    }
+
+    return pDisc;
+}
+
+// Mark the partitions listed in the topology cache as active.  Each
+// line is "slot hsmID embeddedSlot"; only the embedded slot is taken
+// from it, and only if the slot is still on the adapter it was on, so
+// call once the adapters are resolved.  Returns the number of
+// partitions taken from it.
+static uint32_t loadWLDTopology(WLD_TABLE *pTable, const char *pPath)
+{
+    WLD_PARTITION *pPart;
+    FILE *pFile;
+    char line[128];
+    unsigned int slot, hsmID, embSlot;
+    uint32_t loaded = 0;
+    uint32_t i;
+
+    pFile = fopen(pPath, "r");
+    if (!pFile)
+        return 0;
+
+    while (fgets(line, sizeof(line), pFile))
+    {
+        if (sscanf(line, "%u %u %u", &slot, &hsmID, &embSlot) != 3)
+            continue;
+
+        for (i=0; i < pTable->count; i++)
+        {
+            pPart = &pTable->pPartitions[i];
+            if (pPart->slot != slot || pPart->active || pPart->hsmID != hsmID)
+                continue;
+
+            pPart->embeddedSlot = embSlot;
+            pPart->active = true;
+            setPartitionActive(pTable, i, true);
+            loaded++;
+        }
+    }
+
+    fclose(pFile);
+
+    return loaded;
+}
+
+// Write the resolved partitions to the topology cache.  The file is
+// replaced atomically so a crash never leaves half of it behind.
+static void saveWLDTopology(WLD_TABLE *pTable, const char *pPath)
+{
+    const WLD_PARTITION *pPart;
+    uint32_t *pLines;       // slot, hsmID, embeddedSlot per line
+    FILE *pFile;
+    char *pTmpPath;
+    uint32_t lines = 0;
+    uint32_t i;
+    bool ok = true;
+
+    pLines = malloc((pTable->count ? pTable->count : 1) * 3 * sizeof(uint32_t));
+    pTmpPath = malloc(strlen(pPath) + 5);
+    if (!pLines || !pTmpPath)
+    {
+        free(pLines);
+        free(pTmpPath);
+        return;
+    }
+
+    // The prober may be resolving partitions at the same time
+    pthread_mutex_lock(&health_mutex);
+    for (i=0; i < pTable->count; i++)
+    {
+        pPart = &pTable->pPartitions[i];
+        if (!atomic_load_explicit(&pPart->active, memory_order_acquire) || pPart->hsmID == WLD_NO_INDEX)
+            continue;
+
+        pLines[lines * 3] = pPart->slot;
+        pLines[lines * 3 + 1] = pPart->hsmID;
+        pLines[lines * 3 + 2] = loadWLDEmbeddedSlot(pPart);
+        lines++;
+    }
+    pthread_mutex_unlock(&health_mutex);
+
+    sprintf(pTmpPath, "%s.tmp", pPath);
+    pFile = fopen(pTmpPath, "w");
+    if (pFile)
+    {
+        fprintf(pFile, "# WLD topology cache: slot hsmID embeddedSlot\n");
+        for (i=0; i < lines; i++)
+            fprintf(pFile, "%u %u %u\n", pLines[i * 3], pLines[i * 3 + 1], pLines[i * 3 + 2]);
+        ok = (fclose(pFile) == 0);
+    }
+
+    if (!pFile || !ok || rename(pTmpPath, pPath) != 0)
+    {
+        printf("\nWLD: failed to write the topology cache %s\n", pPath);
+        (void)remove(pTmpPath);
+    }
+
+    free(pLines);
+    free(pTmpPath);
+}
+
+// Bring what discovery found on an adapter into a table that is not
+// published yet
+static void applyWLDDiscovery(WLD_DISCOVERY *pDisc, uint32_t adapterIndex)
+{
+    WLD_TABLE *pTable = pDisc->pTable;
+    const WLD_ADAPTER *pAdapter = &pTable->pAdapters[adapterIndex];
+    WLD_PARTITION *pPart;
+    uint32_t index;
+    uint32_t i;
+
+    for (i=0; i < pAdapter->count; i++)
+    {
+        index = pTable->pAdapterPartitions[pAdapter->first + i];
+        pPart = &pTable->pPartitions[index];
+
+        pPart->active = (pDisc->pEmbedded[index] != WLD_NO_INDEX);
+        if (pPart->active)
+            pPart->embeddedSlot = pDisc->pEmbedded[index];
+        setPartitionActive(pTable, index, pPart->active);
+    }
+}
+
+// Bring what discovery found on an adapter into the published table.
+// An adapter found working that is still open is probed at once; one
+// that was serving from the topology cache has its partitions
+// corrected, or its breaker opened if it is not working.  Call with
+// health_mutex held.
+static void applyLateWLDDiscovery(WLD_DISCOVERY *pDisc, uint32_t adapterIndex)
+{
+    WLD_TABLE *pTable = pDisc->pTable;
+    WLD_ADAPTER_HEALTH *pHealth = &pTable->pHealth[adapterIndex];
+    const WLD_ADAPTER *pAdapter = &pTable->pAdapters[adapterIndex];
+    WLD_PARTITION *pPart;
+    uint32_t embSlot;
+    uint32_t index;
+    uint32_t i;
+
+    // Replaced by ReconfigureWLD, which carried over what was known
+    if (atomic_load_explicit(&WLD_Table, memory_order_relaxed) != pTable)
+        return;
+
+    if (atomic_load_explicit(&pHealth->state, memory_order_relaxed) == WLD_ADAPTER_OPEN)
+    {
+        if (pDisc->pAdapters[adapterIndex].ok && healthRunning)
+        {
+            pHealth->retryAtNsec = 0;
+            pthread_cond_signal(&health_cond);
+        }
+        return;
+    }
+
+    if (!pDisc->pAdapters[adapterIndex].ok)
+    {
+        openWLDAdapter(pTable, adapterIndex, wldNowNsec());
+        startWLDHealthMonitor();
+        wldStatsRecordDeactivation(pTable->statPartitions, pTable->hsmMapSize,
+            pTable->pAdapters[adapterIndex].hsmID);
+        return;
+    }
+
+    for (i=0; i < pAdapter->count; i++)
+    {
+        index = pTable->pAdapterPartitions[pAdapter->first + i];
+        pPart = &pTable->pPartitions[index];
+        embSlot = pDisc->pEmbedded[index];
+
+        if (atomic_load_explicit(&pPart->active, memory_order_relaxed) &&
+            atomic_load_explicit(&pPart->embeddedSlot, memory_order_relaxed) == embSlot)
+            continue;
+
+        // Take a stale partition out before changing it
+        deactivateWLDPartition(pTable, index);
+        if (embSlot != WLD_NO_INDEX)
+            activateWLDPartition(pTable, index, embSlot);
+    }
+}
+
+// Discovery thread of one adapter
+static void *discoverWorker(void *pArg)
+{
+    WLD_DISCOVERY_ADAPTER *pDA = (WLD_DISCOVERY_ADAPTER *)pArg;
+    WLD_DISCOVERY *pDisc = pDA->pDiscovery;
+    WLD_TABLE *pTable = pDisc->pTable;
+    const WLD_ADAPTER *pAdapter = &pTable->pAdapters[pDA->adapterIndex];
+    WLD_PARTITION *pPart;
+    HsmState_t hsmState = 0;
+    MD_RV mdResult;
+    unsigned long int embSlot;
+    uint32_t hsmID;
+    uint32_t index;
+    uint32_t i;
+    bool ok;
+    bool complete;
+
+    // Check the state of the HSM - once for all of its partitions
+    mdResult = MD_GetHsmState(pAdapter->hsmID, &hsmState, NULL);
+    ok = (mdResult == MDR_OK && hsmState == S_NORMAL_OPERATION);
+    if (!ok)
+        printf("\nError setting up WLD Table: hsmID=%u, mdResult=%x, hsmState=%x\n",
+            pAdapter->hsmID, mdResult, hsmState);
+
+    // Now get the embedded slot number (on that adapter) of each
+    // partition, checking that the partition still lives there
+    for (i=0; ok && i < pAdapter->count; i++)
+    {
+        index = pTable->pAdapterPartitions[pAdapter->first + i];
+        pPart = &pTable->pPartitions[index];
+
+        mdResult = MD_GetHsmIndexForSlot(pPart->slot, &hsmID);
+        if (mdResult == MDR_OK && hsmID != pAdapter->hsmID)
+        {
+            printf("\nWLD: slot %u moved from hsmID %u to %u - reconfigure to use it\n",
+                pPart->slot, pAdapter->hsmID, hsmID);
+            continue;
+        }
+
+        if (mdResult == MDR_OK)
+            mdResult = MD_GetEmbeddedSlotID(pPart->slot, &embSlot);
+
+        if (mdResult == MDR_OK)
+            pDisc->pEmbedded[index] = (uint32_t)embSlot;
+        else
+            printf("\nError setting up WLD Table: slot=%u, mdResult=%x\n", pPart->slot, mdResult);
+    }
+
+    pthread_mutex_lock(&pDisc->lock);
+    pDA->done = true;
+    pDA->ok = ok;
+    for (i=0; ok && i < pAdapter->count; i++)
+    {
+        if (pDisc->pEmbedded[pTable->pAdapterPartitions[pAdapter->first + i]] != WLD_NO_INDEX)
+        {
+            pDisc->usable++;
+            break;
+        }
+    }
+    complete = (--pDisc->pending == 0);
+    if (pDisc->published)
+    {
+        pthread_mutex_lock(&health_mutex);
+        applyLateWLDDiscovery(pDisc, pDA->adapterIndex);
+        pthread_mutex_unlock(&health_mutex);
+    }
+    else
+        pthread_cond_broadcast(&pDisc->cond);
+    complete = complete && pDisc->published &&
+        atomic_load_explicit(&WLD_Table, memory_order_acquire) == pTable;
+    pthread_mutex_unlock(&pDisc->lock);
+
+    if (complete && pDisc->pCachePath)
+        saveWLDTopology(pTable, pDisc->pCachePath);
+
+    releaseWLDDiscovery(pDisc);
+
+    return NULL;
+}
+
+// Start the discovery threads.  An adapter whose thread cannot be
+// started is discovered inline.
+static void startWLDDiscovery(WLD_DISCOVERY *pDisc)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    uint32_t i;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (i=0; i < pDisc->pTable->adapterCount; i++)
+        pDisc->pending += !pDisc->pAdapters[i].skip;
+
+    for (i=0; i < pDisc->pTable->adapterCount; i++)
+    {
+        if (pDisc->pAdapters[i].skip)
+            continue;
+
+        pthread_mutex_lock(&pDisc->lock);
+        pDisc->refs++;
+        pthread_mutex_unlock(&pDisc->lock);
+
+        if (pthread_create(&thread, &attr, discoverWorker, &pDisc->pAdapters[i]) != 0)
+            (void)discoverWorker(&pDisc->pAdapters[i]);
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
+// Wait until the table can be published: every adapter has answered,
+// the timeout has expired, or (first) one partition is usable.  Call
+// with the discovery lock held.
+static void waitWLDDiscovery(WLD_DISCOVERY *pDisc, uint32_t timeoutMsec, bool first)
+{
+    struct timespec deadline;
+    uint64_t nsec;
+    uint32_t i;
+    int rc = 0;
+    bool cached = false;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    nsec = (uint64_t)deadline.tv_nsec + (uint64_t)timeoutMsec * 1000000ULL;
+    deadline.tv_sec += nsec / 1000000000ULL;
+    deadline.tv_nsec = nsec % 1000000000ULL;
+
+    // Partitions taken from the topology cache are usable at once
+    for (i=0; first && i < pDisc->pTable->count; i++)
+        cached = cached || isPartitionActive(pDisc->pTable, i);
+
+    while (pDisc->pending && rc != ETIMEDOUT)
+    {
+        if (first && (cached || pDisc->usable))
+            return;
+
+        rc = pthread_cond_timedwait(&pDisc->cond, &pDisc->lock, &deadline);
+    }
+}
+
+// Initalize the WLD_PartitionTable
+WLD_RV InitializeWLD(uint32_t *pSlotList, uint32_t numSlots)
+{
+    return InitializeWLDWeighted(pSlotList, NULL, numSlots);
+}
+
+// Initalize the WLD_PartitionTable with a weight (1 - WLD_MAX_WEIGHT)
+// per slot.  pWeights may be NULL, and a weight of 0 means 1 unless
+// WLD_CALIBRATE asks for the weight to be measured.
+WLD_RV InitializeWLDWeighted(uint32_t *pSlotList, const uint32_t *pWeights, uint32_t numSlots)
+{
+    WLD_RV rv = WLDR_NO_SLOT_AVAILABLE;
+    WLD_TABLE *pTable = NULL;
+    char *WLD_PolicyStr = NULL;
+    char *WLD_CalibrateStr = NULL;
+    char *WLD_AffinityStr = NULL;
+    char *WLD_AdmissionStr = NULL;
+    char *WLD_RetryStr = NULL;
+    char *WLD_CacheStr = NULL;
+    char *WLD_SharedStr = NULL;
+    char *WLD_TraceStr = NULL;
+    char *pTracePath = NULL;
+    char *pColon = NULL;
+    char *WLD_CachePath = NULL;
+    char *WLD_ReadyStr = NULL;
+    char *WLD_TimeoutStr = NULL;
+    WLD_DISCOVERY *pDisc = NULL;
+    WLD_ADMISSION_CONFIG admission;
+    WLD_RETRY_CONFIG retryConfig;
+    WLD_CACHE_CONFIG cacheConfig;
+    uint64_t traceRecords;
+    uint32_t discoveryMsec;
+    bool calibrate;
+    bool first;
+    bool complete = false;
+    WLD_POLICY policy;
+    uint32_t i;
+
+    pthread_mutex_lock(&wld_mutex);
+
+    // If the WLD has been initialized an error will be returned, but 
+    // may be ignored by the calling function.
+    if (InWLDMode)
+    {
+        pthread_mutex_unlock(&wld_mutex);
+        return WLDR_WLD_ALREADY_INITIALIZED;
+    }
+
+    // Without a slot list check for the WLD_SLOT_FILE / WLD_SLOT_LIST
+    // enviroment variables and if one exsists, parse out the configured
+    // WLD partitions - if all is good set the InWLDMode flag to TRUE
+    pTable = buildWLDTable(pSlotList, pWeights, numSlots, &rv);
+    if (!pTable)
+    {
+        pthread_mutex_unlock(&wld_mutex);
+        return rv;
+    }
+    rv = WLDR_NO_SLOT_AVAILABLE;
+
+    // An optional WLD_POLICY selects the slot selection policy
+    WLD_PolicyStr = getenv( "WLD_POLICY" );
+    if (WLD_PolicyStr != NULL)
+    {
+        if (parseWLDPolicy(WLD_PolicyStr, &policy))
+            atomic_store_explicit(&WLD_Policy, policy, memory_order_relaxed);
+        else
+            printf("\nUnknown WLD_POLICY '%s' - using round-robin\n", WLD_PolicyStr);
+    }
+
+    WLD_AffinityStr = getenv( "WLD_AFFINITY_LOAD" );
+    if (WLD_AffinityStr != NULL && SetWLDAffinityLoad((uint32_t)atoi(WLD_AffinityStr)) != WLDR_OK)
+        printf("\nInvalid WLD_AFFINITY_LOAD '%s' - using %u\n", WLD_AffinityStr, WLD_AFFINITY_LOAD);
+
+    // WLD_RETRY=budgetPercent[:budgetReserve[:maxAttempts[:backoffMinUsec[:backoffMaxUsec]]]]
+    WLD_RetryStr = getenv( "WLD_RETRY" );
+    if (WLD_RetryStr != NULL)
+    {
+        GetWLDRetryConfig(&retryConfig);
+        if (sscanf(WLD_RetryStr, "%u:%u:%u:%u:%u", &retryConfig.budgetPercent, &retryConfig.budgetReserve,
+            &retryConfig.maxAttempts, &retryConfig.backoffMinUsec, &retryConfig.backoffMaxUsec) < 1 ||
+            SetWLDRetryConfig(&retryConfig) != WLDR_OK)
+            printf("\nInvalid WLD_RETRY '%s' - default retries\n", WLD_RetryStr);
+    }
+
+    // WLD_ADMISSION=maxInFlight[:maxQueued[:ratePerSec[:burst[:maxWaitMsec]]]]
+    WLD_AdmissionStr = getenv( "WLD_ADMISSION" );
+    if (WLD_AdmissionStr != NULL)
+    {
+        memset(&admission, 0, sizeof(admission));
+        if (sscanf(WLD_AdmissionStr, "%u:%u:%u:%u:%u", &admission.maxInFlight, &admission.maxQueued,
+            &admission.ratePerSec, &admission.burst, &admission.maxWaitMsec) < 1 ||
+            SetWLDAdmission(WLD_ALL_ADAPTERS, &admission) != WLDR_OK)
+            printf("\nInvalid WLD_ADMISSION '%s' - no admission limits\n", WLD_AdmissionStr);
+    }
+
+    // WLD_TRACE=path[:maxRecords]
+    WLD_TraceStr = getenv( "WLD_TRACE" );
+    if (WLD_TraceStr != NULL)
+    {
+        pTracePath = strdup(WLD_TraceStr);
+        pColon = pTracePath ? strrchr(pTracePath, ':') : NULL;
+        traceRecords = 0;
+        if (pColon && pColon[1] >= '0' && pColon[1] <= '9')
+        {
+            *pColon = '\0';
+            traceRecords = strtoull(pColon + 1, NULL, 10);
+        }
+        if (!pTracePath || StartWLDTrace(pTracePath, traceRecords) != WLDR_OK)
+            printf("\nInvalid WLD_TRACE '%s' - requests are not traced\n", WLD_TraceStr);
+        free(pTracePath);
+    }
+
+    // WLD_CACHE=entries[:ttlMsec[:negativeTtlMsec[:maxReplyLen]]]
+    WLD_CacheStr = getenv( "WLD_CACHE" );
+    if (WLD_CacheStr != NULL)
+    {
+        memset(&cacheConfig, 0, sizeof(cacheConfig));
+        cacheConfig.ttlMsec = 1000;
+        if (sscanf(WLD_CacheStr, "%u:%u:%u:%u", &cacheConfig.entries, &cacheConfig.ttlMsec,
+            &cacheConfig.negativeTtlMsec, &cacheConfig.maxReplyLen) < 1 ||
+            SetWLDCache(&cacheConfig) != WLDR_OK)
+            printf("\nInvalid WLD_CACHE '%s' - no result cache\n", WLD_CacheStr);
+    }
+
+    // WLD_SHARED=name shares the table with the other processes of the
+    // host that use the same slots
+    WLD_SharedStr = getenv( "WLD_SHARED" );
+    if (WLD_SharedStr != NULL && SetWLDShared(WLD_SharedStr) != WLDR_OK)
+        printf("\nInvalid WLD_SHARED '%s' - the partition table is not shared\n", WLD_SharedStr);
+
+    InWLDMode = true;
+
+#if DEBUG_WLD
+    printf("\n\nWLD count=%d, partitions: ", pTable->count);
+
+    for (i=0; i < pTable->count; i++)
+    {
+        printf("%d,", pTable->pPartitions[i].slot);
+    }
+    printf("\n");
+#endif
+
+    // Determine which adapter (hsmID) each partition targets.
+    // Partitions known from the topology cache are usable right away.
+    resolveWLDAdapters(pTable);
+
+    WLD_CachePath = getenv( "WLD_TOPOLOGY_CACHE" );
+    if (WLD_CachePath != NULL)
+        (void)loadWLDTopology(pTable, WLD_CachePath);
+
+    // An optional WLD_CALIBRATE=<msec> measures the weight of slots
+    // that were not given one; it needs every adapter discovered
+    WLD_CalibrateStr = getenv( "WLD_CALIBRATE" );
+    calibrate = (WLD_CalibrateStr != NULL && atoi(WLD_CalibrateStr) > 0);
+
+    // WLD_READY=first publishes the table as soon as one partition is
+    // usable, WLD_DISCOVERY_TIMEOUT=<msec> bounds the wait for the rest
+    WLD_ReadyStr = getenv( "WLD_READY" );
+    first = (WLD_ReadyStr != NULL && strcmp(WLD_ReadyStr, "first") == 0 && !calibrate);
+    WLD_TimeoutStr = getenv( "WLD_DISCOVERY_TIMEOUT" );
+    discoveryMsec = (WLD_TimeoutStr != NULL && atoi(WLD_TimeoutStr) > 0) ?
+        (uint32_t)atoi(WLD_TimeoutStr) : WLD_DISCOVERY_MSEC;
+
+    if (!indexWLDTable(pTable) || !assignWLDStatIndexes(pTable) ||
+        (pDisc = allocWLDDiscovery(pTable, WLD_CachePath)) == NULL)
+    {
+        freeWLDTable(pTable);
+        InWLDMode = false;
+        pthread_mutex_unlock(&wld_mutex);
+        return WLDR_NO_SLOT_AVAILABLE;
+    }
+
+    // Determine the status of each adapter (and partition) and the
+    // embedded slot number in the FM that corresponds to each
+    // partition - all adapters in parallel
+    startWLDDiscovery(pDisc);
+
+    pthread_mutex_lock(&pDisc->lock);
+    waitWLDDiscovery(pDisc, discoveryMsec, first);
+    for (i=0; i < pTable->adapterCount; i++)
+    {
+        if (pDisc->pAdapters[i].done)
+            applyWLDDiscovery(pDisc, i);
+    }
+
+    // Let's make sure we have at least one active slot in the table
+    // Othewise return an error
+    for (i=0; i < pTable->count; i++)
+    {
+        if (isPartitionActive(pTable, i))
+        {
+            rv = WLDR_OK;
+            break;
+        }
+    }
+
+#if DEBUG_WLD
+    printf("\n\nWLD_ParititonTable setup complete: count=%d, adapters pending=%d\n",
+        pTable->count, pDisc->pending);
+
+    for (i=0; i < pTable->count; i++)
+    {
+        printf("WLD Partitions: part=%d, active=%s, hsmID=%d, embSlot=%d, weight=%d\n",
+            pTable->pPartitions[i].slot,
+            isPartitionActive(pTable, i) ? "yes" : "no",
+            pTable->pPartitions[i].hsmID,
+            pTable->pPartitions[i].embeddedSlot,
+            pTable->pPartitions[i].weight);
+    }
+    printf("\n");
+#endif
+
+    // Publish the table - from here on readers see it without locking.
+    // Adapters with no usable partition (yet) start with an open
+    // breaker so that the prober brings them in once they are up.
+    if (weighWLDTable(pTable, WLD_CalibrateStr))
+    {
+        pthread_mutex_lock(&health_mutex);
+        for (i=0; i < pTable->adapterCount; i++)
+        {
+            if (!adapterHasActivePartition(pTable, i))
+            {
+                openWLDAdapter(pTable, i, wldNowNsec());
+                startWLDHealthMonitor();
+            }
+        }
+        shareWLDTable(pTable);
+        atomic_store_explicit(&WLD_Table, pTable, memory_order_release);
+        pthread_mutex_unlock(&health_mutex);
+
+        pDisc->published = true;
+        complete = (pDisc->pending == 0);
+    }
+    else
+    {
+        InWLDMode = false;
+        rv = WLDR_NO_SLOT_AVAILABLE;
+    }
+    pthread_mutex_unlock(&pDisc->lock);
+
+    pthread_mutex_unlock(&wld_mutex);
+
+    // Otherwise the last discovery thread writes the cache
+    if (complete && pDisc->pCachePath)
+        saveWLDTopology(pTable, pDisc->pCachePath);
+
+    // Frees the table if it was not published
+    releaseWLDDiscovery(pDisc);
+
+    return rv;
+}
+
+/*
+    Reconfiguration
+
+    ReconfigureWLD builds a new table next to the published one and
+    swaps it in.  Slots that stay keep their adapter, embedded slot and
+    statistics, and adapters that stay keep their breaker and load
+    state; only adapters with new partitions are discovered.  Requests
+    in flight on the old table finish there, and a request for a slot
+    that was removed is still served by it while it drains.  The old
+    table is freed once no thread can be reading it, or retired and
+    freed by a later ReconfigureWLD if that takes longer than the drain
+    timeout.
+*/
+
+// Take over what the published table knows about a partition whose
+// slot stays on the same adapter.  Call once the adapters are resolved,
+// with health_mutex held.
+static void carryWLDPartition(WLD_TABLE *pTable, const WLD_TABLE *pOld, uint32_t index)
+{
+    const WLD_PARTITION *pOldPart;
+    WLD_PARTITION *pPart = &pTable->pPartitions[index];
+    uint32_t oldIndex;
+
+    oldIndex = getWLD_HSMIndexFromSlot(pOld, pPart->slot);
+    if (oldIndex >= pOld->count)
+        return;
+
+    pOldPart = &pOld->pPartitions[oldIndex];
+    if (pPart->weight == 0)
+        pPart->weight = pOldPart->weight;
+
+    // A slot that moved is discovered on its new adapter
+    if (pOldPart->hsmID != pPart->hsmID)
+        return;
+
+    pTable->pPartitionHealth[index] = pOld->pPartitionHealth[oldIndex];
+    pPart->embeddedSlot = pOldPart->embeddedSlot;
+    pPart->active = pOldPart->active;
+    setPartitionActive(pTable, index, pPart->active);
+}
+
+// Take over the breaker, load and latency state of the adapters that
+// stay, then open the breaker of any adapter left without a usable
+// partition.  Call with health_mutex held, just before publishing.
+static void inheritWLDAdapters(WLD_TABLE *pTable, const WLD_TABLE *pOld, const WLD_DISCOVERY *pDisc)
+{
+    const WLD_ADAPTER *pOldAdapter;
+    const WLD_ADAPTER *pAdapter;
+    uint32_t oldIndex;
+    uint32_t index;
+    uint32_t i, j;
+    int state;
+
+    for (i=0; i < pTable->adapterCount; i++)
+    {
+        pAdapter = &pTable->pAdapters[i];
+        pOldAdapter = getWLD_AdapterFromHSMIndex(pOld, pAdapter->hsmID);
+        if (pOldAdapter)
+        {
+            oldIndex = (uint32_t)(pOldAdapter - pOld->pAdapters);
+            state = atomic_load_explicit(&pOld->pHealth[oldIndex].state, memory_order_relaxed);
+
+            pTable->pHealth[i].trips = pOld->pHealth[oldIndex].trips;
+            pTable->pHealth[i].rampStep = pOld->pHealth[oldIndex].rampStep;
+            pTable->pHealth[i].retryAtNsec = pOld->pHealth[oldIndex].retryAtNsec;
+            pTable->pHealth[i].rampAtNsec = pOld->pHealth[oldIndex].rampAtNsec;
+            atomic_store_explicit(&pTable->pHealth[i].state, state, memory_order_relaxed);
+            atomic_store_explicit(&pTable->pLoad[i].admitPermille,
+                atomic_load_explicit(&pOld->pLoad[oldIndex].admitPermille, memory_order_relaxed),
+                memory_order_relaxed);
+            atomic_store_explicit(&pTable->pLoad[i].ewmaNsec,
+                atomic_load_explicit(&pOld->pLoad[oldIndex].ewmaNsec, memory_order_relaxed),
+                memory_order_relaxed);
+            for (j=0; j < WLD_WINDOW_BUCKETS; j++)
+                atomic_store_explicit(&pTable->pWindow[i].buckets[j],
+                    atomic_load_explicit(&pOld->pWindow[oldIndex].buckets[j], memory_order_relaxed),
+                    memory_order_relaxed);
+            atomic_store_explicit(&pTable->pWindow[i].samples,
+                atomic_load_explicit(&pOld->pWindow[oldIndex].samples, memory_order_relaxed),
+                memory_order_relaxed);
+
+            // An open adapter keeps its partitions out of rotation.  The
+            // prober may have changed the partitions of an adapter that
+            // was not discovered since they were carried over.
+            for (j=0; j < pAdapter->count; j++)
+            {
+                index = pTable->pAdapterPartitions[pAdapter->first + j];
+                if (pDisc->pAdapters[i].skip)
+                    carryWLDPartition(pTable, pOld, index);
+                setPartitionActive(pTable, index,
+                    pTable->pPartitions[index].active && state != WLD_ADAPTER_OPEN);
+            }
+
+            if (state == WLD_ADAPTER_OPEN)
+                continue;
+        }
+
+        if (!adapterHasActivePartition(pTable, i))
+        {
+            openWLDAdapter(pTable, i, wldNowNsec());
+            startWLDHealthMonitor();
+        }
+    }
+}
+
+// Requests this process has in flight on a table
+static uint32_t wldTableInFlight(const WLD_TABLE *pTable)
+{
+    uint32_t inFlight = 0;
+    uint32_t i;
+
+    for (i=0; i < pTable->adapterCount; i++)
+        inFlight += pTable->pMyInFlight ?
+            atomic_load_explicit(&pTable->pMyInFlight[i], memory_order_acquire) :
+            atomic_load_explicit(&pTable->pLoad[i].inFlight, memory_order_acquire);
+
+    return inFlight;
+}
+
+// Free the retired tables nobody can be using any more
+static void sweepWLDRetired(void)
+{
+    WLD_RETIRED **ppRetired = &WLD_RetiredTables;
+    WLD_RETIRED *pRetired;
+
+    pthread_mutex_lock(&retired_mutex);
+    while ((pRetired = *ppRetired) != NULL)
+    {
+        if (wldQuiescent(pRetired->epoch) &&
+            atomic_load_explicit(&pRetired->pTable->pins, memory_order_acquire) == 0)
+        {
+            *ppRetired = pRetired->pNext;
+            freeWLDTable(pRetired->pTable);
+            free(pRetired);
+        }
+        else
+            ppRetired = &pRetired->pNext;
+    }
+    pthread_mutex_unlock(&retired_mutex);
+}
+
+// Wait for the requests on a replaced table to finish, then free it.
+// Called without wld_mutex, so another ReconfigureWLD may drain at the
+// same time.
+static void retireWLDTable(WLD_TABLE *pOld, uint32_t drainMsec)
+{
+    WLD_RETIRED *pRetired;
+    WLD_TABLE *pExpected = NULL;
+    uint64_t drainUntil = wldNowNsec() + (uint64_t)drainMsec * 1000000ULL;
+    uint64_t epoch;
+    bool draining;
+    bool idle;
+
+    // Slots that were removed are served by the old table meanwhile -
+    // unless an earlier table is still draining, which keeps serving
+    // the slots it had
+    draining = atomic_compare_exchange_strong_explicit(&WLD_Draining, &pExpected, pOld,
+        memory_order_seq_cst, memory_order_seq_cst);
+    while (wldTableInFlight(pOld) && wldNowNsec() < drainUntil)
+        usleep(1000);
+    pExpected = pOld;
+    if (draining)
+        atomic_compare_exchange_strong_explicit(&WLD_Draining, &pExpected, NULL,
+            memory_order_seq_cst, memory_order_seq_cst);
+
+    // Threads that entered from here on cannot see the old table
+    epoch = atomic_fetch_add_explicit(&WLD_Epoch, 1, memory_order_seq_cst);
+    for (;;)
+    {
+        idle = wldQuiescent(epoch) &&
+            atomic_load_explicit(&pOld->pins, memory_order_acquire) == 0;
+        if (idle || wldNowNsec() >= drainUntil)
+            break;
+        usleep(1000);
+    }
+
+    if (idle)
+    {
+        freeWLDTable(pOld);
+        return;
+    }
+
+    printf("\nWLD: requests still running on the old table after %u msec - retiring it\n", drainMsec);
+    pRetired = malloc(sizeof(WLD_RETIRED));
+    if (!pRetired)
+        return;     // leaked rather than freed under a reader
+
+    pRetired->pTable = pOld;
+    pRetired->epoch = epoch;
+    pthread_mutex_lock(&retired_mutex);
+    pRetired->pNext = WLD_RetiredTables;
+    WLD_RetiredTables = pRetired;
+    pthread_mutex_unlock(&retired_mutex);
+}
+
+// Replace the slot list of a running WLD without stopping traffic.
+// pSlotList NULL re-reads WLD_SLOT_FILE / WLD_SLOT_LIST; a weight of 0
+// keeps the weight a slot had.  Returns once the old table is drained.
+WLD_RV ReconfigureWLD(uint32_t *pSlotList, const uint32_t *pWeights, uint32_t numSlots)
+{
+    WLD_RV rv = WLDR_NO_SLOT_AVAILABLE;
+    WLD_TABLE *pTable;
+    WLD_TABLE *pOld;
+    WLD_DISCOVERY *pDisc = NULL;
+    const WLD_ADAPTER *pAdapter;
+    char *WLD_CachePath;
+    char *WLD_TimeoutStr;
+    char *WLD_DrainStr;
+    uint32_t discoveryMsec;
+    uint32_t drainMsec;
+    uint32_t i, j;
+    bool complete = false;
+
+    pthread_mutex_lock(&wld_mutex);
+
+    if (!InWLDMode)
+    {
+        pthread_mutex_unlock(&wld_mutex);
+        return WLDR_NO_SLOTLIST_DEFINED;
+    }
+
+    sweepWLDRetired();
+
+    pTable = buildWLDTable(pSlotList, pWeights, numSlots, &rv);
+    if (!pTable)
+    {
+        pthread_mutex_unlock(&wld_mutex);
+        return rv;
+    }
+    rv = WLDR_NO_SLOT_AVAILABLE;
+
+    resolveWLDAdapters(pTable);
+
+    // The prober may be resolving partitions of the old table
+    pOld = atomic_load_explicit(&WLD_Table, memory_order_acquire);
+    pthread_mutex_lock(&health_mutex);
+    for (i=0; i < pTable->count; i++)
+        carryWLDPartition(pTable, pOld, i);
+    pthread_mutex_unlock(&health_mutex);
+
+    WLD_CachePath = getenv( "WLD_TOPOLOGY_CACHE" );
+    WLD_TimeoutStr = getenv( "WLD_DISCOVERY_TIMEOUT" );
+    discoveryMsec = (WLD_TimeoutStr != NULL && atoi(WLD_TimeoutStr) > 0) ?
+        (uint32_t)atoi(WLD_TimeoutStr) : WLD_DISCOVERY_MSEC;
+    WLD_DrainStr = getenv( "WLD_DRAIN_TIMEOUT" );
+    drainMsec = (WLD_DrainStr != NULL && atoi(WLD_DrainStr) > 0) ?
+        (uint32_t)atoi(WLD_DrainStr) : WLD_DRAIN_MSEC;
+
+    if (!indexWLDTable(pTable) || !assignWLDStatIndexes(pTable) ||
+        (pDisc = allocWLDDiscovery(pTable, WLD_CachePath)) == NULL)
+    {
+        freeWLDTable(pTable);
+        pthread_mutex_unlock(&wld_mutex);
+        return WLDR_NO_SLOT_AVAILABLE;
+    }
+
+    // Only adapters with partitions that are not resolved yet are
+    // discovered
+    for (i=0; i < pTable->adapterCount; i++)
+    {
+        pAdapter = &pTable->pAdapters[i];
+        pDisc->pAdapters[i].skip = true;
+        for (j=0; j < pAdapter->count; j++)
+        {
+            if (!pTable->pPartitions[pTable->pAdapterPartitions[pAdapter->first + j]].active)
+                pDisc->pAdapters[i].skip = false;
+        }
+    }
+
+    startWLDDiscovery(pDisc);
+
+    pthread_mutex_lock(&pDisc->lock);
+    waitWLDDiscovery(pDisc, discoveryMsec, false);
+    for (i=0; i < pTable->adapterCount; i++)
+    {
+        if (pDisc->pAdapters[i].done)
+            applyWLDDiscovery(pDisc, i);
+    }
+
+    for (i=0; i < pTable->count; i++)
+    {
+        if (pTable->pPartitions[i].active)
+        {
+            rv = WLDR_OK;
+            break;
+        }
+    }
+
+    if (rv == WLDR_OK && weighWLDTable(pTable, NULL))
+    {
+        pthread_mutex_lock(&health_mutex);
+        inheritWLDAdapters(pTable, pOld, pDisc);
+        shareWLDTable(pTable);
+        atomic_store_explicit(&WLD_Table, pTable, memory_order_seq_cst);
+        WLD_TableGeneration++;
+        pthread_mutex_unlock(&health_mutex);
+
+        pDisc->published = true;
+        complete = (pDisc->pending == 0);
+    }
+    else
+        rv = WLDR_NO_SLOT_AVAILABLE;
+    pthread_mutex_unlock(&pDisc->lock);
+
+    // Drain without wld_mutex, so InitializeWLD and the next
+    // ReconfigureWLD are not held up by a slow request
+    pthread_mutex_unlock(&wld_mutex);
 
-static pthread_mutex_t wld_mutex;
-static int defaultHSM = 3;
+    if (rv == WLDR_OK)
+        retireWLDTable(pOld, drainMsec);
 
-// Enable this define to print the contents of the WLD_PartitionTable
-// #define DEBUG_WLD 1
+    if (complete && pDisc->pCachePath)
+        saveWLDTopology(pTable, pDisc->pCachePath);
+
+    // Frees the table if it was not published
+    releaseWLDDiscovery(pDisc);
+
+    return rv;
+}
 
-// Get the index for the Partition table for this slot
-static uint32_t getWLD_HSMIndexFromSlot(uint32_t slotID)
+// Get the next available active slot
+WLD_RV GetWLDSlotID(uint32_t *pSlotID, uint32_t *pEmbeddedSlotID)
 {
-    uint32_t i;
+    const WLD_TABLE *pTable;
+    WLD_RV rv = WLDR_OK;
+    uint32_t index;
 
-    // Create a critical section for this function
-    pthread_mutex_lock(&wld_mutex);
+    pTable = enterWLD();
+    if (!pTable || !InWLDMode)
+        rv = WLDR_NO_SLOTLIST_DEFINED;
+    else if (!pSlotID)
+        rv = WLDR_NO_SLOT_AVAILABLE;
+    // Select an active partition with the current policy and return its
+    // slot ID (and embedded slot ID if the pointer is non-NULL).
+    // If no partition is active return an error
+    else if (!selectWLDPartition(pTable, &index))
+        rv = WLDR_NO_SLOT_AVAILABLE;
+    else
+    {
+        *pSlotID = pTable->pPartitions[index].slot;
+        if (pEmbeddedSlotID)
+            *pEmbeddedSlotID = loadWLDEmbeddedSlot(&pTable->pPartitions[index]);
+    }
+    leaveWLD();
+
+    return rv;
+}
+
+// Get the slot of a key's partition
+static WLD_RV getWLDKeyedSlot(uint64_t keyHash, uint32_t *pSlotID, uint32_t *pEmbeddedSlotID)
+{
+    const WLD_TABLE *pTable;
+    WLD_RV rv = WLDR_OK;
+    uint32_t index;
 
-    for(i=0; i < WLD_PartitionCount; i++)
+    pTable = enterWLD();
+    if (!pTable || !InWLDMode)
+        rv = WLDR_NO_SLOTLIST_DEFINED;
+    else if (!pSlotID || !selectKeyedPartition(pTable, keyHash, &index))
+        rv = WLDR_NO_SLOT_AVAILABLE;
+    else
     {
-        if (slotID == WLD_PartitionTable[i].slot)
-            break;
+        *pSlotID = pTable->pPartitions[index].slot;
+        if (pEmbeddedSlotID)
+            *pEmbeddedSlotID = loadWLDEmbeddedSlot(&pTable->pPartitions[index]);
     }
+    leaveWLD();
 
-    pthread_mutex_unlock(&wld_mutex);
-    return i;
+    return rv;
 }
 
-// Set all the slots for this adapter to inactive
-static void SetHSMInactive(uint32_t adapter)
+// Get the active slot an affinity key maps to
+WLD_RV GetWLDSlotIDForKey(const void *pKey, uint32_t keyLen, uint32_t *pSlotID, uint32_t *pEmbeddedSlotID)
 {
-    uint32_t i;
+    if (!pKey && keyLen)
+        return WLDR_INVALID_PARAMETER;
 
-    // Create a critical section for this function
-    pthread_mutex_lock(&wld_mutex);
+    return getWLDKeyedSlot(hashWLDKey(pKey, keyLen), pSlotID, pEmbeddedSlotID);
+}
+
+// Set the key affinity load bound (percent of an adapter's weighted
+// share of the requests in flight, 0 = no bound)
+WLD_RV SetWLDAffinityLoad(uint32_t loadPercent)
+{
+    if (loadPercent && loadPercent < 100)
+        return WLDR_INVALID_PARAMETER;
+
+    atomic_store_explicit(&WLD_AffinityLoad, loadPercent, memory_order_relaxed);
+    return WLDR_OK;
+}
+
+// Number of keyed selections that did not go to the key's own partition
+uint64_t GetWLDAffinitySpills(void)
+{
+    return atomic_load_explicit(&WLD_AffinitySpills, memory_order_relaxed);
+}
+
+// Get the adapter (hsmID) and embedded slot of a WLD slot
+WLD_RV GetWLDSlotInfo(uint32_t slotID, uint32_t *pHsmID, uint32_t *pEmbeddedSlotID)
+{
+    WLD_TABLE *pTable;
+    WLD_RV rv = WLDR_OK;
+    uint32_t index;
 
-    for(i=0; i < WLD_PartitionCount; i++)
+    pTable = enterWLD();
+    if (!pTable || !InWLDMode)
+        rv = WLDR_NO_SLOTLIST_DEFINED;
+    else if (!(pTable = findWLDSlot(pTable, slotID, &index)))
+        rv = WLDR_NO_SLOT_AVAILABLE;
+    else
     {
-        if (adapter == WLD_PartitionTable[i].hsmID)
-        {
-            WLD_PartitionTable[i].active = false;
-        }
+        if (pHsmID)
+            *pHsmID = pTable->pPartitions[index].hsmID;
+        if (pEmbeddedSlotID)
+            *pEmbeddedSlotID = loadWLDEmbeddedSlot(&pTable->pPartitions[index]);
     }
+    leaveWLD();
 
-    pthread_mutex_unlock(&wld_mutex);
-    return;
+    return rv;
 }
 
-// Initalize the WLD_PartitionTable
-WLD_RV InitializeWLD(uint32_t *pSlotList, uint32_t numSlots)
+// Set the slot selection policy
+WLD_RV SetWLDPolicy(WLD_POLICY policy)
 {
-    WLD_RV rv = WLDR_NO_SLOT_AVAILABLE;
-    MD_RV mdResult = MDR_OK;
-    HsmState_t hsmState;
-    char *WLD_EnvStr = NULL;
-    char *part;
-    uint32_t i;
-    unsigned long int embSlot;
+    if (policy < WLD_POLICY_ROUND_ROBIN || policy > WLD_POLICY_ADAPTER_ROUND_ROBIN)
+        return WLDR_INVALID_PARAMETER;
 
-    // If the WLD has been initialized an error will be returned, but 
-    // may be ignored by the calling function.
-    if (InWLDMode)
-        return WLDR_WLD_ALREADY_INITIALIZED;
+    atomic_store_explicit(&WLD_Policy, policy, memory_order_relaxed);
+    return WLDR_OK;
+}
 
+// Get the slot selection policy
+WLD_POLICY GetWLDPolicy(void)
+{
+    return (WLD_POLICY)atomic_load_explicit(&WLD_Policy, memory_order_relaxed);
+}
 
-    // First zeroize the Partition Lookup Table
-    memset(WLD_PartitionTable, 0, sizeof(WLD_PartitionTable));
-    WLD_PartitionCount = 0;
+// Set the health prober and circuit breaker parameters
+WLD_RV SetWLDHealthConfig(const WLD_HEALTH_CONFIG *pConfig)
+{
+    if (!pConfig || pConfig->probeIntervalMsec == 0 || pConfig->backoffMinMsec == 0 ||
+        pConfig->backoffMaxMsec < pConfig->backoffMinMsec || pConfig->rampSteps == 0 ||
+        pConfig->rampSteps > WLD_ADMIT_FULL)
+        return WLDR_INVALID_PARAMETER;
 
-    // Check for the enviroment variable and if it exsists,
-    // parse out the configured WLD partitions - if all is good
-    // set the InWLDMode flag to TRUE
-    WLD_EnvStr = getenv( "WLD_SLOT_LIST" );
-    if (WLD_EnvStr == NULL && pSlotList == NULL)
-    {
+    pthread_mutex_lock(&health_mutex);
+    WLD_HealthConfig = *pConfig;
+    pthread_mutex_unlock(&health_mutex);
+
+    return WLDR_OK;
+}
+
+// Get the circuit breaker state of an adapter and the share of its
+// traffic (in 1/1000) it currently gets
+WLD_RV GetWLDAdapterState(uint32_t hsmID, WLD_ADAPTER_STATE *pState, uint32_t *pAdmitPermille)
+{
+    const WLD_TABLE *pTable;
+    const WLD_ADAPTER *pAdapter;
+    WLD_RV rv = WLDR_OK;
+    uint32_t adapterIndex;
+
+    pTable = enterWLD();
+    if (!pTable || !InWLDMode)
         rv = WLDR_NO_SLOTLIST_DEFINED;
-    }
+    else if (!(pAdapter = getWLD_AdapterFromHSMIndex(pTable, hsmID)))
+        rv = WLDR_INVALID_PARAMETER;
     else
     {
-        InWLDMode = true;
-        if (pSlotList)
-        {
-            for (i=0; i < MAX_WLD_PARTITIONS && i < numSlots; i++)
-            {
-                WLD_PartitionTable[i].slot = pSlotList[i];
-                WLD_PartitionCount++;
-            }
-        }
-        else
-        {
-            part = strtok(WLD_EnvStr, " ,");
-            for (i=0; i < MAX_WLD_PARTITIONS && part != NULL; i++)
-            {
-                WLD_PartitionTable[i].slot = atoi(part);
-                WLD_PartitionCount++;
-                part = strtok(NULL, " ,");
-            }
-        }
+        adapterIndex = (uint32_t)(pAdapter - pTable->pAdapters);
+        if (pState)
+            *pState = (WLD_ADAPTER_STATE)atomic_load_explicit(&pTable->pHealth[adapterIndex].state,
+                memory_order_acquire);
+        if (pAdmitPermille)
+            *pAdmitPermille = atomic_load_explicit(&pTable->pLoad[adapterIndex].admitPermille,
+                memory_order_relaxed);
     }
+    leaveWLD();
 
-#if DEBUG_WLD
-    printf("\n\nWLD Env set = %s, count=%d, partitions: ", WLD_EnvStr, WLD_PartitionCount);
+    return rv;
+}
+
+// Get the latency (nsec) below which permille/1000 of the recent
+// successful commands on an adapter completed.  Fails with
+// WLDR_NO_SLOT_AVAILABLE until the adapter has enough samples.
+WLD_RV GetWLDAdapterLatency(uint32_t hsmID, uint32_t permille, uint64_t *pNsec)
+{
+    const WLD_TABLE *pTable;
+    const WLD_ADAPTER *pAdapter;
+    const WLD_ADAPTER_WINDOW *pWindow;
+    uint64_t total = 0;
+    uint64_t target;
+    uint64_t seen = 0;
+    uint32_t counts[WLD_WINDOW_BUCKETS];
+    uint32_t i;
 
-    for (i=0; i < WLD_PartitionCount; i++)
+    if (!pNsec || permille > 1000)
+        return WLDR_INVALID_PARAMETER;
+
+    pTable = enterWLD();
+    if (!pTable || !InWLDMode)
     {
-        printf("%d,", WLD_PartitionTable[i].slot);
+        leaveWLD();
+        return WLDR_NO_SLOTLIST_DEFINED;
     }
-    printf("\n");
-#endif
 
-    // For each partition in the table, determine which adapter (hsmID)
-    // the partition targets, the status of the adapter (and partition)
-    // and the embedded slot number in the FM that corresponds to this
-    // partition
-    if (InWLDMode)
+    pAdapter = getWLD_AdapterFromHSMIndex(pTable, hsmID);
+    if (!pAdapter)
     {
-        for (i=0; i < WLD_PartitionCount; i++)
-        {
-            // First get the adapter (hsmID) for this partition
-            mdResult = MD_GetHsmIndexForSlot(WLD_PartitionTable[i].slot,
-                &WLD_PartitionTable[i].hsmID);
-            if (mdResult == MDR_OK)
-            {
-                // Check the state of the HSM
-                mdResult = MD_GetHsmState(WLD_PartitionTable[i].hsmID, &hsmState, NULL);
-            }
-
-            if (mdResult == MDR_OK && hsmState == S_NORMAL_OPERATION)
-            {
-                // Now get the embedded slot number (on that adapter) for this partition
-                mdResult = MD_GetEmbeddedSlotID(WLD_PartitionTable[i].slot,
-                    &embSlot);
-                if (mdResult == MDR_OK)
-                {
-                    // We have an active partition - mark it so
-                    WLD_PartitionTable[i].embeddedSlot = (uint32_t)embSlot;
-                    WLD_PartitionTable[i].active = true;
-                }
-            }
-            else
-            {
-                printf("\nError setting up WLD Table: mdResult=%x, hsmState=%x\n",
-                    mdResult, hsmState);
-            }
-        }
+        leaveWLD();
+        return WLDR_INVALID_PARAMETER;
+    }
 
-        // Let's make sure we have at least one active slot in the table
-        // Othewise return an error
-        for (i=0; i < WLD_PartitionCount; i++)
-        {
-            if (WLD_PartitionTable[i].active == true)
-            {
-                rv = WLDR_OK;
-                break;
-            }
-        }
+    pWindow = &pTable->pWindow[pAdapter - pTable->pAdapters];
+    for (i=0; i < WLD_WINDOW_BUCKETS; i++)
+    {
+        counts[i] = atomic_load_explicit(&pWindow->buckets[i], memory_order_relaxed);
+        total += counts[i];
+    }
+    leaveWLD();
 
-#if DEBUG_WLD
-        printf("\n\nWLD_ParititonTable setup complete: count=%d, ret=%x\n",
-            WLD_PartitionCount, mdResult);
+    if (total < WLD_WINDOW_MIN_SAMPLES)
+        return WLDR_NO_SLOT_AVAILABLE;
 
-        for (i=0; i < WLD_PartitionCount; i++)
-        {
-            printf("WLD Partitions: part=%d, active=%s, hsmID=%d, embSlot=%d\n",
-                WLD_PartitionTable[i].slot,
-                WLD_PartitionTable[i].active ? "yes" : "no",
-                WLD_PartitionTable[i].hsmID,
-                WLD_PartitionTable[i].embeddedSlot);
-        }
-        printf("\n");
-#endif
+    target = (total * permille + 999) / 1000;
+    for (i=0; i < WLD_WINDOW_BUCKETS - 1; i++)
+    {
+        seen += counts[i];
+        if (seen >= target)
+            break;
     }
 
-    return rv;
+    *pNsec = windowBucketNsec(i);
+    return WLDR_OK;
 }
 
-// Get the next available active slot
-WLD_RV GetWLDSlotID(uint32_t *pSlotID, uint32_t *pEmbeddedSlotID)
+// Take a statistics snapshot.  The snapshot is allocated here and
+// must be released with FreeWLDStats.
+WLD_RV GetWLDStats(WLD_STATS **ppStats)
 {
-    WLD_RV rv = WLDR_OK;
-    uint32_t index;
-    bool slotFound = false;
+    const WLD_TABLE *pTable;
+    WLD_STATS *pStats;
+    WLD_ADAPTER_STATS *pAdapter;
+    uint32_t i;
 
-    if (!InWLDMode)
+    if (!ppStats)
+        return WLDR_INVALID_PARAMETER;
+
+    *ppStats = NULL;
+
+    pTable = enterWLD();
+    if (!pTable || !InWLDMode)
+    {
+        leaveWLD();
         return WLDR_NO_SLOTLIST_DEFINED;
+    }
 
-    if (!pSlotID)
-        return WLDR_NO_SLOT_AVAILABLE;
+    pStats = calloc(1, sizeof(WLD_STATS));
+    if (pStats)
+    {
+        pStats->pAdapters = calloc(pTable->adapterCount ? pTable->adapterCount : 1, sizeof(WLD_ADAPTER_STATS));
+        pStats->pPartitions = calloc(pTable->count ? pTable->count : 1, sizeof(WLD_PARTITION_STATS));
+    }
+    if (!pStats || !pStats->pAdapters || !pStats->pPartitions)
+    {
+        leaveWLD();
+        FreeWLDStats(pStats);
+        return WLDR_INVALID_PARAMETER;
+    }
 
-    // Create a critial section for remainder of this function
-    pthread_mutex_lock(&wld_mutex);
+    pStats->timestampNsec = wldNowNsec();
+    pStats->adapterCount = pTable->adapterCount;
+    pStats->partitionCount = pTable->count;
 
-    index = WLD_CurrentPartitionIndex;
+    for (i=0; i < pTable->adapterCount; i++)
+    {
+        pAdapter = &pStats->pAdapters[i];
+        pAdapter->hsmID = pTable->pAdapters[i].hsmID;
+        pAdapter->state = (WLD_ADAPTER_STATE)atomic_load_explicit(&pTable->pHealth[i].state,
+            memory_order_acquire);
+        pAdapter->admitPermille = atomic_load_explicit(&pTable->pLoad[i].admitPermille,
+            memory_order_relaxed);
+        pAdapter->inFlight = atomic_load_explicit(&pTable->pLoad[i].inFlight,
+            memory_order_relaxed);
+    }
 
-    // Increment the current index and return the first slot ID (and
-    // embedded slot ID if the pointer is non-NULL) that is active.
-    // If we return back to the original index, no active slots were
-    // found so return an error
-    do
+    for (i=0; i < pTable->count; i++)
     {
-        index++;
-        if (index == WLD_PartitionCount)
-        {
-            index = 0;
-        }
+        pStats->pPartitions[i].slot = pTable->pPartitions[i].slot;
+        pStats->pPartitions[i].hsmID = pTable->pPartitions[i].hsmID;
+        pStats->pPartitions[i].active = isPartitionActive(pTable, i);
+        pStats->pPartitions[i].weight = pTable->pPartitions[i].weight;
+    }
 
-        if (WLD_PartitionTable[index].active)
-        {
-            *pSlotID = WLD_PartitionTable[index].slot;
-            slotFound = true;
-            if (pEmbeddedSlotID)
-                *pEmbeddedSlotID = WLD_PartitionTable[index].embeddedSlot;
-            break;
-        }
-    } while(index != WLD_CurrentPartitionIndex);
+    wldStatsCollect(pStats, pTable->pPartitionStat);
+    leaveWLD();
+
+    *ppStats = pStats;
+    return WLDR_OK;
+}
 
-    if (!slotFound)
+// Release a snapshot taken with GetWLDStats
+void FreeWLDStats(WLD_STATS *pStats)
+{
+    if (pStats)
     {
-        rv = WLDR_NO_SLOT_AVAILABLE;
+        free(pStats->pAdapters);
+        free(pStats->pPartitions);
+        free(pStats);
     }
-    else
-        WLD_CurrentPartitionIndex = index;
+}
 
-    // Release the mutex for this section
-    pthread_mutex_unlock(&wld_mutex);
+// Report whether the published table is shared with other processes
+WLD_RV GetWLDSharedState(WLD_SHARED_STATE *pState)
+{
+    const WLD_TABLE *pTable;
 
-    return rv;
+    if (!pState)
+        return WLDR_INVALID_PARAMETER;
+
+    memset(pState, 0, sizeof(*pState));
+
+    pTable = enterWLD();
+    if (!pTable || !InWLDMode)
+    {
+        leaveWLD();
+        return WLDR_NO_SLOTLIST_DEFINED;
+    }
+
+    if (pTable->pShared)
+    {
+        pState->shared = true;
+        wldShmCounts(pTable->pShared, &pState->processes, &pState->reclaimed);
+    }
+    leaveWLD();
+
+    return WLDR_OK;
+}
+
+// Stop the health prober thread.  Adapters that are open stay inactive.
+void StopWLDHealthMonitor(void)
+{
+    pthread_mutex_lock(&health_mutex);
+    if (!healthRunning)
+    {
+        pthread_mutex_unlock(&health_mutex);
+        return;
+    }
+
+    healthStop = true;
+    pthread_cond_signal(&health_cond);
+    pthread_mutex_unlock(&health_mutex);
+
+    pthread_join(healthThread, NULL);
+
+    pthread_mutex_lock(&health_mutex);
+    healthRunning = false;
+    pthread_cond_destroy(&health_cond);
+    pthread_mutex_unlock(&health_mutex);
 }
 
 // This function is a wrapper around the MD_SendReceive function
 // If the WLD_NO_SLOT_ID slot number is passed in (i.e. any slot
 // can be used) then the function will try to replay the op if a
-// particular adapter fails. Otherwise it will simply set the
-// adapter to inactive and return the MD error code
-MD_RV SendWLDMessageToFM(uint32_t slotID,
+// particular adapter or partition fails, within the retry budget
+// (see wld_retry.c). Otherwise it will simply set the adapter or
+// partition to inactive and return the MD error code.
+// A non-zero timeout (msec) is a deadline for the whole call: each
+// MD_SendReceive gets the time that is left, and no adapter is tried
+// once it has passed (WLD_MDR_TIMEOUT is returned instead).
+// With pKeyHash the slots are chosen by key affinity, and a firstSlot
+// other than WLD_NO_SLOT_ID is tried first.  With admission limits set
+// a command waits for its adapter only if wait is set.
+static MD_RV sendWLDMessage(uint32_t slotID,
+    uint32_t firstSlot,
+    const uint64_t *pKeyHash,
+    bool wait,
     uint16_t fmNumber,
     MD_Buffer_t *pReq,
     uint32_t timeout,
@@ -266,66 +3681,248 @@ MD_RV SendWLDMessageToFM(uint32_t slotID,
 {
     MD_RV mdResult = MDR_OK;
     WLD_RV wldErr = WLDR_OK;
+    WLD_TABLE *pTable;
+    WLD_TABLE *pFirst;
     uint32_t adapter = defaultHSM;
     uint32_t appState = 0;
     uint32_t originatorID = 0;
     uint32_t recvlen = 0;
     uint32_t index = 0;
-    uint32_t slot = slotID;
+    uint32_t remaining = 0;
+    uint32_t attempts = 0;
+    uint32_t maxAttempts = 0;
+    uint32_t partitionSlot = slotID;
+    uint64_t start, latency;
+    uint64_t callStart = 0;
+    uint64_t deadline = 0;
+    uint64_t backoff;
+    struct timespec pause;
+    WLD_ERROR_CLASS errorClass;
+    bool retry = false;
+    bool admitted;
+
+    if (timeout || wldTraceEnabled())
+        callStart = wldNowNsec();
+    if (timeout)
+        deadline = callStart + (uint64_t)timeout * 1000000ULL;
 
     do
     {
+        // Select the partition and use it from the same table, which
+        // is not freed until leaveWLD even if ReconfigureWLD replaces it
+        pTable = enterWLD();
+        if (!pTable || !InWLDMode)
+        {
+            leaveWLD();
+            mdResult = MDR_INVALID_HSM_INDEX;
+            break;
+        }
+
+        // The caller picked the first slot of a command for any slot
+        // (a hedged copy); failures are replayed as below
+        if (slotID == WLD_NO_SLOT_ID && !retry && firstSlot != WLD_NO_SLOT_ID &&
+            (pFirst = findWLDSlot(pTable, firstSlot, &index)) != NULL)
+        {
+            pTable = pFirst;
+        }
         // If slotID == WLD_NO_SLOT_ID (i.e. the application
         // doesn't care which slot is used) then get the 
         // next available slot and try it.  If it fails, loop
         // around again and try another slot.
-        if (slotID == WLD_NO_SLOT_ID)
+        else if (slotID == WLD_NO_SLOT_ID)
         {
-            wldErr = GetWLDSlotID(&slot, NULL);
+            if (pKeyHash)
+                wldErr = selectKeyedPartition(pTable, *pKeyHash, &index) ? WLDR_OK : WLDR_NO_SLOT_AVAILABLE;
+            else
+                wldErr = selectWLDPartition(pTable, &index) ? WLDR_OK : WLDR_NO_SLOT_AVAILABLE;
             if (wldErr != WLDR_OK)
             {
-                // Either no slot list defined or none available -
-                // break out of loop in either case
+                // None available - break out of loop
+                leaveWLD();
                 mdResult = MDR_INVALID_HSM_INDEX;
                 break;
             }
         }
+        // Get the partition of this slot number - a slot that was
+        // just reconfigured away is still served while it drains
+        else if (!(pTable = findWLDSlot(pTable, slotID, &index)))
+        {
+            // Not a WLD slot (or its adapter is unknown)
+            leaveWLD();
+            mdResult = MDR_INVALID_HSM_INDEX;
+            break;
+        }
 
-        if (mdResult == MDR_OK)
+        // Admission control: a command for any slot passes a full
+        // adapter over for one that is not, otherwise it waits for the
+        // adapter (until its deadline) or is turned away
+        adapter = pTable->pPartitions[index].hsmID;
+        admitted = wldAdmitEnabled();
+        if (admitted && !wldAdmitTry(adapter))
         {
-            // Get the HsmID associated with this slot number
-            index = getWLD_HSMIndexFromSlot(slot);
-            if (index < WLD_PartitionCount)
+            if (slotID != WLD_NO_SLOT_ID || !selectAdmittedPartition(pTable, &index))
             {
-                adapter = WLD_PartitionTable[index].hsmID;
-                mdResult = MD_SendReceive( adapter,
-                            originatorID,
-                            fmNumber,
-                            pReq,
-                            0,
-                            pResp,
-                            &recvlen,
-                            &appState);
+                if (!wait || !wldAdmitWait(adapter, deadline))
+                {
+                    leaveWLD();
+                    wldAdmitReject();
+                    mdResult = WLD_MDR_BUSY;
+                    break;
+                }
             }
+            adapter = pTable->pPartitions[index].hsmID;
+        }
 
-            if (mdResult == MDR_OK)
+        start = wldNowNsec();
+        if (deadline)
+        {
+            if (start >= deadline)
             {
-                *pReceivedLen = recvlen;
-                *pFMStatus = appState;
+                if (admitted)
+                    wldAdmitRelease(adapter);
+                leaveWLD();
+                mdResult = WLD_MDR_TIMEOUT;
                 break;
             }
-            else if (mdResult == MDR_UNSUCCESSFUL ||
-                mdResult == MDR_INTERNAL_ERROR)
-            {
-                // Set this adapter as inactive
-                SetHSMInactive(adapter);
-            }
-            // Any other MD error should be returned to the
-            // application to be handled appropriately
-            else
+
+            // Round up so that less than 1 msec left is not "no timeout"
+            remaining = (uint32_t)((deadline - start + 999999) / 1000000);
+        }
+
+        if (!retry)
+            wldRetryEarn();
+        maxAttempts = wldRetryMaxAttempts();
+        if (maxAttempts == 0)
+            maxAttempts = pTable->count;
+        partitionSlot = pTable->pPartitions[index].slot;
+
+        beginWLDRequest(pTable, index);
+        mdResult = MD_SendReceive( adapter,
+                    originatorID,
+                    fmNumber,
+                    pReq,
+                    remaining,
+                    pResp,
+                    &recvlen,
+                    &appState);
+        latency = wldNowNsec() - start;
+        if (admitted)
+            wldAdmitRelease(adapter);
+
+        // A command that failed because the caller's time ran out
+        // says nothing about the adapter
+        if (mdResult != MDR_OK && deadline && start + latency >= deadline)
+            mdResult = WLD_MDR_TIMEOUT;
+
+        endWLDRequest(pTable, index, latency, mdResult == MDR_OK);
+        wldStatsRecordRequest(pTable->statPartitions, pTable->hsmMapSize,
+            pTable->pPartitionStat[index], adapter, mdResult, latency, retry);
+        leaveWLD();
+        retry = true;
+        attempts++;
+
+        if (mdResult == MDR_OK)
+        {
+            *pReceivedLen = recvlen;
+            *pFMStatus = appState;
+        }
+
+        errorClass = ClassifyWLDError(mdResult, appState);
+        if (errorClass == WLD_ERROR_NONE)
+            break;
+
+        // Set this adapter (or only this partition) as inactive until
+        // the health prober finds it working again
+        if (errorClass == WLD_ERROR_ADAPTER)
+            tripWLDAdapter(adapter);
+        else if (errorClass == WLD_ERROR_PARTITION)
+            tripWLDPartition(partitionSlot);
+
+        // Any other error should be returned to the application to be
+        // handled appropriately, as is the last one once the attempts
+        // or the retry budget run out
+        if (errorClass == WLD_ERROR_FATAL || slotID != WLD_NO_SLOT_ID ||
+            attempts >= maxAttempts || !wldRetryTake())
+            break;
+
+        // A transient error leaves the adapter in rotation, so give it
+        // a moment - unless that would outlast the caller's deadline
+        if (errorClass == WLD_ERROR_RETRYABLE)
+        {
+            backoff = wldRetryBackoffNsec(attempts);
+            if (deadline && wldNowNsec() + backoff >= deadline)
                 break;
+            pause.tv_sec = (time_t)(backoff / 1000000000ULL);
+            pause.tv_nsec = (long)(backoff % 1000000000ULL);
+            nanosleep(&pause, NULL);
         }
     } while (slotID == WLD_NO_SLOT_ID); // Only loop for this slotID setting
 
+    if (callStart && wldTraceEnabled())
+        wldTraceRecord(callStart, wldNowNsec() - callStart, partitionSlot,
+            attempts ? adapter : 0xFFFFFFFF, slotID == WLD_NO_SLOT_ID,
+            fmNumber, pReq, mdResult, appState);
+
     return mdResult;
 }
+
+// Send a command to the FM on slotID, or on any slot (see above)
+MD_RV SendWLDMessageToFM(uint32_t slotID,
+    uint16_t fmNumber,
+    MD_Buffer_t *pReq,
+    uint32_t timeout,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    uint32_t *pFMStatus)
+{
+    return sendWLDMessage(slotID, WLD_NO_SLOT_ID, NULL, true, fmNumber, pReq, timeout,
+        pResp, pReceivedLen, pFMStatus);
+}
+
+// SendWLDMessageToFM for any slot that tries firstSlot first
+MD_RV wldSendFromSlot(uint32_t firstSlot,
+    uint16_t fmNumber,
+    MD_Buffer_t *pReq,
+    uint32_t timeout,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    uint32_t *pFMStatus)
+{
+    return sendWLDMessage(WLD_NO_SLOT_ID, firstSlot, NULL, true, fmNumber, pReq, timeout,
+        pResp, pReceivedLen, pFMStatus);
+}
+
+// SendWLDMessageToFM that is turned away at once (WLD_MDR_BUSY) rather
+// than wait for an adapter at its admission limits
+MD_RV TrySendWLDMessageToFM(uint32_t slotID,
+    uint16_t fmNumber,
+    MD_Buffer_t *pReq,
+    uint32_t timeout,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    uint32_t *pFMStatus)
+{
+    return sendWLDMessage(slotID, WLD_NO_SLOT_ID, NULL, false, fmNumber, pReq, timeout,
+        pResp, pReceivedLen, pFMStatus);
+}
+
+// SendWLDMessageToFM to the partition of an affinity key.  If its
+// adapter fails the command is replayed on the key's next partition.
+MD_RV SendWLDKeyedMessageToFM(const void *pKey,
+    uint32_t keyLen,
+    uint16_t fmNumber,
+    MD_Buffer_t *pReq,
+    uint32_t timeout,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    uint32_t *pFMStatus)
+{
+    uint64_t keyHash;
+
+    if (!pKey && keyLen)
+        return MDR_INVALID_PARAMETER;
+
+    keyHash = hashWLDKey(pKey, keyLen);
+    return sendWLDMessage(WLD_NO_SLOT_ID, WLD_NO_SLOT_ID, &keyHash, true, fmNumber, pReq, timeout,
+        pResp, pReceivedLen, pFMStatus);
+}
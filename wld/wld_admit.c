@@ -0,0 +1,355 @@
+/*
+    wld_admit.c
+
+    Admission control for the workload distribution (WLD) sample.  Each
+    adapter (hsmID) has a limit on the commands sent to it at once, a
+    token bucket limiting the rate they are sent at, and a bounded queue
+    of callers waiting for either.  A caller that does not get in is
+    turned away with WLD_MDR_BUSY instead of piling up inside
+    MD_SendReceive, so the latency of the admitted commands stays
+    bounded.  This code is sample ONLY and Thales Inc. assumes no
+    liability or responsibility for its correct operation.
+*/
+
+#undef UNICODE
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "wld.h"
+#include "wld_admit.h"
+#include "wld_time.h"
+
+// Limits and state of one adapter.  The limits are read without
+// locking; lock guards the wait queue.
+typedef struct WLD_ADMIT_ADAPTER {
+    struct WLD_ADMIT_ADAPTER *pNext;
+    uint32_t hsmID;
+    bool configured;                // has limits of its own (admit_mutex)
+
+    _Atomic uint32_t maxInFlight;
+    _Atomic uint32_t maxQueued;
+    _Atomic uint32_t maxWaitMsec;
+    _Atomic uint64_t intervalNsec;  // between tokens, 0 = no rate limit
+    _Atomic uint64_t burstNsec;     // bucket size in time: burst * interval
+
+    _Atomic uint32_t inFlight;
+    _Atomic uint64_t tatNsec;       // when the bucket is full again (GCRA)
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    _Atomic uint32_t queued;        // changed with lock held
+} __attribute__((aligned(64))) WLD_ADMIT_ADAPTER;
+
+static WLD_ADMIT_ADAPTER * _Atomic WLD_AdmitAdapters = NULL;
+static _Atomic bool WLD_AdmitOn = false;
+static WLD_ADMISSION_CONFIG WLD_AdmitDefault = {0, 0, 0, 0, 0};
+static _Atomic uint64_t WLD_AdmitQueued = 0;
+static _Atomic uint64_t WLD_AdmitRejected = 0;
+
+// Serializes adapter creation and configuration changes
+static pthread_mutex_t admit_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Apply a configuration to an adapter.  Call with admit_mutex held.
+static void setAdmitLimits(WLD_ADMIT_ADAPTER *pAdmit, const WLD_ADMISSION_CONFIG *pConfig)
+{
+    uint64_t interval = pConfig->ratePerSec ? 1000000000ULL / pConfig->ratePerSec : 0;
+
+    atomic_store_explicit(&pAdmit->maxInFlight, pConfig->maxInFlight, memory_order_relaxed);
+    atomic_store_explicit(&pAdmit->maxQueued, pConfig->maxQueued, memory_order_relaxed);
+    atomic_store_explicit(&pAdmit->maxWaitMsec, pConfig->maxWaitMsec, memory_order_relaxed);
+    atomic_store_explicit(&pAdmit->burstNsec,
+        interval * (pConfig->burst ? pConfig->burst : 1), memory_order_relaxed);
+    atomic_store_explicit(&pAdmit->intervalNsec, interval, memory_order_relaxed);
+
+    // Waiters may now get in, or have a different token to wait for
+    pthread_mutex_lock(&pAdmit->lock);
+    pthread_cond_broadcast(&pAdmit->cond);
+    pthread_mutex_unlock(&pAdmit->lock);
+}
+
+// Get the admission state of an adapter, creating it on first use
+static WLD_ADMIT_ADAPTER *getAdmitAdapter(uint32_t hsmID)
+{
+    WLD_ADMIT_ADAPTER *pAdmit;
+    pthread_condattr_t attr;
+
+    for (pAdmit = atomic_load_explicit(&WLD_AdmitAdapters, memory_order_acquire);
+        pAdmit; pAdmit = pAdmit->pNext)
+    {
+        if (pAdmit->hsmID == hsmID)
+            return pAdmit;
+    }
+
+    pthread_mutex_lock(&admit_mutex);
+
+    // Someone else may have created it meanwhile
+    for (pAdmit = atomic_load_explicit(&WLD_AdmitAdapters, memory_order_acquire);
+        pAdmit; pAdmit = pAdmit->pNext)
+    {
+        if (pAdmit->hsmID == hsmID)
+            break;
+    }
+
+    if (!pAdmit)
+    {
+        pAdmit = aligned_alloc(_Alignof(WLD_ADMIT_ADAPTER), sizeof(WLD_ADMIT_ADAPTER));
+        if (pAdmit)
+        {
+            memset(pAdmit, 0, sizeof(WLD_ADMIT_ADAPTER));
+            pAdmit->hsmID = hsmID;
+            pthread_mutex_init(&pAdmit->lock, NULL);
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&pAdmit->cond, &attr);
+            pthread_condattr_destroy(&attr);
+            setAdmitLimits(pAdmit, &WLD_AdmitDefault);
+
+            pAdmit->pNext = atomic_load_explicit(&WLD_AdmitAdapters, memory_order_relaxed);
+            atomic_store_explicit(&WLD_AdmitAdapters, pAdmit, memory_order_release);
+        }
+    }
+
+    pthread_mutex_unlock(&admit_mutex);
+
+    return pAdmit;
+}
+
+// Take one of the adapter's in-flight commands
+static bool takeInFlight(WLD_ADMIT_ADAPTER *pAdmit)
+{
+    uint32_t max = atomic_load_explicit(&pAdmit->maxInFlight, memory_order_relaxed);
+    uint32_t inFlight = atomic_load_explicit(&pAdmit->inFlight, memory_order_relaxed);
+
+    do
+    {
+        if (max && inFlight >= max)
+            return false;
+    } while (!atomic_compare_exchange_weak_explicit(&pAdmit->inFlight, &inFlight, inFlight + 1,
+        memory_order_acquire, memory_order_relaxed));
+
+    return true;
+}
+
+// Take a token from the adapter's bucket.  The bucket is kept as the
+// time at which it will be full again (the generic cell rate
+// algorithm), so taking a token is a single compare and swap.  When
+// the bucket is empty *pWaitNsec says how long until the next token.
+static bool takeToken(WLD_ADMIT_ADAPTER *pAdmit, uint64_t now, uint64_t *pWaitNsec)
+{
+    uint64_t interval = atomic_load_explicit(&pAdmit->intervalNsec, memory_order_relaxed);
+    uint64_t burst = atomic_load_explicit(&pAdmit->burstNsec, memory_order_relaxed);
+    uint64_t tat, next;
+
+    if (interval == 0)
+        return true;
+
+    tat = atomic_load_explicit(&pAdmit->tatNsec, memory_order_relaxed);
+    do
+    {
+        next = (tat > now ? tat : now) + interval;
+        if (next - now > burst)
+        {
+            *pWaitNsec = next - now - burst;
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&pAdmit->tatNsec, &tat, next,
+        memory_order_relaxed, memory_order_relaxed));
+
+    return true;
+}
+
+static void releaseInFlight(WLD_ADMIT_ADAPTER *pAdmit)
+{
+    atomic_fetch_sub_explicit(&pAdmit->inFlight, 1, memory_order_seq_cst);
+
+    // A waiter counts itself in before it looks, so it either sees this
+    // command gone or is signalled
+    if (atomic_load_explicit(&pAdmit->queued, memory_order_seq_cst))
+    {
+        pthread_mutex_lock(&pAdmit->lock);
+        pthread_cond_signal(&pAdmit->cond);
+        pthread_mutex_unlock(&pAdmit->lock);
+    }
+}
+
+// Take a command and a token, or neither.  locked says the caller holds
+// pAdmit->lock (a queued waiter), so the command is given back without
+// taking the lock again; the waiter retries when the token is due.
+static bool takeAdmission(WLD_ADMIT_ADAPTER *pAdmit, uint64_t *pWaitNsec, bool locked)
+{
+    *pWaitNsec = 0;
+
+    if (!takeInFlight(pAdmit))
+        return false;
+
+    if (!takeToken(pAdmit, wldNowNsec(), pWaitNsec))
+    {
+        if (!locked)
+            releaseInFlight(pAdmit);
+        else
+        {
+            atomic_fetch_sub_explicit(&pAdmit->inFlight, 1, memory_order_seq_cst);
+            // A command that ended meanwhile may have woken this waiter
+            // rather than another one that wants the command
+            if (atomic_load_explicit(&pAdmit->queued, memory_order_seq_cst) > 1)
+                pthread_cond_signal(&pAdmit->cond);
+        }
+        return false;
+    }
+
+    return true;
+}
+
+bool wldAdmitEnabled(void)
+{
+    return atomic_load_explicit(&WLD_AdmitOn, memory_order_relaxed);
+}
+
+bool wldAdmitTry(uint32_t hsmID)
+{
+    WLD_ADMIT_ADAPTER *pAdmit = getAdmitAdapter(hsmID);
+    uint64_t waitNsec;
+
+    // No memory for the state - do not limit the adapter
+    if (!pAdmit)
+        return true;
+
+    // Do not jump the queue
+    if (atomic_load_explicit(&pAdmit->queued, memory_order_relaxed))
+        return false;
+
+    return takeAdmission(pAdmit, &waitNsec, false);
+}
+
+bool wldAdmitWait(uint32_t hsmID, uint64_t untilNsec)
+{
+    WLD_ADMIT_ADAPTER *pAdmit = getAdmitAdapter(hsmID);
+    struct timespec wake;
+    uint64_t waitNsec, now, wakeNsec;
+    uint32_t maxWaitMsec;
+    bool admitted = false;
+
+    if (!pAdmit)
+        return true;
+
+    maxWaitMsec = atomic_load_explicit(&pAdmit->maxWaitMsec, memory_order_relaxed);
+    if (untilNsec == 0 && maxWaitMsec)
+        untilNsec = wldNowNsec() + (uint64_t)maxWaitMsec * 1000000ULL;
+
+    pthread_mutex_lock(&pAdmit->lock);
+
+    if (atomic_load_explicit(&pAdmit->queued, memory_order_relaxed) >=
+        atomic_load_explicit(&pAdmit->maxQueued, memory_order_relaxed))
+    {
+        pthread_mutex_unlock(&pAdmit->lock);
+        return false;
+    }
+
+    atomic_fetch_add_explicit(&pAdmit->queued, 1, memory_order_seq_cst);
+    atomic_fetch_add_explicit(&WLD_AdmitQueued, 1, memory_order_relaxed);
+
+    for (;;)
+    {
+        if (takeAdmission(pAdmit, &waitNsec, true))
+        {
+            admitted = true;
+            break;
+        }
+
+        now = wldNowNsec();
+        if (untilNsec && now >= untilNsec)
+            break;
+
+        // Out of tokens: nobody signals the next one, so wake up for it
+        wakeNsec = waitNsec ? now + waitNsec : untilNsec;
+        if (untilNsec && wakeNsec > untilNsec)
+            wakeNsec = untilNsec;
+
+        if (wakeNsec == 0)
+            pthread_cond_wait(&pAdmit->cond, &pAdmit->lock);
+        else
+        {
+            wake.tv_sec = (time_t)(wakeNsec / 1000000000ULL);
+            wake.tv_nsec = (long)(wakeNsec % 1000000000ULL);
+            (void)pthread_cond_timedwait(&pAdmit->cond, &pAdmit->lock, &wake);
+        }
+    }
+
+    atomic_fetch_sub_explicit(&pAdmit->queued, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&pAdmit->lock);
+
+    return admitted;
+}
+
+void wldAdmitReject(void)
+{
+    atomic_fetch_add_explicit(&WLD_AdmitRejected, 1, memory_order_relaxed);
+}
+
+void wldAdmitRelease(uint32_t hsmID)
+{
+    WLD_ADMIT_ADAPTER *pAdmit = getAdmitAdapter(hsmID);
+
+    if (pAdmit)
+        releaseInFlight(pAdmit);
+}
+
+// Set the admission limits of one adapter, or with WLD_ALL_ADAPTERS of
+// every adapter that was not given limits of its own
+WLD_RV SetWLDAdmission(uint32_t hsmID, const WLD_ADMISSION_CONFIG *pConfig)
+{
+    WLD_ADMIT_ADAPTER *pAdmit;
+    bool limited;
+
+    if (!pConfig || pConfig->ratePerSec > 1000000000)
+        return WLDR_INVALID_PARAMETER;
+
+    limited = pConfig->maxInFlight || pConfig->ratePerSec;
+
+    if (hsmID != WLD_ALL_ADAPTERS && !getAdmitAdapter(hsmID))
+        return WLDR_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&admit_mutex);
+
+    if (hsmID == WLD_ALL_ADAPTERS)
+        WLD_AdmitDefault = *pConfig;
+
+    for (pAdmit = atomic_load_explicit(&WLD_AdmitAdapters, memory_order_acquire);
+        pAdmit; pAdmit = pAdmit->pNext)
+    {
+        if (pAdmit->hsmID == hsmID)
+        {
+            pAdmit->configured = true;
+            setAdmitLimits(pAdmit, pConfig);
+        }
+        else if (hsmID == WLD_ALL_ADAPTERS && !pAdmit->configured)
+            setAdmitLimits(pAdmit, pConfig);
+
+        // Admission stays on while any adapter is limited
+        limited = limited || atomic_load_explicit(&pAdmit->maxInFlight, memory_order_relaxed) ||
+            atomic_load_explicit(&pAdmit->intervalNsec, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&WLD_AdmitOn, limited, memory_order_relaxed);
+
+    pthread_mutex_unlock(&admit_mutex);
+
+    return WLDR_OK;
+}
+
+// Callers that had to wait for an adapter, and callers turned away
+void GetWLDAdmissionCounts(uint64_t *pQueued, uint64_t *pRejected)
+{
+    if (pQueued)
+        *pQueued = atomic_load_explicit(&WLD_AdmitQueued, memory_order_relaxed);
+    if (pRejected)
+        *pRejected = atomic_load_explicit(&WLD_AdmitRejected, memory_order_relaxed);
+}
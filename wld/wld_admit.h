@@ -0,0 +1,35 @@
+/*
+    wld_admit.h
+
+    Internal interface between wld.c and the per-adapter admission
+    control in wld_admit.c.  Adapters are identified by hsmID, and
+    times are CLOCK_MONOTONIC nanoseconds.  This code is sample ONLY
+    and Thales Inc. assumes no liability or responsibility for its
+    correct operation.
+*/
+
+
+#ifndef _WLD_ADMIT_H_
+#define _WLD_ADMIT_H_
+
+#include "wld.h"
+
+// True once any admission limit has been set
+bool wldAdmitEnabled(void);
+
+// Take a command on an adapter if it is within its limits right now
+// and nobody is queued for it
+bool wldAdmitTry(uint32_t hsmID);
+
+// Take a command on an adapter, waiting in its queue until untilNsec
+// (0 = the configured maxWaitMsec).  False if the queue is full or the
+// time ran out.
+bool wldAdmitWait(uint32_t hsmID, uint64_t untilNsec);
+
+// Give back a command taken with wldAdmitTry or wldAdmitWait
+void wldAdmitRelease(uint32_t hsmID);
+
+// Count a caller turned away with WLD_MDR_BUSY
+void wldAdmitReject(void);
+
+#endif
@@ -0,0 +1,482 @@
+/*
+    wld_async.c
+
+    Asynchronous submit/complete interface for the workload distribution
+    (WLD) sample.  Each adapter (hsmID) gets a submission queue served by
+    a fixed number of worker threads, so a few application threads can
+    keep the pipeline of every adapter full without blocking for the
+    MD_SendReceive round trip.  This code is sample ONLY and Thales Inc.
+    assumes no liability or responsibility for its correct operation.
+*/
+
+#undef UNICODE
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "wld.h"
+#include "wld_retry.h"
+#include "wld_time.h"
+
+// One queued request.  Once complete the same record is linked on the
+// completion queue.
+typedef struct WLD_ASYNC_REQ {
+    struct WLD_ASYNC_REQ *pNext;
+    uint32_t slot;
+    bool anySlot;
+    uint16_t fmNumber;
+    MD_Buffer_t *pReq;
+    uint32_t timeout;
+    uint64_t deadlineNsec;          // 0 = no timeout
+    MD_Buffer_t *pResp;
+    WLD_COMPLETION_CB pCallback;
+    WLD_COMPLETION completion;
+} WLD_ASYNC_REQ;
+
+// Submission queue and workers of one adapter
+typedef struct WLD_ASYNC_QUEUE {
+    struct WLD_ASYNC_QUEUE *pNext;
+    uint32_t hsmID;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    WLD_ASYNC_REQ *pHead;
+    WLD_ASYNC_REQ *pTail;
+    bool stopping;
+    uint32_t workerCount;
+    pthread_t *pWorkers;
+} WLD_ASYNC_QUEUE;
+
+static WLD_ASYNC_QUEUE * _Atomic WLD_AsyncQueues = NULL;
+static _Atomic uint64_t WLD_NextTicket = 0;
+static _Atomic bool InWLDAsyncMode = false;
+static uint32_t WLD_AsyncDepth = 0;
+
+// Serializes queue creation and InitializeWLDAsync / FinalizeWLDAsync
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond;
+static WLD_ASYNC_REQ *pDoneHead = NULL;
+static WLD_ASYNC_REQ *pDoneTail = NULL;
+static int doneFD = -1;
+
+static void *asyncWorker(void *pArg);
+
+// Report a completed request through its callback or the completion queue
+static void completeAsyncReq(WLD_ASYNC_REQ *pReq, MD_RV mdResult, uint32_t recvlen, uint32_t fmStatus)
+{
+    uint64_t one = 1;
+
+    pReq->completion.mdResult = mdResult;
+    pReq->completion.receivedLen = recvlen;
+    pReq->completion.fmStatus = fmStatus;
+
+    if (pReq->pCallback)
+    {
+        pReq->pCallback(&pReq->completion);
+        free(pReq);
+        return;
+    }
+
+    pReq->pNext = NULL;
+
+    pthread_mutex_lock(&done_mutex);
+    if (pDoneTail)
+        pDoneTail->pNext = pReq;
+    else
+        pDoneHead = pReq;
+    pDoneTail = pReq;
+    pthread_cond_signal(&done_cond);
+
+    // Under done_mutex, so PollWLDCompletions cannot reset the fd
+    // between the queue and the write and leave it readable
+    if (doneFD >= 0)
+        (void)write(doneFD, &one, sizeof(one));
+    pthread_mutex_unlock(&done_mutex);
+}
+
+// Append a request to a queue; fails if the queue is shutting down
+static bool enqueueAsyncReq(WLD_ASYNC_QUEUE *pQueue, WLD_ASYNC_REQ *pReq)
+{
+    bool ok = false;
+
+    pReq->pNext = NULL;
+
+    pthread_mutex_lock(&pQueue->lock);
+    if (!pQueue->stopping)
+    {
+        if (pQueue->pTail)
+            pQueue->pTail->pNext = pReq;
+        else
+            pQueue->pHead = pReq;
+        pQueue->pTail = pReq;
+        pthread_cond_signal(&pQueue->ready);
+        ok = true;
+    }
+    pthread_mutex_unlock(&pQueue->lock);
+
+    return ok;
+}
+
+// Find the queue for an adapter, creating it (and its workers) on first use
+static WLD_ASYNC_QUEUE *getAsyncQueue(uint32_t hsmID)
+{
+    WLD_ASYNC_QUEUE *pQueue;
+    uint32_t i;
+
+    for (pQueue = atomic_load_explicit(&WLD_AsyncQueues, memory_order_acquire);
+        pQueue; pQueue = pQueue->pNext)
+    {
+        if (pQueue->hsmID == hsmID)
+            return pQueue;
+    }
+
+    pthread_mutex_lock(&async_mutex);
+
+    // Someone may have created it while we waited for the lock
+    for (pQueue = atomic_load_explicit(&WLD_AsyncQueues, memory_order_acquire);
+        pQueue; pQueue = pQueue->pNext)
+    {
+        if (pQueue->hsmID == hsmID)
+            break;
+    }
+
+    if (!pQueue && atomic_load(&InWLDAsyncMode))
+    {
+        pQueue = calloc(1, sizeof(WLD_ASYNC_QUEUE));
+        if (pQueue)
+            pQueue->pWorkers = calloc(WLD_AsyncDepth, sizeof(pthread_t));
+
+        if (pQueue && pQueue->pWorkers)
+        {
+            pQueue->hsmID = hsmID;
+            pthread_mutex_init(&pQueue->lock, NULL);
+            pthread_cond_init(&pQueue->ready, NULL);
+
+            for (i=0; i < WLD_AsyncDepth; i++)
+            {
+                if (pthread_create(&pQueue->pWorkers[i], NULL, asyncWorker, pQueue) != 0)
+                    break;
+                pQueue->workerCount++;
+            }
+        }
+
+        if (pQueue && pQueue->workerCount == 0)
+        {
+            printf("\nWLD async: failed to start workers for adapter %u\n", hsmID);
+            if (pQueue->pWorkers)
+                free(pQueue->pWorkers);
+            free(pQueue);
+            pQueue = NULL;
+        }
+
+        if (pQueue)
+        {
+            pQueue->pNext = atomic_load_explicit(&WLD_AsyncQueues, memory_order_relaxed);
+            atomic_store_explicit(&WLD_AsyncQueues, pQueue, memory_order_release);
+        }
+    }
+
+    pthread_mutex_unlock(&async_mutex);
+
+    return pQueue;
+}
+
+// Pick a slot (if the caller did not) and queue the request on its adapter
+static WLD_RV routeAsyncReq(WLD_ASYNC_REQ *pReq)
+{
+    WLD_ASYNC_QUEUE *pQueue;
+    WLD_RV rv;
+    uint32_t hsmID;
+
+    if (pReq->anySlot)
+    {
+        rv = GetWLDSlotID(&pReq->slot, NULL);
+        if (rv != WLDR_OK)
+            return rv;
+    }
+
+    rv = GetWLDSlotInfo(pReq->slot, &hsmID, NULL);
+    if (rv != WLDR_OK)
+        return rv;
+
+    pQueue = getAsyncQueue(hsmID);
+    if (!pQueue || !enqueueAsyncReq(pQueue, pReq))
+        return WLDR_ASYNC_NOT_INITIALIZED;
+
+    return WLDR_OK;
+}
+
+// Worker thread: send requests from one adapter queue until it stops
+static void *asyncWorker(void *pArg)
+{
+    WLD_ASYNC_QUEUE *pQueue = (WLD_ASYNC_QUEUE *)pArg;
+    WLD_ASYNC_REQ *pReq;
+    MD_RV mdResult;
+    WLD_ERROR_CLASS errorClass;
+    uint32_t recvlen;
+    uint32_t fmStatus;
+    uint64_t now;
+
+    while (1)
+    {
+        pthread_mutex_lock(&pQueue->lock);
+        while (!pQueue->pHead && !pQueue->stopping)
+            pthread_cond_wait(&pQueue->ready, &pQueue->lock);
+
+        pReq = pQueue->pHead;
+        if (pReq)
+        {
+            pQueue->pHead = pReq->pNext;
+            if (!pQueue->pHead)
+                pQueue->pTail = NULL;
+        }
+        pthread_mutex_unlock(&pQueue->lock);
+
+        // Queue drained and shutting down
+        if (!pReq)
+            break;
+
+        recvlen = 0;
+        fmStatus = 0;
+
+        // The timeout runs from submission, so time spent queued (and
+        // on an adapter that failed) is taken out of it
+        if (pReq->deadlineNsec)
+        {
+            now = wldNowNsec();
+            if (now >= pReq->deadlineNsec)
+            {
+                completeAsyncReq(pReq, WLD_MDR_TIMEOUT, 0, 0);
+                continue;
+            }
+            pReq->timeout = (uint32_t)((pReq->deadlineNsec - now + 999999) / 1000000);
+        }
+
+        mdResult = SendWLDMessageToFM(pReq->slot,
+            pReq->fmNumber,
+            pReq->pReq,
+            pReq->timeout,
+            pReq->pResp,
+            &recvlen,
+            &fmStatus);
+
+        // SendWLDMessageToFM has marked this adapter or partition
+        // inactive, or ReconfigureWLD removed the slot while the request
+        // was queued - if any slot will do, replay the request on
+        // another adapter while the retry budget allows
+        errorClass = ClassifyWLDError(mdResult, fmStatus);
+        if (pReq->anySlot && errorClass != WLD_ERROR_NONE && errorClass != WLD_ERROR_FATAL &&
+            wldRetryTake())
+        {
+            if (routeAsyncReq(pReq) == WLDR_OK)
+                continue;
+        }
+
+        completeAsyncReq(pReq, mdResult, recvlen, fmStatus);
+    }
+
+    return NULL;
+}
+
+// Start the asynchronous interface with inFlightPerAdapter workers per adapter
+WLD_RV InitializeWLDAsync(uint32_t inFlightPerAdapter)
+{
+    pthread_condattr_t attr;
+
+    if (inFlightPerAdapter == 0)
+        return WLDR_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&async_mutex);
+
+    if (atomic_load(&InWLDAsyncMode))
+    {
+        pthread_mutex_unlock(&async_mutex);
+        return WLDR_WLD_ALREADY_INITIALIZED;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&done_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    doneFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    WLD_AsyncDepth = inFlightPerAdapter;
+    atomic_store(&InWLDAsyncMode, true);
+
+    pthread_mutex_unlock(&async_mutex);
+
+    return WLDR_OK;
+}
+
+// Stop the asynchronous interface.  Queued requests are sent before
+// the workers exit; completions not yet polled are discarded.  Must not
+// be called concurrently with SubmitWLDMessageToFM.
+void FinalizeWLDAsync(void)
+{
+    WLD_ASYNC_QUEUE *pQueue, *pNextQueue;
+    WLD_ASYNC_REQ *pDone;
+    uint32_t i;
+
+    pthread_mutex_lock(&async_mutex);
+
+    if (!atomic_load(&InWLDAsyncMode))
+    {
+        pthread_mutex_unlock(&async_mutex);
+        return;
+    }
+    atomic_store(&InWLDAsyncMode, false);
+
+    pQueue = atomic_exchange(&WLD_AsyncQueues, NULL);
+    for (pNextQueue = pQueue; pNextQueue; pNextQueue = pNextQueue->pNext)
+    {
+        pthread_mutex_lock(&pNextQueue->lock);
+        pNextQueue->stopping = true;
+        pthread_cond_broadcast(&pNextQueue->ready);
+        pthread_mutex_unlock(&pNextQueue->lock);
+    }
+
+    pthread_mutex_unlock(&async_mutex);
+
+    for (; pQueue; pQueue = pNextQueue)
+    {
+        pNextQueue = pQueue->pNext;
+        for (i=0; i < pQueue->workerCount; i++)
+            pthread_join(pQueue->pWorkers[i], NULL);
+
+        pthread_mutex_destroy(&pQueue->lock);
+        pthread_cond_destroy(&pQueue->ready);
+        free(pQueue->pWorkers);
+        free(pQueue);
+    }
+
+    pthread_mutex_lock(&done_mutex);
+    while ((pDone = pDoneHead) != NULL)
+    {
+        pDoneHead = pDone->pNext;
+        free(pDone);
+    }
+    pDoneTail = NULL;
+    pthread_mutex_unlock(&done_mutex);
+
+    if (doneFD >= 0)
+    {
+        close(doneFD);
+        doneFD = -1;
+    }
+}
+
+// Queue a request for an FM.  Returns immediately with a ticket that
+// identifies the request in its completion.
+WLD_RV SubmitWLDMessageToFM(uint32_t slotID,
+    uint16_t fmNumber,
+    MD_Buffer_t *pReq,
+    uint32_t timeout,
+    MD_Buffer_t *pResp,
+    WLD_COMPLETION_CB pCallback,
+    void *pContext,
+    WLD_TICKET *pTicket)
+{
+    WLD_ASYNC_REQ *pAsyncReq;
+    WLD_RV rv;
+
+    if (!atomic_load_explicit(&InWLDAsyncMode, memory_order_acquire))
+        return WLDR_ASYNC_NOT_INITIALIZED;
+
+    if (!pReq)
+        return WLDR_INVALID_PARAMETER;
+
+    pAsyncReq = malloc(sizeof(WLD_ASYNC_REQ));
+    if (!pAsyncReq)
+        return WLDR_NO_SLOT_AVAILABLE;
+
+    memset(pAsyncReq, 0, sizeof(WLD_ASYNC_REQ));
+    pAsyncReq->completion.ticket = atomic_fetch_add_explicit(&WLD_NextTicket, 1, memory_order_relaxed) + 1;
+    pAsyncReq->completion.pContext = pContext;
+    pAsyncReq->slot = slotID;
+    pAsyncReq->anySlot = (slotID == WLD_NO_SLOT_ID);
+    pAsyncReq->fmNumber = fmNumber;
+    pAsyncReq->pReq = pReq;
+    pAsyncReq->timeout = timeout;
+    if (timeout)
+        pAsyncReq->deadlineNsec = wldNowNsec() + (uint64_t)timeout * 1000000ULL;
+    pAsyncReq->pResp = pResp;
+    pAsyncReq->pCallback = pCallback;
+
+    if (pTicket)
+        *pTicket = pAsyncReq->completion.ticket;
+
+    rv = routeAsyncReq(pAsyncReq);
+    if (rv != WLDR_OK)
+        free(pAsyncReq);
+
+    return rv;
+}
+
+// Collect up to maxCompletions completions, waiting up to waitMsec for
+// the first one.  Returns the number of completions copied out.
+uint32_t PollWLDCompletions(WLD_COMPLETION *pCompletions, uint32_t maxCompletions, uint32_t waitMsec)
+{
+    WLD_ASYNC_REQ *pDone;
+    struct timespec deadline;
+    uint64_t count;
+    uint32_t n = 0;
+
+    if (!pCompletions || maxCompletions == 0)
+        return 0;
+
+    pthread_mutex_lock(&done_mutex);
+
+    if (!pDoneHead && waitMsec)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += waitMsec / 1000;
+        deadline.tv_nsec += (long)(waitMsec % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while (!pDoneHead)
+        {
+            if (pthread_cond_timedwait(&done_cond, &done_mutex, &deadline) == ETIMEDOUT)
+                break;
+        }
+    }
+
+    while (n < maxCompletions && (pDone = pDoneHead) != NULL)
+    {
+        pDoneHead = pDone->pNext;
+        pCompletions[n++] = pDone->completion;
+        free(pDone);
+    }
+
+    // Reset the eventfd once the queue is empty; a completion posted
+    // after this point signals it again
+    if (!pDoneHead)
+    {
+        pDoneTail = NULL;
+        if (doneFD >= 0)
+            (void)read(doneFD, &count, sizeof(count));
+    }
+
+    pthread_mutex_unlock(&done_mutex);
+
+    return n;
+}
+
+// Get the eventfd that becomes readable when completions are queued
+int GetWLDCompletionFD(void)
+{
+    return doneFD;
+}
@@ -0,0 +1,321 @@
+/*
+    wld_batch.c
+
+    Host side batcher for the workload distribution (WLD) sample.
+    Concurrent fixed-size FM records headed for the same adapter are
+    coalesced into one batch envelope (see wld_fm.h) and sent with a
+    single MD_SendReceive.  A batch is flushed when it reaches the size
+    threshold or when its linger timer expires.  This code is sample
+    ONLY and Thales Inc. assumes no liability or responsibility for its
+    correct operation.
+*/
+
+#undef UNICODE
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "wld.h"
+#include "wld_fm.h"
+#include "wld_msg.h"
+#include "wld_time.h"
+
+// One batch being collected or in flight.  Callers that added a record
+// hold a reference; the last one to leave frees it.
+typedef struct WLD_BATCH {
+    uint32_t slot;
+    uint16_t fmNumber;
+    uint32_t recordLen;
+    uint32_t count;
+    uint32_t refs;
+    uint64_t deadlineNsec;  // earliest deadline of its records, 0 = none
+    bool full;
+    bool done;
+    MD_RV mdResult;
+    const void *pRecords[WLD_FM_MAX_BATCH];
+    uint32_t status[WLD_FM_MAX_BATCH];
+} WLD_BATCH;
+
+// Batch collector of one adapter
+typedef struct WLD_BATCH_COLLECTOR {
+    struct WLD_BATCH_COLLECTOR *pNext;
+    uint32_t hsmID;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    WLD_BATCH *pOpen;
+} WLD_BATCH_COLLECTOR;
+
+static WLD_BATCH_COLLECTOR * _Atomic WLD_Collectors = NULL;
+static _Atomic uint32_t WLD_BatchMax = 1;
+static _Atomic uint32_t WLD_BatchLingerUsec = 0;
+
+static pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Find the collector for an adapter, creating it on first use
+static WLD_BATCH_COLLECTOR *getBatchCollector(uint32_t hsmID)
+{
+    WLD_BATCH_COLLECTOR *pColl;
+    pthread_condattr_t attr;
+
+    for (pColl = atomic_load_explicit(&WLD_Collectors, memory_order_acquire);
+        pColl; pColl = pColl->pNext)
+    {
+        if (pColl->hsmID == hsmID)
+            return pColl;
+    }
+
+    pthread_mutex_lock(&batch_mutex);
+
+    for (pColl = atomic_load_explicit(&WLD_Collectors, memory_order_acquire);
+        pColl; pColl = pColl->pNext)
+    {
+        if (pColl->hsmID == hsmID)
+            break;
+    }
+
+    if (!pColl)
+    {
+        pColl = calloc(1, sizeof(WLD_BATCH_COLLECTOR));
+        if (pColl)
+        {
+            pColl->hsmID = hsmID;
+            pthread_mutex_init(&pColl->lock, NULL);
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&pColl->cond, &attr);
+            pthread_condattr_destroy(&attr);
+
+            pColl->pNext = atomic_load_explicit(&WLD_Collectors, memory_order_relaxed);
+            atomic_store_explicit(&WLD_Collectors, pColl, memory_order_release);
+        }
+    }
+
+    pthread_mutex_unlock(&batch_mutex);
+
+    return pColl;
+}
+
+// Send a closed batch as one envelope and fill in the per record
+// status.  The records are sent from the callers' memory, within the
+// earliest deadline of the batch.
+static void sendBatch(WLD_BATCH *pBatch)
+{
+    WLD_MSG *pMsg;
+    WLD_MSG_BATCH header;
+    WLD_MSG_BATCH_REPLY replyHeader;
+    const uint8_t *p;
+    uint32_t fmStatus = 0;
+    uint32_t timeout = 0;
+    uint64_t now;
+    uint32_t i;
+
+    if (pBatch->deadlineNsec)
+    {
+        now = wldNowNsec();
+        if (now >= pBatch->deadlineNsec)
+        {
+            pBatch->mdResult = WLD_MDR_TIMEOUT;
+            return;
+        }
+        timeout = (uint32_t)((pBatch->deadlineNsec - now + 999999) / 1000000);
+    }
+
+    header.magic = WLD_FM_BATCH_MAGIC;
+    header.count = pBatch->count;
+    header.recordLen = pBatch->recordLen;
+
+    pMsg = BeginWLDMessage();
+    if (!WLD_MSG_BATCH_Append(pMsg, &header))
+    {
+        pBatch->mdResult = MDR_INSUFFICIENT_RESOURCE;
+        return;
+    }
+
+    for (i=0; i < pBatch->count; i++)
+        (void)AttachWLDMessage(pMsg, pBatch->pRecords[i], pBatch->recordLen);
+
+    pBatch->mdResult = SendWLDMessage(pMsg, pBatch->slot, pBatch->fmNumber, timeout, &fmStatus);
+    if (pBatch->mdResult != MDR_OK)
+        return;
+
+    // A rejected envelope fails every record with the FM status
+    if (fmStatus != 0 ||
+        pMsg->replyLen < WLD_MSG_BATCH_REPLY_WIRE_LEN + pBatch->count * sizeof(uint32_t) ||
+        !WLD_MSG_BATCH_REPLY_Parse(pMsg->replyData, pMsg->replyLen, &replyHeader) ||
+        replyHeader.count != pBatch->count)
+    {
+        for (i=0; i < pBatch->count; i++)
+            pBatch->status[i] = fmStatus ? fmStatus : (uint32_t)-1;
+        return;
+    }
+
+    p = pMsg->replyData + WLD_MSG_BATCH_REPLY_WIRE_LEN;
+    for (i=0; i < pBatch->count; i++)
+        p = wldMsgGet_uint32_t(p, &pBatch->status[i]);
+}
+
+// Set the batch size threshold and linger time.  maxRecords of 1
+// (the default) sends every record in its own envelope.
+WLD_RV SetWLDBatching(uint32_t maxRecords, uint32_t lingerUsec)
+{
+    if (maxRecords == 0 || maxRecords > WLD_FM_MAX_BATCH)
+        return WLDR_INVALID_PARAMETER;
+
+    atomic_store(&WLD_BatchMax, maxRecords);
+    atomic_store(&WLD_BatchLingerUsec, lingerUsec);
+
+    return WLDR_OK;
+}
+
+// Send one fixed-size record to the FM, coalesced with concurrent
+// records for the same adapter.  Blocks until the batch holding the
+// record completes; the record's own result is returned in
+// pRecordStatus.  The record is built for the adapter of slotID, so
+// there is no WLD_NO_SLOT_ID and no failover.
+MD_RV SendWLDBatchRecord(uint32_t slotID,
+    uint16_t fmNumber,
+    const void *pRecord,
+    uint32_t recordLen,
+    uint32_t timeout,
+    uint32_t *pRecordStatus)
+{
+    WLD_BATCH_COLLECTOR *pColl;
+    WLD_BATCH *pBatch;
+    WLD_BATCH single;
+    struct timespec until;
+    uint32_t maxRecords = atomic_load_explicit(&WLD_BatchMax, memory_order_relaxed);
+    uint32_t lingerUsec = atomic_load_explicit(&WLD_BatchLingerUsec, memory_order_relaxed);
+    uint32_t slot = slotID;
+    uint32_t hsmID;
+    uint32_t index;
+    uint64_t deadlineNsec = 0;
+    uint64_t lingerEnd, untilNsec;
+    bool leader = false;
+    MD_RV mdResult;
+
+    if (!pRecord || recordLen == 0 || !pRecordStatus || slotID == WLD_NO_SLOT_ID)
+        return MDR_INVALID_PARAMETER;
+
+    if (timeout)
+        deadlineNsec = wldNowNsec() + (uint64_t)timeout * 1000000ULL;
+
+    if (GetWLDSlotInfo(slot, &hsmID, NULL) != WLDR_OK)
+        return MDR_INVALID_HSM_INDEX;
+
+    pColl = (maxRecords > 1) ? getBatchCollector(hsmID) : NULL;
+    if (pColl)
+    {
+        pthread_mutex_lock(&pColl->lock);
+
+        pBatch = pColl->pOpen;
+        if (pBatch && (pBatch->fmNumber != fmNumber || pBatch->recordLen != recordLen))
+        {
+            // Different command shape - don't mix it into this batch
+            pthread_mutex_unlock(&pColl->lock);
+            pColl = NULL;
+        }
+        else if (!pBatch)
+        {
+            pBatch = calloc(1, sizeof(WLD_BATCH));
+            if (pBatch)
+            {
+                pBatch->slot = slot;
+                pBatch->fmNumber = fmNumber;
+                pBatch->recordLen = recordLen;
+                pColl->pOpen = pBatch;
+                leader = true;
+            }
+            else
+            {
+                pthread_mutex_unlock(&pColl->lock);
+                pColl = NULL;
+            }
+        }
+    }
+
+    // Not batching - send the record in an envelope of its own
+    if (!pColl)
+    {
+        memset(&single, 0, sizeof(single));
+        single.slot = slot;
+        single.fmNumber = fmNumber;
+        single.recordLen = recordLen;
+        single.count = 1;
+        single.deadlineNsec = deadlineNsec;
+        single.pRecords[0] = pRecord;
+        sendBatch(&single);
+        *pRecordStatus = single.status[0];
+        return single.mdResult;
+    }
+
+    index = pBatch->count++;
+    pBatch->pRecords[index] = pRecord;
+    pBatch->refs++;
+
+    // The envelope has to make the earliest deadline of its records,
+    // so that no caller waits for it past its own
+    if (deadlineNsec && (!pBatch->deadlineNsec || deadlineNsec < pBatch->deadlineNsec))
+    {
+        pBatch->deadlineNsec = deadlineNsec;
+        if (!leader)
+            pthread_cond_broadcast(&pColl->cond);
+    }
+
+    // Full - close it and wake the leader to send it now
+    if (pBatch->count >= maxRecords)
+    {
+        pBatch->full = true;
+        pColl->pOpen = NULL;
+        pthread_cond_broadcast(&pColl->cond);
+    }
+
+    if (leader)
+    {
+        // Linger for more records unless the batch filled up or its
+        // earliest deadline comes first
+        lingerEnd = wldNowNsec() + (uint64_t)lingerUsec * 1000ULL;
+        while (!pBatch->full)
+        {
+            untilNsec = lingerEnd;
+            if (pBatch->deadlineNsec && pBatch->deadlineNsec < untilNsec)
+                untilNsec = pBatch->deadlineNsec;
+            if (wldNowNsec() >= untilNsec)
+                break;
+
+            until.tv_sec = (time_t)(untilNsec / 1000000000ULL);
+            until.tv_nsec = (long)(untilNsec % 1000000000ULL);
+            (void)pthread_cond_timedwait(&pColl->cond, &pColl->lock, &until);
+        }
+
+        if (pColl->pOpen == pBatch)
+            pColl->pOpen = NULL;
+        pthread_mutex_unlock(&pColl->lock);
+
+        sendBatch(pBatch);
+
+        pthread_mutex_lock(&pColl->lock);
+        pBatch->done = true;
+        pthread_cond_broadcast(&pColl->cond);
+    }
+    else
+    {
+        while (!pBatch->done)
+            pthread_cond_wait(&pColl->cond, &pColl->lock);
+    }
+
+    *pRecordStatus = pBatch->status[index];
+    mdResult = pBatch->mdResult;
+
+    if (--pBatch->refs == 0)
+        free(pBatch);
+
+    pthread_mutex_unlock(&pColl->lock);
+
+    return mdResult;
+}
@@ -0,0 +1,632 @@
+/*
+    wld_cache.c
+
+    Result cache for the workload distribution (WLD) sample.  Replies
+    to read only FM commands are kept, keyed by FM number, request
+    bytes and slot, in lock striped shards with an LRU list each.
+    Callers that ask for a reply another caller is already fetching
+    wait for it (single flight) rather than send the command again.
+    Replies are invalidated lazily: every entry remembers the
+    generation of its slot when it was fetched, and taking a partition
+    out of rotation bumps that generation.  This code is sample ONLY
+    and Thales Inc. assumes no liability or responsibility for its
+    correct operation.
+*/
+
+#undef UNICODE
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "wld.h"
+#include "wld_cache.h"
+#include "wld_time.h"
+
+// Shards (a power of 2), slot generations and the default largest
+// reply kept
+#define WLD_CACHE_SHARDS                64
+#define WLD_CACHE_GENERATIONS           256
+#define WLD_CACHE_REPLY_LEN             256
+
+typedef enum WLD_CACHE_STATE {
+    WLD_CACHE_PENDING = 0,              // the command is being sent
+    WLD_CACHE_READY,                    // the reply may be handed out
+    WLD_CACHE_DONE                      // not kept - lives until its waiters have the result
+} WLD_CACHE_STATE;
+
+typedef struct WLD_CACHE_ENTRY {
+    struct WLD_CACHE_ENTRY *pNext;      // hash chain
+    struct WLD_CACHE_ENTRY *pNewer;     // LRU list
+    struct WLD_CACHE_ENTRY *pOlder;
+    uint64_t hash;
+    uint64_t expiresNsec;
+    WLD_CACHE_STATE state;
+    uint32_t waiters;
+    uint32_t slot;
+    uint32_t epoch;
+    uint32_t generation;
+    MD_RV mdResult;
+    uint32_t fmStatus;
+    uint32_t reqLen;
+    uint32_t replyLen;
+    uint32_t replyMax;
+    bool hasReply;
+    uint16_t fmNumber;
+    uint8_t data[];                     // request, then reply
+} WLD_CACHE_ENTRY;
+
+typedef struct WLD_CACHE_SHARD {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;                // a pending entry completed
+    WLD_CACHE_ENTRY **ppBuckets;
+    uint32_t bucketMask;
+    uint32_t count;
+    WLD_CACHE_ENTRY *pNewest;
+    WLD_CACHE_ENTRY *pOldest;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t collapsed;
+} __attribute__((aligned(64))) WLD_CACHE_SHARD;
+
+static WLD_CACHE_SHARD WLD_CacheShards[WLD_CACHE_SHARDS];
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static WLD_CACHE_CONFIG WLD_CacheConfig = { 0, 0, 0, WLD_CACHE_REPLY_LEN };
+static _Atomic bool WLD_CacheEnabled = false;
+static _Atomic uint32_t WLD_CacheShardCapacity = 0;
+static _Atomic uint32_t WLD_CacheTtlMsec = 0;
+static _Atomic uint32_t WLD_CacheNegativeTtlMsec = 0;
+static _Atomic uint32_t WLD_CacheReplyMax = WLD_CACHE_REPLY_LEN;
+
+// Bumped to drop every reply, when any partition goes out (replies for
+// WLD_NO_SLOT_ID) and when a partition of the slot goes out
+static _Atomic uint32_t WLD_CacheEpoch = 0;
+static _Atomic uint32_t WLD_CacheAnyGeneration = 0;
+static _Atomic uint32_t WLD_CacheGenerations[WLD_CACHE_GENERATIONS];
+
+// Serializes configuration changes
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void initCacheShards(void)
+{
+    pthread_condattr_t attr;
+    uint32_t i;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    for (i=0; i < WLD_CACHE_SHARDS; i++)
+    {
+        pthread_mutex_init(&WLD_CacheShards[i].lock, NULL);
+        pthread_cond_init(&WLD_CacheShards[i].cond, &attr);
+    }
+    pthread_condattr_destroy(&attr);
+}
+
+static uint32_t cacheGeneration(uint32_t slot)
+{
+    if (slot == WLD_NO_SLOT_ID)
+        return atomic_load_explicit(&WLD_CacheAnyGeneration, memory_order_acquire);
+
+    return atomic_load_explicit(&WLD_CacheGenerations[slot % WLD_CACHE_GENERATIONS], memory_order_acquire);
+}
+
+void wldCacheInvalidateSlot(uint32_t slot)
+{
+    if (slot != WLD_NO_SLOT_ID)
+        atomic_fetch_add_explicit(&WLD_CacheGenerations[slot % WLD_CACHE_GENERATIONS], 1, memory_order_release);
+    atomic_fetch_add_explicit(&WLD_CacheAnyGeneration, 1, memory_order_release);
+}
+
+// FNV-1a over the request, then the FM number and slot mixed in
+static uint64_t hashCacheKey(uint16_t fmNumber, const MD_Buffer_t *pReq, uint32_t slot, uint32_t *pReqLen)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    uint32_t len = 0;
+    uint32_t i;
+
+    for (; pReq->pData; pReq++)
+    {
+        for (i=0; i < pReq->length; i++)
+            hash = (hash ^ pReq->pData[i]) * 1099511628211ULL;
+        len += pReq->length;
+    }
+
+    hash ^= ((uint64_t)fmNumber << 32) | slot;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    *pReqLen = len;
+    return hash;
+}
+
+static bool sameCacheRequest(const WLD_CACHE_ENTRY *pEntry, const MD_Buffer_t *pReq)
+{
+    const uint8_t *p = pEntry->data;
+
+    for (; pReq->pData; pReq++)
+    {
+        if (memcmp(p, pReq->pData, pReq->length) != 0)
+            return false;
+        p += pReq->length;
+    }
+
+    return true;
+}
+
+static WLD_CACHE_SHARD *getCacheShard(uint64_t hash)
+{
+    return &WLD_CacheShards[hash >> 58];
+}
+
+static WLD_CACHE_ENTRY *findCacheEntry(WLD_CACHE_SHARD *pShard, uint64_t hash, uint16_t fmNumber,
+    const MD_Buffer_t *pReq, uint32_t reqLen, uint32_t slot)
+{
+    WLD_CACHE_ENTRY *pEntry;
+
+    if (!pShard->ppBuckets)
+        return NULL;
+
+    for (pEntry = pShard->ppBuckets[hash & pShard->bucketMask]; pEntry; pEntry = pEntry->pNext)
+    {
+        if (pEntry->hash == hash && pEntry->slot == slot && pEntry->fmNumber == fmNumber &&
+            pEntry->reqLen == reqLen && sameCacheRequest(pEntry, pReq))
+            return pEntry;
+    }
+
+    return NULL;
+}
+
+static void unlinkCacheLRU(WLD_CACHE_SHARD *pShard, WLD_CACHE_ENTRY *pEntry)
+{
+    if (pEntry->pNewer)
+        pEntry->pNewer->pOlder = pEntry->pOlder;
+    else
+        pShard->pNewest = pEntry->pOlder;
+
+    if (pEntry->pOlder)
+        pEntry->pOlder->pNewer = pEntry->pNewer;
+    else
+        pShard->pOldest = pEntry->pNewer;
+}
+
+static void linkCacheLRU(WLD_CACHE_SHARD *pShard, WLD_CACHE_ENTRY *pEntry)
+{
+    pEntry->pNewer = NULL;
+    pEntry->pOlder = pShard->pNewest;
+    if (pShard->pNewest)
+        pShard->pNewest->pNewer = pEntry;
+    else
+        pShard->pOldest = pEntry;
+    pShard->pNewest = pEntry;
+}
+
+// Take an entry out of its shard.  It is freed unless callers still
+// wait for its result; the last of them frees it.
+static void dropCacheEntry(WLD_CACHE_SHARD *pShard, WLD_CACHE_ENTRY *pEntry)
+{
+    WLD_CACHE_ENTRY **ppLink = &pShard->ppBuckets[pEntry->hash & pShard->bucketMask];
+
+    while (*ppLink != pEntry)
+        ppLink = &(*ppLink)->pNext;
+    *ppLink = pEntry->pNext;
+
+    unlinkCacheLRU(pShard, pEntry);
+    pShard->count--;
+
+    pEntry->state = WLD_CACHE_DONE;
+    if (pEntry->waiters == 0)
+        free(pEntry);
+}
+
+// Make room for one more entry by dropping the least recently used
+// ones that nobody is fetching or waiting for
+static bool evictCacheEntries(WLD_CACHE_SHARD *pShard, uint32_t capacity)
+{
+    WLD_CACHE_ENTRY *pEntry = pShard->pOldest;
+    WLD_CACHE_ENTRY *pNewer;
+
+    while (pShard->count >= capacity && pEntry)
+    {
+        pNewer = pEntry->pNewer;
+        if (pEntry->state == WLD_CACHE_READY && pEntry->waiters == 0)
+            dropCacheEntry(pShard, pEntry);
+        pEntry = pNewer;
+    }
+
+    return pShard->count < capacity;
+}
+
+// Give a caller the reply of an entry.  False if the caller's buffers
+// are too small for it.
+static bool copyCacheReply(const WLD_CACHE_ENTRY *pEntry, MD_Buffer_t *pResp)
+{
+    const uint8_t *p = pEntry->data + pEntry->reqLen;
+    const MD_Buffer_t *pBuf;
+    uint32_t left = pEntry->replyLen;
+    uint32_t room = 0;
+    uint32_t len;
+
+    for (pBuf = pResp; pBuf->pData; pBuf++)
+        room += pBuf->length;
+    if (room < left)
+        return false;
+
+    for (; left; pResp++)
+    {
+        len = pResp->length < left ? pResp->length : left;
+        memcpy(pResp->pData, p, len);
+        p += len;
+        left -= len;
+    }
+
+    return true;
+}
+
+// Keep the reply the caller's buffers received, if it fits
+static void storeCacheReply(WLD_CACHE_ENTRY *pEntry, const MD_Buffer_t *pResp, uint32_t receivedLen)
+{
+    uint8_t *p = pEntry->data + pEntry->reqLen;
+    uint32_t left = receivedLen;
+    uint32_t len;
+
+    pEntry->hasReply = (receivedLen <= pEntry->replyMax);
+    if (!pEntry->hasReply)
+        return;
+
+    for (; left && pResp->pData; pResp++)
+    {
+        len = pResp->length < left ? pResp->length : left;
+        memcpy(p, pResp->pData, len);
+        p += len;
+        left -= len;
+    }
+
+    pEntry->replyLen = receivedLen - left;
+}
+
+// Hand out the result of an entry that is no longer pending.  False
+// if the reply was too long to keep or does not fit the caller's
+// buffers, and the caller has to send the command itself.
+static bool takeCacheResult(const WLD_CACHE_ENTRY *pEntry,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    uint32_t *pFMStatus,
+    MD_RV *pResult)
+{
+    *pResult = pEntry->mdResult;
+    if (pEntry->mdResult != MDR_OK)
+        return true;
+
+    if (!pEntry->hasReply || !copyCacheReply(pEntry, pResp))
+        return false;
+
+    *pReceivedLen = pEntry->replyLen;
+    *pFMStatus = pEntry->fmStatus;
+    return true;
+}
+
+static bool isCacheEntryFresh(const WLD_CACHE_ENTRY *pEntry, uint64_t now)
+{
+    return pEntry->expiresNsec > now &&
+        pEntry->epoch == atomic_load_explicit(&WLD_CacheEpoch, memory_order_acquire) &&
+        pEntry->generation == cacheGeneration(pEntry->slot);
+}
+
+// Send the command of a pending entry this caller created, and keep
+// the reply or hand it to the callers waiting for it
+static MD_RV fetchCacheEntry(WLD_CACHE_SHARD *pShard,
+    WLD_CACHE_ENTRY *pEntry,
+    MD_Buffer_t *pReq,
+    uint32_t timeout,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    uint32_t *pFMStatus)
+{
+    MD_RV mdResult;
+    uint32_t ttlMsec;
+
+    // Read before the command is sent, so that an invalidation while it
+    // is in flight makes the reply stale
+    pEntry->epoch = atomic_load_explicit(&WLD_CacheEpoch, memory_order_acquire);
+    pEntry->generation = cacheGeneration(pEntry->slot);
+
+    *pReceivedLen = 0;
+    mdResult = SendWLDMessageToFM(pEntry->slot, pEntry->fmNumber, pReq, timeout, pResp, pReceivedLen, pFMStatus);
+
+    pthread_mutex_lock(&pShard->lock);
+
+    pEntry->mdResult = mdResult;
+    pEntry->hasReply = false;
+    if (mdResult == MDR_OK)
+    {
+        pEntry->fmStatus = *pFMStatus;
+        storeCacheReply(pEntry, pResp, *pReceivedLen);
+    }
+
+    ttlMsec = (pEntry->fmStatus == 0) ?
+        atomic_load_explicit(&WLD_CacheTtlMsec, memory_order_relaxed) :
+        atomic_load_explicit(&WLD_CacheNegativeTtlMsec, memory_order_relaxed);
+
+    // MD errors are never kept: they are about the adapter, not the
+    // command, and the next caller should get a chance elsewhere
+    if (mdResult == MDR_OK && pEntry->hasReply && ttlMsec &&
+        atomic_load_explicit(&WLD_CacheEnabled, memory_order_relaxed))
+    {
+        pEntry->expiresNsec = wldNowNsec() + (uint64_t)ttlMsec * 1000000ULL;
+        pEntry->state = WLD_CACHE_READY;
+    }
+    else
+    {
+        dropCacheEntry(pShard, pEntry);
+    }
+
+    pthread_cond_broadcast(&pShard->cond);
+    pthread_mutex_unlock(&pShard->lock);
+
+    return mdResult;
+}
+
+MD_RV SendWLDCachedMessageToFM(uint32_t slotID,
+    uint16_t fmNumber,
+    MD_Buffer_t *pReq,
+    uint32_t timeout,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    uint32_t *pFMStatus)
+{
+    WLD_CACHE_SHARD *pShard;
+    WLD_CACHE_ENTRY *pEntry;
+    struct timespec wake;
+    const MD_Buffer_t *pSeg;
+    uint8_t *p;
+    uint64_t hash;
+    uint64_t deadline = 0;
+    uint32_t reqLen;
+    uint32_t capacity;
+    uint32_t replyMax;
+    bool waited = false;
+    bool taken;
+    MD_RV mdResult;
+    int rc = 0;
+
+    if (!atomic_load_explicit(&WLD_CacheEnabled, memory_order_relaxed) ||
+        !pReq || !pResp || !pReceivedLen || !pFMStatus)
+        return SendWLDMessageToFM(slotID, fmNumber, pReq, timeout, pResp, pReceivedLen, pFMStatus);
+
+    hash = hashCacheKey(fmNumber, pReq, slotID, &reqLen);
+    pShard = getCacheShard(hash);
+    if (timeout)
+        deadline = wldNowNsec() + (uint64_t)timeout * 1000000ULL;
+
+    pthread_mutex_lock(&pShard->lock);
+
+    for (;;)
+    {
+        pEntry = findCacheEntry(pShard, hash, fmNumber, pReq, reqLen, slotID);
+        if (!pEntry)
+            break;
+
+        if (pEntry->state == WLD_CACHE_READY)
+        {
+            if (!isCacheEntryFresh(pEntry, wldNowNsec()))
+            {
+                dropCacheEntry(pShard, pEntry);
+                break;
+            }
+
+            pShard->hits++;
+            unlinkCacheLRU(pShard, pEntry);
+            linkCacheLRU(pShard, pEntry);
+            taken = takeCacheResult(pEntry, pResp, pReceivedLen, pFMStatus, &mdResult);
+            pthread_mutex_unlock(&pShard->lock);
+
+            return taken ? mdResult :
+                SendWLDMessageToFM(slotID, fmNumber, pReq, timeout, pResp, pReceivedLen, pFMStatus);
+        }
+
+        // Someone is sending the same command - wait for the reply
+        if (!waited)
+        {
+            pShard->collapsed++;
+            waited = true;
+        }
+
+        pEntry->waiters++;
+        while (pEntry->state == WLD_CACHE_PENDING && rc == 0)
+        {
+            if (deadline)
+            {
+                wake.tv_sec = (time_t)(deadline / 1000000000ULL);
+                wake.tv_nsec = (long)(deadline % 1000000000ULL);
+                rc = pthread_cond_timedwait(&pShard->cond, &pShard->lock, &wake);
+            }
+            else
+            {
+                rc = pthread_cond_wait(&pShard->cond, &pShard->lock);
+            }
+        }
+        pEntry->waiters--;
+
+        if (pEntry->state == WLD_CACHE_PENDING)
+        {
+            pthread_mutex_unlock(&pShard->lock);
+            return WLD_MDR_TIMEOUT;
+        }
+
+        taken = takeCacheResult(pEntry, pResp, pReceivedLen, pFMStatus, &mdResult);
+        if (pEntry->state == WLD_CACHE_DONE && pEntry->waiters == 0)
+            free(pEntry);
+
+        if (taken)
+        {
+            pthread_mutex_unlock(&pShard->lock);
+            return mdResult;
+        }
+        // The reply could not be handed over - look again, and send
+        // the command if nobody else does
+    }
+
+    // Not cached and nobody is fetching it: this caller does
+    pShard->misses++;
+    capacity = atomic_load_explicit(&WLD_CacheShardCapacity, memory_order_relaxed);
+    replyMax = atomic_load_explicit(&WLD_CacheReplyMax, memory_order_relaxed);
+    pEntry = NULL;
+    if (pShard->ppBuckets && evictCacheEntries(pShard, capacity))
+        pEntry = malloc(sizeof(WLD_CACHE_ENTRY) + reqLen + replyMax);
+
+    if (!pEntry)
+    {
+        pthread_mutex_unlock(&pShard->lock);
+        return SendWLDMessageToFM(slotID, fmNumber, pReq, timeout, pResp, pReceivedLen, pFMStatus);
+    }
+
+    memset(pEntry, 0, sizeof(WLD_CACHE_ENTRY));
+    pEntry->hash = hash;
+    pEntry->state = WLD_CACHE_PENDING;
+    pEntry->slot = slotID;
+    pEntry->fmNumber = fmNumber;
+    pEntry->reqLen = reqLen;
+    pEntry->replyMax = replyMax;
+    for (p = pEntry->data, pSeg = pReq; pSeg->pData; pSeg++)
+    {
+        memcpy(p, pSeg->pData, pSeg->length);
+        p += pSeg->length;
+    }
+
+    pEntry->pNext = pShard->ppBuckets[hash & pShard->bucketMask];
+    pShard->ppBuckets[hash & pShard->bucketMask] = pEntry;
+    linkCacheLRU(pShard, pEntry);
+    pShard->count++;
+
+    pthread_mutex_unlock(&pShard->lock);
+
+    return fetchCacheEntry(pShard, pEntry, pReq, timeout, pResp, pReceivedLen, pFMStatus);
+}
+
+// Drop every entry of a shard that nobody is fetching and give it
+// buckets for capacity entries.  Call with the shard locked.
+static void resetCacheShard(WLD_CACHE_SHARD *pShard, uint32_t capacity)
+{
+    WLD_CACHE_ENTRY **ppBuckets;
+    WLD_CACHE_ENTRY *pEntry;
+    WLD_CACHE_ENTRY *pNewer;
+    uint32_t buckets = 1;
+
+    for (pEntry = pShard->pOldest; pEntry; pEntry = pNewer)
+    {
+        pNewer = pEntry->pNewer;
+        if (pEntry->state == WLD_CACHE_READY)
+            dropCacheEntry(pShard, pEntry);
+    }
+
+    while (buckets < capacity)
+        buckets *= 2;
+    if (pShard->ppBuckets && pShard->bucketMask + 1 == buckets)
+        return;
+
+    ppBuckets = calloc(buckets, sizeof(WLD_CACHE_ENTRY *));
+    if (!ppBuckets)
+        return;
+
+    // Only pending entries are left; they move to the new buckets
+    for (pEntry = pShard->pOldest; pEntry; pEntry = pEntry->pNewer)
+    {
+        pEntry->pNext = ppBuckets[pEntry->hash & (buckets - 1)];
+        ppBuckets[pEntry->hash & (buckets - 1)] = pEntry;
+    }
+
+    free(pShard->ppBuckets);
+    pShard->ppBuckets = ppBuckets;
+    pShard->bucketMask = buckets - 1;
+}
+
+WLD_RV SetWLDCache(const WLD_CACHE_CONFIG *pConfig)
+{
+    uint32_t capacity;
+    uint32_t i;
+
+    if (!pConfig || pConfig->entries > 16777216 || pConfig->maxReplyLen > 65536 ||
+        (pConfig->entries && pConfig->ttlMsec == 0 && pConfig->negativeTtlMsec == 0))
+        return WLDR_INVALID_PARAMETER;
+
+    pthread_once(&cache_once, initCacheShards);
+    pthread_mutex_lock(&cache_mutex);
+
+    WLD_CacheConfig = *pConfig;
+    if (WLD_CacheConfig.maxReplyLen == 0)
+        WLD_CacheConfig.maxReplyLen = WLD_CACHE_REPLY_LEN;
+    capacity = (pConfig->entries + WLD_CACHE_SHARDS - 1) / WLD_CACHE_SHARDS;
+
+    atomic_store_explicit(&WLD_CacheEnabled, false, memory_order_relaxed);
+    atomic_store_explicit(&WLD_CacheShardCapacity, capacity, memory_order_relaxed);
+    atomic_store_explicit(&WLD_CacheTtlMsec, pConfig->ttlMsec, memory_order_relaxed);
+    atomic_store_explicit(&WLD_CacheNegativeTtlMsec, pConfig->negativeTtlMsec, memory_order_relaxed);
+    atomic_store_explicit(&WLD_CacheReplyMax, WLD_CacheConfig.maxReplyLen, memory_order_relaxed);
+
+    // Replies kept under the old settings are dropped
+    for (i=0; i < WLD_CACHE_SHARDS; i++)
+    {
+        pthread_mutex_lock(&WLD_CacheShards[i].lock);
+        resetCacheShard(&WLD_CacheShards[i], capacity);
+        pthread_mutex_unlock(&WLD_CacheShards[i].lock);
+    }
+
+    atomic_store_explicit(&WLD_CacheEnabled, pConfig->entries != 0, memory_order_release);
+
+    pthread_mutex_unlock(&cache_mutex);
+
+    return WLDR_OK;
+}
+
+WLD_RV GetWLDCacheConfig(WLD_CACHE_CONFIG *pConfig)
+{
+    if (!pConfig)
+        return WLDR_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&cache_mutex);
+    *pConfig = WLD_CacheConfig;
+    pthread_mutex_unlock(&cache_mutex);
+
+    return WLDR_OK;
+}
+
+void InvalidateWLDCache(uint32_t slotID)
+{
+    if (slotID == WLD_NO_SLOT_ID)
+        atomic_fetch_add_explicit(&WLD_CacheEpoch, 1, memory_order_release);
+    else
+        wldCacheInvalidateSlot(slotID);
+}
+
+void GetWLDCacheCounts(uint64_t *pHits, uint64_t *pMisses, uint64_t *pCollapsed)
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t collapsed = 0;
+    uint32_t i;
+
+    pthread_once(&cache_once, initCacheShards);
+
+    for (i=0; i < WLD_CACHE_SHARDS; i++)
+    {
+        pthread_mutex_lock(&WLD_CacheShards[i].lock);
+        hits += WLD_CacheShards[i].hits;
+        misses += WLD_CacheShards[i].misses;
+        collapsed += WLD_CacheShards[i].collapsed;
+        pthread_mutex_unlock(&WLD_CacheShards[i].lock);
+    }
+
+    if (pHits)
+        *pHits = hits;
+    if (pMisses)
+        *pMisses = misses;
+    if (pCollapsed)
+        *pCollapsed = collapsed;
+}
@@ -0,0 +1,19 @@
+/*
+    wld_cache.h
+
+    Internal interface between wld.c and the result cache in
+    wld_cache.c.  This code is sample ONLY and Thales Inc. assumes no
+    liability or responsibility for its correct operation.
+*/
+
+
+#ifndef _WLD_CACHE_H_
+#define _WLD_CACHE_H_
+
+#include "wld.h"
+
+// A partition went out of rotation - its cached replies, and those
+// cached for any partition, are stale.  Never blocks.
+void wldCacheInvalidateSlot(uint32_t slot);
+
+#endif
@@ -0,0 +1,556 @@
+/*
+    wld_hedge.c
+
+    Hedged requests for the workload distribution (WLD) sample.  An
+    idempotent command is sent to one adapter; if that adapter has not
+    replied once the configured percentile of its recent latency has
+    passed, a duplicate is sent to a partition on another adapter and
+    whichever reply arrives first is returned.  Both copies run on
+    helper threads so the caller can return on the first reply; the
+    late one is discarded.  This code is sample ONLY and Thales Inc.
+    assumes no liability or responsibility for its correct operation.
+*/
+
+#undef UNICODE
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "wld.h"
+#include "wld_retry.h"
+#include "wld_time.h"
+
+// Helper threads are started on demand up to this limit and exit
+// after sitting idle for WLD_HEDGE_IDLE_SEC
+#define WLD_HEDGE_MAX_WORKERS 256
+#define WLD_HEDGE_IDLE_SEC 10
+
+// A hedge costs WLD_HEDGE_COST budget; every hedged call earns
+// maxHedgePercent of it, up to WLD_HEDGE_BURST hedges in reserve
+#define WLD_HEDGE_COST 100
+#define WLD_HEDGE_BURST 10
+
+// Attempts at finding a partition on another adapter for the hedge
+#define WLD_HEDGE_PICK_RETRIES 4
+
+struct WLD_HEDGE_CALL;
+
+// One copy of the command, with its own response buffers
+typedef struct WLD_HEDGE_ATTEMPT {
+    struct WLD_HEDGE_CALL *pCall;
+    uint32_t slot;
+    MD_Buffer_t *pResp;
+} WLD_HEDGE_ATTEMPT;
+
+// State shared by the caller and the attempts.  Everyone holding a
+// reference frees it when they leave last, so an attempt that finishes
+// after the caller returned still has somewhere to write.
+typedef struct WLD_HEDGE_CALL {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t refs;
+    uint32_t outstanding;
+    bool done;
+    bool abandoned;
+    uint16_t fmNumber;
+    uint64_t deadlineNsec;
+    MD_Buffer_t *pReq;
+    MD_Buffer_t *pCallerResp;
+    MD_RV mdResult;
+    uint32_t receivedLen;
+    uint32_t fmStatus;
+    uint32_t winner;
+    WLD_HEDGE_ATTEMPT attempts[2];
+} WLD_HEDGE_CALL;
+
+typedef struct WLD_HEDGE_WORKER {
+    struct WLD_HEDGE_WORKER *pNext;
+    pthread_cond_t cond;
+    WLD_HEDGE_ATTEMPT *pJob;
+} WLD_HEDGE_WORKER;
+
+static _Atomic uint32_t WLD_HedgePercentile = 0;
+static _Atomic uint32_t WLD_HedgeMinDelayUsec = 0;
+static _Atomic uint32_t WLD_HedgeMaxPercent = 0;
+static _Atomic int32_t WLD_HedgeBudget = 0;
+static _Atomic uint64_t WLD_HedgesSent = 0;
+static _Atomic uint64_t WLD_HedgeWins = 0;
+
+// Guards the worker pool
+static pthread_mutex_t hedge_mutex = PTHREAD_MUTEX_INITIALIZER;
+static WLD_HEDGE_WORKER *pIdleWorkers = NULL;
+static uint32_t hedgeWorkers = 0;
+
+static void hedgeTimespec(uint64_t nsec, struct timespec *pTs)
+{
+    pTs->tv_sec = (time_t)(nsec / 1000000000ULL);
+    pTs->tv_nsec = (long)(nsec % 1000000000ULL);
+}
+
+static uint32_t countBuffers(const MD_Buffer_t *pBuffers)
+{
+    uint32_t n = 0;
+
+    while (pBuffers && pBuffers[n].pData)
+        n++;
+
+    return n;
+}
+
+// Copy a buffer list (lengths, and the data if copyData) into
+// pBuffers[0..n] with the data placed at *ppData
+static void layoutBuffers(MD_Buffer_t *pBuffers, const MD_Buffer_t *pSrc, uint32_t n,
+    uint8_t **ppData, bool copyData)
+{
+    uint32_t i;
+
+    for (i=0; i < n; i++)
+    {
+        pBuffers[i].pData = *ppData;
+        pBuffers[i].length = pSrc[i].length;
+        if (copyData)
+            memcpy(*ppData, pSrc[i].pData, pSrc[i].length);
+        *ppData += pSrc[i].length;
+    }
+    pBuffers[n].pData = NULL;
+    pBuffers[n].length = 0;
+}
+
+// Allocate a call with a private copy of the request and response
+// buffers for both attempts, all in one block
+static WLD_HEDGE_CALL *allocHedgeCall(const MD_Buffer_t *pReq, MD_Buffer_t *pResp)
+{
+    WLD_HEDGE_CALL *pCall;
+    pthread_condattr_t attr;
+    uint32_t reqCount = countBuffers(pReq);
+    uint32_t respCount = countBuffers(pResp);
+    size_t reqBytes = 0, respBytes = 0;
+    uint8_t *pData;
+    uint32_t i;
+
+    for (i=0; i < reqCount; i++)
+        reqBytes += pReq[i].length;
+    for (i=0; i < respCount; i++)
+        respBytes += pResp[i].length;
+
+    pCall = malloc(sizeof(WLD_HEDGE_CALL) +
+        (reqCount + 1 + 2 * (respCount + 1)) * sizeof(MD_Buffer_t) +
+        reqBytes + 2 * respBytes);
+    if (!pCall)
+        return NULL;
+
+    memset(pCall, 0, sizeof(WLD_HEDGE_CALL));
+    pCall->pReq = (MD_Buffer_t *)(pCall + 1);
+    pCall->attempts[0].pResp = pCall->pReq + reqCount + 1;
+    pCall->attempts[1].pResp = pCall->attempts[0].pResp + respCount + 1;
+    pCall->attempts[0].pCall = pCall;
+    pCall->attempts[1].pCall = pCall;
+    pCall->pCallerResp = pResp;
+
+    pData = (uint8_t *)(pCall->attempts[1].pResp + respCount + 1);
+    layoutBuffers(pCall->pReq, pReq, reqCount, &pData, true);
+    layoutBuffers(pCall->attempts[0].pResp, pResp, respCount, &pData, false);
+    layoutBuffers(pCall->attempts[1].pResp, pResp, respCount, &pData, false);
+
+    pthread_mutex_init(&pCall->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pCall->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    return pCall;
+}
+
+// Drop a reference; the caller holds pCall->lock, which is released
+static void releaseHedgeCall(WLD_HEDGE_CALL *pCall)
+{
+    bool last = (--pCall->refs == 0);
+
+    pthread_mutex_unlock(&pCall->lock);
+
+    if (last)
+    {
+        pthread_mutex_destroy(&pCall->lock);
+        pthread_cond_destroy(&pCall->cond);
+        free(pCall);
+    }
+}
+
+// Copy the winning reply into the caller's buffers
+static void copyHedgeReply(WLD_HEDGE_CALL *pCall, const WLD_HEDGE_ATTEMPT *pAttempt, uint32_t recvlen)
+{
+    uint32_t len;
+    uint32_t i;
+
+    for (i=0; pCall->pCallerResp && pCall->pCallerResp[i].pData && recvlen; i++)
+    {
+        len = pCall->pCallerResp[i].length < recvlen ? pCall->pCallerResp[i].length : recvlen;
+        memcpy(pCall->pCallerResp[i].pData, pAttempt->pResp[i].pData, len);
+        recvlen -= len;
+    }
+}
+
+// Time left before the call's deadline in msec (0 = no deadline), or
+// false if it has passed
+static bool hedgeRemainingMsec(const WLD_HEDGE_CALL *pCall, uint32_t *pTimeout)
+{
+    uint64_t now;
+
+    *pTimeout = 0;
+    if (!pCall->deadlineNsec)
+        return true;
+
+    now = wldNowNsec();
+    if (now >= pCall->deadlineNsec)
+        return false;
+
+    *pTimeout = (uint32_t)((pCall->deadlineNsec - now + 999999) / 1000000);
+    return true;
+}
+
+// Send one copy of the command.  A failure is replayed on the other
+// partitions within the retry budget, as SendWLDMessageToFM does for
+// WLD_NO_SLOT_ID.
+static void runHedgeAttempt(WLD_HEDGE_ATTEMPT *pAttempt)
+{
+    WLD_HEDGE_CALL *pCall = pAttempt->pCall;
+    MD_RV mdResult = WLD_MDR_TIMEOUT;
+    uint32_t recvlen = 0;
+    uint32_t fmStatus = 0;
+    uint32_t timeout;
+
+    if (hedgeRemainingMsec(pCall, &timeout))
+    {
+        mdResult = wldSendFromSlot(pAttempt->slot, pCall->fmNumber, pCall->pReq,
+            timeout, pAttempt->pResp, &recvlen, &fmStatus);
+    }
+
+    pthread_mutex_lock(&pCall->lock);
+    pCall->outstanding--;
+
+    // The first reply wins; a failure only ends the call when no other
+    // copy is still out
+    if (!pCall->done && (mdResult == MDR_OK || pCall->outstanding == 0))
+    {
+        pCall->done = true;
+        pCall->mdResult = mdResult;
+        pCall->winner = (uint32_t)(pAttempt - pCall->attempts);
+        if (!pCall->abandoned)
+        {
+            pCall->receivedLen = recvlen;
+            pCall->fmStatus = fmStatus;
+            if (mdResult == MDR_OK)
+                copyHedgeReply(pCall, pAttempt, recvlen);
+        }
+        pthread_cond_signal(&pCall->cond);
+    }
+
+    releaseHedgeCall(pCall);
+}
+
+static void *hedgeWorker(void *pArg)
+{
+    WLD_HEDGE_WORKER *pWorker = (WLD_HEDGE_WORKER *)pArg;
+    WLD_HEDGE_WORKER **ppLink;
+    WLD_HEDGE_ATTEMPT *pJob;
+    struct timespec idleTs;
+
+    pthread_mutex_lock(&hedge_mutex);
+
+    while (1)
+    {
+        if (!pWorker->pJob)
+        {
+            hedgeTimespec(wldNowNsec() + WLD_HEDGE_IDLE_SEC * 1000000000ULL, &idleTs);
+            while (!pWorker->pJob)
+            {
+                if (pthread_cond_timedwait(&pWorker->cond, &hedge_mutex, &idleTs) == ETIMEDOUT)
+                    break;
+            }
+
+            // Idle for too long - leave the pool
+            if (!pWorker->pJob)
+            {
+                for (ppLink = &pIdleWorkers; *ppLink; ppLink = &(*ppLink)->pNext)
+                {
+                    if (*ppLink == pWorker)
+                    {
+                        *ppLink = pWorker->pNext;
+                        break;
+                    }
+                }
+                hedgeWorkers--;
+                break;
+            }
+        }
+
+        pJob = pWorker->pJob;
+        pWorker->pJob = NULL;
+        pthread_mutex_unlock(&hedge_mutex);
+
+        runHedgeAttempt(pJob);
+
+        pthread_mutex_lock(&hedge_mutex);
+        pWorker->pNext = pIdleWorkers;
+        pIdleWorkers = pWorker;
+    }
+
+    pthread_mutex_unlock(&hedge_mutex);
+
+    pthread_cond_destroy(&pWorker->cond);
+    free(pWorker);
+
+    return NULL;
+}
+
+// Hand an attempt to an idle helper thread, starting one if needed.
+// Fails if the pool is at its limit.
+static bool dispatchHedgeAttempt(WLD_HEDGE_ATTEMPT *pAttempt)
+{
+    WLD_HEDGE_WORKER *pWorker;
+    pthread_condattr_t attr;
+    pthread_attr_t threadAttr;
+    pthread_t thread;
+    bool ok = false;
+
+    pthread_mutex_lock(&hedge_mutex);
+
+    pWorker = pIdleWorkers;
+    if (pWorker)
+    {
+        pIdleWorkers = pWorker->pNext;
+        pWorker->pJob = pAttempt;
+        pthread_cond_signal(&pWorker->cond);
+        ok = true;
+    }
+    else if (hedgeWorkers < WLD_HEDGE_MAX_WORKERS)
+    {
+        pWorker = calloc(1, sizeof(WLD_HEDGE_WORKER));
+        if (pWorker)
+        {
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&pWorker->cond, &attr);
+            pthread_condattr_destroy(&attr);
+            pWorker->pJob = pAttempt;
+
+            pthread_attr_init(&threadAttr);
+            pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED);
+            if (pthread_create(&thread, &threadAttr, hedgeWorker, pWorker) == 0)
+            {
+                hedgeWorkers++;
+                ok = true;
+            }
+            else
+            {
+                pthread_cond_destroy(&pWorker->cond);
+                free(pWorker);
+            }
+            pthread_attr_destroy(&threadAttr);
+        }
+    }
+
+    pthread_mutex_unlock(&hedge_mutex);
+
+    return ok;
+}
+
+// Take one hedge from the budget
+static bool takeHedgeBudget(void)
+{
+    int32_t budget = atomic_load_explicit(&WLD_HedgeBudget, memory_order_relaxed);
+
+    while (budget >= WLD_HEDGE_COST)
+    {
+        if (atomic_compare_exchange_weak_explicit(&WLD_HedgeBudget, &budget,
+            budget - WLD_HEDGE_COST, memory_order_relaxed, memory_order_relaxed))
+            return true;
+    }
+
+    return false;
+}
+
+static void addHedgeBudget(uint32_t percent)
+{
+    int32_t budget = atomic_load_explicit(&WLD_HedgeBudget, memory_order_relaxed);
+
+    while (budget < WLD_HEDGE_COST * WLD_HEDGE_BURST)
+    {
+        if (atomic_compare_exchange_weak_explicit(&WLD_HedgeBudget, &budget,
+            budget + (int32_t)percent, memory_order_relaxed, memory_order_relaxed))
+            return;
+    }
+}
+
+// Pick a partition that is not on the adapter the first copy went to
+static bool pickHedgeSlot(uint32_t primaryHsmID, uint32_t *pSlot)
+{
+    uint32_t hsmID;
+    uint32_t i;
+
+    for (i=0; i < WLD_HEDGE_PICK_RETRIES; i++)
+    {
+        if (GetWLDSlotID(pSlot, NULL) != WLDR_OK)
+            return false;
+
+        if (GetWLDSlotInfo(*pSlot, &hsmID, NULL) == WLDR_OK && hsmID != primaryHsmID)
+            return true;
+    }
+
+    return false;
+}
+
+// Wait for the call to finish, up to untilNsec (0 = no limit).
+// pCall->lock is held.
+static void waitHedgeCall(WLD_HEDGE_CALL *pCall, uint64_t untilNsec)
+{
+    struct timespec ts;
+
+    if (!untilNsec)
+    {
+        while (!pCall->done)
+            pthread_cond_wait(&pCall->cond, &pCall->lock);
+        return;
+    }
+
+    hedgeTimespec(untilNsec, &ts);
+    while (!pCall->done)
+    {
+        if (pthread_cond_timedwait(&pCall->cond, &pCall->lock, &ts) == ETIMEDOUT)
+            break;
+    }
+}
+
+// Configure hedging.  percentile (in 1/1000 of the adapter's recent
+// latency) 0 turns it off.
+WLD_RV SetWLDHedging(const WLD_HEDGE_CONFIG *pConfig)
+{
+    if (!pConfig || pConfig->percentile > 1000 || pConfig->maxHedgePercent > 100)
+        return WLDR_INVALID_PARAMETER;
+
+    atomic_store(&WLD_HedgeMinDelayUsec, pConfig->minDelayUsec);
+    atomic_store(&WLD_HedgeMaxPercent, pConfig->maxHedgePercent);
+    atomic_store(&WLD_HedgePercentile, pConfig->percentile);
+
+    return WLDR_OK;
+}
+
+// Number of hedges sent, and how many of them replied first
+void GetWLDHedgeCounts(uint64_t *pHedged, uint64_t *pHedgeWins)
+{
+    if (pHedged)
+        *pHedged = atomic_load_explicit(&WLD_HedgesSent, memory_order_relaxed);
+    if (pHedgeWins)
+        *pHedgeWins = atomic_load_explicit(&WLD_HedgeWins, memory_order_relaxed);
+}
+
+// Send an idempotent command, hedging it on a second adapter if the
+// first one is slow.  Without hedging configured, or for an explicit
+// slot, this is SendWLDMessageToFM.
+MD_RV SendWLDHedgedMessageToFM(uint32_t slotID,
+    uint16_t fmNumber,
+    MD_Buffer_t *pReq,
+    uint32_t timeout,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    uint32_t *pFMStatus)
+{
+    WLD_HEDGE_CALL *pCall;
+    MD_RV mdResult;
+    uint64_t start = wldNowNsec();
+    uint64_t delayNsec;
+    uint64_t hedgeAt;
+    uint32_t percentile = atomic_load_explicit(&WLD_HedgePercentile, memory_order_relaxed);
+    uint32_t slot;
+    uint32_t hsmID;
+
+    if (percentile == 0 || slotID != WLD_NO_SLOT_ID)
+        return SendWLDMessageToFM(slotID, fmNumber, pReq, timeout, pResp, pReceivedLen, pFMStatus);
+
+    if (!pReq || !pReceivedLen || !pFMStatus)
+        return MDR_INVALID_PARAMETER;
+
+    if (GetWLDSlotID(&slot, NULL) != WLDR_OK || GetWLDSlotInfo(slot, &hsmID, NULL) != WLDR_OK)
+        return MDR_INVALID_HSM_INDEX;
+
+    // Without a latency history for the adapter there is nothing to
+    // hedge against yet
+    if (GetWLDAdapterLatency(hsmID, percentile, &delayNsec) != WLDR_OK)
+        return wldSendFromSlot(slot, fmNumber, pReq, timeout, pResp, pReceivedLen, pFMStatus);
+
+    if (delayNsec < atomic_load_explicit(&WLD_HedgeMinDelayUsec, memory_order_relaxed) * 1000ULL)
+        delayNsec = atomic_load_explicit(&WLD_HedgeMinDelayUsec, memory_order_relaxed) * 1000ULL;
+
+    addHedgeBudget(atomic_load_explicit(&WLD_HedgeMaxPercent, memory_order_relaxed));
+
+    pCall = allocHedgeCall(pReq, pResp);
+    if (!pCall)
+        return wldSendFromSlot(slot, fmNumber, pReq, timeout, pResp, pReceivedLen, pFMStatus);
+
+    pCall->fmNumber = fmNumber;
+    pCall->deadlineNsec = timeout ? start + (uint64_t)timeout * 1000000ULL : 0;
+    pCall->attempts[0].slot = slot;
+    pCall->refs = 2;
+    pCall->outstanding = 1;
+
+    if (!dispatchHedgeAttempt(&pCall->attempts[0]))
+    {
+        // No helper thread to be had - just send it from here
+        pthread_mutex_destroy(&pCall->lock);
+        pthread_cond_destroy(&pCall->cond);
+        free(pCall);
+        return wldSendFromSlot(slot, fmNumber, pReq, timeout, pResp, pReceivedLen, pFMStatus);
+    }
+
+    hedgeAt = start + delayNsec;
+
+    pthread_mutex_lock(&pCall->lock);
+
+    waitHedgeCall(pCall, (pCall->deadlineNsec && pCall->deadlineNsec < hedgeAt) ? pCall->deadlineNsec : hedgeAt);
+
+    if (!pCall->done && wldNowNsec() >= hedgeAt &&
+        (!pCall->deadlineNsec || wldNowNsec() < pCall->deadlineNsec) &&
+        takeHedgeBudget() && pickHedgeSlot(hsmID, &pCall->attempts[1].slot))
+    {
+        pCall->refs++;
+        pCall->outstanding++;
+        if (dispatchHedgeAttempt(&pCall->attempts[1]))
+            atomic_fetch_add_explicit(&WLD_HedgesSent, 1, memory_order_relaxed);
+        else
+        {
+            pCall->refs--;
+            pCall->outstanding--;
+        }
+    }
+
+    waitHedgeCall(pCall, pCall->deadlineNsec);
+
+    if (pCall->done)
+    {
+        mdResult = pCall->mdResult;
+        if (mdResult == MDR_OK)
+        {
+            *pReceivedLen = pCall->receivedLen;
+            *pFMStatus = pCall->fmStatus;
+            if (pCall->winner == 1)
+                atomic_fetch_add_explicit(&WLD_HedgeWins, 1, memory_order_relaxed);
+        }
+    }
+    else
+    {
+        // Out of time: whatever still arrives is dropped
+        pCall->abandoned = true;
+        mdResult = WLD_MDR_TIMEOUT;
+    }
+
+    releaseHedgeCall(pCall);
+
+    return mdResult;
+}
@@ -0,0 +1,291 @@
+/*
+    wld_msg.c
+
+    Per-thread message buffers for the typed FM messages in wld_msg.h.
+    Each thread gets one WLD_MSG the first time it builds a message and
+    keeps reusing it; when the thread exits the buffer goes back to a
+    pool for the next thread.  This code is sample ONLY and Thales Inc.
+    assumes no liability or responsibility for its correct operation.
+*/
+
+#undef UNICODE
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "wld_msg.h"
+
+// Pool entry - the link is kept outside the message so a pooled
+// buffer is a plain WLD_MSG
+typedef struct WLD_MSG_ENTRY {
+    struct WLD_MSG_ENTRY *pNext;
+    WLD_MSG msg;
+} WLD_MSG_ENTRY;
+
+static __thread WLD_MSG_ENTRY *pMyMsg = NULL;
+
+static pthread_mutex_t msg_mutex = PTHREAD_MUTEX_INITIALIZER;
+static WLD_MSG_ENTRY *pFreeMsgs = NULL;
+static pthread_key_t msgKey;
+static pthread_once_t msgKeyOnce = PTHREAD_ONCE_INIT;
+
+// Thread exit: hand the thread's buffer to the pool
+static void releaseMsgEntry(void *pArg)
+{
+    WLD_MSG_ENTRY *pEntry = (WLD_MSG_ENTRY *)pArg;
+
+    pthread_mutex_lock(&msg_mutex);
+    pEntry->pNext = pFreeMsgs;
+    pFreeMsgs = pEntry;
+    pthread_mutex_unlock(&msg_mutex);
+}
+
+static void createMsgKey(void)
+{
+    (void)pthread_key_create(&msgKey, releaseMsgEntry);
+}
+
+// Get the calling thread's message buffer, emptied
+WLD_MSG *BeginWLDMessage(void)
+{
+    WLD_MSG_ENTRY *pEntry = pMyMsg;
+    WLD_MSG *pMsg;
+
+    if (!pEntry)
+    {
+        (void)pthread_once(&msgKeyOnce, createMsgKey);
+
+        pthread_mutex_lock(&msg_mutex);
+        pEntry = pFreeMsgs;
+        if (pEntry)
+            pFreeMsgs = pEntry->pNext;
+        pthread_mutex_unlock(&msg_mutex);
+
+        if (!pEntry)
+        {
+            pEntry = malloc(sizeof(WLD_MSG_ENTRY));
+            if (!pEntry)
+                return NULL;
+            pEntry->msg.pLarge = NULL;
+            pEntry->msg.largeLen = 0;
+        }
+
+        (void)pthread_setspecific(msgKey, pEntry);
+        pMyMsg = pEntry;
+    }
+
+    pMsg = &pEntry->msg;
+    pMsg->segments = 0;
+    pMsg->arenaUsed = 0;
+    pMsg->overflow = false;
+    pMsg->replyLen = 0;
+    pMsg->request[0].pData = NULL;
+    pMsg->request[0].length = 0;
+    pMsg->reply[0].pData = pMsg->replyData;
+    pMsg->reply[0].length = WLD_MSG_REPLY_LEN;
+    pMsg->reply[1].pData = NULL;
+    pMsg->reply[1].length = 0;
+
+    return pMsg;
+}
+
+// Add a buffer to the end of the request list
+static bool addSegment(WLD_MSG *pMsg, uint8_t *pData, uint32_t len)
+{
+    if (pMsg->segments == WLD_MSG_MAX_SEGMENTS)
+    {
+        pMsg->overflow = true;
+        return false;
+    }
+
+    pMsg->request[pMsg->segments].pData = pData;
+    pMsg->request[pMsg->segments].length = len;
+    pMsg->segments++;
+    pMsg->request[pMsg->segments].pData = NULL;
+    pMsg->request[pMsg->segments].length = 0;
+
+    return true;
+}
+
+// Reserve len bytes of the arena at the end of the message.  Fields
+// encoded back to back share one buffer.
+uint8_t *ReserveWLDMessage(WLD_MSG *pMsg, uint32_t len)
+{
+    MD_Buffer_t *pLast;
+    uint8_t *p;
+
+    if (!pMsg || pMsg->overflow)
+        return NULL;
+
+    if (len > WLD_MSG_ARENA_LEN - pMsg->arenaUsed)
+    {
+        pMsg->overflow = true;
+        return NULL;
+    }
+
+    p = pMsg->arena + pMsg->arenaUsed;
+    pLast = pMsg->segments ? &pMsg->request[pMsg->segments - 1] : NULL;
+
+    if (pLast && pLast->pData + pLast->length == p)
+        pLast->length += len;
+    else if (!addSegment(pMsg, p, len))
+        return NULL;
+
+    pMsg->arenaUsed += len;
+
+    return p;
+}
+
+// Reserve len bytes in the message's large buffer, growing it if need be
+uint8_t *ReserveWLDLargeMessage(WLD_MSG *pMsg, uint32_t len)
+{
+    uint8_t *pNew;
+
+    if (!pMsg || pMsg->overflow)
+        return NULL;
+
+    if (len > pMsg->largeLen)
+    {
+        pNew = realloc(pMsg->pLarge, len);
+        if (!pNew)
+        {
+            pMsg->overflow = true;
+            return NULL;
+        }
+        pMsg->pLarge = pNew;
+        pMsg->largeLen = len;
+    }
+
+    return addSegment(pMsg, pMsg->pLarge, len) ? pMsg->pLarge : NULL;
+}
+
+// Add caller memory to the message as its own buffer, without copying
+bool AttachWLDMessage(WLD_MSG *pMsg, const void *pData, uint32_t len)
+{
+    if (!pMsg || pMsg->overflow || !pData)
+        return false;
+
+    return addSegment(pMsg, (uint8_t *)pData, len);
+}
+
+// Send a built message; the reply is left in pMsg->replyData
+MD_RV SendWLDMessage(WLD_MSG *pMsg,
+    uint32_t slotID,
+    uint16_t fmNumber,
+    uint32_t timeout,
+    uint32_t *pFMStatus)
+{
+    if (!pMsg || pMsg->overflow || pMsg->segments == 0)
+        return MDR_INVALID_PARAMETER;
+
+    pMsg->replyLen = 0;
+
+    return SendWLDMessageToFM(slotID,
+        fmNumber,
+        pMsg->request,
+        timeout,
+        pMsg->reply,
+        &pMsg->replyLen,
+        pFMStatus);
+}
+
+// Verify keys with as few bulk key verify messages as the FM accepts
+MD_RV VerifyWLDKeys(uint32_t slotID,
+    uint16_t fmNumber,
+    const WLD_KEY_REF *pKeys,
+    uint32_t count,
+    uint32_t timeout,
+    uint32_t *pBitmap,
+    uint32_t *pFMStatus)
+{
+    WLD_MSG_BULK_VERIFY header = { WLD_FM_BULK_VERIFY_MAGIC, 0, 0 };
+    WLD_MSG_BULK_KEY record;
+    WLD_MSG_BULK_REPLY replyHeader;
+    WLD_MSG *pMsg;
+    const uint8_t *pIn;
+    uint8_t *p;
+    uint32_t hsmID;
+    uint32_t len;
+    uint32_t fmStatus;
+    uint32_t first, chunk, word, i;
+    MD_RV mdResult = MDR_OK;
+
+    if ((!pKeys && count) || !pBitmap || !pFMStatus)
+        return MDR_INVALID_PARAMETER;
+
+    for (i=0; i < count; i++)
+    {
+        if (!pKeys[i].pLabel || pKeys[i].labelLen == 0 || pKeys[i].labelLen > WLD_FM_MAX_LABEL_LEN)
+            return MDR_INVALID_PARAMETER;
+    }
+
+    if (GetWLDSlotInfo(slotID, &hsmID, &header.embeddedSlot) != WLDR_OK)
+        return MDR_INVALID_HSM_INDEX;
+
+    memset(pBitmap, 0, ((count + 31) / 32) * sizeof(uint32_t));
+    *pFMStatus = 0;
+
+    for (first=0; first < count && mdResult == MDR_OK; first += chunk)
+    {
+        chunk = count - first;
+        if (chunk > WLD_FM_MAX_BULK_VERIFY)
+            chunk = WLD_FM_MAX_BULK_VERIFY;
+
+        len = WLD_MSG_BULK_VERIFY_WIRE_LEN + chunk * WLD_MSG_BULK_KEY_WIRE_LEN;
+        for (i=first; i < first + chunk; i++)
+            len += pKeys[i].labelLen;
+
+        pMsg = BeginWLDMessage();
+        p = ReserveWLDLargeMessage(pMsg, len);
+        if (!p)
+            return MDR_INSUFFICIENT_RESOURCE;
+
+        header.count = chunk;
+        p = WLD_MSG_BULK_VERIFY_Encode(&header, p);
+        for (i=first; i < first + chunk; i++)
+        {
+            record.hKey = pKeys[i].hKey;
+            record.labelLen = pKeys[i].labelLen;
+            p = WLD_MSG_BULK_KEY_Encode(&record, p);
+            memcpy(p, pKeys[i].pLabel, pKeys[i].labelLen);
+            p += pKeys[i].labelLen;
+        }
+
+        fmStatus = 0;
+        mdResult = SendWLDMessage(pMsg, slotID, fmNumber, timeout, &fmStatus);
+        if (mdResult != MDR_OK)
+            break;
+
+        if (fmStatus != 0)
+        {
+            if (*pFMStatus == 0)
+                *pFMStatus = fmStatus;
+            continue;
+        }
+
+        // An FM without the command would have failed it, so this one
+        // does not speak the same format
+        if (!WLD_MSG_BULK_REPLY_Parse(pMsg->replyData, pMsg->replyLen, &replyHeader) ||
+            replyHeader.count != chunk ||
+            pMsg->replyLen < WLD_MSG_BULK_REPLY_WIRE_LEN + ((chunk + 31) / 32) * 4)
+        {
+            mdResult = MDR_NOT_IMPLEMENTED;
+            break;
+        }
+
+        // Merge the message's bitmap in at bit first, which is a
+        // multiple of 32 since WLD_FM_MAX_BULK_VERIFY is
+        pIn = pMsg->replyData + WLD_MSG_BULK_REPLY_WIRE_LEN;
+        for (i=0; i < (chunk + 31) / 32; i++)
+        {
+            pIn = wldMsgGet_uint32_t(pIn, &word);
+            pBitmap[(first / 32) + i] |= word;
+        }
+    }
+
+    return mdResult;
+}
@@ -0,0 +1,45 @@
+/*
+    wld_random.h
+
+    The random number generator of the WLD modules and tools: one
+    xorshift64* implementation, seeded from the clock, for the
+    randomized policies, jitter and simulations - not for anything
+    cryptographic.  Only the code is shared; every module keeps its
+    own state per thread.  This code is sample ONLY and Thales Inc.
+    assumes no liability or responsibility for its correct operation.
+*/
+
+
+#ifndef _WLD_RANDOM_H_
+#define _WLD_RANDOM_H_
+
+#include <stdint.h>
+
+#include "wld_time.h"
+
+// Each module including this header has its own state per thread
+static __thread uint64_t wldRandState = 0;
+
+// 64 random bits
+static inline uint64_t wldRandom64(void)
+{
+    uint64_t x = wldRandState;
+
+    if (x == 0)
+        x = wldNowNsec() ^ ((uint64_t)(uintptr_t)&wldRandState << 16) ^ 0x9E3779B97F4A7C15ULL;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    wldRandState = x;
+
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// 32 random bits
+static inline uint32_t wldRandom(void)
+{
+    return (uint32_t)(wldRandom64() >> 32);
+}
+
+#endif
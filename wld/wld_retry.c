@@ -0,0 +1,217 @@
+/*
+    wld_retry.c
+
+    Retries for the workload distribution (WLD) sample.  A failed
+    command is classified (see ClassifyWLDError), and one that may be
+    replayed is only replayed while the process-wide retry budget
+    allows: every first attempt earns a fraction of a retry and every
+    retry spends a whole one, so when an outage makes most commands
+    fail the retries cannot multiply the load on the adapters that are
+    left.  Transient errors are retried after an exponential backoff
+    with full jitter.  This code is sample ONLY and Thales Inc. assumes
+    no liability or responsibility for its correct operation.
+*/
+
+#undef UNICODE
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "wld.h"
+#include "wld_fm.h"
+#include "wld_retry.h"
+#include "wld_random.h"
+
+// First attempts a thread counts before it adds what they earned to
+// the shared budget, so the budget is not touched on every command
+#define WLD_RETRY_EARN_BATCH 16
+
+// The budget is kept in thousandths of a retry
+#define WLD_RETRY_UNIT 1000
+
+static WLD_RETRY_CONFIG WLD_RetryConfig = {
+    20,                 // budgetPercent
+    10,                 // budgetReserve
+    0,                  // maxAttempts
+    200,                // backoffMinUsec
+    20000               // backoffMaxUsec
+};
+
+static _Atomic int64_t WLD_RetryBalance = 10 * WLD_RETRY_UNIT;
+static _Atomic uint32_t WLD_RetryPercent = 20;
+static _Atomic int64_t WLD_RetryCap = 10 * WLD_RETRY_UNIT;
+static _Atomic uint32_t WLD_RetryAttempts = 0;
+static _Atomic uint32_t WLD_RetryBackoffMin = 200;
+static _Atomic uint32_t WLD_RetryBackoffMax = 20000;
+static _Atomic uint64_t WLD_RetryCount = 0;
+static _Atomic uint64_t WLD_RetryDenied = 0;
+
+static __thread uint32_t retryEarned = 0;
+
+// Serializes configuration changes
+static pthread_mutex_t retry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void wldRetryEarn(void)
+{
+    int64_t cap, balance, credit;
+    uint32_t percent;
+
+    if (++retryEarned < WLD_RETRY_EARN_BATCH)
+        return;
+    retryEarned = 0;
+
+    percent = atomic_load_explicit(&WLD_RetryPercent, memory_order_relaxed);
+    cap = atomic_load_explicit(&WLD_RetryCap, memory_order_relaxed);
+    credit = (int64_t)WLD_RETRY_EARN_BATCH * percent * (WLD_RETRY_UNIT / 100);
+
+    // Unused budget does not pile up beyond the reserve
+    balance = atomic_load_explicit(&WLD_RetryBalance, memory_order_relaxed);
+    if (balance >= cap)
+        return;
+    if (credit > cap - balance)
+        credit = cap - balance;
+    atomic_fetch_add_explicit(&WLD_RetryBalance, credit, memory_order_relaxed);
+}
+
+bool wldRetryTake(void)
+{
+    int64_t balance;
+
+    // No budget percentage: retries are not limited
+    if (atomic_load_explicit(&WLD_RetryPercent, memory_order_relaxed) == 0)
+    {
+        atomic_fetch_add_explicit(&WLD_RetryCount, 1, memory_order_relaxed);
+        return true;
+    }
+
+    balance = atomic_load_explicit(&WLD_RetryBalance, memory_order_relaxed);
+    do
+    {
+        if (balance < WLD_RETRY_UNIT)
+        {
+            atomic_fetch_add_explicit(&WLD_RetryDenied, 1, memory_order_relaxed);
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&WLD_RetryBalance, &balance,
+        balance - WLD_RETRY_UNIT, memory_order_relaxed, memory_order_relaxed));
+
+    atomic_fetch_add_explicit(&WLD_RetryCount, 1, memory_order_relaxed);
+    return true;
+}
+
+uint32_t wldRetryMaxAttempts(void)
+{
+    return atomic_load_explicit(&WLD_RetryAttempts, memory_order_relaxed);
+}
+
+// Full jitter: anywhere between 0 and the exponential backoff, so
+// callers that failed together do not come back together
+uint64_t wldRetryBackoffNsec(uint32_t retry)
+{
+    uint64_t minUsec = atomic_load_explicit(&WLD_RetryBackoffMin, memory_order_relaxed);
+    uint64_t maxUsec = atomic_load_explicit(&WLD_RetryBackoffMax, memory_order_relaxed);
+    uint64_t usec = minUsec;
+
+    if (minUsec == 0)
+        return 0;
+
+    while (--retry && usec < maxUsec)
+        usec *= 2;
+    if (usec > maxUsec)
+        usec = maxUsec;
+
+    return (uint64_t)(wldRandom() % (uint32_t)(usec + 1)) * 1000ULL;
+}
+
+// The FM statuses that say the partition itself is not there, rather
+// than anything about the command.  CKR_SLOT_ID_INVALID is not one of
+// them: it is what a caller passing the wrong embedded slot gets.
+static bool isPartitionFault(uint32_t fmStatus)
+{
+    switch (fmStatus)
+    {
+        case WLD_FM_STATUS_DEVICE_REMOVED:
+        case WLD_FM_STATUS_TOKEN_NOT_PRESENT:
+        case WLD_FM_STATUS_TOKEN_NOT_RECOGNIZED:
+            return true;
+        default:
+            return false;
+    }
+}
+
+WLD_ERROR_CLASS ClassifyWLDError(MD_RV mdResult, uint32_t fmStatus)
+{
+    switch ((uint32_t)mdResult)
+    {
+        case MDR_OK:
+            return isPartitionFault(fmStatus) ? WLD_ERROR_PARTITION : WLD_ERROR_NONE;
+
+        // The adapter's queue is full, or admission control turned the
+        // command away before it was sent
+        case MDR_INSUFFICIENT_RESOURCE:
+        case WLD_MDR_BUSY:
+            return WLD_ERROR_RETRYABLE;
+
+        case MDR_UNSUCCESSFUL:
+        case MDR_INTERNAL_ERROR:
+        case MDR_INVALID_HSM_INDEX:
+            return WLD_ERROR_ADAPTER;
+
+        // Bad parameters, an FM that is not loaded or a deadline that
+        // has passed are the same on every adapter
+        default:
+            return WLD_ERROR_FATAL;
+    }
+}
+
+WLD_RV SetWLDRetryConfig(const WLD_RETRY_CONFIG *pConfig)
+{
+    int64_t cap;
+
+    if (!pConfig || pConfig->budgetPercent > 1000 || pConfig->budgetReserve > 1000000 ||
+        pConfig->backoffMaxUsec < pConfig->backoffMinUsec)
+        return WLDR_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&retry_mutex);
+
+    WLD_RetryConfig = *pConfig;
+    cap = (int64_t)pConfig->budgetReserve * WLD_RETRY_UNIT;
+
+    atomic_store_explicit(&WLD_RetryPercent, pConfig->budgetPercent, memory_order_relaxed);
+    atomic_store_explicit(&WLD_RetryCap, cap, memory_order_relaxed);
+    atomic_store_explicit(&WLD_RetryAttempts, pConfig->maxAttempts, memory_order_relaxed);
+    atomic_store_explicit(&WLD_RetryBackoffMin, pConfig->backoffMinUsec, memory_order_relaxed);
+    atomic_store_explicit(&WLD_RetryBackoffMax, pConfig->backoffMaxUsec, memory_order_relaxed);
+
+    // Start again from a full reserve
+    atomic_store_explicit(&WLD_RetryBalance, cap, memory_order_relaxed);
+
+    pthread_mutex_unlock(&retry_mutex);
+
+    return WLDR_OK;
+}
+
+WLD_RV GetWLDRetryConfig(WLD_RETRY_CONFIG *pConfig)
+{
+    if (!pConfig)
+        return WLDR_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&retry_mutex);
+    *pConfig = WLD_RetryConfig;
+    pthread_mutex_unlock(&retry_mutex);
+
+    return WLDR_OK;
+}
+
+void GetWLDRetryCounts(uint64_t *pRetries, uint64_t *pDenied)
+{
+    if (pRetries)
+        *pRetries = atomic_load_explicit(&WLD_RetryCount, memory_order_relaxed);
+    if (pDenied)
+        *pDenied = atomic_load_explicit(&WLD_RetryDenied, memory_order_relaxed);
+}
@@ -0,0 +1,41 @@
+/*
+    wld_retry.h
+
+    Internal interface between wld.c (and the asynchronous and hedged
+    senders) and the retry budget and backoff in wld_retry.c.  Times
+    are nanoseconds.  This code is sample ONLY and Thales Inc. assumes
+    no liability or responsibility for its correct operation.
+*/
+
+
+#ifndef _WLD_RETRY_H_
+#define _WLD_RETRY_H_
+
+#include "wld.h"
+
+// Earn retry budget for a first attempt
+void wldRetryEarn(void);
+
+// Spend one retry of the budget.  False (and counted as denied) when
+// the budget is used up.
+bool wldRetryTake(void);
+
+// Most attempts of one command, or 0 for one per partition
+uint32_t wldRetryMaxAttempts(void);
+
+// Jittered backoff before retry number retry (1 = the first retry)
+// after a transient error
+uint64_t wldRetryBackoffNsec(uint32_t retry);
+
+// SendWLDMessageToFM with WLD_NO_SLOT_ID whose first attempt goes to
+// firstSlot: a failure there is replayed on the other partitions
+// within the retry budget (wld.c)
+MD_RV wldSendFromSlot(uint32_t firstSlot,
+    uint16_t fmNumber,
+    MD_Buffer_t *pReq,
+    uint32_t timeout,
+    MD_Buffer_t *pResp,
+    uint32_t *pReceivedLen,
+    uint32_t *pFMStatus);
+
+#endif
@@ -0,0 +1,474 @@
+/*
+    wld_session.c
+
+    Host side PKCS#11 session pool for the workload distribution (WLD)
+    sample.  Opening a session, logging in and searching for the key by
+    label costs several round trips to the HSM - often more than the FM
+    command itself - so each slot keeps a pool of logged-in sessions and
+    a cache of resolved object handles.  This code is sample ONLY and
+    Thales Inc. assumes no liability or responsibility for its correct
+    operation.
+*/
+
+#undef UNICODE
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "wld_session.h"
+
+// Object handle resolved for a label on one slot
+typedef struct WLD_LABEL_ENTRY {
+    bool valid;
+    char label[WLD_SESSION_MAX_LABEL_LEN];
+    CK_OBJECT_HANDLE hObject;
+} WLD_LABEL_ENTRY;
+
+// Sessions and handle cache of one slot
+typedef struct WLD_SESSION_POOL {
+    struct WLD_SESSION_POOL *pNext;
+    uint32_t slotID;
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    CK_SESSION_HANDLE *pIdle;
+    uint32_t idleCount;
+    uint32_t openCount;
+    uint32_t generation;
+    bool loggedIn;
+    WLD_LABEL_ENTRY labels[WLD_SESSION_MAX_LABELS];
+    uint32_t nextLabel;
+} WLD_SESSION_POOL;
+
+static WLD_SESSION_POOL * _Atomic WLD_SessionPools = NULL;
+static _Atomic bool InWLDSessionMode = false;
+
+static CK_FUNCTION_LIST *WLD_P11 = NULL;
+static CK_USER_TYPE WLD_UserType = 0;
+static CK_CHAR *WLD_Pin = NULL;
+static CK_ULONG WLD_PinLen = 0;
+static uint32_t WLD_SessionsPerSlot = WLD_SESSION_DEFAULT_PER_SLOT;
+
+// Serializes pool creation and InitializeWLDSessionPool / FinalizeWLDSessionPool
+static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Return true if the error means the session (or the whole token login)
+// can not be used again
+static bool wldSessionBroken(CK_RV rv)
+{
+    switch (rv)
+    {
+        case CKR_SESSION_HANDLE_INVALID:
+        case CKR_SESSION_CLOSED:
+        case CKR_DEVICE_ERROR:
+        case CKR_DEVICE_REMOVED:
+        case CKR_TOKEN_NOT_PRESENT:
+        case CKR_USER_NOT_LOGGED_IN:
+            return true;
+    }
+
+    return false;
+}
+
+// Find the pool of a slot, creating it on first use
+static WLD_SESSION_POOL *getSessionPool(uint32_t slotID)
+{
+    WLD_SESSION_POOL *pPool;
+
+    for (pPool = atomic_load_explicit(&WLD_SessionPools, memory_order_acquire);
+        pPool; pPool = pPool->pNext)
+    {
+        if (pPool->slotID == slotID)
+            return pPool;
+    }
+
+    pthread_mutex_lock(&session_mutex);
+
+    // Someone may have created it while we waited for the lock
+    for (pPool = atomic_load_explicit(&WLD_SessionPools, memory_order_acquire);
+        pPool; pPool = pPool->pNext)
+    {
+        if (pPool->slotID == slotID)
+            break;
+    }
+
+    if (!pPool && atomic_load(&InWLDSessionMode))
+    {
+        pPool = calloc(1, sizeof(WLD_SESSION_POOL));
+        if (pPool)
+            pPool->pIdle = calloc(WLD_SessionsPerSlot, sizeof(CK_SESSION_HANDLE));
+
+        if (pPool && pPool->pIdle)
+        {
+            pPool->slotID = slotID;
+            pthread_mutex_init(&pPool->lock, NULL);
+            pthread_cond_init(&pPool->available, NULL);
+
+            pPool->pNext = atomic_load_explicit(&WLD_SessionPools, memory_order_relaxed);
+            atomic_store_explicit(&WLD_SessionPools, pPool, memory_order_release);
+        }
+        else if (pPool)
+        {
+            free(pPool);
+            pPool = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&session_mutex);
+
+    return pPool;
+}
+
+// Close the idle sessions and drop the handle cache of a pool.  Sessions
+// checked out now are closed when they are returned.  Call with the
+// pool locked.
+static void flushSessionPool(WLD_SESSION_POOL *pPool)
+{
+    while (pPool->idleCount)
+    {
+        (void)WLD_P11->C_CloseSession(pPool->pIdle[--pPool->idleCount]);
+        pPool->openCount--;
+    }
+
+    memset(pPool->labels, 0, sizeof(pPool->labels));
+    pPool->generation++;
+    pPool->loggedIn = false;
+
+    pthread_cond_broadcast(&pPool->available);
+}
+
+// Look up the cached handle of a label.  Call with the pool locked.
+static bool findCachedHandle(WLD_SESSION_POOL *pPool, const char *pLabel, CK_OBJECT_HANDLE *phObject)
+{
+    uint32_t i;
+
+    for (i=0; i < WLD_SESSION_MAX_LABELS; i++)
+    {
+        if (pPool->labels[i].valid && strcmp(pPool->labels[i].label, pLabel) == 0)
+        {
+            *phObject = pPool->labels[i].hObject;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Resolve the handle of a label on the slot with a C_FindObjects search
+static CK_RV findObjectByLabel(CK_SESSION_HANDLE hSession, const char *pLabel, CK_OBJECT_HANDLE *phObject)
+{
+    CK_RV rv;
+    CK_ULONG retCount = 0;
+    CK_ATTRIBUTE findAttr = {CKA_LABEL, (CK_VOID_PTR)pLabel, (CK_ULONG)strlen(pLabel)};
+
+    rv = WLD_P11->C_FindObjectsInit(hSession, &findAttr, 1);
+    if (rv != CKR_OK)
+        return rv;
+
+    rv = WLD_P11->C_FindObjects(hSession, phObject, 1, &retCount);
+    (void)WLD_P11->C_FindObjectsFinal(hSession);
+
+    if (rv == CKR_OK && retCount != 1)
+        rv = CKR_OBJECT_HANDLE_INVALID;
+
+    return rv;
+}
+
+// Open a new session on the slot and log it in unless the token
+// already has a logged in session of ours
+static CK_RV openPoolSession(WLD_SESSION_POOL *pPool, CK_SESSION_HANDLE *phSession)
+{
+    CK_RV rv;
+    bool loggedIn;
+
+    rv = WLD_P11->C_OpenSession(pPool->slotID, CKF_RW_SESSION | CKF_SERIAL_SESSION,
+        NULL, NULL, phSession);
+    if (rv != CKR_OK)
+        return rv;
+
+    pthread_mutex_lock(&pPool->lock);
+    loggedIn = pPool->loggedIn;
+    pthread_mutex_unlock(&pPool->lock);
+
+    if (!loggedIn && WLD_Pin)
+    {
+        rv = WLD_P11->C_Login(*phSession, WLD_UserType, WLD_Pin, WLD_PinLen);
+        if (rv == CKR_USER_ALREADY_LOGGED_IN)
+            rv = CKR_OK;
+
+        if (rv != CKR_OK)
+        {
+            (void)WLD_P11->C_CloseSession(*phSession);
+            return rv;
+        }
+
+        pthread_mutex_lock(&pPool->lock);
+        pPool->loggedIn = true;
+        pthread_mutex_unlock(&pPool->lock);
+    }
+
+    return CKR_OK;
+}
+
+// Set up the session pools.  Sessions are opened with pFunctions and
+// logged in as userType with pPin (no login if pPin is NULL).  At most
+// maxSessionsPerSlot sessions are kept open per slot (0 selects the
+// default); GetWLDSession waits when all of them are checked out.
+WLD_RV InitializeWLDSessionPool(CK_FUNCTION_LIST *pFunctions,
+    CK_USER_TYPE userType,
+    const CK_CHAR *pPin,
+    CK_ULONG pinLen,
+    uint32_t maxSessionsPerSlot)
+{
+    WLD_RV wldErr = WLDR_OK;
+
+    if (!pFunctions || (pPin == NULL && pinLen != 0))
+        return WLDR_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&session_mutex);
+
+    if (atomic_load(&InWLDSessionMode))
+    {
+        wldErr = WLDR_WLD_ALREADY_INITIALIZED;
+        goto doneInit;
+    }
+
+    if (pPin)
+    {
+        WLD_Pin = malloc(pinLen ? pinLen : 1);
+        if (!WLD_Pin)
+        {
+            wldErr = WLDR_INVALID_PARAMETER;
+            goto doneInit;
+        }
+        memcpy(WLD_Pin, pPin, pinLen);
+    }
+
+    WLD_P11 = pFunctions;
+    WLD_UserType = userType;
+    WLD_PinLen = pinLen;
+    WLD_SessionsPerSlot = maxSessionsPerSlot ? maxSessionsPerSlot : WLD_SESSION_DEFAULT_PER_SLOT;
+
+    atomic_store(&InWLDSessionMode, true);
+
+doneInit:
+
+    pthread_mutex_unlock(&session_mutex);
+
+    return wldErr;
+}
+
+// Close every pooled session and free the pools.  No session may be
+// checked out.
+void FinalizeWLDSessionPool(void)
+{
+    WLD_SESSION_POOL *pPool, *pNext;
+
+    pthread_mutex_lock(&session_mutex);
+
+    if (!atomic_load(&InWLDSessionMode))
+    {
+        pthread_mutex_unlock(&session_mutex);
+        return;
+    }
+
+    atomic_store(&InWLDSessionMode, false);
+
+    pPool = atomic_exchange(&WLD_SessionPools, NULL);
+    while (pPool)
+    {
+        pNext = pPool->pNext;
+
+        pthread_mutex_lock(&pPool->lock);
+        flushSessionPool(pPool);
+        pthread_mutex_unlock(&pPool->lock);
+
+        pthread_mutex_destroy(&pPool->lock);
+        pthread_cond_destroy(&pPool->available);
+        free(pPool->pIdle);
+        free(pPool);
+
+        pPool = pNext;
+    }
+
+    if (WLD_Pin)
+    {
+        memset(WLD_Pin, 0, WLD_PinLen);
+        free(WLD_Pin);
+        WLD_Pin = NULL;
+    }
+    WLD_PinLen = 0;
+
+    pthread_mutex_unlock(&session_mutex);
+}
+
+// Check out a logged-in session.  If WLD_NO_SLOT_ID is passed in the
+// slot is picked with GetWLDSlotID.  If pLabel is not NULL the handle
+// of the object with that label is returned in pSession->hObject,
+// from the slot's cache when possible.  The session must be handed
+// back with ReleaseWLDSession.
+CK_RV GetWLDSession(uint32_t slotID, const char *pLabel, WLD_SESSION *pSession)
+{
+    WLD_SESSION_POOL *pPool;
+    CK_SESSION_HANDLE hSession = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE hObject = CK_INVALID_HANDLE;
+    uint32_t embeddedSlotID = 0;
+    uint32_t generation;
+    bool cached = false;
+    bool fresh = false;
+    CK_RV rv;
+
+    if (!pSession || (pLabel && strlen(pLabel) >= WLD_SESSION_MAX_LABEL_LEN))
+        return CKR_ARGUMENTS_BAD;
+
+    memset(pSession, 0, sizeof(WLD_SESSION));
+
+    if (!atomic_load_explicit(&InWLDSessionMode, memory_order_acquire))
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+    if (slotID == WLD_NO_SLOT_ID)
+    {
+        if (GetWLDSlotID(&slotID, &embeddedSlotID) != WLDR_OK)
+            return CKR_TOKEN_NOT_PRESENT;
+    }
+    else if (GetWLDSlotInfo(slotID, NULL, &embeddedSlotID) != WLDR_OK)
+        return CKR_SLOT_ID_INVALID;
+
+    pPool = getSessionPool(slotID);
+    if (!pPool)
+        return CKR_HOST_MEMORY;
+
+    // Take an idle session, or reserve room for a new one
+    pthread_mutex_lock(&pPool->lock);
+
+    while (pPool->idleCount == 0 && pPool->openCount >= WLD_SessionsPerSlot)
+        pthread_cond_wait(&pPool->available, &pPool->lock);
+
+    if (pPool->idleCount)
+        hSession = pPool->pIdle[--pPool->idleCount];
+    else
+    {
+        pPool->openCount++;
+        fresh = true;
+    }
+
+    generation = pPool->generation;
+    if (pLabel)
+        cached = findCachedHandle(pPool, pLabel, &hObject);
+
+    pthread_mutex_unlock(&pPool->lock);
+
+    if (fresh)
+    {
+        rv = openPoolSession(pPool, &hSession);
+        if (rv != CKR_OK)
+        {
+            pthread_mutex_lock(&pPool->lock);
+            pPool->openCount--;
+            pthread_cond_signal(&pPool->available);
+            pthread_mutex_unlock(&pPool->lock);
+            return rv;
+        }
+    }
+
+    pSession->slotID = slotID;
+    pSession->embeddedSlotID = embeddedSlotID;
+    pSession->hSession = hSession;
+    pSession->pPool = pPool;
+    pSession->generation = generation;
+
+    if (pLabel && !cached)
+    {
+        rv = findObjectByLabel(hSession, pLabel, &hObject);
+        if (rv != CKR_OK)
+        {
+            ReleaseWLDSession(pSession, rv);
+            return rv;
+        }
+
+        pthread_mutex_lock(&pPool->lock);
+        if (pPool->generation == generation && !findCachedHandle(pPool, pLabel, &hObject))
+        {
+            WLD_LABEL_ENTRY *pEntry = &pPool->labels[pPool->nextLabel];
+
+            pPool->nextLabel = (pPool->nextLabel + 1) % WLD_SESSION_MAX_LABELS;
+            pEntry->valid = true;
+            strcpy(pEntry->label, pLabel);
+            pEntry->hObject = hObject;
+        }
+        pthread_mutex_unlock(&pPool->lock);
+    }
+
+    pSession->hObject = hObject;
+
+    return CKR_OK;
+}
+
+// Hand a session back to its pool.  lastResult is the result of the
+// last operation done with it: a session error closes it (and every
+// idle session of the slot), a bad object handle drops the slot's
+// handle cache.
+void ReleaseWLDSession(WLD_SESSION *pSession, CK_RV lastResult)
+{
+    WLD_SESSION_POOL *pPool;
+
+    if (!pSession || !pSession->pPool)
+        return;
+
+    pPool = (WLD_SESSION_POOL *)pSession->pPool;
+
+    pthread_mutex_lock(&pPool->lock);
+
+    if (lastResult == CKR_OBJECT_HANDLE_INVALID || lastResult == CKR_KEY_HANDLE_INVALID)
+        memset(pPool->labels, 0, sizeof(pPool->labels));
+
+    if (wldSessionBroken(lastResult) || pSession->generation != pPool->generation)
+    {
+        (void)WLD_P11->C_CloseSession(pSession->hSession);
+        pPool->openCount--;
+
+        if (wldSessionBroken(lastResult) && pSession->generation == pPool->generation)
+            flushSessionPool(pPool);
+    }
+    else
+        pPool->pIdle[pPool->idleCount++] = pSession->hSession;
+
+    pthread_cond_signal(&pPool->available);
+    pthread_mutex_unlock(&pPool->lock);
+
+    pSession->pPool = NULL;
+}
+
+// Close the pooled sessions and drop the cached handles of a slot
+// (all slots if WLD_NO_SLOT_ID is passed in), e.g. after the keys on
+// it were changed
+void FlushWLDSessions(uint32_t slotID)
+{
+    WLD_SESSION_POOL *pPool;
+
+    // FinalizeWLDSessionPool frees the pools under session_mutex
+    pthread_mutex_lock(&session_mutex);
+
+    if (!atomic_load(&InWLDSessionMode))
+    {
+        pthread_mutex_unlock(&session_mutex);
+        return;
+    }
+
+    for (pPool = atomic_load_explicit(&WLD_SessionPools, memory_order_acquire);
+        pPool; pPool = pPool->pNext)
+    {
+        if (slotID != WLD_NO_SLOT_ID && pPool->slotID != slotID)
+            continue;
+
+        pthread_mutex_lock(&pPool->lock);
+        flushSessionPool(pPool);
+        pthread_mutex_unlock(&pPool->lock);
+    }
+
+    pthread_mutex_unlock(&session_mutex);
+}
@@ -0,0 +1,581 @@
+/*
+    wld_shm.c
+
+    Host-wide shared state for the workload distribution (WLD) sample.
+    With SetWLDShared (or WLD_SHARED) the partitions, the active bitmap,
+    the per adapter loads and the round-robin cursor of a table live in
+    a POSIX shared memory segment, one per table layout, which every
+    process with that layout maps.  The request path only uses atomic
+    operations on the segment.  Attaching, leaving and taking back the
+    share of a process that died are guarded by a robust process-shared
+    mutex, so a process that dies holding it does not wedge the others.
+    This code is sample ONLY and Thales Inc. assumes no liability or
+    responsibility for its correct operation.
+*/
+
+#undef UNICODE
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wld.h"
+#include "wld_shm.h"
+
+// Set once a segment is initialized, and the layout version of it
+#define WLD_SHM_READY                   0x574C4453
+#define WLD_SHM_VERSION                 1
+
+#define WLD_SHM_NAME_LEN                64
+
+// How long a process waits for the creator to initialize a segment,
+// and how often it retries a segment that was removed under it
+#define WLD_SHM_INIT_MSEC               1000
+#define WLD_SHM_ATTEMPTS                4
+
+#define WLD_SHM_NO_ENTRY                0xFFFFFFFF
+
+// Round up to whole cache lines
+#define WLD_SHM_LINES(n)                (((size_t)(n) + 63) & ~(size_t)63)
+
+// A process attached to a segment, pid 0 = free
+typedef struct WLD_SHM_PROCESS {
+    uint32_t pid;
+    uint64_t startTime;                 // tells a reused pid apart
+} WLD_SHM_PROCESS;
+
+// Start of a segment.  The active bitmap, the partitions, a mask of
+// the processes probing each adapter, the loads and a row of in-flight
+// counts per process follow, each on cache lines of its own.
+typedef struct WLD_SHM_HEADER {
+    _Atomic uint32_t ready;             // WLD_SHM_READY
+    uint32_t version;
+    uint64_t size;
+    uint64_t hash;
+    uint32_t partitions;
+    uint32_t words;
+    uint32_t adapters;
+    uint32_t loadSize;
+    uint32_t partitionSize;
+
+    // Robust and process shared.  Guards the rest of the header.
+    pthread_mutex_t lock;
+    bool unlinked;                      // removed by the last process out
+    uint32_t processes;
+    uint64_t reclaimed;
+    WLD_SHM_PROCESS process[WLD_SHM_PROCESSES];
+
+    _Atomic uint32_t cursor __attribute__((aligned(64)));
+} __attribute__((aligned(64))) WLD_SHM_HEADER;
+
+struct WLD_SHM {
+    WLD_SHM_HEADER *pHeader;
+    size_t size;
+    uint32_t entry;                     // this process's entry
+    uint32_t adapters;
+    size_t activeOffset;
+    size_t partitionOffset;
+    size_t probingOffset;
+    size_t loadOffset;
+    size_t inFlightOffset;
+    size_t rowSize;
+    char name[WLD_SHM_NAME_LEN + 20];
+};
+
+// Segment name prefix, empty = sharing is off.  Guarded by shm_mutex.
+static char WLD_ShmPrefix[WLD_SHM_NAME_LEN] = "";
+static pthread_mutex_t shm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Start time of a process (clock ticks after boot), 0 if unknown
+static uint64_t processStartTime(uint32_t pid)
+{
+    char path[32];
+    char buf[1024];
+    char *pFields;
+    unsigned long long startTime = 0;
+    ssize_t len;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%u/stat", pid);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+
+    // The command name may hold anything, so start after its last ')'
+    pFields = strrchr(buf, ')');
+    if (!pFields || sscanf(pFields + 1,
+        " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+        &startTime) != 1)
+        return 0;
+
+    return startTime;
+}
+
+// Check that the process of an entry is still the one that attached
+static bool processAlive(const WLD_SHM_PROCESS *pProcess)
+{
+    uint64_t startTime;
+
+    if (kill((pid_t)pProcess->pid, 0) != 0 && errno == ESRCH)
+        return false;
+
+    startTime = processStartTime(pProcess->pid);
+    return startTime == 0 || startTime == pProcess->startTime;
+}
+
+// Take the segment lock.  A process that died holding it was only
+// changing entries and counts, which stay usable, so the lock is
+// simply made consistent again.
+static bool lockShm(WLD_SHM_HEADER *pHeader)
+{
+    int rc = pthread_mutex_lock(&pHeader->lock);
+
+    if (rc == EOWNERDEAD)
+    {
+        printf("\nWLD: a process died holding the shared segment lock\n");
+        rc = pthread_mutex_consistent(&pHeader->lock);
+    }
+
+    return rc == 0;
+}
+
+static inline _Atomic uint64_t *shmProbing(WLD_SHM *pShm)
+{
+    return (_Atomic uint64_t *)((char *)pShm->pHeader + pShm->probingOffset);
+}
+
+static inline _Atomic uint32_t *shmRow(WLD_SHM *pShm, uint32_t entry)
+{
+    return (_Atomic uint32_t *)((char *)pShm->pHeader + pShm->inFlightOffset + entry * pShm->rowSize);
+}
+
+// Place the parts of a segment
+static void layoutShm(WLD_SHM *pShm, const WLD_SHM_LAYOUT *pLayout)
+{
+    size_t offset = WLD_SHM_LINES(sizeof(WLD_SHM_HEADER));
+
+    pShm->adapters = pLayout->adapters ? pLayout->adapters : 1;
+
+    pShm->activeOffset = offset;
+    offset += WLD_SHM_LINES(pLayout->words * sizeof(uint64_t));
+    pShm->partitionOffset = offset;
+    offset += WLD_SHM_LINES((pLayout->partitions ? pLayout->partitions : 1) * pLayout->partitionSize);
+    pShm->probingOffset = offset;
+    offset += WLD_SHM_LINES(pShm->adapters * sizeof(uint64_t));
+    pShm->loadOffset = offset;
+    offset += WLD_SHM_LINES(pShm->adapters * pLayout->loadSize);
+    pShm->rowSize = WLD_SHM_LINES(pShm->adapters * sizeof(uint32_t));
+    pShm->inFlightOffset = offset;
+    offset += WLD_SHM_PROCESSES * pShm->rowSize;
+
+    pShm->size = offset;
+}
+
+// Fill in a segment just created (and zeroed by ftruncate)
+static bool initShm(WLD_SHM *pShm, const WLD_SHM_LAYOUT *pLayout)
+{
+    WLD_SHM_HEADER *pHeader = pShm->pHeader;
+    pthread_mutexattr_t attr;
+    int rc;
+
+    pHeader->version = WLD_SHM_VERSION;
+    pHeader->size = pShm->size;
+    pHeader->hash = pLayout->hash;
+    pHeader->partitions = pLayout->partitions;
+    pHeader->words = pLayout->words;
+    pHeader->adapters = pLayout->adapters;
+    pHeader->loadSize = pLayout->loadSize;
+    pHeader->partitionSize = pLayout->partitionSize;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    rc = pthread_mutex_init(&pHeader->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc != 0)
+        return false;
+
+    atomic_init(&pHeader->cursor, 0);
+    atomic_store_explicit(&pHeader->ready, WLD_SHM_READY, memory_order_release);
+
+    return true;
+}
+
+// Check that a segment someone else created has this layout
+static bool checkShm(WLD_SHM *pShm, const WLD_SHM_LAYOUT *pLayout)
+{
+    const WLD_SHM_HEADER *pHeader = pShm->pHeader;
+
+    return pHeader->version == WLD_SHM_VERSION && pHeader->size == pShm->size &&
+        pHeader->hash == pLayout->hash && pHeader->partitions == pLayout->partitions &&
+        pHeader->words == pLayout->words && pHeader->adapters == pLayout->adapters &&
+        pHeader->loadSize == pLayout->loadSize &&
+        pHeader->partitionSize == pLayout->partitionSize;
+}
+
+// Open and map the segment, creating it if there is none.  False on
+// failure, with the reason printed.  A segment whose creator never set
+// it up (it died or hung) is removed: true with no header then, and
+// the next call creates a new one.
+static bool mapShm(WLD_SHM *pShm, const WLD_SHM_LAYOUT *pLayout)
+{
+    struct stat st;
+    void *pMap;
+    uint32_t waited;
+    bool created = true;
+    int fd;
+
+    fd = shm_open(pShm->name, O_RDWR | O_CREAT | O_EXCL, 0660);
+    if (fd < 0 && errno == EEXIST)
+    {
+        created = false;
+        fd = shm_open(pShm->name, O_RDWR, 0);
+    }
+    if (fd < 0)
+    {
+        printf("\nWLD: cannot open shared segment %s (errno %d)\n", pShm->name, errno);
+        return false;
+    }
+
+    if (created && ftruncate(fd, (off_t)pShm->size) != 0)
+    {
+        printf("\nWLD: cannot size shared segment %s (errno %d)\n", pShm->name, errno);
+        (void)shm_unlink(pShm->name);
+        close(fd);
+        return false;
+    }
+
+    // The creator may not have sized it yet
+    for (waited=0; !created; waited++)
+    {
+        if (fstat(fd, &st) != 0 || (st.st_size != 0 && (size_t)st.st_size != pShm->size))
+        {
+            printf("\nWLD: shared segment %s has another layout\n", pShm->name);
+            close(fd);
+            return false;
+        }
+        if ((size_t)st.st_size == pShm->size)
+            break;
+        if (waited == WLD_SHM_INIT_MSEC)
+        {
+            printf("\nWLD: shared segment %s was never set up - removing it\n", pShm->name);
+            (void)shm_unlink(pShm->name);
+            close(fd);
+            pShm->pHeader = NULL;
+            return true;
+        }
+        usleep(1000);
+    }
+
+    pMap = mmap(NULL, pShm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pMap == MAP_FAILED)
+    {
+        printf("\nWLD: cannot map shared segment %s (errno %d)\n", pShm->name, errno);
+        return false;
+    }
+    pShm->pHeader = (WLD_SHM_HEADER *)pMap;
+
+    if (created)
+    {
+        if (initShm(pShm, pLayout))
+            return true;
+        printf("\nWLD: cannot set up the lock of shared segment %s\n", pShm->name);
+        (void)shm_unlink(pShm->name);
+    }
+    else
+    {
+        for (waited=0; waited < WLD_SHM_INIT_MSEC; waited++)
+        {
+            if (atomic_load_explicit(&pShm->pHeader->ready, memory_order_acquire) == WLD_SHM_READY)
+                break;
+            usleep(1000);
+        }
+        if (waited == WLD_SHM_INIT_MSEC)
+        {
+            printf("\nWLD: shared segment %s was never set up - removing it\n", pShm->name);
+            (void)shm_unlink(pShm->name);
+            munmap(pMap, pShm->size);
+            pShm->pHeader = NULL;
+            return true;
+        }
+        if (checkShm(pShm, pLayout))
+            return true;
+        printf("\nWLD: shared segment %s has another layout\n", pShm->name);
+    }
+
+    munmap(pMap, pShm->size);
+    pShm->pHeader = NULL;
+    return false;
+}
+
+// Share the tables published from now on through segments named
+// pName (e.g. "/wld") plus the layout, or stop sharing with NULL
+WLD_RV SetWLDShared(const char *pName)
+{
+    if (pName && pName[0] != '\0' &&
+        (pName[0] != '/' || strchr(pName + 1, '/') || strlen(pName) >= WLD_SHM_NAME_LEN))
+        return WLDR_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&shm_mutex);
+    snprintf(WLD_ShmPrefix, sizeof(WLD_ShmPrefix), "%s", pName ? pName : "");
+    pthread_mutex_unlock(&shm_mutex);
+
+    return WLDR_OK;
+}
+
+WLD_SHM *wldShmAttach(const WLD_SHM_LAYOUT *pLayout, bool *pFirst)
+{
+    WLD_SHM_HEADER *pHeader = NULL;
+    WLD_SHM *pShm;
+    uint32_t entry = WLD_SHM_NO_ENTRY;
+    uint32_t live = 0;
+    uint32_t attempt;
+    uint32_t i;
+
+    pShm = calloc(1, sizeof(WLD_SHM));
+    if (!pShm)
+        return NULL;
+
+    pthread_mutex_lock(&shm_mutex);
+    snprintf(pShm->name, sizeof(pShm->name), "%s.%016llx", WLD_ShmPrefix,
+        (unsigned long long)pLayout->hash);
+    pthread_mutex_unlock(&shm_mutex);
+
+    if (pShm->name[0] != '/')
+    {
+        free(pShm);
+        return NULL;
+    }
+
+    layoutShm(pShm, pLayout);
+
+    // A segment removed by the last process out while we were opening
+    // it, or one that was never set up, is left alone; the next attempt
+    // creates a new one
+    for (attempt=0; attempt < WLD_SHM_ATTEMPTS && !pHeader; attempt++)
+    {
+        if (!mapShm(pShm, pLayout))
+            break;
+
+        pHeader = pShm->pHeader;
+        if (!pHeader)
+            continue;
+
+        if (!lockShm(pHeader))
+        {
+            printf("\nWLD: cannot lock shared segment %s\n", pShm->name);
+            munmap(pHeader, pShm->size);
+            pHeader = NULL;
+            break;
+        }
+
+        if (pHeader->unlinked)
+        {
+            pthread_mutex_unlock(&pHeader->lock);
+            munmap(pHeader, pShm->size);
+            pHeader = NULL;
+        }
+    }
+
+    if (!pHeader)
+    {
+        printf("\nWLD: the partition table is not shared\n");
+        free(pShm);
+        return NULL;
+    }
+
+    for (i=0; i < WLD_SHM_PROCESSES; i++)
+    {
+        if (pHeader->process[i].pid == 0)
+        {
+            if (entry == WLD_SHM_NO_ENTRY)
+                entry = i;
+        }
+        else if (processAlive(&pHeader->process[i]))
+            live++;
+    }
+
+    // Nobody is left: whatever the processes before left behind goes
+    if (live == 0)
+    {
+        for (i=0; i < WLD_SHM_PROCESSES; i++)
+        {
+            if (pHeader->process[i].pid != 0)
+                pHeader->reclaimed++;
+            pHeader->process[i].pid = 0;
+        }
+        memset(shmProbing(pShm), 0, pShm->adapters * sizeof(uint64_t));
+        memset(shmRow(pShm, 0), 0, WLD_SHM_PROCESSES * pShm->rowSize);
+        entry = 0;
+    }
+    else if (entry == WLD_SHM_NO_ENTRY)
+    {
+        printf("\nWLD: shared segment %s has no room for another process - the partition table is not shared\n",
+            pShm->name);
+        pthread_mutex_unlock(&pHeader->lock);
+        munmap(pHeader, pShm->size);
+        free(pShm);
+        return NULL;
+    }
+
+    pShm->entry = entry;
+    pHeader->process[entry].startTime = processStartTime((uint32_t)getpid());
+    pHeader->process[entry].pid = (uint32_t)getpid();
+    pHeader->processes = live + 1;
+
+    *pFirst = (live == 0);
+    return pShm;
+}
+
+void wldShmUnlock(WLD_SHM *pShm)
+{
+    pthread_mutex_unlock(&pShm->pHeader->lock);
+}
+
+void wldShmDetach(WLD_SHM *pShm)
+{
+    WLD_SHM_HEADER *pHeader = pShm->pHeader;
+    uint64_t bit = 1ULL << pShm->entry;
+    uint32_t live = 0;
+    uint32_t i;
+
+    if (lockShm(pHeader))
+    {
+        for (i=0; i < pShm->adapters; i++)
+            atomic_fetch_and_explicit(&shmProbing(pShm)[i], ~bit, memory_order_relaxed);
+        memset(shmRow(pShm, pShm->entry), 0, pShm->rowSize);
+        pHeader->process[pShm->entry].pid = 0;
+
+        for (i=0; i < WLD_SHM_PROCESSES; i++)
+        {
+            if (pHeader->process[i].pid != 0 && processAlive(&pHeader->process[i]))
+                live++;
+        }
+        pHeader->processes = live;
+
+        if (live == 0)
+        {
+            pHeader->unlinked = true;
+            (void)shm_unlink(pShm->name);
+        }
+        pthread_mutex_unlock(&pHeader->lock);
+    }
+
+    munmap(pHeader, pShm->size);
+    free(pShm);
+}
+
+_Atomic uint32_t *wldShmCursor(WLD_SHM *pShm)
+{
+    return &pShm->pHeader->cursor;
+}
+
+_Atomic uint64_t *wldShmActive(WLD_SHM *pShm)
+{
+    return (_Atomic uint64_t *)((char *)pShm->pHeader + pShm->activeOffset);
+}
+
+void *wldShmPartitions(WLD_SHM *pShm)
+{
+    return (char *)pShm->pHeader + pShm->partitionOffset;
+}
+
+void *wldShmLoad(WLD_SHM *pShm)
+{
+    return (char *)pShm->pHeader + pShm->loadOffset;
+}
+
+_Atomic uint32_t *wldShmInFlight(WLD_SHM *pShm)
+{
+    return shmRow(pShm, pShm->entry);
+}
+
+void wldShmSetProbing(WLD_SHM *pShm, uint32_t adapter, bool probing)
+{
+    uint64_t bit = 1ULL << pShm->entry;
+
+    if (probing)
+        atomic_fetch_or_explicit(&shmProbing(pShm)[adapter], bit, memory_order_relaxed);
+    else
+        atomic_fetch_and_explicit(&shmProbing(pShm)[adapter], ~bit, memory_order_relaxed);
+}
+
+uint32_t wldShmReclaim(WLD_SHM *pShm, uint32_t *pInFlight, bool *pOrphaned)
+{
+    WLD_SHM_HEADER *pHeader = pShm->pHeader;
+    _Atomic uint32_t *pRow;
+    uint64_t probing;
+    uint64_t bit;
+    uint32_t reclaimed = 0;
+    uint32_t live = 0;
+    uint32_t i, j;
+
+    memset(pInFlight, 0, pShm->adapters * sizeof(uint32_t));
+    memset(pOrphaned, 0, pShm->adapters * sizeof(bool));
+
+    if (!lockShm(pHeader))
+        return 0;
+
+    for (i=0; i < WLD_SHM_PROCESSES; i++)
+    {
+        if (pHeader->process[i].pid == 0)
+            continue;
+        if (i == pShm->entry || processAlive(&pHeader->process[i]))
+        {
+            live++;
+            continue;
+        }
+
+        // Nothing writes the row of a dead process any more
+        pRow = shmRow(pShm, i);
+        bit = 1ULL << i;
+        for (j=0; j < pShm->adapters; j++)
+        {
+            pInFlight[j] += atomic_exchange_explicit(&pRow[j], 0, memory_order_relaxed);
+            probing = atomic_fetch_and_explicit(&shmProbing(pShm)[j], ~bit, memory_order_relaxed);
+            if ((probing & bit) && (probing & ~bit) == 0)
+                pOrphaned[j] = true;
+        }
+
+        printf("\nWLD: process %u left shared segment %s without detaching - taking back its share\n",
+            pHeader->process[i].pid, pShm->name);
+        pHeader->process[i].pid = 0;
+        pHeader->reclaimed++;
+        reclaimed++;
+    }
+    pHeader->processes = live;
+
+    pthread_mutex_unlock(&pHeader->lock);
+
+    return reclaimed;
+}
+
+void wldShmCounts(WLD_SHM *pShm, uint32_t *pProcesses, uint64_t *pReclaimed)
+{
+    WLD_SHM_HEADER *pHeader = pShm->pHeader;
+
+    *pProcesses = 0;
+    *pReclaimed = 0;
+    if (!lockShm(pHeader))
+        return;
+
+    *pProcesses = pHeader->processes;
+    *pReclaimed = pHeader->reclaimed;
+    pthread_mutex_unlock(&pHeader->lock);
+}
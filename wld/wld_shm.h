@@ -0,0 +1,74 @@
+/*
+    wld_shm.h
+
+    Internal interface between wld.c and the host-wide shared state in
+    wld_shm.c.  A table is shared by every process whose table has the
+    same layout (slots, adapters and weights, in the same order).  This
+    code is sample ONLY and Thales Inc. assumes no liability or
+    responsibility for its correct operation.
+*/
+
+
+#ifndef _WLD_SHM_H_
+#define _WLD_SHM_H_
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "wld.h"
+
+// Processes that can share one segment
+#define WLD_SHM_PROCESSES 64
+
+// An attached segment
+typedef struct WLD_SHM WLD_SHM;
+
+// What a table shares, and the size of its partition and per adapter
+// load records
+typedef struct WLD_SHM_LAYOUT {
+    uint64_t hash;
+    uint32_t partitions;
+    uint32_t words;
+    uint32_t adapters;
+    uint32_t partitionSize;
+    uint32_t loadSize;
+} WLD_SHM_LAYOUT;
+
+// Attach to (or create) the segment of a layout, or NULL when sharing
+// is off or not possible (the table then stays private).  *pFirst is
+// true when no other live process is attached, so the caller's state
+// is to be copied in.  Returns with the segment locked, so that the
+// caller can merge its table before anyone else looks at it; call
+// wldShmUnlock when done.
+WLD_SHM *wldShmAttach(const WLD_SHM_LAYOUT *pLayout, bool *pFirst);
+
+void wldShmUnlock(WLD_SHM *pShm);
+
+// Leave a segment; the last process out removes it
+void wldShmDetach(WLD_SHM *pShm);
+
+// The shared state of an attached segment
+_Atomic uint32_t *wldShmCursor(WLD_SHM *pShm);
+_Atomic uint64_t *wldShmActive(WLD_SHM *pShm);
+void *wldShmPartitions(WLD_SHM *pShm);
+void *wldShmLoad(WLD_SHM *pShm);
+
+// This process's requests in flight per adapter, kept so that the
+// counts of a process that dies can be taken back
+_Atomic uint32_t *wldShmInFlight(WLD_SHM *pShm);
+
+// This process has the breaker of an adapter open (or ramping) and
+// probes it
+void wldShmSetProbing(WLD_SHM *pShm, uint32_t adapter, bool probing);
+
+// Take back the entries of processes that died.  pInFlight[adapter]
+// gets the requests they had in flight and pOrphaned[adapter] is set
+// for adapters they were probing that nobody else probes.  Returns the
+// number of processes taken back.
+uint32_t wldShmReclaim(WLD_SHM *pShm, uint32_t *pInFlight, bool *pOrphaned);
+
+// Live processes attached (as of the last attach, detach or reclaim)
+// and processes taken back since the segment was created
+void wldShmCounts(WLD_SHM *pShm, uint32_t *pProcesses, uint64_t *pReclaimed);
+
+#endif
@@ -0,0 +1,686 @@
+/*
+    wld_stats.c
+
+    Statistics for the workload distribution (WLD) sample: per thread
+    request counters and latency histograms, the snapshot sums and the
+    JSON / Prometheus dumps.  This code is sample ONLY and Thales Inc.
+    assumes no liability or responsibility for its correct operation.
+*/
+
+#undef UNICODE
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "wld.h"
+#include "wld_stats.h"
+
+// Histogram layout: values below 16 have a bucket each, above that
+// every power of two is split into 8 linear sub-buckets
+#define WLD_HIST_SUB_BITS 3
+#define WLD_HIST_SUB (1 << WLD_HIST_SUB_BITS)
+
+#define WLD_CACHE_LINE 64
+
+// Counters of one partition, written only by the owning thread
+typedef struct WLD_THREAD_PARTITION {
+    _Atomic uint64_t requests;
+    _Atomic uint64_t errors;
+    _Atomic uint64_t retries;
+} WLD_THREAD_PARTITION;
+
+// Counters and histogram of one adapter, written only by the owning thread
+typedef struct WLD_THREAD_ADAPTER {
+    _Atomic uint64_t mdResults[WLD_STATS_MD_RESULTS];
+    _Atomic uint64_t retries;
+    _Atomic uint64_t deactivations;
+    _Atomic uint64_t latencySum;
+    _Atomic uint64_t latencyMax;
+    _Atomic uint64_t buckets[WLD_STATS_HIST_BUCKETS];
+} __attribute__((aligned(WLD_CACHE_LINE))) WLD_THREAD_ADAPTER;
+
+// Counter block of one thread.  Blocks are never freed: when a thread
+// exits its block is released and adopted by the next new thread, so
+// the totals keep counting.
+typedef struct WLD_THREAD_STATS {
+    struct WLD_THREAD_STATS *pNext;
+    _Atomic bool inUse;
+    uint32_t partitions;
+    uint32_t adapters;
+    WLD_THREAD_PARTITION *pPartitions;
+    WLD_THREAD_ADAPTER *pAdapters;
+} __attribute__((aligned(WLD_CACHE_LINE))) WLD_THREAD_STATS;
+
+static WLD_THREAD_STATS * _Atomic WLD_StatsBlocks = NULL;
+static __thread WLD_THREAD_STATS *pMyStats = NULL;
+
+static pthread_once_t statsKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t statsKey;
+
+// Periodic dump
+static pthread_mutex_t dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dump_cond;
+static pthread_t dumpThread;
+static bool dumpRunning = false;
+static bool dumpStop = false;
+static char *pDumpPath = NULL;
+static WLD_STATS_FORMAT dumpFormat = WLD_STATS_JSON;
+static uint32_t dumpIntervalMsec = 0;
+
+static const char *WLD_ResultNames[WLD_STATS_MD_RESULTS] = {
+    "ok",
+    "unsuccessful",
+    "not_implemented",
+    "insufficient_resource",
+    "internal_error",
+    "invalid_parameter",
+    "invalid_hsm_index",
+    "timeout",
+    "other"
+};
+
+// Prometheus histogram bounds (seconds) the fine buckets are folded into
+static const double WLD_PromBounds[] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+    0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0
+};
+
+// Single writer increment - no locked instruction needed
+static inline void statsAdd(_Atomic uint64_t *pCounter, uint64_t value)
+{
+    atomic_store_explicit(pCounter,
+        atomic_load_explicit(pCounter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static inline uint32_t statsResultIndex(MD_RV mdResult)
+{
+    // Not an MD_RV enumerator, so kept out of the switch
+    if (mdResult == WLD_MDR_TIMEOUT)
+        return 7;
+
+    switch (mdResult)
+    {
+        case MDR_OK:                    return 0;
+        case MDR_UNSUCCESSFUL:          return 1;
+        case MDR_NOT_IMPLEMENTED:       return 2;
+        case MDR_INSUFFICIENT_RESOURCE: return 3;
+        case MDR_INTERNAL_ERROR:        return 4;
+        case MDR_INVALID_PARAMETER:     return 5;
+        case MDR_INVALID_HSM_INDEX:     return 6;
+        default:                        return 8;
+    }
+}
+
+static inline uint32_t statsBucket(uint64_t nsec)
+{
+    uint32_t msb;
+    uint32_t bucket;
+
+    if (nsec < 2 * WLD_HIST_SUB)
+        return (uint32_t)nsec;
+
+    msb = 63 - (uint32_t)__builtin_clzll(nsec);
+    bucket = (msb - WLD_HIST_SUB_BITS) * WLD_HIST_SUB +
+        (uint32_t)(nsec >> (msb - WLD_HIST_SUB_BITS));
+
+    return bucket < WLD_STATS_HIST_BUCKETS ? bucket : WLD_STATS_HIST_BUCKETS - 1;
+}
+
+// Upper bound (inclusive, in nsec) of a histogram bucket
+uint64_t GetWLDStatsBucketNsec(uint32_t bucket)
+{
+    uint32_t shift;
+    uint64_t mantissa;
+
+    if (bucket < 2 * WLD_HIST_SUB)
+        return bucket;
+
+    shift = bucket / WLD_HIST_SUB - 1;
+    mantissa = bucket % WLD_HIST_SUB + WLD_HIST_SUB;
+
+    return ((mantissa + 1) << shift) - 1;
+}
+
+// Name of a WLD_ADAPTER_STATS mdResults entry
+const char *GetWLDStatsResultName(uint32_t result)
+{
+    return result < WLD_STATS_MD_RESULTS ? WLD_ResultNames[result] : "unknown";
+}
+
+static void releaseStatsBlock(void *pArg)
+{
+    WLD_THREAD_STATS *pBlock = (WLD_THREAD_STATS *)pArg;
+
+    atomic_store_explicit(&pBlock->inUse, false, memory_order_release);
+}
+
+static void createStatsKey(void)
+{
+    (void)pthread_key_create(&statsKey, releaseStatsBlock);
+}
+
+static void *allocLines(size_t size)
+{
+    void *p;
+
+    size = (size + WLD_CACHE_LINE - 1) & ~(size_t)(WLD_CACHE_LINE - 1);
+    p = aligned_alloc(WLD_CACHE_LINE, size ? size : WLD_CACHE_LINE);
+    if (p)
+        memset(p, 0, size);
+
+    return p;
+}
+
+// Get this thread's counter block, big enough for the table in use.  A
+// released block is adopted before a new one is allocated.
+static WLD_THREAD_STATS *getStatsBlock(uint32_t partitions, uint32_t adapters)
+{
+    WLD_THREAD_STATS *pBlock = pMyStats;
+    bool expected;
+
+    if (pBlock && pBlock->partitions >= partitions && pBlock->adapters >= adapters)
+        return pBlock;
+
+    (void)pthread_once(&statsKeyOnce, createStatsKey);
+
+    // Outgrown by a bigger table - hand it back and find a bigger one
+    if (pBlock)
+    {
+        pMyStats = NULL;
+        releaseStatsBlock(pBlock);
+    }
+
+    for (pBlock = atomic_load_explicit(&WLD_StatsBlocks, memory_order_acquire);
+        pBlock; pBlock = pBlock->pNext)
+    {
+        expected = false;
+        if (pBlock->partitions >= partitions && pBlock->adapters >= adapters &&
+            atomic_compare_exchange_strong_explicit(&pBlock->inUse, &expected, true,
+                memory_order_acquire, memory_order_relaxed))
+            break;
+    }
+
+    if (!pBlock)
+    {
+        pBlock = allocLines(sizeof(WLD_THREAD_STATS));
+        if (!pBlock)
+            return NULL;
+
+        pBlock->partitions = partitions;
+        pBlock->adapters = adapters;
+        pBlock->pPartitions = allocLines(partitions * sizeof(WLD_THREAD_PARTITION));
+        pBlock->pAdapters = allocLines(adapters * sizeof(WLD_THREAD_ADAPTER));
+        if (!pBlock->pPartitions || !pBlock->pAdapters)
+        {
+            free(pBlock->pPartitions);
+            free(pBlock->pAdapters);
+            free(pBlock);
+            return NULL;
+        }
+        atomic_init(&pBlock->inUse, true);
+
+        pBlock->pNext = atomic_load_explicit(&WLD_StatsBlocks, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&WLD_StatsBlocks, &pBlock->pNext, pBlock,
+            memory_order_release, memory_order_relaxed))
+            ;
+    }
+
+    (void)pthread_setspecific(statsKey, pBlock);
+    pMyStats = pBlock;
+
+    return pBlock;
+}
+
+// Count one MD_SendReceive on a partition (retry is set when it is a
+// resend after another attempt failed)
+void wldStatsRecordRequest(uint32_t partitions, uint32_t adapters,
+    uint32_t partition, uint32_t adapter,
+    MD_RV mdResult, uint64_t latencyNsec, bool retry)
+{
+    WLD_THREAD_STATS *pBlock = getStatsBlock(partitions, adapters);
+    WLD_THREAD_PARTITION *pPart;
+    WLD_THREAD_ADAPTER *pAdapter;
+
+    if (!pBlock)
+        return;
+
+    pPart = &pBlock->pPartitions[partition];
+    pAdapter = &pBlock->pAdapters[adapter];
+
+    statsAdd(&pPart->requests, 1);
+    statsAdd(&pAdapter->mdResults[statsResultIndex(mdResult)], 1);
+    if (mdResult != MDR_OK)
+        statsAdd(&pPart->errors, 1);
+    if (retry)
+    {
+        statsAdd(&pPart->retries, 1);
+        statsAdd(&pAdapter->retries, 1);
+    }
+
+    statsAdd(&pAdapter->buckets[statsBucket(latencyNsec)], 1);
+    statsAdd(&pAdapter->latencySum, latencyNsec);
+    if (latencyNsec > atomic_load_explicit(&pAdapter->latencyMax, memory_order_relaxed))
+        atomic_store_explicit(&pAdapter->latencyMax, latencyNsec, memory_order_relaxed);
+}
+
+// Count an adapter being taken out of rotation
+void wldStatsRecordDeactivation(uint32_t partitions, uint32_t adapters, uint32_t adapter)
+{
+    WLD_THREAD_STATS *pBlock = getStatsBlock(partitions, adapters);
+
+    if (pBlock)
+        statsAdd(&pBlock->pAdapters[adapter].deactivations, 1);
+}
+
+// Value at a percentile of a histogram, reported as the upper bound of
+// its bucket
+static uint64_t statsPercentile(const uint64_t *pBuckets, uint64_t count, double pct)
+{
+    uint64_t rank, seen = 0;
+    uint32_t i;
+
+    if (count == 0)
+        return 0;
+
+    rank = (uint64_t)((pct / 100.0) * (double)count);
+    if (rank >= count)
+        rank = count - 1;
+
+    for (i=0; i < WLD_STATS_HIST_BUCKETS; i++)
+    {
+        seen += pBuckets[i];
+        if (seen > rank)
+            return GetWLDStatsBucketNsec(i);
+    }
+
+    return GetWLDStatsBucketNsec(WLD_STATS_HIST_BUCKETS - 1);
+}
+
+void wldStatsCollect(WLD_STATS *pStats, const uint32_t *pPartitionStat)
+{
+    const WLD_THREAD_STATS *pBlock;
+    const WLD_THREAD_PARTITION *pPartSrc;
+    const WLD_THREAD_ADAPTER *pSrc;
+    WLD_ADAPTER_STATS *pAdapter;
+    WLD_PARTITION_STATS *pPart;
+    uint64_t max;
+    uint32_t i, j;
+
+    for (pBlock = atomic_load_explicit(&WLD_StatsBlocks, memory_order_acquire);
+        pBlock; pBlock = pBlock->pNext)
+    {
+        for (i=0; i < pStats->partitionCount; i++)
+        {
+            if (pPartitionStat[i] >= pBlock->partitions)
+                continue;
+
+            pPart = &pStats->pPartitions[i];
+            pPartSrc = &pBlock->pPartitions[pPartitionStat[i]];
+            pPart->requests += atomic_load_explicit(&pPartSrc->requests, memory_order_relaxed);
+            pPart->errors += atomic_load_explicit(&pPartSrc->errors, memory_order_relaxed);
+            pPart->retries += atomic_load_explicit(&pPartSrc->retries, memory_order_relaxed);
+        }
+
+        for (i=0; i < pStats->adapterCount; i++)
+        {
+            if (pStats->pAdapters[i].hsmID >= pBlock->adapters)
+                continue;
+
+            pAdapter = &pStats->pAdapters[i];
+            pSrc = &pBlock->pAdapters[pStats->pAdapters[i].hsmID];
+
+            for (j=0; j < WLD_STATS_MD_RESULTS; j++)
+                pAdapter->mdResults[j] += atomic_load_explicit(&pSrc->mdResults[j], memory_order_relaxed);
+            for (j=0; j < WLD_STATS_HIST_BUCKETS; j++)
+                pAdapter->latencyBuckets[j] += atomic_load_explicit(&pSrc->buckets[j], memory_order_relaxed);
+
+            pAdapter->retries += atomic_load_explicit(&pSrc->retries, memory_order_relaxed);
+            pAdapter->deactivations += atomic_load_explicit(&pSrc->deactivations, memory_order_relaxed);
+            pAdapter->latencySumNsec += atomic_load_explicit(&pSrc->latencySum, memory_order_relaxed);
+
+            max = atomic_load_explicit(&pSrc->latencyMax, memory_order_relaxed);
+            if (max > pAdapter->latencyMaxNsec)
+                pAdapter->latencyMaxNsec = max;
+        }
+    }
+
+    for (i=0; i < pStats->adapterCount; i++)
+    {
+        pAdapter = &pStats->pAdapters[i];
+
+        pAdapter->requests = 0;
+        for (j=0; j < WLD_STATS_HIST_BUCKETS; j++)
+            pAdapter->requests += pAdapter->latencyBuckets[j];
+        pAdapter->errors = pAdapter->requests - pAdapter->mdResults[0];
+
+        pAdapter->latencyP50Nsec = statsPercentile(pAdapter->latencyBuckets, pAdapter->requests, 50.0);
+        pAdapter->latencyP99Nsec = statsPercentile(pAdapter->latencyBuckets, pAdapter->requests, 99.0);
+        pAdapter->latencyP999Nsec = statsPercentile(pAdapter->latencyBuckets, pAdapter->requests, 99.9);
+        if (pAdapter->latencyP999Nsec > pAdapter->latencyMaxNsec)
+            pAdapter->latencyP999Nsec = pAdapter->latencyMaxNsec;
+        if (pAdapter->latencyP99Nsec > pAdapter->latencyMaxNsec)
+            pAdapter->latencyP99Nsec = pAdapter->latencyMaxNsec;
+        if (pAdapter->latencyP50Nsec > pAdapter->latencyMaxNsec)
+            pAdapter->latencyP50Nsec = pAdapter->latencyMaxNsec;
+    }
+}
+
+static const char *statsStateName(WLD_ADAPTER_STATE state)
+{
+    switch (state)
+    {
+        case WLD_ADAPTER_OPEN:      return "open";
+        case WLD_ADAPTER_HALF_OPEN: return "half_open";
+        default:                    return "closed";
+    }
+}
+
+static void writeStatsJSON(FILE *pFile, const WLD_STATS *pStats)
+{
+    const WLD_ADAPTER_STATS *pAdapter;
+    const WLD_PARTITION_STATS *pPart;
+    uint32_t i, j;
+
+    fprintf(pFile, "{\"timestamp_ns\":%llu,\"adapters\":[",
+        (unsigned long long)pStats->timestampNsec);
+
+    for (i=0; i < pStats->adapterCount; i++)
+    {
+        pAdapter = &pStats->pAdapters[i];
+
+        fprintf(pFile, "%s{\"hsm\":%u,\"state\":\"%s\",\"admit_permille\":%u,\"in_flight\":%u,"
+            "\"requests\":%llu,\"errors\":%llu,\"retries\":%llu,\"deactivations\":%llu,\"md_results\":{",
+            i ? "," : "", pAdapter->hsmID, statsStateName(pAdapter->state),
+            pAdapter->admitPermille, pAdapter->inFlight,
+            (unsigned long long)pAdapter->requests, (unsigned long long)pAdapter->errors,
+            (unsigned long long)pAdapter->retries, (unsigned long long)pAdapter->deactivations);
+
+        for (j=0; j < WLD_STATS_MD_RESULTS; j++)
+            fprintf(pFile, "%s\"%s\":%llu", j ? "," : "", WLD_ResultNames[j],
+                (unsigned long long)pAdapter->mdResults[j]);
+
+        fprintf(pFile, "},\"latency_ns\":{\"mean\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}",
+            (unsigned long long)(pAdapter->requests ? pAdapter->latencySumNsec / pAdapter->requests : 0),
+            (unsigned long long)pAdapter->latencyP50Nsec,
+            (unsigned long long)pAdapter->latencyP99Nsec,
+            (unsigned long long)pAdapter->latencyP999Nsec,
+            (unsigned long long)pAdapter->latencyMaxNsec);
+    }
+
+    fprintf(pFile, "],\"partitions\":[");
+
+    for (i=0; i < pStats->partitionCount; i++)
+    {
+        pPart = &pStats->pPartitions[i];
+
+        fprintf(pFile, "%s{\"slot\":%u,\"hsm\":%d,\"active\":%s,\"weight\":%u,\"requests\":%llu,\"errors\":%llu,\"retries\":%llu}",
+            i ? "," : "", pPart->slot, (pPart->hsmID == 0xFFFFFFFF) ? -1 : (int)pPart->hsmID,
+            pPart->active ? "true" : "false", pPart->weight,
+            (unsigned long long)pPart->requests, (unsigned long long)pPart->errors,
+            (unsigned long long)pPart->retries);
+    }
+
+    fprintf(pFile, "]}\n");
+}
+
+static void writeStatsPrometheus(FILE *pFile, const WLD_STATS *pStats)
+{
+    const WLD_ADAPTER_STATS *pAdapter;
+    const WLD_PARTITION_STATS *pPart;
+    uint64_t cumulative;
+    uint32_t bucket;
+    uint32_t i, j;
+
+    fprintf(pFile, "# HELP wld_requests_total Commands sent to the adapter.\n"
+        "# TYPE wld_requests_total counter\n");
+    for (i=0; i < pStats->adapterCount; i++)
+        fprintf(pFile, "wld_requests_total{hsm=\"%u\"} %llu\n",
+            pStats->pAdapters[i].hsmID, (unsigned long long)pStats->pAdapters[i].requests);
+
+    fprintf(pFile, "# HELP wld_md_results_total Commands by MD_SendReceive result.\n"
+        "# TYPE wld_md_results_total counter\n");
+    for (i=0; i < pStats->adapterCount; i++)
+    {
+        for (j=0; j < WLD_STATS_MD_RESULTS; j++)
+            fprintf(pFile, "wld_md_results_total{hsm=\"%u\",result=\"%s\"} %llu\n",
+                pStats->pAdapters[i].hsmID, WLD_ResultNames[j],
+                (unsigned long long)pStats->pAdapters[i].mdResults[j]);
+    }
+
+    fprintf(pFile, "# HELP wld_retries_total Commands resent after another attempt failed.\n"
+        "# TYPE wld_retries_total counter\n");
+    for (i=0; i < pStats->adapterCount; i++)
+        fprintf(pFile, "wld_retries_total{hsm=\"%u\"} %llu\n",
+            pStats->pAdapters[i].hsmID, (unsigned long long)pStats->pAdapters[i].retries);
+
+    fprintf(pFile, "# HELP wld_deactivations_total Times the adapter was taken out of rotation.\n"
+        "# TYPE wld_deactivations_total counter\n");
+    for (i=0; i < pStats->adapterCount; i++)
+        fprintf(pFile, "wld_deactivations_total{hsm=\"%u\"} %llu\n",
+            pStats->pAdapters[i].hsmID, (unsigned long long)pStats->pAdapters[i].deactivations);
+
+    fprintf(pFile, "# HELP wld_in_flight Commands currently outstanding on the adapter.\n"
+        "# TYPE wld_in_flight gauge\n");
+    for (i=0; i < pStats->adapterCount; i++)
+        fprintf(pFile, "wld_in_flight{hsm=\"%u\"} %u\n",
+            pStats->pAdapters[i].hsmID, pStats->pAdapters[i].inFlight);
+
+    fprintf(pFile, "# HELP wld_adapter_state Circuit breaker state (0 closed, 1 open, 2 half open).\n"
+        "# TYPE wld_adapter_state gauge\n");
+    for (i=0; i < pStats->adapterCount; i++)
+        fprintf(pFile, "wld_adapter_state{hsm=\"%u\"} %d\n",
+            pStats->pAdapters[i].hsmID, (int)pStats->pAdapters[i].state);
+
+    fprintf(pFile, "# HELP wld_latency_seconds MD_SendReceive latency.\n"
+        "# TYPE wld_latency_seconds histogram\n");
+    for (i=0; i < pStats->adapterCount; i++)
+    {
+        pAdapter = &pStats->pAdapters[i];
+        cumulative = 0;
+        bucket = 0;
+
+        for (j=0; j < sizeof(WLD_PromBounds) / sizeof(WLD_PromBounds[0]); j++)
+        {
+            while (bucket < WLD_STATS_HIST_BUCKETS &&
+                (double)GetWLDStatsBucketNsec(bucket) <= WLD_PromBounds[j] * 1e9)
+                cumulative += pAdapter->latencyBuckets[bucket++];
+
+            fprintf(pFile, "wld_latency_seconds_bucket{hsm=\"%u\",le=\"%g\"} %llu\n",
+                pAdapter->hsmID, WLD_PromBounds[j], (unsigned long long)cumulative);
+        }
+
+        fprintf(pFile, "wld_latency_seconds_bucket{hsm=\"%u\",le=\"+Inf\"} %llu\n"
+            "wld_latency_seconds_sum{hsm=\"%u\"} %.9f\n"
+            "wld_latency_seconds_count{hsm=\"%u\"} %llu\n",
+            pAdapter->hsmID, (unsigned long long)pAdapter->requests,
+            pAdapter->hsmID, (double)pAdapter->latencySumNsec / 1e9,
+            pAdapter->hsmID, (unsigned long long)pAdapter->requests);
+    }
+
+    fprintf(pFile, "# HELP wld_partition_requests_total Commands sent to the partition.\n"
+        "# TYPE wld_partition_requests_total counter\n");
+    for (i=0; i < pStats->partitionCount; i++)
+    {
+        pPart = &pStats->pPartitions[i];
+        fprintf(pFile, "wld_partition_requests_total{slot=\"%u\"} %llu\n",
+            pPart->slot, (unsigned long long)pPart->requests);
+    }
+
+    fprintf(pFile, "# HELP wld_partition_errors_total Failed commands sent to the partition.\n"
+        "# TYPE wld_partition_errors_total counter\n");
+    for (i=0; i < pStats->partitionCount; i++)
+    {
+        pPart = &pStats->pPartitions[i];
+        fprintf(pFile, "wld_partition_errors_total{slot=\"%u\"} %llu\n",
+            pPart->slot, (unsigned long long)pPart->errors);
+    }
+
+    fprintf(pFile, "# HELP wld_partition_active Partition is in rotation.\n"
+        "# TYPE wld_partition_active gauge\n");
+    for (i=0; i < pStats->partitionCount; i++)
+    {
+        pPart = &pStats->pPartitions[i];
+        fprintf(pFile, "wld_partition_active{slot=\"%u\"} %d\n", pPart->slot, pPart->active ? 1 : 0);
+    }
+}
+
+// Write a statistics snapshot to pFile
+WLD_RV WriteWLDStats(FILE *pFile, WLD_STATS_FORMAT format)
+{
+    WLD_STATS *pStats = NULL;
+    WLD_RV wldErr;
+
+    if (!pFile || (format != WLD_STATS_JSON && format != WLD_STATS_PROMETHEUS))
+        return WLDR_INVALID_PARAMETER;
+
+    wldErr = GetWLDStats(&pStats);
+    if (wldErr != WLDR_OK)
+        return wldErr;
+
+    if (format == WLD_STATS_JSON)
+        writeStatsJSON(pFile, pStats);
+    else
+        writeStatsPrometheus(pFile, pStats);
+
+    FreeWLDStats(pStats);
+    return WLDR_OK;
+}
+
+// Write a snapshot to the dump file, replacing it in one step so a
+// reader (e.g. the Prometheus textfile collector) never sees half of it
+static void dumpStats(const char *pPath, WLD_STATS_FORMAT format)
+{
+    char tmpPath[4096];
+    FILE *pFile;
+
+    if (!pPath)
+    {
+        (void)WriteWLDStats(stdout, format);
+        fflush(stdout);
+        return;
+    }
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", pPath);
+    pFile = fopen(tmpPath, "w");
+    if (!pFile)
+        return;
+
+    if (WriteWLDStats(pFile, format) != WLDR_OK)
+    {
+        fclose(pFile);
+        (void)remove(tmpPath);
+        return;
+    }
+
+    if (fclose(pFile) == 0)
+        (void)rename(tmpPath, pPath);
+    else
+        (void)remove(tmpPath);
+}
+
+static void *statsDumper(void *pArg)
+{
+    struct timespec deadline;
+    uint64_t nsec;
+
+    (void)pArg;
+
+    pthread_mutex_lock(&dump_mutex);
+
+    while (!dumpStop)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        nsec = (uint64_t)deadline.tv_nsec + dumpIntervalMsec * 1000000ULL;
+        deadline.tv_sec += nsec / 1000000000ULL;
+        deadline.tv_nsec = nsec % 1000000000ULL;
+
+        while (!dumpStop &&
+            pthread_cond_timedwait(&dump_cond, &dump_mutex, &deadline) != ETIMEDOUT)
+            ;
+
+        if (!dumpStop)
+            dumpStats(pDumpPath, dumpFormat);
+    }
+
+    pthread_mutex_unlock(&dump_mutex);
+
+    return NULL;
+}
+
+// Dump a statistics snapshot every intervalMsec to pPath (stdout if
+// pPath is NULL)
+WLD_RV StartWLDStatsDump(const char *pPath, WLD_STATS_FORMAT format, uint32_t intervalMsec)
+{
+    pthread_condattr_t attr;
+    WLD_RV wldErr = WLDR_OK;
+
+    if (intervalMsec == 0 || (format != WLD_STATS_JSON && format != WLD_STATS_PROMETHEUS))
+        return WLDR_INVALID_PARAMETER;
+
+    StopWLDStatsDump();
+
+    pthread_mutex_lock(&dump_mutex);
+
+    pDumpPath = pPath ? strdup(pPath) : NULL;
+    if (pPath && !pDumpPath)
+    {
+        wldErr = WLDR_INVALID_PARAMETER;
+        goto doneStart;
+    }
+
+    dumpFormat = format;
+    dumpIntervalMsec = intervalMsec;
+    dumpStop = false;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&dump_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&dumpThread, NULL, statsDumper, NULL) != 0)
+    {
+        pthread_cond_destroy(&dump_cond);
+        free(pDumpPath);
+        pDumpPath = NULL;
+        wldErr = WLDR_INVALID_PARAMETER;
+        goto doneStart;
+    }
+    dumpRunning = true;
+
+doneStart:
+
+    pthread_mutex_unlock(&dump_mutex);
+
+    return wldErr;
+}
+
+// Stop the periodic dump
+void StopWLDStatsDump(void)
+{
+    pthread_mutex_lock(&dump_mutex);
+    if (!dumpRunning)
+    {
+        pthread_mutex_unlock(&dump_mutex);
+        return;
+    }
+
+    dumpStop = true;
+    pthread_cond_signal(&dump_cond);
+    pthread_mutex_unlock(&dump_mutex);
+
+    pthread_join(dumpThread, NULL);
+
+    pthread_mutex_lock(&dump_mutex);
+    dumpRunning = false;
+    pthread_cond_destroy(&dump_cond);
+    free(pDumpPath);
+    pDumpPath = NULL;
+    pthread_mutex_unlock(&dump_mutex);
+}
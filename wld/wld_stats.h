@@ -0,0 +1,28 @@
+/*
+    wld_stats.h
+
+    Internal interface between wld.c and the statistics recorder in
+    wld_stats.c.  Partitions are identified by their statistics index,
+    which a slot keeps across table reconfigurations, and adapters by
+    hsmID.  This code is sample ONLY and Thales Inc. assumes no
+    liability or responsibility for its correct operation.
+*/
+
+
+#ifndef _WLD_STATS_H_
+#define _WLD_STATS_H_
+
+#include "wld.h"
+
+void wldStatsRecordRequest(uint32_t partitions, uint32_t adapters,
+    uint32_t partition, uint32_t adapter,
+    MD_RV mdResult, uint64_t latencyNsec, bool retry);
+
+void wldStatsRecordDeactivation(uint32_t partitions, uint32_t adapters, uint32_t adapter);
+
+// Add the counters of every thread into pStats, whose arrays are sized
+// and filled in with the table layout by the caller.  pPartitionStat
+// maps the partitions of pStats to their statistics index.
+void wldStatsCollect(WLD_STATS *pStats, const uint32_t *pPartitionStat);
+
+#endif
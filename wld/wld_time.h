@@ -0,0 +1,32 @@
+/*
+    wld_time.h
+
+    The clock shared by the WLD modules and tools: every deadline,
+    latency and rate is in CLOCK_MONOTONIC nanoseconds.  This code is
+    sample ONLY and Thales Inc. assumes no liability or responsibility
+    for its correct operation.
+*/
+
+
+#ifndef _WLD_TIME_H_
+#define _WLD_TIME_H_
+
+#include <stdint.h>
+#include <time.h>
+
+// Nanoseconds of a clock
+static inline uint64_t wldClockNsec(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Monotonic nanoseconds
+static inline uint64_t wldNowNsec(void)
+{
+    return wldClockNsec(CLOCK_MONOTONIC);
+}
+
+#endif
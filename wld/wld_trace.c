@@ -0,0 +1,372 @@
+/*
+    wld_trace.c
+
+    Request trace recorder for the workload distribution (WLD) sample.
+    Every thread writes its records into a ring of its own without any
+    locked instruction; when the ring is full (and when the trace stops)
+    the ring is copied to the memory mapped trace file in one piece,
+    at a position reserved with a single atomic add.  Rings are never
+    freed: the ring of a thread that exits is written out and adopted
+    by the next new thread.  This code is sample ONLY and Thales Inc.
+    assumes no liability or responsibility for its correct operation.
+*/
+
+#undef UNICODE
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "wld.h"
+#include "wld_trace.h"
+#include "wld_time.h"
+
+// Records per thread ring (a power of 2), and the default file size
+#define WLD_TRACE_RING_LEN              256
+#define WLD_TRACE_RECORDS               1048576
+
+// Ring of one thread.  head is written by the owning thread only; tail
+// is advanced by whoever copies the ring out, with lock held.
+typedef struct WLD_TRACE_RING {
+    struct WLD_TRACE_RING *pNext;
+    _Atomic bool inUse;
+    uint32_t thread;
+    uint32_t session;                   // trace the records belong to
+    pthread_mutex_t lock;
+    _Atomic uint64_t head __attribute__((aligned(64)));
+    _Atomic uint64_t tail __attribute__((aligned(64)));
+    WLD_TRACE_RECORD records[WLD_TRACE_RING_LEN];
+} __attribute__((aligned(64))) WLD_TRACE_RING;
+
+// The file of the running trace
+typedef struct WLD_TRACE_FILE {
+    int fd;
+    size_t mapLen;
+    WLD_TRACE_HEADER *pHeader;
+    WLD_TRACE_RECORD *pRecords;
+    uint64_t capacity;
+    _Atomic uint64_t next;              // records reserved so far
+    _Atomic uint64_t dropped;
+} WLD_TRACE_FILE;
+
+static WLD_TRACE_RING * _Atomic WLD_TraceRings = NULL;
+static __thread WLD_TRACE_RING *pMyRing = NULL;
+static _Atomic uint32_t WLD_TraceThreads = 0;
+
+static WLD_TRACE_FILE * _Atomic WLD_TraceFile = NULL;
+static _Atomic bool WLD_TraceOn = false;
+static _Atomic uint32_t WLD_TraceSession = 0;
+static _Atomic uint64_t WLD_TraceStartNsec = 0;
+
+// Counts of the last trace once it has stopped
+static uint64_t WLD_TraceRecorded = 0;
+static uint64_t WLD_TraceDropped = 0;
+
+static pthread_once_t traceKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t traceKey;
+
+// Serializes StartWLDTrace and StopWLDTrace
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+bool wldTraceEnabled(void)
+{
+    return atomic_load_explicit(&WLD_TraceOn, memory_order_relaxed);
+}
+
+// Copy the records of a ring to the trace file, or throw them away
+// without one or when they are left over from an earlier trace.  Call
+// with the ring's lock held.
+static void flushTraceRing(WLD_TRACE_RING *pRing, WLD_TRACE_FILE *pFile)
+{
+    uint64_t head = atomic_load_explicit(&pRing->head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&pRing->tail, memory_order_relaxed);
+    uint64_t first;
+    uint64_t i;
+
+    if (pRing->session != atomic_load_explicit(&WLD_TraceSession, memory_order_acquire))
+        pFile = NULL;
+
+    if (pFile && head != tail)
+    {
+        first = atomic_fetch_add_explicit(&pFile->next, head - tail, memory_order_relaxed);
+        for (i=0; tail + i < head; i++)
+        {
+            if (first + i < pFile->capacity)
+                pFile->pRecords[first + i] = pRing->records[(tail + i) & (WLD_TRACE_RING_LEN - 1)];
+            else
+                atomic_fetch_add_explicit(&pFile->dropped, 1, memory_order_relaxed);
+        }
+    }
+
+    atomic_store_explicit(&pRing->tail, head, memory_order_release);
+}
+
+// A thread exits: write out its ring and let another thread adopt it
+static void releaseTraceRing(void *pArg)
+{
+    WLD_TRACE_RING *pRing = (WLD_TRACE_RING *)pArg;
+
+    pthread_mutex_lock(&pRing->lock);
+    flushTraceRing(pRing, atomic_load_explicit(&WLD_TraceFile, memory_order_acquire));
+    pthread_mutex_unlock(&pRing->lock);
+
+    atomic_store_explicit(&pRing->inUse, false, memory_order_release);
+}
+
+static void createTraceKey(void)
+{
+    (void)pthread_key_create(&traceKey, releaseTraceRing);
+}
+
+// Get this thread's ring.  A released ring is adopted before a new one
+// is allocated.
+static WLD_TRACE_RING *getTraceRing(void)
+{
+    WLD_TRACE_RING *pRing = pMyRing;
+    bool expected;
+
+    if (pRing)
+        return pRing;
+
+    (void)pthread_once(&traceKeyOnce, createTraceKey);
+
+    for (pRing = atomic_load_explicit(&WLD_TraceRings, memory_order_acquire);
+        pRing; pRing = pRing->pNext)
+    {
+        expected = false;
+        if (atomic_compare_exchange_strong_explicit(&pRing->inUse, &expected, true,
+            memory_order_acquire, memory_order_relaxed))
+            break;
+    }
+
+    if (!pRing)
+    {
+        pRing = aligned_alloc(_Alignof(WLD_TRACE_RING), sizeof(WLD_TRACE_RING));
+        if (!pRing)
+            return NULL;
+
+        memset(pRing, 0, sizeof(WLD_TRACE_RING));
+        pthread_mutex_init(&pRing->lock, NULL);
+        atomic_store_explicit(&pRing->inUse, true, memory_order_relaxed);
+        pRing->thread = atomic_fetch_add_explicit(&WLD_TraceThreads, 1, memory_order_relaxed);
+
+        pRing->pNext = atomic_load_explicit(&WLD_TraceRings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&WLD_TraceRings, &pRing->pNext, pRing,
+            memory_order_release, memory_order_relaxed))
+            ;
+    }
+
+    pMyRing = pRing;
+    (void)pthread_setspecific(traceKey, pRing);
+
+    return pRing;
+}
+
+void wldTraceRecord(uint64_t startNsec, uint64_t latencyNsec,
+    uint32_t slot, uint32_t hsmID, bool anySlot,
+    uint16_t fmNumber, const MD_Buffer_t *pReq,
+    MD_RV mdResult, uint32_t fmStatus)
+{
+    WLD_TRACE_RING *pRing = getTraceRing();
+    WLD_TRACE_RECORD *pRecord;
+    uint64_t traceStart;
+    uint64_t head;
+    uint32_t session;
+    uint32_t len = 0;
+
+    if (!pRing)
+        return;
+
+    // Records left over from an earlier trace are not part of this one
+    session = atomic_load_explicit(&WLD_TraceSession, memory_order_acquire);
+    if (pRing->session != session)
+    {
+        pthread_mutex_lock(&pRing->lock);
+        flushTraceRing(pRing, NULL);
+        pRing->session = session;
+        pthread_mutex_unlock(&pRing->lock);
+    }
+
+    head = atomic_load_explicit(&pRing->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&pRing->tail, memory_order_acquire) == WLD_TRACE_RING_LEN)
+    {
+        pthread_mutex_lock(&pRing->lock);
+        flushTraceRing(pRing, atomic_load_explicit(&WLD_TraceFile, memory_order_acquire));
+        pthread_mutex_unlock(&pRing->lock);
+    }
+
+    for (; pReq && pReq->pData; pReq++)
+        len += pReq->length;
+
+    traceStart = atomic_load_explicit(&WLD_TraceStartNsec, memory_order_relaxed);
+
+    pRecord = &pRing->records[head & (WLD_TRACE_RING_LEN - 1)];
+    pRecord->timeNsec = startNsec > traceStart ? startNsec - traceStart : 0;
+    pRecord->latencyNsec = latencyNsec < 0xFFFFFFFFULL ? (uint32_t)latencyNsec : 0xFFFFFFFF;
+    pRecord->slot = slot;
+    pRecord->hsmID = hsmID;
+    pRecord->mdResult = (uint32_t)mdResult;
+    pRecord->fmStatus = fmStatus;
+    pRecord->requestLen = len;
+    pRecord->fmNumber = fmNumber;
+    pRecord->flags = WLD_TRACE_RECORDED | (anySlot ? WLD_TRACE_ANY_SLOT : 0);
+    pRecord->thread = pRing->thread;
+
+    atomic_store_explicit(&pRing->head, head + 1, memory_order_release);
+}
+
+// Stop the running trace.  Call with trace_mutex held.
+static void stopTrace(void)
+{
+    WLD_TRACE_FILE *pFile;
+    WLD_TRACE_RING *pRing;
+    uint64_t records;
+
+    atomic_store_explicit(&WLD_TraceOn, false, memory_order_relaxed);
+    pFile = atomic_exchange_explicit(&WLD_TraceFile, NULL, memory_order_acq_rel);
+    if (!pFile)
+        return;
+
+    // A ring being copied out holds its lock, so once every ring has
+    // been locked here nobody writes to the file any more
+    for (pRing = atomic_load_explicit(&WLD_TraceRings, memory_order_acquire);
+        pRing; pRing = pRing->pNext)
+    {
+        pthread_mutex_lock(&pRing->lock);
+        flushTraceRing(pRing, pFile);
+        pthread_mutex_unlock(&pRing->lock);
+    }
+
+    records = atomic_load_explicit(&pFile->next, memory_order_relaxed);
+    if (records > pFile->capacity)
+        records = pFile->capacity;
+
+    WLD_TraceRecorded = records;
+    WLD_TraceDropped = atomic_load_explicit(&pFile->dropped, memory_order_relaxed);
+
+    pFile->pHeader->records = records;
+    pFile->pHeader->dropped = WLD_TraceDropped;
+    (void)msync(pFile->pHeader, pFile->mapLen, MS_SYNC);
+    (void)munmap(pFile->pHeader, pFile->mapLen);
+
+    if (ftruncate(pFile->fd, (off_t)(sizeof(WLD_TRACE_HEADER) + records * sizeof(WLD_TRACE_RECORD))) != 0)
+        printf("\nWLD: failed to trim the trace file - %s\n", strerror(errno));
+    close(pFile->fd);
+    free(pFile);
+}
+
+WLD_RV StartWLDTrace(const char *pPath, uint64_t maxRecords)
+{
+    WLD_TRACE_FILE *pFile;
+    WLD_TRACE_HEADER *pHeader;
+    WLD_RV wldErr = WLDR_OK;
+
+    if (!pPath || maxRecords > (1ULL << 32))
+        return WLDR_INVALID_PARAMETER;
+    if (maxRecords == 0)
+        maxRecords = WLD_TRACE_RECORDS;
+
+    pthread_mutex_lock(&trace_mutex);
+
+    stopTrace();
+
+    pFile = calloc(1, sizeof(WLD_TRACE_FILE));
+    if (!pFile)
+    {
+        wldErr = WLDR_INVALID_PARAMETER;
+        goto doneStart;
+    }
+
+    pFile->capacity = maxRecords;
+    pFile->mapLen = sizeof(WLD_TRACE_HEADER) + maxRecords * sizeof(WLD_TRACE_RECORD);
+    pFile->fd = open(pPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (pFile->fd < 0 || ftruncate(pFile->fd, (off_t)pFile->mapLen) != 0)
+    {
+        printf("\nWLD: cannot create the trace file '%s' - %s\n", pPath, strerror(errno));
+        goto failStart;
+    }
+
+    pHeader = mmap(NULL, pFile->mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, pFile->fd, 0);
+    if (pHeader == MAP_FAILED)
+    {
+        printf("\nWLD: cannot map the trace file '%s' - %s\n", pPath, strerror(errno));
+        goto failStart;
+    }
+
+    memcpy(pHeader->magic, WLD_TRACE_MAGIC, sizeof(pHeader->magic));
+    pHeader->version = WLD_TRACE_VERSION;
+    pHeader->recordSize = sizeof(WLD_TRACE_RECORD);
+    pHeader->startTimeNsec = wldClockNsec(CLOCK_REALTIME);
+    pHeader->capacity = maxRecords;
+    pFile->pHeader = pHeader;
+    pFile->pRecords = (WLD_TRACE_RECORD *)(pHeader + 1);
+
+    WLD_TraceRecorded = 0;
+    WLD_TraceDropped = 0;
+    atomic_store_explicit(&WLD_TraceStartNsec, wldNowNsec(), memory_order_relaxed);
+    atomic_fetch_add_explicit(&WLD_TraceSession, 1, memory_order_release);
+    atomic_store_explicit(&WLD_TraceFile, pFile, memory_order_release);
+    atomic_store_explicit(&WLD_TraceOn, true, memory_order_relaxed);
+    goto doneStart;
+
+failStart:
+
+    if (pFile->fd >= 0)
+        close(pFile->fd);
+    free(pFile);
+    wldErr = WLDR_INVALID_PARAMETER;
+
+doneStart:
+
+    pthread_mutex_unlock(&trace_mutex);
+
+    return wldErr;
+}
+
+void StopWLDTrace(void)
+{
+    pthread_mutex_lock(&trace_mutex);
+    stopTrace();
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+// Records written to the file so far - not those still in the rings -
+// and calls dropped, of the running trace or else the last one
+void GetWLDTraceCounts(uint64_t *pRecorded, uint64_t *pDropped)
+{
+    WLD_TRACE_FILE *pFile;
+    uint64_t recorded;
+    uint64_t dropped;
+
+    pthread_mutex_lock(&trace_mutex);
+
+    pFile = atomic_load_explicit(&WLD_TraceFile, memory_order_acquire);
+    if (pFile)
+    {
+        recorded = atomic_load_explicit(&pFile->next, memory_order_relaxed);
+        if (recorded > pFile->capacity)
+            recorded = pFile->capacity;
+        dropped = atomic_load_explicit(&pFile->dropped, memory_order_relaxed);
+    }
+    else
+    {
+        recorded = WLD_TraceRecorded;
+        dropped = WLD_TraceDropped;
+    }
+
+    pthread_mutex_unlock(&trace_mutex);
+
+    if (pRecorded)
+        *pRecorded = recorded;
+    if (pDropped)
+        *pDropped = dropped;
+}
@@ -0,0 +1,27 @@
+/*
+    wld_trace.h
+
+    Internal interface between wld.c and the request trace recorder in
+    wld_trace.c.  Times are CLOCK_MONOTONIC nanoseconds.  This code is
+    sample ONLY and Thales Inc. assumes no liability or responsibility
+    for its correct operation.
+*/
+
+
+#ifndef _WLD_TRACE_H_
+#define _WLD_TRACE_H_
+
+#include "wld.h"
+
+// True while a trace is being recorded
+bool wldTraceEnabled(void);
+
+// Record one call.  slot and hsmID are where it was served (hsmID
+// 0xFFFFFFFF if no adapter was tried) and anySlot whether it was sent
+// with WLD_NO_SLOT_ID.
+void wldTraceRecord(uint64_t startNsec, uint64_t latencyNsec,
+    uint32_t slot, uint32_t hsmID, bool anySlot,
+    uint16_t fmNumber, const MD_Buffer_t *pReq,
+    MD_RV mdResult, uint32_t fmStatus);
+
+#endif